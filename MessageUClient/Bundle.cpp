@@ -0,0 +1,294 @@
+// Bundle.cpp
+// author: Ariel Cohen ID: 329599187
+
+#include "Bundle.h"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+/**
+ * @brief A regular file found while walking a directory.
+ */
+struct FoundFile {
+    std::string relative; // the path within the directory, '/'-separated
+    std::string path;     // the path to open
+    uint64_t size;        // the size of the file
+};
+
+/**
+ * @brief Appends the bytes of a value to a buffer.
+ */
+void appendBytes(std::vector<uint8_t>& out, const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    out.insert(out.end(), bytes, bytes + size);
+}
+
+/**
+ * @brief Returns true if a path from a bundle stays within the directory it is unpacked into.
+ * Every '/'-separated component must be non-empty and not "." or ".."; '\' and ':' are rejected
+ * so that no component is read as a separator, a drive or a stream on Windows.
+ */
+bool isSafePath(const std::string& path) {
+    if (path.find_first_of(std::string("\\:\0", 3)) != std::string::npos) {
+        return false;
+    }
+    size_t start = 0;
+    while (true) {
+        size_t end = path.find('/', start);
+        std::string component = path.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        if (component.empty() || component == "." || component == "..") {
+            return false;
+        }
+        if (end == std::string::npos) {
+            return true;
+        }
+        start = end + 1;
+    }
+}
+
+} // namespace
+
+/**
+ * @brief Walks a directory and its subdirectories and indexes the regular files in it, by path.
+ * Files are listed in ascending order of their relative paths, as BundleEntry requires, and a
+ * path the recipient would reject fails here rather than after the upload. A file that shrinks
+ * before it is sent fails the send; bytes it gains are not sent.
+ * @param directory The directory.
+ * @throws std::runtime_error if the directory cannot be read, holds too many files, a path is
+ * too long, or the memory budget has no room for the index.
+ */
+DirectoryBundle::DirectoryBundle(const std::string& directory) {
+    namespace fs = boost::filesystem;
+    boost::system::error_code ec;
+    fs::path root(directory);
+    if (!fs::is_directory(root, ec)) {
+        throw std::runtime_error("Not a directory: " + directory);
+    }
+
+    std::vector<FoundFile> files;
+    for (fs::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec)) {
+        boost::system::error_code statusError; // e.g. a broken link, which is skipped
+        if (!fs::is_regular_file(it->status(statusError))) {
+            continue;
+        }
+        if (files.size() == MAX_BUNDLE_ENTRIES) {
+            throw std::runtime_error("The directory holds more than " + std::to_string(MAX_BUNDLE_ENTRIES) + " files.");
+        }
+        FoundFile file;
+        file.path = it->path().string();
+        file.relative = it->path().lexically_relative(root).generic_string();
+        file.size = fs::file_size(it->path(), ec);
+        if (ec) {
+            break;
+        }
+        if (file.relative.size() > MAX_BUNDLE_PATH_SIZE || !isSafePath(file.relative)) {
+            throw std::runtime_error("The path of " + file.path + " cannot be sent in a bundle.");
+        }
+        files.push_back(std::move(file));
+    }
+    if (ec) {
+        throw std::runtime_error("Failed to read the directory " + directory + ": " + ec.message());
+    }
+    std::sort(files.begin(), files.end(), [](const FoundFile& a, const FoundFile& b) { return a.relative < b.relative; });
+
+    size_t indexSize = sizeof(BundleHeader);
+    for (const auto& file : files) {
+        indexSize += sizeof(BundleEntry) + file.relative.size();
+    }
+    if (!_indexCharge.waitUpdate(indexSize + (files.size() + 1) * sizeof(ContentSource), MEMORY_WAIT_TIMEOUT)) {
+        throw std::runtime_error("The memory budget has no room for the index of " + directory);
+    }
+
+    _index.reserve(indexSize);
+    BundleHeader header{ BUNDLE_VERSION, static_cast<uint32_t>(files.size()) };
+    appendBytes(_index, &header, sizeof(header));
+    for (const auto& file : files) {
+        BundleEntry entry{ file.size, static_cast<uint16_t>(file.relative.size()) };
+        appendBytes(_index, &entry, sizeof(entry));
+        appendBytes(_index, file.relative.data(), file.relative.size());
+    }
+    _parts.reserve(files.size() + 1);
+    _parts.push_back(ContentSource::memory(_index.data(), _index.size()));
+    for (const auto& file : files) {
+        _parts.push_back(ContentSource::file(file.path, 0, file.size));
+    }
+}
+
+/**
+ * @brief Creates the directory the bundle is unpacked into.
+ * @param directory The directory; it must not exist yet.
+ * @throws std::runtime_error if the directory cannot be created.
+ */
+BundleUnpacker::BundleUnpacker(const std::string& directory) : _directory(directory) {
+    boost::system::error_code ec;
+    if (!boost::filesystem::create_directory(directory, ec) || ec) {
+        throw std::runtime_error("Failed to create the directory " + directory);
+    }
+}
+
+/**
+ * @brief Removes the directory and everything in it, unless finish() succeeded.
+ */
+BundleUnpacker::~BundleUnpacker() {
+    if (_finished) {
+        return;
+    }
+    if (_file.is_open()) {
+        _file.close();
+    }
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(_directory, ec);
+}
+
+/**
+ * @brief Takes the next bytes of the plaintext: the index, a field at a time, then the files.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @throws std::runtime_error if the index is malformed, a path is unsafe, there are bytes past
+ * the last file, or a file cannot be written.
+ */
+void BundleUnpacker::write(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        if (_stage == Stage::DONE) {
+            throw std::runtime_error("The bundle has bytes past its last file.");
+        }
+        if (_stage == Stage::CONTENT) {
+            size_t take = static_cast<size_t>(std::min<uint64_t>(size, _fileRemaining));
+            if (!_file.write(reinterpret_cast<const char*>(data), take)) {
+                throw std::runtime_error("Failed to write " + _entries[_nextFile - 1].path + " in " + _directory);
+            }
+            _fileRemaining -= take;
+            data += take;
+            size -= take;
+            if (_fileRemaining == 0) {
+                openNextFile();
+            }
+            continue;
+        }
+        size_t take = std::min(size, _fieldSize - _field.size());
+        _field.insert(_field.end(), data, data + take);
+        data += take;
+        size -= take;
+        if (_field.size() == _fieldSize) {
+            parseField();
+        }
+    }
+}
+
+/**
+ * @brief Checks that the whole bundle was received and keeps the directory.
+ * @throws std::runtime_error if the bundle is truncated.
+ */
+void BundleUnpacker::finish() {
+    if (_stage != Stage::DONE) {
+        throw std::runtime_error("The bundle is truncated.");
+    }
+    _finished = true;
+}
+
+/**
+ * @brief Handles a header, entry or path once _field holds all of its bytes.
+ * @throws std::runtime_error if it is malformed, out of order, or the index does not fit the budget.
+ */
+void BundleUnpacker::parseField() {
+    switch (_stage) {
+    case Stage::HEADER: {
+        BundleHeader header;
+        memcpy(&header, _field.data(), sizeof(header));
+        if (header.version != BUNDLE_VERSION) {
+            throw std::runtime_error("Unsupported bundle version " + std::to_string(header.version));
+        }
+        if (header.entryCount > MAX_BUNDLE_ENTRIES) {
+            throw std::runtime_error("The bundle lists too many files.");
+        }
+        _entryCount = header.entryCount;
+        break;
+    }
+    case Stage::ENTRY: {
+        BundleEntry entry;
+        memcpy(&entry, _field.data(), sizeof(entry));
+        if (entry.pathSize == 0 || entry.pathSize > MAX_BUNDLE_PATH_SIZE) {
+            throw std::runtime_error("The bundle lists a path of invalid length.");
+        }
+        _pendingSize = entry.size;
+        _stage = Stage::PATH;
+        _fieldSize = entry.pathSize;
+        _field.clear();
+        return;
+    }
+    case Stage::PATH: {
+        std::string path(_field.begin(), _field.end());
+        if (!_entries.empty() && !(_entries.back().path < path)) {
+            throw std::runtime_error("The bundle lists " + path + " out of order.");
+        }
+        if (!_indexCharge.tryUpdate(_indexCharge.bytes() + sizeof(Entry) + path.size())) {
+            throw std::runtime_error("The memory budget has no room for the bundle's index.");
+        }
+        _entries.push_back({ std::move(path), _pendingSize });
+        break;
+    }
+    default:
+        return;
+    }
+    _field.clear();
+    if (_entries.size() == _entryCount) {
+        prepareFiles();
+    }
+    else {
+        _stage = Stage::ENTRY;
+        _fieldSize = sizeof(BundleEntry);
+    }
+}
+
+/**
+ * @brief Checks every path and creates the subdirectories, once the index was read.
+ * @throws std::runtime_error if a path is unsafe or a subdirectory cannot be created.
+ */
+void BundleUnpacker::prepareFiles() {
+    for (const auto& entry : _entries) {
+        if (!isSafePath(entry.path)) {
+            throw std::runtime_error("The bundle lists an unsafe path: " + entry.path);
+        }
+    }
+    boost::filesystem::path root(_directory);
+    for (const auto& entry : _entries) {
+        boost::system::error_code ec;
+        boost::filesystem::create_directories((root / entry.path).parent_path(), ec);
+        if (ec) {
+            throw std::runtime_error("Failed to create the directory of " + entry.path + " in " + _directory);
+        }
+    }
+    _nextFile = 0;
+    openNextFile();
+}
+
+/**
+ * @brief Closes the current file and opens the next one to write, creating empty files on the way.
+ * @throws std::runtime_error if a file cannot be written or created.
+ */
+void BundleUnpacker::openNextFile() {
+    if (_file.is_open()) {
+        _file.close();
+        if (!_file) {
+            throw std::runtime_error("Failed to write " + _entries[_nextFile - 1].path + " in " + _directory);
+        }
+    }
+    boost::filesystem::path root(_directory);
+    while (_nextFile < _entries.size()) {
+        const Entry& entry = _entries[_nextFile++];
+        _file.open((root / entry.path).string(), std::ios::binary | std::ios::trunc);
+        if (!_file) {
+            throw std::runtime_error("Failed to create " + entry.path + " in " + _directory);
+        }
+        if (entry.size > 0) {
+            _fileRemaining = entry.size;
+            _stage = Stage::CONTENT;
+            return;
+        }
+        _file.close();
+    }
+    _stage = Stage::DONE;
+}
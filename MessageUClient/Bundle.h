@@ -0,0 +1,118 @@
+// Bundle.h
+// author: Ariel Cohen ID: 329599187
+
+#pragma once
+#include "MemoryStats.h"
+#include "Protocol.h"
+#include "Spool.h"
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief A directory packed as the plaintext of a FILE_BUNDLE message: a BundleHeader, the index
+ * of its regular files (a BundleEntry and the relative path of each), then their contents.
+ * Only the index is held in memory; the files are read while the message is encrypted and sent,
+ * so a directory of thousands of files goes out as one request of one stream of chunks.
+ */
+class DirectoryBundle {
+public:
+    /**
+     * @brief Walks a directory and its subdirectories and indexes the regular files in it, by path.
+     * @param directory The directory.
+     * @throws std::runtime_error if the directory cannot be read, holds too many files, a path is
+     * too long, or the memory budget has no room for the index.
+     */
+    explicit DirectoryBundle(const std::string& directory);
+
+    DirectoryBundle(const DirectoryBundle&) = delete;
+    DirectoryBundle& operator=(const DirectoryBundle&) = delete;
+
+    /**
+     * @brief Returns the plaintext: the index, then each file's content. The bundle must outlive it.
+     */
+    ContentSource content() const { return ContentSource::concat(_parts); }
+
+    /**
+     * @brief Returns the number of files.
+     */
+    size_t fileCount() const { return _parts.size() - 1; }
+
+private:
+    std::vector<uint8_t> _index;       // the encoded header and entries
+    std::vector<ContentSource> _parts; // _index, then each file
+    MemoryCharge _indexCharge{MemorySubsystem::FILE_IO}; // _index and _parts
+};
+
+/**
+ * @brief Unpacks the plaintext of a FILE_BUNDLE message into a new directory while it is decrypted.
+ * The whole index is read, and every path checked, before any file is created; each file is then
+ * written as its bytes arrive, so only the index is held in memory. A path may not leave the
+ * directory: absolute paths, "." and ".." components, '\' and ':' are rejected, as are paths out
+ * of order or listed twice. Unless finish() succeeds, the directory and everything written into
+ * it are removed with the unpacker.
+ */
+class BundleUnpacker {
+public:
+    /**
+     * @brief Creates the directory the bundle is unpacked into.
+     * @param directory The directory; it must not exist yet.
+     * @throws std::runtime_error if the directory cannot be created.
+     */
+    explicit BundleUnpacker(const std::string& directory);
+    ~BundleUnpacker();
+
+    BundleUnpacker(const BundleUnpacker&) = delete;
+    BundleUnpacker& operator=(const BundleUnpacker&) = delete;
+
+    /**
+     * @brief Takes the next bytes of the plaintext.
+     * @throws std::runtime_error if the index is malformed, a path is unsafe, there are bytes
+     * past the last file, or a file cannot be written.
+     */
+    void write(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Checks that the whole bundle was received and keeps the directory.
+     * @throws std::runtime_error if the bundle is truncated.
+     */
+    void finish();
+
+    /**
+     * @brief Returns the directory the bundle is unpacked into.
+     */
+    const std::string& directory() const { return _directory; }
+
+    /**
+     * @brief Returns the number of files in the bundle, once its index was read.
+     */
+    size_t fileCount() const { return _entries.size(); }
+
+private:
+    enum class Stage { HEADER, ENTRY, PATH, CONTENT, DONE };
+
+    struct Entry {
+        std::string path; // relative to the directory, '/'-separated
+        uint64_t size;    // the size of the file
+    };
+
+    // Handles a header, entry or path once _field holds all of its bytes
+    void parseField();
+    // Checks every path and creates the subdirectories, once the index was read
+    void prepareFiles();
+    // Opens the next file to write, skipping (but creating) empty ones
+    void openNextFile();
+
+    std::string _directory;             // where the files are written
+    Stage _stage = Stage::HEADER;       // what the next bytes are
+    std::vector<uint8_t> _field;        // the header, entry or path being received
+    size_t _fieldSize = sizeof(BundleHeader); // the size of that field
+    uint32_t _entryCount = 0;           // files listed in the header
+    uint64_t _pendingSize = 0;          // the size of the entry whose path is being received
+    std::vector<Entry> _entries;        // the index read so far
+    size_t _nextFile = 0;               // the entry whose content comes after the current file
+    std::ofstream _file;                // the file being written
+    uint64_t _fileRemaining = 0;        // bytes of it still to come
+    bool _finished = false;             // true once finish() succeeded
+    MemoryCharge _indexCharge{MemorySubsystem::FILE_IO}; // _entries
+};
@@ -0,0 +1,514 @@
+// ChunkedFile.cpp
+// author: Ariel Cohen ID: 329599187
+
+#include "ChunkedFile.h"
+#include "CryptoWrapper.h"
+#include "Logger.h"
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+
+const char MAC_KEY_LABEL[] = "MessageU chunk MAC key"; // derives the MAC key from the symmetric key
+const char IV_KEY_LABEL[] = "MessageU chunk IV key";   // derives the IV key from the symmetric key
+const uint8_t CHUNK_DOMAIN = 'C';    // starts the MAC input of a chunk
+const uint8_t MANIFEST_DOMAIN = 'M'; // starts the MAC input of a manifest, so neither MAC passes for the other
+
+/**
+ * @brief Runs work(i) for every i below count, spread over one thread per core.
+ */
+template <typename Work>
+void runParallel(size_t count, const Work& work) {
+    size_t workers = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), count));
+    if (workers == 1) {
+        for (size_t i = 0; i < count; i++) {
+            work(i);
+        }
+        return;
+    }
+    std::vector<std::future<void>> tasks;
+    for (size_t worker = 0; worker < workers; worker++) {
+        tasks.push_back(std::async(std::launch::async, [&work, worker, workers, count]() {
+            for (size_t i = worker; i < count; i += workers) {
+                work(i);
+            }
+        }));
+    }
+    for (auto& task : tasks) {
+        task.get();
+    }
+}
+
+/**
+ * @brief Charges room for one chunk per core, at least one, and returns how many chunks fit.
+ * @param charge The charge to grow.
+ * @param perChunk The memory one chunk in flight takes.
+ * @param wanted The number of chunks there are.
+ * @throws std::runtime_error if not even one chunk fits the budget.
+ */
+size_t reserveBatch(MemoryCharge& charge, size_t perChunk, size_t wanted) {
+    size_t workers = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), wanted));
+    if (!charge.waitUpdate(perChunk, MEMORY_WAIT_TIMEOUT)) {
+        throw std::runtime_error("The memory budget has no room for a file chunk.");
+    }
+    size_t batch = 1;
+    while (batch < workers && charge.tryUpdate(perChunk * (batch + 1))) {
+        batch++;
+    }
+    return batch;
+}
+
+/**
+ * @brief Reads exactly size bytes.
+ * @return False if the content ends first or cannot be read.
+ */
+bool readExact(ContentReader& reader, void* buffer, size_t size) {
+    uint8_t* out = static_cast<uint8_t*>(buffer);
+    while (size > 0) {
+        size_t count = reader.read(out, size);
+        if (count == 0) {
+            return false;
+        }
+        out += count;
+        size -= count;
+    }
+    return true;
+}
+
+} // namespace
+
+/**
+ * @brief Derives the keys for a file.
+ * The MAC and IV keys are HMAC-SHA256 of fixed labels under the symmetric key, so they are
+ * independent of the encryption key and of each other.
+ * @param symKey The symmetric key shared with the other client.
+ * @param fileID The file's ID.
+ */
+ChunkCipher::ChunkCipher(const std::vector<uint8_t>& symKey, const FileID& fileID)
+    : _encryptionKey(symKey), _macKey(CHUNK_MAC_SIZE), _ivKey(CHUNK_MAC_SIZE), _fileID(fileID) {
+    if (symKey.empty()) {
+        throw std::runtime_error("missing symmetric key");
+    }
+    CryptoWrapper::hmacSha256(symKey, { { reinterpret_cast<const uint8_t*>(MAC_KEY_LABEL), sizeof(MAC_KEY_LABEL) - 1 } }, _macKey.data());
+    CryptoWrapper::hmacSha256(symKey, { { reinterpret_cast<const uint8_t*>(IV_KEY_LABEL), sizeof(IV_KEY_LABEL) - 1 } }, _ivKey.data());
+}
+
+/**
+ * @brief Returns the IV a chunk is encrypted with: the start of an HMAC of the file ID and index.
+ * @param index The chunk's index.
+ */
+std::vector<uint8_t> ChunkCipher::chunkIv(uint32_t index) const {
+    uint8_t digest[CHUNK_MAC_SIZE];
+    CryptoWrapper::hmacSha256(_ivKey, { { _fileID.data(), _fileID.size() }, { reinterpret_cast<const uint8_t*>(&index), sizeof(index) } }, digest);
+    return std::vector<uint8_t>(digest, digest + 16);
+}
+
+/**
+ * @brief Encrypts one chunk.
+ * @param index The chunk's index.
+ * @param plaintext The chunk.
+ * @param size Its size.
+ * @return The ciphertext.
+ */
+std::vector<uint8_t> ChunkCipher::encrypt(uint32_t index, const uint8_t* plaintext, size_t size) const {
+    std::vector<uint8_t> ciphertext;
+    ciphertext.reserve(static_cast<size_t>(AesStream::ciphertextSize(size)));
+    AesStream aes(_encryptionKey, AesStream::Direction::ENCRYPT, chunkIv(index));
+    aes.update(plaintext, size, ciphertext);
+    aes.finish(ciphertext);
+    return ciphertext;
+}
+
+/**
+ * @brief Decrypts one chunk; check its MAC first.
+ * @param index The chunk's index.
+ * @param ciphertext The ciphertext.
+ * @return The plaintext.
+ */
+std::vector<uint8_t> ChunkCipher::decrypt(uint32_t index, const std::vector<uint8_t>& ciphertext) const {
+    std::vector<uint8_t> plaintext;
+    plaintext.reserve(ciphertext.size());
+    AesStream aes(_encryptionKey, AesStream::Direction::DECRYPT, chunkIv(index));
+    aes.update(ciphertext.data(), ciphertext.size(), plaintext);
+    aes.finish(plaintext);
+    return plaintext;
+}
+
+/**
+ * @brief Returns the MAC of a chunk's ciphertext, bound to the file ID and the chunk's index.
+ * @param index The chunk's index.
+ * @param ciphertext The ciphertext.
+ * @param size Its size.
+ */
+ChunkMac ChunkCipher::mac(uint32_t index, const uint8_t* ciphertext, size_t size) const {
+    ChunkMac mac;
+    CryptoWrapper::hmacSha256(_macKey, { { &CHUNK_DOMAIN, 1 }, { _fileID.data(), _fileID.size() },
+        { reinterpret_cast<const uint8_t*>(&index), sizeof(index) }, { ciphertext, size } }, mac.data());
+    return mac;
+}
+
+/**
+ * @brief Returns the MAC of an encoded manifest header and entries.
+ * @param manifest The encoded header and entries.
+ * @param size Their size.
+ */
+ChunkMac ChunkCipher::manifestMac(const uint8_t* manifest, size_t size) const {
+    ChunkMac mac;
+    CryptoWrapper::hmacSha256(_macKey, { { &MANIFEST_DOMAIN, 1 }, { manifest, size } }, mac.data());
+    return mac;
+}
+
+/**
+ * @brief Returns the file's ID.
+ */
+FileID FileManifest::fileID() const {
+    FileID id;
+    std::copy_n(header.fileID, FILE_ID_SIZE, id.begin());
+    return id;
+}
+
+/**
+ * @brief Returns the number of chunks the whole file is split into.
+ */
+uint64_t FileManifest::chunkCount() const {
+    if (header.chunkSize == 0) {
+        return 0;
+    }
+    return (header.fileSize + header.chunkSize - 1) / header.chunkSize;
+}
+
+/**
+ * @brief Returns the plaintext size of a chunk: the chunk size, or what is left for the last one.
+ * @param index The chunk's index.
+ */
+uint32_t FileManifest::plaintextSize(uint32_t index) const {
+    uint64_t offset = static_cast<uint64_t>(index) * header.chunkSize;
+    return static_cast<uint32_t>(std::min<uint64_t>(header.chunkSize, header.fileSize - offset));
+}
+
+/**
+ * @brief Returns the size of the whole message content: the encoded manifest and the ciphertexts.
+ */
+uint64_t FileManifest::contentSize() const {
+    uint64_t size = encodedSize();
+    for (const auto& entry : entries) {
+        size += entry.size;
+    }
+    return size;
+}
+
+/**
+ * @brief Encodes the header and entries, followed by their MAC.
+ * @param cipher The cipher for the file.
+ * @return The encoded manifest.
+ */
+std::vector<uint8_t> FileManifest::encode(const ChunkCipher& cipher) const {
+    FileManifestHeader encodedHeader = header;
+    encodedHeader.entryCount = static_cast<uint32_t>(entries.size());
+    std::vector<uint8_t> encoded(encodedSize());
+    memcpy(encoded.data(), &encodedHeader, sizeof(encodedHeader));
+    if (!entries.empty()) {
+        memcpy(encoded.data() + sizeof(encodedHeader), entries.data(), entries.size() * sizeof(FileManifestEntry));
+    }
+    size_t signedSize = encoded.size() - CHUNK_MAC_SIZE;
+    ChunkMac mac = cipher.manifestMac(encoded.data(), signedSize);
+    std::copy(mac.begin(), mac.end(), encoded.begin() + signedSize);
+    return encoded;
+}
+
+/**
+ * @brief Returns a manifest for the same file listing only some of its chunks.
+ * @param indexes The chunks; indexes the manifest does not list are skipped.
+ * @return The manifest, listing the chunks in the order of indexes.
+ */
+FileManifest FileManifest::subset(const std::vector<uint32_t>& indexes) const {
+    std::unordered_map<uint32_t, size_t> positions;
+    for (size_t i = 0; i < entries.size(); i++) {
+        positions.emplace(entries[i].index, i);
+    }
+    FileManifest part;
+    part.header = header;
+    for (uint32_t index : indexes) {
+        auto found = positions.find(index);
+        if (found != positions.end()) {
+            part.entries.push_back(entries[found->second]);
+            positions.erase(found);
+        }
+    }
+    part.header.entryCount = static_cast<uint32_t>(part.entries.size());
+    // Chunks sent again complete the file already numbered; they are not a new message.
+    part.header.sequence = 0;
+    return part;
+}
+
+/**
+ * @brief Encrypts a whole file and builds its manifest.
+ * Chunks are read a batch at a time, one per core as far as the memory budget allows, and
+ * encrypted and authenticated in parallel.
+ * @param path The file.
+ * @param fileSize Its size.
+ * @param cipher The cipher for the file's ID.
+ * @return The manifest listing every chunk.
+ */
+FileManifest FileManifest::build(const std::string& path, uint64_t fileSize, const ChunkCipher& cipher) {
+    FileManifest manifest;
+    manifest.header.version = FILE_MANIFEST_VERSION;
+    std::copy(cipher.fileID().begin(), cipher.fileID().end(), manifest.header.fileID);
+    manifest.header.fileSize = fileSize;
+    manifest.header.chunkSize = FILE_CHUNK_SIZE;
+    uint64_t count = manifest.chunkCount();
+    if (count == 0 || count > UINT32_MAX) {
+        throw std::runtime_error("A file of " + std::to_string(fileSize) + " bytes cannot be sent in chunks.");
+    }
+    manifest.header.entryCount = static_cast<uint32_t>(count);
+    manifest.entries.resize(static_cast<size_t>(count));
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Failed to open " + path);
+    }
+    MemoryCharge batchCharge(MemorySubsystem::FILE_IO);
+    size_t batch = reserveBatch(batchCharge, 2 * FILE_CHUNK_SIZE + 16, manifest.entries.size());
+    std::vector<std::vector<uint8_t>> plaintexts(batch);
+    for (size_t first = 0; first < manifest.entries.size(); first += batch) {
+        size_t n = std::min(batch, manifest.entries.size() - first);
+        for (size_t i = 0; i < n; i++) {
+            plaintexts[i].resize(manifest.plaintextSize(static_cast<uint32_t>(first + i)));
+            if (!file.read(reinterpret_cast<char*>(plaintexts[i].data()), plaintexts[i].size())) {
+                throw std::runtime_error("Failed to read " + path);
+            }
+        }
+        // Each task fills only the entries of its own chunks, so no locking is needed.
+        runParallel(n, [&](size_t i) {
+            uint32_t index = static_cast<uint32_t>(first + i);
+            auto ciphertext = cipher.encrypt(index, plaintexts[i].data(), plaintexts[i].size());
+            ChunkMac mac = cipher.mac(index, ciphertext.data(), ciphertext.size());
+            FileManifestEntry& entry = manifest.entries[index];
+            entry.index = index;
+            entry.size = static_cast<uint32_t>(ciphertext.size());
+            std::copy(mac.begin(), mac.end(), entry.mac);
+        });
+    }
+    return manifest;
+}
+
+/**
+ * @brief Reads and authenticates the manifest at the start of FILE_CHUNKED content.
+ * The entries are only checked against each other and the content size once the MAC is
+ * verified, so a forged manifest is rejected before anything in it is relied on.
+ * @param reader The content, positioned at its start.
+ * @param contentSize The size of the whole content.
+ * @param symKey The symmetric key shared with the sender.
+ * @return The manifest.
+ */
+FileManifest FileManifest::read(ContentReader& reader, uint64_t contentSize, const std::vector<uint8_t>& symKey) {
+    FileManifest manifest;
+    FileManifestHeader& header = manifest.header;
+    if (!readExact(reader, &header, sizeof(header))) {
+        throw std::runtime_error("truncated file manifest");
+    }
+    if (header.version != FILE_MANIFEST_VERSION) {
+        throw std::runtime_error("unsupported file manifest version " + std::to_string(header.version));
+    }
+    // The entries are bounded by the content they arrived in before any memory is allocated for them.
+    uint64_t manifestSize = sizeof(header) + static_cast<uint64_t>(header.entryCount) * sizeof(FileManifestEntry) + CHUNK_MAC_SIZE;
+    if (header.chunkSize == 0 || header.chunkSize > MAX_FILE_CHUNK_SIZE || header.entryCount == 0
+        || header.entryCount > manifest.chunkCount() || manifestSize > contentSize) {
+        throw std::runtime_error("malformed file manifest");
+    }
+    manifest.entries.resize(header.entryCount);
+    ChunkMac mac;
+    if (!readExact(reader, manifest.entries.data(), manifest.entries.size() * sizeof(FileManifestEntry))
+        || !readExact(reader, mac.data(), mac.size())) {
+        throw std::runtime_error("truncated file manifest");
+    }
+
+    ChunkCipher cipher(symKey, manifest.fileID());
+    std::vector<uint8_t> encoded = manifest.encode(cipher);
+    if (!CryptoWrapper::macEqual(encoded.data() + encoded.size() - CHUNK_MAC_SIZE, mac.data(), CHUNK_MAC_SIZE)) {
+        throw std::runtime_error("the file manifest failed authentication");
+    }
+
+    std::vector<bool> listed(static_cast<size_t>(manifest.chunkCount()), false);
+    uint64_t total = manifest.encodedSize();
+    for (const auto& entry : manifest.entries) {
+        if (entry.index >= listed.size() || listed[entry.index]
+            || entry.size != AesStream::ciphertextSize(manifest.plaintextSize(entry.index))) {
+            throw std::runtime_error("inconsistent file manifest");
+        }
+        listed[entry.index] = true;
+        total += entry.size;
+    }
+    if (total != contentSize) {
+        throw std::runtime_error("the content size does not match the file manifest");
+    }
+    return manifest;
+}
+
+/**
+ * @brief Reads the chunks that follow a FILE_CHUNKED manifest into a partial file.
+ * Chunks the file is not missing, e.g. sent twice, are skipped without counting as failed.
+ * @param reader The content, positioned after the manifest.
+ * @param manifest The manifest.
+ * @param cipher The cipher for the file.
+ * @param file The partial file.
+ * @return The number of chunks that failed verification.
+ */
+uint32_t receiveChunks(ContentReader& reader, const FileManifest& manifest, const ChunkCipher& cipher, PartialFile& file) {
+    std::fstream out(file.path, std::ios::binary | std::ios::in | std::ios::out);
+    if (!out) {
+        throw std::runtime_error("Failed to open " + file.path);
+    }
+    const auto& entries = manifest.entries;
+    MemoryCharge batchCharge(MemorySubsystem::CRYPTO);
+    size_t perChunk = static_cast<size_t>(manifest.header.chunkSize + AesStream::ciphertextSize(manifest.header.chunkSize));
+    size_t batch = reserveBatch(batchCharge, perChunk, entries.size());
+    std::vector<std::vector<uint8_t>> ciphertexts(batch);
+    std::vector<std::vector<uint8_t>> plaintexts(batch);
+    std::vector<char> intact(batch);
+    uint32_t failed = 0;
+    for (size_t first = 0; first < entries.size(); first += batch) {
+        size_t n = std::min(batch, entries.size() - first);
+        for (size_t i = 0; i < n; i++) {
+            ciphertexts[i].resize(entries[first + i].size);
+            if (!readExact(reader, ciphertexts[i].data(), ciphertexts[i].size())) {
+                throw std::runtime_error("truncated file chunk");
+            }
+        }
+        // The missing chunks are only looked up while the tasks run, and changed after they are done.
+        runParallel(n, [&](size_t i) {
+            const FileManifestEntry& entry = entries[first + i];
+            auto missing = file.missing.find(entry.index);
+            ChunkMac mac = cipher.mac(entry.index, ciphertexts[i].data(), ciphertexts[i].size());
+            intact[i] = missing != file.missing.end()
+                && CryptoWrapper::macEqual(mac.data(), entry.mac, CHUNK_MAC_SIZE)
+                && CryptoWrapper::macEqual(mac.data(), missing->second.data(), CHUNK_MAC_SIZE);
+            if (!intact[i]) {
+                return;
+            }
+            try {
+                plaintexts[i] = cipher.decrypt(entry.index, ciphertexts[i]);
+                intact[i] = plaintexts[i].size() == manifest.plaintextSize(entry.index);
+            }
+            catch (const std::exception&) {
+                intact[i] = false;
+            }
+        });
+        for (size_t i = 0; i < n; i++) {
+            const FileManifestEntry& entry = entries[first + i];
+            if (!intact[i]) {
+                if (file.missing.count(entry.index)) {
+                    failed++;
+                }
+                continue;
+            }
+            out.seekp(static_cast<std::streamoff>(static_cast<uint64_t>(entry.index) * file.chunkSize));
+            out.write(reinterpret_cast<const char*>(plaintexts[i].data()), plaintexts[i].size());
+            if (!out) {
+                throw std::runtime_error("Failed to write " + file.path);
+            }
+            file.missing.erase(entry.index);
+        }
+    }
+    out.flush();
+    if (!out) {
+        throw std::runtime_error("Failed to write " + file.path);
+    }
+    return failed;
+}
+
+/**
+ * @brief Prepares the payload.
+ * @param recipientID The recipient's UUID.
+ * @param path The file.
+ * @param manifest The chunks to send; must outlive the source.
+ * @param cipher The cipher for the file; must outlive the source.
+ */
+ChunkedFileSource::ChunkedFileSource(const std::vector<uint8_t>& recipientID, const std::string& path, const FileManifest& manifest, const ChunkCipher& cipher)
+    : _path(path), _manifest(manifest), _cipher(cipher), _encoded(manifest.encode(cipher)), _contentSize(manifest.contentSize()) {
+    std::copy_n(recipientID.begin(), std::min(recipientID.size(), CLIENT_ID_SIZE), _header.clientID);
+    _header.type = MessageType::FILE_CHUNKED;
+    _header.contentSize = static_cast<uint32_t>(_contentSize);
+}
+
+/**
+ * @brief Starts over: the manifest, then a fresh encryption of the listed chunks.
+ */
+bool ChunkedFileSource::rewind() {
+    _position = 0;
+    _nextEntry = 0;
+    size_t chunkSize = _manifest.header.chunkSize;
+    if (!_buffersCharge.waitUpdate(static_cast<size_t>(chunkSize + AesStream::ciphertextSize(chunkSize)), MEMORY_WAIT_TIMEOUT)) {
+        _failed = true;
+        return false;
+    }
+    _file.close();
+    _file.clear();
+    _file.open(_path, std::ios::binary);
+    if (!_file) {
+        _failed = true;
+        return false;
+    }
+    // The manifest goes out first, from the buffer the chunks use after it.
+    _pending = _encoded;
+    _pendingOffset = 0;
+    return true;
+}
+
+/**
+ * @brief Produces the header, the manifest, then the ciphertext one chunk at a time.
+ */
+size_t ChunkedFileSource::read(uint8_t* buffer, size_t capacity) {
+    size_t produced = 0;
+    while (produced < capacity && _position < size()) {
+        size_t count;
+        if (_position < sizeof(_header)) {
+            count = std::min(capacity - produced, static_cast<size_t>(sizeof(_header) - _position));
+            memcpy(buffer + produced, reinterpret_cast<const uint8_t*>(&_header) + _position, count);
+        }
+        else {
+            if (_pendingOffset == _pending.size() && !encryptNextChunk()) {
+                _failed = true;
+                return 0;
+            }
+            count = std::min(capacity - produced, _pending.size() - _pendingOffset);
+            memcpy(buffer + produced, _pending.data() + _pendingOffset, count);
+            _pendingOffset += count;
+        }
+        produced += count;
+        _position += count;
+    }
+    return produced;
+}
+
+/**
+ * @brief Reads and encrypts the next listed chunk into _pending, checking it against the manifest.
+ */
+bool ChunkedFileSource::encryptNextChunk() {
+    if (_nextEntry == _manifest.entries.size()) {
+        return false;
+    }
+    const FileManifestEntry& entry = _manifest.entries[_nextEntry++];
+    _chunk.resize(_manifest.plaintextSize(entry.index));
+    _file.seekg(static_cast<std::streamoff>(static_cast<uint64_t>(entry.index) * _manifest.header.chunkSize));
+    if (!_file.read(reinterpret_cast<char*>(_chunk.data()), _chunk.size())) {
+        return false;
+    }
+    try {
+        _pending = _cipher.encrypt(entry.index, _chunk.data(), _chunk.size());
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+    _pendingOffset = 0;
+    ChunkMac mac = _cipher.mac(entry.index, _pending.data(), _pending.size());
+    if (!CryptoWrapper::macEqual(mac.data(), entry.mac, CHUNK_MAC_SIZE)) {
+        LOG_WARN("session", "File changed since its manifest was built", logField("path", _path), logField("chunk", entry.index));
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,214 @@
+// ChunkedFile.h
+// author: Ariel Cohen ID: 329599187
+
+#pragma once
+#include "MemoryStats.h"
+#include "Protocol.h"
+#include "ProtocolEngine.h"
+#include "Spool.h"
+#include <array>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+constexpr uint32_t FILE_CHUNK_SIZE = 1024 * 1024;                ///< Plaintext bytes per chunk of a FILE_CHUNKED message.
+constexpr uint64_t FILE_CHUNKED_THRESHOLD = 4 * FILE_CHUNK_SIZE; ///< Files at least this large are sent as FILE_CHUNKED.
+constexpr uint32_t MAX_FILE_CHUNK_SIZE = 16 * 1024 * 1024;       ///< Largest chunk size accepted in a manifest.
+
+using FileID = std::array<uint8_t, FILE_ID_SIZE>;
+using ChunkMac = std::array<uint8_t, CHUNK_MAC_SIZE>;
+
+/**
+ * @brief Encrypts, decrypts and authenticates the chunks of one FILE_CHUNKED file.
+ * Each chunk is encrypted on its own with AES-CBC under the shared symmetric key, with an IV
+ * derived from the file ID and chunk index, so chunks can be processed in any order and in
+ * parallel, and encrypting a chunk again gives the same ciphertext. Each ciphertext is then
+ * authenticated with HMAC-SHA256 under a key derived from the symmetric key (encrypt-then-MAC),
+ * bound to the file ID and the chunk's index, so chunks cannot be moved between files or positions.
+ */
+class ChunkCipher {
+public:
+    /**
+     * @brief Derives the keys for a file.
+     * @param symKey The symmetric key shared with the other client.
+     * @param fileID The file's ID.
+     * @throws std::runtime_error if the key is invalid.
+     */
+    ChunkCipher(const std::vector<uint8_t>& symKey, const FileID& fileID);
+
+    /**
+     * @brief Encrypts one chunk.
+     */
+    std::vector<uint8_t> encrypt(uint32_t index, const uint8_t* plaintext, size_t size) const;
+
+    /**
+     * @brief Decrypts one chunk; check its MAC first.
+     * @throws std::runtime_error if the ciphertext is invalid.
+     */
+    std::vector<uint8_t> decrypt(uint32_t index, const std::vector<uint8_t>& ciphertext) const;
+
+    /**
+     * @brief Returns the MAC of a chunk's ciphertext.
+     */
+    ChunkMac mac(uint32_t index, const uint8_t* ciphertext, size_t size) const;
+
+    /**
+     * @brief Returns the MAC of an encoded manifest header and entries.
+     */
+    ChunkMac manifestMac(const uint8_t* manifest, size_t size) const;
+
+    /**
+     * @brief Returns the file's ID.
+     */
+    const FileID& fileID() const { return _fileID; }
+
+private:
+    // Returns the IV a chunk is encrypted with
+    std::vector<uint8_t> chunkIv(uint32_t index) const;
+
+    std::vector<uint8_t> _encryptionKey; // the symmetric key
+    std::vector<uint8_t> _macKey;        // authenticates chunks and the manifest
+    std::vector<uint8_t> _ivKey;         // derives the IV of each chunk
+    FileID _fileID{};                    // the file the chunks belong to
+};
+
+/**
+ * @brief The manifest that starts a FILE_CHUNKED message: the file, and the size and MAC of each chunk it carries.
+ */
+struct FileManifest {
+    FileManifestHeader header{};            ///< The file's ID, size and chunk size.
+    std::vector<FileManifestEntry> entries; ///< The chunks in the message, in the order their ciphertexts follow.
+
+    /**
+     * @brief Returns the file's ID.
+     */
+    FileID fileID() const;
+
+    /**
+     * @brief Returns the number of chunks the whole file is split into.
+     */
+    uint64_t chunkCount() const;
+
+    /**
+     * @brief Returns the plaintext size of a chunk.
+     */
+    uint32_t plaintextSize(uint32_t index) const;
+
+    /**
+     * @brief Returns the size of the encoded header, entries and MAC.
+     */
+    size_t encodedSize() const { return sizeof(FileManifestHeader) + entries.size() * sizeof(FileManifestEntry) + CHUNK_MAC_SIZE; }
+
+    /**
+     * @brief Returns the size of the whole message content: the encoded manifest and the ciphertexts.
+     */
+    uint64_t contentSize() const;
+
+    /**
+     * @brief Encodes the header and entries, followed by their MAC.
+     */
+    std::vector<uint8_t> encode(const ChunkCipher& cipher) const;
+
+    /**
+     * @brief Returns a manifest for the same file listing only some of its chunks, e.g. to send them again.
+     * Its sequence number is 0, since the chunks belong to a message numbered already.
+     * @param indexes The chunks; indexes the manifest does not list are skipped.
+     */
+    FileManifest subset(const std::vector<uint32_t>& indexes) const;
+
+    /**
+     * @brief Encrypts a whole file and builds its manifest, encrypting chunks in parallel.
+     * Only the MACs are kept, so the file is encrypted a second time while it is sent.
+     * @param path The file.
+     * @param fileSize Its size.
+     * @param cipher The cipher for the file's ID.
+     * @return The manifest listing every chunk.
+     * @throws std::runtime_error if the file cannot be read or the memory budget has no room.
+     */
+    static FileManifest build(const std::string& path, uint64_t fileSize, const ChunkCipher& cipher);
+
+    /**
+     * @brief Reads and authenticates the manifest at the start of FILE_CHUNKED content.
+     * Nothing after the manifest is read, so content whose manifest is corrupt is rejected at once.
+     * @param reader The content, positioned at its start.
+     * @param contentSize The size of the whole content.
+     * @param symKey The symmetric key shared with the sender.
+     * @return The manifest; its sizes are checked against the content size.
+     * @throws std::runtime_error if the manifest is malformed, inconsistent or fails authentication.
+     */
+    static FileManifest read(ContentReader& reader, uint64_t contentSize, const std::vector<uint8_t>& symKey);
+};
+
+/**
+ * @brief A FILE_CHUNKED file being received, with the chunks still missing from it.
+ */
+struct PartialFile {
+    std::vector<uint8_t> senderID;       ///< The client that sent the file.
+    std::string path;                    ///< The file being assembled.
+    uint64_t fileSize = 0;               ///< Its size.
+    uint32_t chunkSize = 0;              ///< Plaintext bytes per chunk.
+    std::map<uint32_t, ChunkMac> missing; ///< Chunks not yet received intact, with the MAC the first manifest gave them.
+    unsigned requests = 0;               ///< FILE_CHUNK_REQUESTs sent for the file.
+};
+
+/**
+ * @brief Reads the chunks that follow a FILE_CHUNKED manifest into a partial file.
+ * Chunks are verified and decrypted in parallel, a batch at a time; a chunk is only decrypted
+ * and written if its MAC matches both its ciphertext and the MAC the file's first manifest gave
+ * it, so a chunk sent again must be the very chunk that was missing.
+ * @param reader The content, positioned after the manifest.
+ * @param manifest The manifest.
+ * @param cipher The cipher for the file.
+ * @param file The partial file; intact chunks are written to it and removed from its missing chunks.
+ * @return The number of chunks that failed verification.
+ * @throws std::runtime_error if the content or the file cannot be read or written.
+ */
+uint32_t receiveChunks(ContentReader& reader, const FileManifest& manifest, const ChunkCipher& cipher, PartialFile& file);
+
+/**
+ * @brief The payload of a SEND_MESSAGE request carrying a FILE_CHUNKED message.
+ * The manifest goes first; the chunks it lists are then read from the file and encrypted one at
+ * a time. A chunk whose MAC differs from the manifest's, because the file changed since the
+ * manifest was built, fails the request rather than sending a chunk the recipient would reject.
+ */
+class ChunkedFileSource : public PayloadSource {
+public:
+    /**
+     * @brief Prepares the payload.
+     * @param recipientID The recipient's UUID.
+     * @param path The file.
+     * @param manifest The chunks to send.
+     * @param cipher The cipher for the file.
+     */
+    ChunkedFileSource(const std::vector<uint8_t>& recipientID, const std::string& path, const FileManifest& manifest, const ChunkCipher& cipher);
+
+    size_t size() const override { return static_cast<size_t>(sizeof(_header) + _contentSize); }
+
+    /**
+     * @brief Returns true if the file could not be read or no longer matches the manifest.
+     */
+    bool failed() const { return _failed; }
+
+    bool rewind() override;
+    size_t read(uint8_t* buffer, size_t capacity) override;
+
+private:
+    // Reads and encrypts the next listed chunk into _pending
+    bool encryptNextChunk();
+
+    SendMessageHeader _header{};     // precedes the content
+    std::string _path;               // the file
+    const FileManifest& _manifest;   // the chunks to send
+    const ChunkCipher& _cipher;      // encrypts them
+    std::vector<uint8_t> _encoded;   // the encoded manifest
+    uint64_t _contentSize;           // the size of the content
+    std::ifstream _file;             // the open file
+    size_t _nextEntry = 0;           // the entry whose chunk is encrypted next
+    std::vector<uint8_t> _chunk;     // the plaintext chunk being encrypted
+    std::vector<uint8_t> _pending;   // content not yet produced
+    size_t _pendingOffset = 0;       // bytes of _pending already produced
+    uint64_t _position = 0;          // bytes of the payload already produced
+    bool _failed = false;            // true if the file could not be read or changed
+    MemoryCharge _buffersCharge{MemorySubsystem::CRYPTO}; // _chunk and _pending
+};
@@ -2,38 +2,16 @@
 // author: Ariel Cohen ID: 329599187
 
 #include "Client.h"
+#include "Logger.h"
 #include <iostream>
 #include <iomanip>
-
-// When DEBUG is defined, DEBUG_LOG(x) will print x to the console.
-// Otherwise, it will do nothing. This is useful for adding debug prints that are
-// automatically removed from release builds.
-#ifdef DEBUG
-#define DEBUG_LOG(x) do { std::cout << x << std::endl; } while (0)
-#else
-#define DEBUG_LOG(x)
-#endif
+#include <sstream>
 
 /**
  * @brief Initializes the client.
- * Reads server info from server.info and user data from my.info if it exists.
+ * The session reads server info from server.info and user data from my.info if it exists.
  */
-Client::Client() {
-    // Load server IP and port from the configuration file.
-    auto serverInfo = FileHandler::readServerInfo();
-    if (!serverInfo) {
-        throw std::runtime_error("server.info file not found or is invalid.");
-    }
-    _communicator = std::make_unique<Communicator>(serverInfo->ip, serverInfo->port);
-
-    // If a my.info file exists, load the user's identity.
-    _userInfo = FileHandler::readMyInfo();
-    if (_userInfo) {
-        DEBUG_LOG("[DEBUG] Loaded user info for " << _userInfo->username);
-        // The private key is stored in Base64, so it needs to be decoded.
-        CryptoWrapper::base64ToPrivateKey(_userInfo->privateKey, _privateKey);
-    }
-}
+Client::Client() : _session() {}
 
 /**
  * @brief The main loop of the client application.
@@ -61,6 +39,12 @@ void Client::run() {
         case 151: handleSendSymKeyRequest(); break;
         case 152: handleSendSymKey(); break;
         case 153: handleSendFile(); break;
+        case 154: handleSendDirectory(); break;
+        case 160: handleSendStream(); break;
+        case 161: handleListenForStreams(); break;
+        case 162: handleWatchPresence(); break;
+        case 170: handleShowMemoryUsage(); break;
+        case 171: handleSetLogLevel(); break;
         case 0: std::cout << "Exiting..." << std::endl; break;
         default: std::cout << "Invalid option." << std::endl; break;
         }
@@ -80,10 +64,38 @@ void Client::showMenu() {
     std::cout << "151) Send a request for symmetric key\n";
     std::cout << "152) Send your symmetric key\n";
     std::cout << "153) Send a file\n";
+    std::cout << "154) Send a directory\n";
+    std::cout << "160) Stream lines to a client\n";
+    std::cout << "161) Listen for streams and presence changes\n";
+    std::cout << "162) Watch who is online\n";
+    std::cout << "170) Show memory usage\n";
+    std::cout << "171) Set log level\n";
     std::cout << "0) Exit client\n";
     std::cout << "? ";
 }
 
+/**
+ * @brief Prompts for a username and resolves it to a known client.
+ * If the client is not cached, it is looked up on the server.
+ * @param prompt The prompt to display.
+ * @param username Receives the entered username.
+ * @return A pointer to the client, or nullptr (after printing an error) if not found.
+ */
+ClientInfo* Client::promptForClient(const std::string& prompt, std::string& username) {
+    std::cout << prompt;
+    std::getline(std::cin, username);
+
+    // Check if we know the user first, if not, refresh the list.
+    if (!_session.findClientByName(username)) {
+        std::cout << "Client not cached, looking up on server..." << std::endl;
+    }
+    ClientInfo* client = _session.resolveClient(username);
+    if (!client) {
+        std::cerr << "Could not find client '" << username << "'." << std::endl;
+    }
+    return client;
+}
+
 /**
  * @brief Handles the user registration process.
  * Generates a new RSA key pair, sends the username and public key to the server,
@@ -99,41 +111,19 @@ void Client::handleRegister() {
     std::string username;
     std::getline(std::cin, username);
 
-    // Generate a new RSA key pair for the user.
-    DEBUG_LOG("[DEBUG] Generating RSA key pair for registration...");
-    CryptoPP::RSA::PrivateKey privateKey;
-    CryptoPP::RSA::PublicKey publicKey;
-    CryptoWrapper::generateRsaKeys(privateKey, publicKey);
-
-    // Pack the registration request according to the protocol.
-    RegistrationRequest req{};
-    strncpy_s(req.name, sizeof(req.name), username.c_str(), sizeof(req.name) - 1);
-    auto pubKeyBytes = CryptoWrapper::publicKeyToBytes(publicKey);
-    std::copy(pubKeyBytes.begin(), pubKeyBytes.end(), req.publicKey);
-
-    std::vector<uint8_t> payload(sizeof(req));
-    memcpy(payload.data(), &req, sizeof(req));
-
-    DEBUG_LOG("[DEBUG] Sending registration request for user " << username);
-    auto response = _communicator->sendAndReceive(RequestCode::REGISTER, payload, {});
-    
-    // On successful registration, save the new user info.
-    if (response && response->size() == sizeof(RegistrationSuccessResponse)) {
-        auto* respData = reinterpret_cast<RegistrationSuccessResponse*>(response->data());
-        UserInfo info;
-        info.username = username;
-        info.uuid.assign(respData->clientID, respData->clientID + CLIENT_ID_SIZE);
-        info.privateKey = CryptoWrapper::privateKeyToBase64(privateKey);
-
-        if (FileHandler::writeMyInfo(info)) {
-            std::cout << "Registration successful." << std::endl;
-            // Update the current session with the new user info.
-            _userInfo = info;
-            _privateKey = privateKey;
-        }
-        else {
-            std::cerr << "Failed to write my.info file." << std::endl;
-        }
+    switch (_session.registerUser(username)) {
+    case SessionStatus::OK:
+        std::cout << "Registration successful." << std::endl;
+        break;
+    case SessionStatus::ALREADY_REGISTERED:
+        std::cerr << "Error: my.info file already exists. Cannot register again." << std::endl;
+        break;
+    case SessionStatus::FILE_ERROR:
+        std::cerr << "Failed to write my.info file." << std::endl;
+        break;
+    default:
+        std::cerr << _session.lastError() << std::endl;
+        std::cerr << "Registration failed." << std::endl;
     }
 }
 
@@ -141,130 +131,96 @@ void Client::handleRegister() {
  * @brief Requests the list of all registered clients from the server and displays it.
  */
 void Client::handleRequestClientsList() {
-    if (!_userInfo) { std::cerr << "Please register first." << std::endl; return; }
-    DEBUG_LOG("[DEBUG] Requesting clients list from server...");
-    auto response = _communicator->sendAndReceive(RequestCode::CLIENTS_LIST, {}, _userInfo->uuid);
-    if (response) {
-        _clientList.clear(); // Clear the old list.
-        // The response payload is a series of ClientInfoResponse structs.
-        size_t entrySize = sizeof(ClientInfoResponse);
-        for (size_t i = 0; i < response->size(); i += entrySize) {
-            auto* info = reinterpret_cast<ClientInfoResponse*>(response->data() + i);
-            ClientInfo client;
-            client.id.assign(info->clientID, info->clientID + CLIENT_ID_SIZE);
-            client.name = std::string(info->name);
-            _clientList.push_back(client);
+    if (!_session.isRegistered()) { std::cerr << "Please register first." << std::endl; return; }
+    std::vector<ClientInfo> clients;
+    if (_session.listClients(clients) != SessionStatus::OK) {
+        std::cerr << _session.lastError() << std::endl;
+        return;
+    }
+    std::cout << "Clients list:" << std::endl;
+    for (const auto& client : clients) {
+        std::cout << "- " << client.name << std::endl;
+    }
+}
+
+/**
+ * @brief Displays a single pulled message.
+ * @param msg The message as processed by the session.
+ */
+void Client::showMessage(const IncomingMessage& msg) {
+    std::cout << "From: " << msg.senderName << (msg.deferred ? " (deferred)" : "") << '\n';
+    if (msg.skipped > 0) {
+        std::cout << "(" << msg.skipped << " earlier message(s) from " << msg.senderName << " missing)" << '\n';
+    }
+    std::cout << "Content:\n";
+
+    switch (msg.type) {
+    case MessageType::SYM_KEY_REQUEST:
+        std::cout << "Request for symmetric key" << '\n';
+        break;
+    case MessageType::SYM_KEY_SEND:
+        if (msg.status == MessageStatus::DELIVERED) {
+            std::cout << "Symmetric key received." << '\n';
+        }
+        else {
+            std::cerr << "Failed to decrypt symmetric key." << '\n';
+        }
+        break;
+    case MessageType::TEXT_MESSAGE:
+        switch (msg.status) {
+        case MessageStatus::DELIVERED: std::cout << msg.text << '\n'; break;
+        case MessageStatus::DEFERRED:
+            std::cout << "Can't decrypt message yet, no symmetric key. It will be shown once a key is received." << '\n';
+            break;
+        default: std::cerr << "Can't decrypt message" << '\n'; break;
+        }
+        break;
+    case MessageType::FILE_SEND:
+    case MessageType::FILE_CHUNKED:
+    case MessageType::FILE_BUNDLE:
+    case MessageType::STREAM:
+        switch (msg.status) {
+        case MessageStatus::DELIVERED: std::cout << msg.filePath << '\n'; break;
+        case MessageStatus::REPAIRING:
+            std::cout << "File incomplete: " << msg.error << ". It will be saved once they are received." << '\n';
+            break;
+        case MessageStatus::DEFERRED:
+            std::cout << "Can't decrypt file yet, no symmetric key. It will be saved once a key is received." << '\n';
+            break;
+        case MessageStatus::NO_SYM_KEY: std::cerr << "Can't decrypt file, no symmetric key." << '\n'; break;
+        default: std::cerr << "Can't decrypt or save file: " << msg.error << '\n'; break;
         }
-        std::cout << "Clients list:" << std::endl;
-        for (const auto& client : _clientList) {
-            std::cout << "- " << client.name << std::endl;
+        break;
+    case MessageType::FILE_CHUNK_REQUEST:
+        if (msg.status == MessageStatus::DELIVERED) {
+            std::cout << msg.text << '\n';
         }
+        else {
+            std::cerr << "Can't send file chunks again: " << (msg.error.empty() ? "no symmetric key" : msg.error) << '\n';
+        }
+        break;
+    default:
+        std::cout << "Unknown message type." << '\n';
     }
+    std::cout << "-----<EOM>-----\n\n";
 }
 
 /**
- * @brief Fetches and processes all waiting messages from the server.
- * This function handles different message types like key requests, keys, text, and files.
+ * @brief Fetches and displays all waiting messages from the server.
  */
 void Client::handleRequestWaitingMessages() {
-    if (!_userInfo) { std::cerr << "Please register first." << std::endl; return; }
-    DEBUG_LOG("[DEBUG] Requesting waiting messages...");
-    auto response = _communicator->sendAndReceive(RequestCode::PULL_MESSAGES, {}, _userInfo->uuid);
-    if (response && !response->empty()) {
-        // The response is a stream of messages, so we loop through it.
-        size_t offset = 0;
-        while (offset < response->size()) {
-            // Parse the message header.
-            auto* header = reinterpret_cast<MessageHeader*>(response->data() + offset);
-            offset += sizeof(MessageHeader);
-            // Extract the message content.
-            std::vector<uint8_t> content(response->data() + offset, response->data() + offset + header->messageSize);
-            offset += header->messageSize;
-
-            // Find the sender in our local list. If not found, refresh the list.
-            auto* sender = findClientByID(std::vector<uint8_t>(header->clientID, header->clientID + CLIENT_ID_SIZE));
-            if (!sender) { 
-                DEBUG_LOG("[DEBUG] Sender " << FileHandler::bytesToHex({header->clientID, header->clientID + 16}) << " not in local list. Refreshing.");
-                handleRequestClientsList();
-                sender = findClientByID(std::vector<uint8_t>(header->clientID, header->clientID + CLIENT_ID_SIZE));
-            }
-            std::string senderName = sender ? sender->name : "Unknown";
-
-            std::cout << "From: " << senderName << std::endl;
-            std::cout << "Content:\n";
-
-            // Handle the message based on its type.
-            switch (header->type) {
-            case MessageType::SYM_KEY_REQUEST:
-                DEBUG_LOG("[DEBUG] Received SYM_KEY_REQUEST from " << senderName);
-                std::cout << "Request for symmetric key" << std::endl;
-                break;
-            case MessageType::SYM_KEY_SEND: {
-                DEBUG_LOG("[DEBUG] Received SYM_KEY_SEND from " << senderName << ". Content size: " << content.size());
-                try {
-                    // Decrypt the symmetric key with our private RSA key.
-                    auto symKey = CryptoWrapper::rsaDecrypt(_privateKey, content);
-                    if (sender) {
-                        sender->symKey = symKey;
-                        DEBUG_LOG("[DEBUG] Decrypted and stored symmetric key: " << FileHandler::bytesToHex(symKey));
-                    }
-                    std::cout << "Symmetric key received." << std::endl;
-                }
-                catch (...) {
-                    std::cerr << "Failed to decrypt symmetric key." << std::endl;
-                }
-                break;
-            }
-            case MessageType::TEXT_MESSAGE: {
-                DEBUG_LOG("[DEBUG] Received TEXT_MESSAGE from " << senderName << ". Content size: " << content.size());
-                if (sender && !sender->symKey.empty()) {
-                    try {
-                        // Decrypt the text message with the shared symmetric key.
-                        auto decrypted = CryptoWrapper::aesDecrypt(sender->symKey, content);
-                        std::cout << std::string(decrypted.begin(), decrypted.end()) << std::endl;
-                    }
-                    catch (...) {
-                        std::cerr << "Can't decrypt message" << std::endl;
-                    }
-                }
-                else {
-                    std::cerr << "Can't decrypt message" << std::endl;
-                }
-                break;
-            }
-            case MessageType::FILE_SEND: {
-                if (sender && !sender->symKey.empty()) {
-                    DEBUG_LOG("\n[DEBUG] RECEIVING CLIENT (File):");
-                    DEBUG_LOG("  Symmetric key:   " << FileHandler::bytesToHex(sender->symKey));
-                    DEBUG_LOG("  Ciphertext size: " << content.size() << " bytes");
-                    if (content.size() >= 16) {
-                        DEBUG_LOG("  Ciphertext prefix: " << FileHandler::bytesToHex({content.begin(), content.begin() + 16}));
-                    }
-                    DEBUG_LOG("-----");
-                    try {
-                        // Decrypt the file content with the shared symmetric key.
-                        auto decrypted = CryptoWrapper::aesDecrypt(sender->symKey, content);
-                        // Save the decrypted content to a temporary file.
-                        auto saved_path = FileHandler::writeToTempFile(decrypted);
-                        std::cout << saved_path << std::endl;
-                    }
-                    catch (const std::exception& e) {
-                        std::cerr << "Can't decrypt or save file: " << e.what() << std::endl;
-                    }
-                }
-                else {
-                    std::cerr << "Can't decrypt file, no symmetric key." << std::endl;
-                }
-                break;
-            }
-            default:
-                DEBUG_LOG("[DEBUG] Received unknown message type: " << (int)header->type);
-                std::cout << "Unknown message type." << std::endl;
-            }
-            std::cout << "-----<EOM>-----\n" << std::endl;
-        }
+    if (!_session.isRegistered()) { std::cerr << "Please register first." << std::endl; return; }
+    size_t shown = 0;
+    auto status = _session.pullMessages([&](const IncomingMessage& msg) {
+        showMessage(msg);
+        shown++;
+    });
+    // Messages are written without flushing each one; a large pull is flushed once at the end.
+    std::cout.flush();
+    if (status != SessionStatus::OK) {
+        std::cerr << _session.lastError() << std::endl;
     }
-    else {
+    else if (shown == 0) {
         std::cout << "No new messages." << std::endl;
     }
 }
@@ -273,41 +229,15 @@ void Client::handleRequestWaitingMessages() {
  * @brief Requests the public key for a specific user from the server.
  */
 void Client::handleRequestPublicKey() {
-    if (!_userInfo) { std::cerr << "Please register first." << std::endl; return; }
+    if (!_session.isRegistered()) { std::cerr << "Please register first." << std::endl; return; }
 
-    std::cout << "Enter username to get public key for: ";
     std::string username;
-    std::getline(std::cin, username);
-
-    // Check if we know the user first, if not, refresh the list.
-    ClientInfo* client = findClientByName(username);
-    if (!client) {
-        std::cout << "Client not in local list, fetching from server..." << std::endl;
-        handleRequestClientsList(); // Refresh list
-        client = findClientByName(username);
-    }
-
+    ClientInfo* client = promptForClient("Enter username to get public key for: ", username);
     if (!client) {
-        std::cerr << "Could not find client '" << username << "'." << std::endl;
         return;
     }
 
-    // Pack the request payload.
-    PublicKeyRequest req{};
-    std::copy(client->id.begin(), client->id.end(), req.clientID);
-    
-    std::vector<uint8_t> payload(sizeof(req));
-    memcpy(payload.data(), &req, sizeof(req));
-
-    DEBUG_LOG("[DEBUG] Requesting public key for " << username);
-    auto response = _communicator->sendAndReceive(RequestCode::PUBLIC_KEY, payload, _userInfo->uuid);
-
-    if (response && response->size() == sizeof(PublicKeyResponse)) {
-        auto* respData = reinterpret_cast<PublicKeyResponse*>(response->data());
-        // Store the received public key in our local list for this user.
-        client->publicKey.assign(respData->publicKey, respData->publicKey + PUBLIC_KEY_SIZE);
-        
-        DEBUG_LOG("[DEBUG] Received public key: " << FileHandler::bytesToHex(client->publicKey));
+    if (_session.requestPublicKey(username) == SessionStatus::OK) {
         std::cout << "Public key for " << username << ":" << std::endl;
         for (const auto& byte : client->publicKey) {
             std::cout << std::hex << std::setw(2) << std::setfill('0') << (int)byte;
@@ -324,21 +254,11 @@ void Client::handleRequestPublicKey() {
  * Requires a symmetric key to be established first.
  */
 void Client::handleSendTextMessage() {
-    if (!_userInfo) { std::cerr << "Please register first." << std::endl; return; }
+    if (!_session.isRegistered()) { std::cerr << "Please register first." << std::endl; return; }
 
-    std::cout << "Enter username to send a message to: ";
     std::string username;
-    std::getline(std::cin, username);
-
-    ClientInfo* client = findClientByName(username);
+    ClientInfo* client = promptForClient("Enter username to send a message to: ", username);
     if (!client) {
-        std::cout << "Client not in local list, fetching from server..." << std::endl;
-        handleRequestClientsList(); // Refresh list
-        client = findClientByName(username);
-    }
-
-    if (!client) {
-        std::cerr << "Could not find client '" << username << "'." << std::endl;
         return;
     }
 
@@ -353,38 +273,10 @@ void Client::handleSendTextMessage() {
     std::string message;
     std::getline(std::cin, message);
 
-    try {
-        DEBUG_LOG("\n[DEBUG] SENDING CLIENT (Text):");
-        DEBUG_LOG("  To user: " << username);
-        DEBUG_LOG("  Symmetric key: " << FileHandler::bytesToHex(client->symKey));
-        
-        // Encrypt the message with the shared symmetric key.
-        std::vector<uint8_t> plaintext(message.begin(), message.end());
-        auto ciphertext = CryptoWrapper::aesEncrypt(client->symKey, plaintext);
-
-        DEBUG_LOG("  Ciphertext size: " << ciphertext.size() << " bytes");
-        DEBUG_LOG("-----");
-
-        // Construct the payload with a header and the encrypted content.
-        SendMessageHeader msgHeader{};
-        std::copy(client->id.begin(), client->id.end(), msgHeader.clientID);
-        msgHeader.type = MessageType::TEXT_MESSAGE;
-        msgHeader.contentSize = static_cast<uint32_t>(ciphertext.size());
-
-        std::vector<uint8_t> payload;
-        payload.resize(sizeof(msgHeader) + ciphertext.size());
-        memcpy(payload.data(), &msgHeader, sizeof(msgHeader));
-        memcpy(payload.data() + sizeof(msgHeader), ciphertext.data(), ciphertext.size());
-
-        auto response = _communicator->sendAndReceive(RequestCode::SEND_MESSAGE, payload, _userInfo->uuid);
-
-        if (response && response->size() == sizeof(MessageSentResponse)) {
-            std::cout << "Message sent to " << username << "." << std::endl;
-        } else {
-            std::cerr << "Failed to send message." << std::endl;
-        }
-    } catch (const std::exception& e) {
-        std::cerr << "An error occurred during message encryption: " << e.what() << std::endl;
+    switch (_session.sendText(username, message)) {
+    case SessionStatus::OK: std::cout << "Message sent to " << username << "." << std::endl; break;
+    case SessionStatus::CRYPTO_ERROR: std::cerr << "An error occurred during message encryption." << std::endl; break;
+    default: std::cerr << "Failed to send message." << std::endl; break;
     }
 }
 
@@ -392,40 +284,14 @@ void Client::handleSendTextMessage() {
  * @brief Sends a request to another user, asking them to send their symmetric key.
  */
 void Client::handleSendSymKeyRequest() {
-    if (!_userInfo) { std::cerr << "Please register first." << std::endl; return; }
+    if (!_session.isRegistered()) { std::cerr << "Please register first." << std::endl; return; }
 
-    std::cout << "Enter username to request a symmetric key from: ";
     std::string username;
-    std::getline(std::cin, username);
-
-    ClientInfo* client = findClientByName(username);
-    if (!client) {
-        std::cout << "Client not in local list, fetching from server..." << std::endl;
-        handleRequestClientsList(); // Refresh list
-        client = findClientByName(username);
-    }
-
-    if (!client) {
-        std::cerr << "Could not find client '" << username << "'." << std::endl;
+    if (!promptForClient("Enter username to request a symmetric key from: ", username)) {
         return;
     }
 
-    DEBUG_LOG("\n[DEBUG] SENDING CLIENT (SymKey Request):");
-    DEBUG_LOG("  To user: " << username);
-    DEBUG_LOG("-----");
-
-    // The payload for a key request is just the header, with no content.
-    SendMessageHeader msgHeader{};
-    std::copy(client->id.begin(), client->id.end(), msgHeader.clientID);
-    msgHeader.type = MessageType::SYM_KEY_REQUEST;
-    msgHeader.contentSize = 0;
-
-    std::vector<uint8_t> payload(sizeof(msgHeader));
-    memcpy(payload.data(), &msgHeader, sizeof(msgHeader));
-
-    auto response = _communicator->sendAndReceive(RequestCode::SEND_MESSAGE, payload, _userInfo->uuid);
-
-    if (response && response->size() == sizeof(MessageSentResponse)) {
+    if (_session.sendSymKeyRequest(username) == SessionStatus::OK) {
         std::cout << "Symmetric key request sent to " << username << "." << std::endl;
     } else {
         std::cerr << "Failed to send symmetric key request." << std::endl;
@@ -438,111 +304,27 @@ void Client::handleSendSymKeyRequest() {
  * and then sent.
  */
 void Client::handleSendSymKey() {
-    if (!_userInfo) { std::cerr << "Please register first." << std::endl; return; }
+    if (!_session.isRegistered()) { std::cerr << "Please register first." << std::endl; return; }
 
-    std::cout << "Enter username to send your symmetric key to: ";
     std::string username;
-    std::getline(std::cin, username);
-
-    ClientInfo* client = findClientByName(username);
-    if (!client) {
-        std::cout << "Client not in local list, fetching from server..." << std::endl;
-        handleRequestClientsList(); // Refresh list
-        client = findClientByName(username);
-    }
-
+    ClientInfo* client = promptForClient("Enter username to send your symmetric key to: ", username);
     if (!client) {
-        std::cerr << "Could not find client '" << username << "'." << std::endl;
         return;
     }
 
-    // We must have the recipient's public key to encrypt the symmetric key.
+    // The session requests the public key first if we don't have it yet.
     if (client->publicKey.empty()) {
         std::cout << "Public key for " << username << " not found. Requesting it now..." << std::endl;
-        
-        PublicKeyRequest pkReq{};
-        std::copy(client->id.begin(), client->id.end(), pkReq.clientID);
-        std::vector<uint8_t> pkPayload(sizeof(pkReq));
-        memcpy(pkPayload.data(), &pkReq, sizeof(pkReq));
-
-        auto pkResponse = _communicator->sendAndReceive(RequestCode::PUBLIC_KEY, pkPayload, _userInfo->uuid);
-
-        if (pkResponse && pkResponse->size() == sizeof(PublicKeyResponse)) {
-            auto* respData = reinterpret_cast<PublicKeyResponse*>(pkResponse->data());
-            client->publicKey.assign(respData->publicKey, respData->publicKey + PUBLIC_KEY_SIZE);
-            std::cout << "Successfully received public key." << std::endl;
-        } else {
-            std::cerr << "Failed to retrieve public key for " << username << ". Cannot send symmetric key." << std::endl;
-            return;
-        }
-    }
-
-    try {
-        DEBUG_LOG("\n[DEBUG] SENDING CLIENT (SymKey):");
-        DEBUG_LOG("  To user: " << username);
-
-        // Generate a new AES key.
-        auto symKey = CryptoWrapper::generateAesKey();
-        DEBUG_LOG("  New symkey: " << FileHandler::bytesToHex(symKey));
-
-        // Encrypt the new AES key with the recipient's public RSA key.
-        CryptoPP::RSA::PublicKey publicKey;
-        CryptoWrapper::bytesToPublicKey(client->publicKey, publicKey);
-        auto encryptedSymKey = CryptoWrapper::rsaEncrypt(publicKey, symKey);
-        DEBUG_LOG("  Encrypted key size: " << encryptedSymKey.size() << " bytes");
-        DEBUG_LOG("-----");
-
-        // Construct the payload.
-        SendMessageHeader msgHeader{};
-        std::copy(client->id.begin(), client->id.end(), msgHeader.clientID);
-        msgHeader.type = MessageType::SYM_KEY_SEND;
-        msgHeader.contentSize = static_cast<uint32_t>(encryptedSymKey.size());
-
-        std::vector<uint8_t> payload;
-        payload.resize(sizeof(msgHeader) + encryptedSymKey.size());
-        memcpy(payload.data(), &msgHeader, sizeof(msgHeader));
-        memcpy(payload.data() + sizeof(msgHeader), encryptedSymKey.data(), encryptedSymKey.size());
-
-        auto response = _communicator->sendAndReceive(RequestCode::SEND_MESSAGE, payload, _userInfo->uuid);
-
-        if (response && response->size() == sizeof(MessageSentResponse)) {
-            // Store the new key for our own use with this client.
-            client->symKey = symKey;
-            std::cout << "Symmetric key sent to " << username << "." << std::endl;
-        } else {
-            std::cerr << "Failed to send symmetric key." << std::endl;
-        }
-    } catch (const std::exception& e) {
-        std::cerr << "An error occurred during key generation or encryption: " << e.what() << std::endl;
     }
-}
 
-/**
- * @brief Finds a client in the local list by their username.
- * @param name The name of the client to find.
- * @return A pointer to the ClientInfo struct, or nullptr if not found.
- */
-ClientInfo* Client::findClientByName(const std::string& name) {
-    for (auto& client : _clientList) {
-        if (client.name == name) {
-            return &client;
-        }
+    switch (_session.sendSymKey(username)) {
+    case SessionStatus::OK: std::cout << "Symmetric key sent to " << username << "." << std::endl; break;
+    case SessionStatus::NO_PUBLIC_KEY:
+        std::cerr << "Failed to retrieve public key for " << username << ". Cannot send symmetric key." << std::endl;
+        break;
+    case SessionStatus::CRYPTO_ERROR: std::cerr << "An error occurred during key generation or encryption." << std::endl; break;
+    default: std::cerr << "Failed to send symmetric key." << std::endl; break;
     }
-    return nullptr;
-}
-
-/**
- * @brief Finds a client in the local list by their UUID.
- * @param id The UUID of the client to find.
- * @return A pointer to the ClientInfo struct, or nullptr if not found.
- */
-ClientInfo* Client::findClientByID(const std::vector<uint8_t>& id) {
-    for (auto& client : _clientList) {
-        if (client.id == id) {
-            return &client;
-        }
-    }
-    return nullptr;
 }
 
 /**
@@ -550,21 +332,11 @@ ClientInfo* Client::findClientByID(const std::vector<uint8_t>& id) {
  * Requires a symmetric key to be established first.
  */
 void Client::handleSendFile() {
-    if (!_userInfo) { std::cerr << "Please register first." << std::endl; return; }
+    if (!_session.isRegistered()) { std::cerr << "Please register first." << std::endl; return; }
 
-    std::cout << "Enter username to send a file to: ";
     std::string username;
-    std::getline(std::cin, username);
-
-    ClientInfo* client = findClientByName(username);
-    if (!client) {
-        std::cout << "Client not in local list, fetching from server..." << std::endl;
-        handleRequestClientsList(); // Refresh list
-        client = findClientByName(username);
-    }
-
+    ClientInfo* client = promptForClient("Enter username to send a file to: ", username);
     if (!client) {
-        std::cerr << "Could not find client '" << username << "'." << std::endl;
         return;
     }
 
@@ -578,47 +350,212 @@ void Client::handleSendFile() {
     std::string filepath;
     std::getline(std::cin, filepath);
 
-    // Read the entire file into a byte vector.
-    auto file_content = FileHandler::readFileContent(filepath);
-    if (!file_content) {
-        std::cerr << "file not found or could not be read." << std::endl;
+    switch (_session.sendFile(username, filepath)) {
+    case SessionStatus::OK: std::cout << "File sent to " << username << "." << std::endl; break;
+    case SessionStatus::FILE_ERROR: std::cerr << "file not found or could not be read." << std::endl; break;
+    case SessionStatus::CRYPTO_ERROR: std::cerr << "An error occurred during file encryption." << std::endl; break;
+    default: std::cerr << "Failed to send file." << std::endl; break;
+    }
+}
+
+/**
+ * @brief Prompts for a recipient and a directory, and sends the directory's files as one message.
+ * Requires a symmetric key to be established first.
+ */
+void Client::handleSendDirectory() {
+    if (!_session.isRegistered()) { std::cerr << "Please register first." << std::endl; return; }
+
+    std::string username;
+    ClientInfo* client = promptForClient("Enter username to send a directory to: ", username);
+    if (!client) {
         return;
     }
 
-    try {
-        DEBUG_LOG("\n[DEBUG] SENDING CLIENT (File):");
-        DEBUG_LOG("  To user: " << username);
-        DEBUG_LOG("  Symmetric key:   " << FileHandler::bytesToHex(client->symKey));
-        DEBUG_LOG("  Plaintext size:  " << file_content->size() << " bytes");
+    if (client->symKey.empty()) {
+        std::cerr << "No symmetric key for " << username << ". Please send a key first." << std::endl;
+        return;
+    }
+
+    std::cout << "Enter full path to the directory: ";
+    std::string dirpath;
+    std::getline(std::cin, dirpath);
+
+    switch (_session.sendDirectory(username, dirpath)) {
+    case SessionStatus::OK: std::cout << "Directory sent to " << username << "." << std::endl; break;
+    case SessionStatus::FILE_ERROR: std::cerr << "directory not found or could not be read." << std::endl; break;
+    case SessionStatus::CRYPTO_ERROR: std::cerr << "An error occurred during encryption." << std::endl; break;
+    default: std::cerr << "Failed to send directory." << std::endl; break;
+    }
+}
+
+/**
+ * @brief Streams lines typed by the user to another user, one chunk per line, until an empty line.
+ * Requires a symmetric key to be established first.
+ */
+void Client::handleSendStream() {
+    if (!_session.isRegistered()) { std::cerr << "Please register first." << std::endl; return; }
 
-        // Encrypt the file content with the shared symmetric key.
-        auto ciphertext = CryptoWrapper::aesEncrypt(client->symKey, *file_content);
+    std::string username;
+    ClientInfo* client = promptForClient("Enter username to stream to: ", username);
+    if (!client) {
+        return;
+    }
+    if (client->symKey.empty()) {
+        std::cerr << "No symmetric key for " << username << ". Please send a key first." << std::endl;
+        return;
+    }
 
-        DEBUG_LOG("  Ciphertext size: " << ciphertext.size() << " bytes");
-        if (ciphertext.size() >= 16) {
-            DEBUG_LOG("  Ciphertext prefix: " << FileHandler::bytesToHex({ciphertext.begin(), ciphertext.begin() + 16}));
+    uint32_t streamID = 0;
+    bool live = false;
+    switch (_session.openStream(username, streamID, live)) {
+    case SessionStatus::OK: break;
+    case SessionStatus::NOT_SUPPORTED: std::cerr << "The server does not support streams." << std::endl; return;
+    default: std::cerr << "Failed to open stream. " << _session.lastError() << std::endl; return;
+    }
+    std::cout << (live ? "Streaming live to " : "Recipient is offline, the stream will be stored for ") << username << "." << std::endl;
+    std::cout << "Enter lines to send, an empty line ends the stream:" << std::endl;
+
+    std::string line;
+    while (std::getline(std::cin, line) && !line.empty()) {
+        line += '\n';
+        if (_session.writeStream(streamID, std::vector<uint8_t>(line.begin(), line.end())) != SessionStatus::OK) {
+            std::cerr << "Failed to send. " << _session.lastError() << std::endl;
+            break;
         }
-        DEBUG_LOG("-----");
+    }
 
-        // Construct the payload.
-        SendMessageHeader msgHeader{};
-        std::copy(client->id.begin(), client->id.end(), msgHeader.clientID);
-        msgHeader.type = MessageType::FILE_SEND;
-        msgHeader.contentSize = static_cast<uint32_t>(ciphertext.size());
+    if (_session.closeStream(streamID) == SessionStatus::OK) {
+        std::cout << "Stream to " << username << " closed." << std::endl;
+    }
+    else {
+        std::cerr << "Stream closed, but not every chunk reached the server." << std::endl;
+    }
+}
 
-        std::vector<uint8_t> payload;
-        payload.resize(sizeof(msgHeader) + ciphertext.size());
-        memcpy(payload.data(), &msgHeader, sizeof(msgHeader));
-        memcpy(payload.data() + sizeof(msgHeader), ciphertext.data(), ciphertext.size());
+/**
+ * @brief Prints a presence change of a watched user.
+ * @param change The change to print.
+ */
+static void showPresence(const PresenceChange& change) {
+    std::cout << "[" << change.name << (change.online ? " is online]" : " is offline]") << '\n';
+}
 
-        auto response = _communicator->sendAndReceive(RequestCode::SEND_MESSAGE, payload, _userInfo->uuid);
+/**
+ * @brief Watches the presence of users and prints who is online now.
+ * Later changes are printed while listening (option 161).
+ */
+void Client::handleWatchPresence() {
+    if (!_session.isRegistered()) { std::cerr << "Please register first." << std::endl; return; }
+
+    std::cout << "Enter usernames to watch, separated by spaces (empty for everyone): ";
+    std::string line;
+    std::getline(std::cin, line);
+    std::vector<std::string> usernames;
+    std::istringstream names(line);
+    for (std::string name; names >> name;) {
+        usernames.push_back(name);
+    }
+    // Everyone is watched straight from the clients list, without looking each one up.
+    std::vector<ClientInfo> clients;
+    if (usernames.empty() && _session.listClients(clients) != SessionStatus::OK) {
+        std::cerr << "Failed to get clients list. " << _session.lastError() << std::endl;
+        return;
+    }
+    size_t count = usernames.empty() ? clients.size() : usernames.size();
+    SessionStatus status = usernames.empty() ? _session.watchPresence(clients, showPresence) : _session.watchPresence(usernames, showPresence);
+
+    switch (status) {
+    case SessionStatus::OK: break;
+    case SessionStatus::UNKNOWN_CLIENT: std::cerr << "One of the users is not known to the server." << std::endl; return;
+    case SessionStatus::NOT_SUPPORTED: std::cerr << "The server does not support presence." << std::endl; return;
+    default: std::cerr << "Failed to watch presence. " << _session.lastError() << std::endl; return;
+    }
+    std::cout << "Watching " << count << " users; listen (161) to see changes." << std::endl;
+}
 
-        if (response && response->size() == sizeof(MessageSentResponse)) {
-            std::cout << "File sent to " << username << "." << std::endl;
-        } else {
-            std::cerr << "Failed to send file." << std::endl;
+/**
+ * @brief Waits for live streams and presence changes from other users and prints them as they arrive.
+ */
+void Client::handleListenForStreams() {
+    if (!_session.isRegistered()) { std::cerr << "Please register first." << std::endl; return; }
+
+    std::cout << "Listen for how many seconds? ";
+    int seconds = 0;
+    std::cin >> seconds;
+    if (std::cin.fail()) {
+        std::cin.clear();
+        seconds = 0;
+    }
+    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    auto showEvent = [](const StreamEvent& event) {
+        switch (event.type) {
+        case StreamEventType::OPEN: std::cout << "[" << event.senderName << " opened stream " << event.streamID << "]" << '\n'; break;
+        case StreamEventType::DATA:
+            if (event.status == MessageStatus::DELIVERED) {
+                std::cout << std::string(event.data.begin(), event.data.end());
+            }
+            else {
+                std::cerr << "[can't decrypt chunk from " << event.senderName << "]" << '\n';
+            }
+            break;
+        case StreamEventType::CLOSE: std::cout << "[stream " << event.streamID << " closed]" << '\n'; break;
+        case StreamEventType::ABORT: std::cout << "[stream " << event.streamID << " aborted by the sender]" << '\n'; break;
+        case StreamEventType::STORED: std::cout << "[the rest of stream " << event.streamID << " will arrive as a message]" << '\n'; break;
         }
-    } catch (const std::exception& e) {
-        std::cerr << "An error occurred during file encryption: " << e.what() << std::endl;
+    };
+    while (std::chrono::steady_clock::now() < deadline) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        SessionStatus status = _session.waitForEvents(showEvent, showPresence, remaining);
+        std::cout.flush();
+        if (status == SessionStatus::NOT_SUPPORTED) {
+            std::cerr << "The server does not support streams." << std::endl;
+            return;
+        }
+        if (status == SessionStatus::EVENTS_LOST) {
+            std::cerr << "[some stream chunks or presence changes were lost while unread]" << std::endl;
+            continue;
+        }
+        if (status != SessionStatus::OK) {
+            std::cerr << _session.lastError() << std::endl;
+            return;
+        }
+    }
+    std::cout << "Stopped listening." << std::endl;
+}
+
+/**
+ * @brief Prints the memory held by each subsystem of the client, now and at its peak.
+ */
+void Client::handleShowMemoryUsage() {
+    std::cout << MemoryStats::report();
+}
+
+/**
+ * @brief Changes the level of the diagnostic log, and optionally the file it is written to.
+ */
+void Client::handleSetLogLevel() {
+    std::cout << "Enter log level (trace, debug, info, warn, error, off): ";
+    std::string name;
+    std::getline(std::cin, name);
+    LogLevel level;
+    if (!Logger::parseLevel(name, level)) {
+        std::cerr << "Unknown log level." << std::endl;
+        return;
+    }
+    std::cout << "Enter log file (empty for stderr): ";
+    std::string path;
+    std::getline(std::cin, path);
+    if (!Logger::setFile(path)) {
+        std::cerr << "Failed to open " << path << "." << std::endl;
+        return;
+    }
+    Logger::setLevel(level);
+    if (level == LogLevel::OFF) {
+        std::cout << "Logging is off." << std::endl;
+    }
+    else {
+        std::cout << "Logging " << name << " and up." << std::endl;
     }
 }
@@ -2,14 +2,12 @@
 // author: Ariel Cohen ID: 329599187
 
 #pragma once
-#include "Communicator.h"
-#include "CryptoWrapper.h"
-#include "FileHandler.h"
-#include <map>
+#include "Session.h"
 
 /*
 * The Client class is the main class for the client side of the application.
 * It handles the user interface and the main loop of the program.
+* All protocol, crypto and transport work is delegated to a Session.
 */
 class Client {
 public:
@@ -37,18 +35,24 @@ private:
     void handleSendSymKey();
     // Handles sending a file
     void handleSendFile();
+    // Handles sending a directory as one bundle
+    void handleSendDirectory();
+    // Handles streaming lines typed by the user to another client
+    void handleSendStream();
+    // Handles waiting for live streams and presence changes from other clients
+    void handleListenForStreams();
+    // Handles choosing the clients whose presence is watched
+    void handleWatchPresence();
+    // Handles printing the memory held by each subsystem
+    void handleShowMemoryUsage();
+    // Handles changing the log level and file
+    void handleSetLogLevel();
 
-    // Finds a client by name in the client list
-    ClientInfo* findClientByName(const std::string& name);
-    // Finds a client by ID in the client list
-    ClientInfo* findClientByID(const std::vector<uint8_t>& id);
+    // Prompts for a username and resolves it to a known client, printing an error if not found
+    ClientInfo* promptForClient(const std::string& prompt, std::string& username);
+    // Displays a single pulled message
+    void showMessage(const IncomingMessage& msg);
 
-    // The communicator object for handling communication with the server
-    std::unique_ptr<Communicator> _communicator;
-    // The user information of the current user
-    std::optional<UserInfo> _userInfo;
-    // The private key of the current user
-    CryptoPP::RSA::PrivateKey _privateKey;
-    // The list of clients
-    std::vector<ClientInfo> _clientList;
-}; 
+    // The session holding identity, keys and the connection to the server
+    Session _session;
+};
@@ -2,7 +2,8 @@
 // author: Ariel Cohen ID: 329599187
 
 #include "Communicator.h"
-#include <iostream>
+#include "Logger.h"
+#include "ProtocolCodec.h"
 
 /**
  * @brief Constructs a Communicator object and initializes the network endpoint with the specified IP address and port.
@@ -16,56 +17,393 @@ Communicator::Communicator(const std::string& ip, uint16_t port)
 }
 
 /**
- * @brief Sends a request to the server and receives a response.
+ * @brief Opens a new connection to the server.
+ * The HELLO exchange runs on every new connection, since the server keeps the negotiated
+ * state per connection, unless an earlier exchange showed the server does not support it.
+ */
+void Communicator::connect() {
+    _socket = boost::asio::ip::tcp::socket(_io_context);
+    _socket.connect(_endpoint);
+    _engine.reset();
+    if (!_capabilities || _capabilities->negotiated) {
+        negotiate();
+        if (!_capabilities->negotiated) {
+            // A version 2 server may close the connection after the error response.
+            disconnect();
+            _socket = boost::asio::ip::tcp::socket(_io_context);
+            _socket.connect(_endpoint);
+            _engine.reset();
+        }
+    }
+    LOG_INFO("transport", "Connected", logField("address", _endpoint.address().to_string()), logField("port", _endpoint.port()),
+        logField("negotiated", _capabilities->negotiated), logField("capabilities", _capabilities->flags));
+}
+
+/**
+ * @brief Closes the connection, if open.
+ */
+void Communicator::disconnect() {
+    if (_socket.is_open()) {
+        boost::system::error_code ec;
+        _socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+        _socket.close(ec);
+    }
+}
+
+/**
+ * @brief Performs the HELLO exchange and caches the result.
+ * A server that answers with an error does not support HELLO; it is then used with
+ * no optional capabilities, exactly like a version 2 server.
+ */
+void Communicator::negotiate() {
+    auto hello = ProtocolCodec::encodeHello(CLIENT_CAPABILITIES, static_cast<uint32_t>(std::min<size_t>(MAX_RESPONSE_PAYLOAD_SIZE, UINT32_MAX)), CLIENT_MAX_BATCH);
+    auto event = exchange(RequestCode::HELLO, hello, _clientID);
+    if (!event) {
+        throw std::runtime_error(_lastError);
+    }
+    ServerCapabilities caps;
+    auto negotiated = event->isError() ? std::nullopt : ProtocolCodec::decodeHello(event->payload);
+    if (negotiated) {
+        caps.negotiated = true;
+        caps.flags = negotiated->capabilities & CLIENT_CAPABILITIES;
+        caps.maxFrameSize = negotiated->maxFrameSize;
+        caps.maxBatch = negotiated->maxBatch;
+    }
+    _capabilities = caps;
+    // Nothing follows the HELLO response until the next request, so both sides switch here.
+    if (caps.supports(CAP_COMPACT_FRAMING)) {
+        _engine.useCompactFraming();
+    }
+}
+
+/**
+ * @brief Writes all bytes the engine has framed.
+ * @throws boost::system::system_error on network errors.
+ */
+void Communicator::writeOutgoing() {
+    while (_engine.wantsWrite()) {
+        size_t written = _socket.write_some(boost::asio::buffer(_engine.outgoingData(), _engine.outgoingSize()));
+        _engine.consumeOutgoing(written);
+    }
+}
+
+/**
+ * @brief Takes decoded events from the engine until a response is found.
+ * Pushes found on the way are queued for waitForPush, up to MAX_QUEUED_PUSH_BYTES.
+ * @return The response, or std::nullopt if none has been decoded yet.
+ */
+std::optional<ProtocolEvent> Communicator::takeResponse() {
+    while (auto event = _engine.nextEvent()) {
+        if (!event->isPush()) {
+            return event;
+        }
+        if (_queuedPushBytes + event->payload.size() > MAX_QUEUED_PUSH_BYTES) {
+            _droppedPushes++;
+            LOG_WARN("transport", "Push queue full, dropping push", logField("code", event->code), logField("size", event->payload.size()));
+            continue;
+        }
+        _queuedPushBytes += event->payload.size();
+        _pushCharge.update(_queuedPushBytes);
+        _pushes.push_back(std::move(*event));
+    }
+    return std::nullopt;
+}
+
+/**
+ * @brief Writes one request and blocks until its response is decoded.
  * @param code The request code.
  * @param payload The payload of the request.
  * @param clientID The client ID.
- * @return An optional vector of bytes containing the response payload, or std::nullopt on error.
+ * @param sink Takes the response payload; nullptr to keep it in the event.
+ * @return The response event, or std::nullopt if the server violated the protocol (see lastError()).
+ * @throws boost::system::system_error on network errors.
  */
-std::optional<std::vector<uint8_t>> Communicator::sendAndReceive(RequestCode code, const std::vector<uint8_t>& payload, const std::vector<uint8_t>& clientID) {
-    try {
-        // Connect on each request as server is stateless
-        _socket = boost::asio::ip::tcp::socket(_io_context);
-        _socket.connect(_endpoint);
+std::optional<ProtocolEvent> Communicator::exchange(RequestCode code, const std::vector<uint8_t>& payload, const std::vector<uint8_t>& clientID, PayloadSink* sink) {
+    LOG_TRACE("transport", "Request", logField("code", code), logField("size", payload.size()));
+    // Let the engine frame the request, then write whatever it produced.
+    _engine.sendRequest(code, payload, clientID, sink);
+    writeOutgoing();
+    return readResponse();
+}
 
-        RequestHeader header{};
-        if (!clientID.empty()) {
-            std::copy(clientID.begin(), clientID.end(), header.clientID);
+/**
+ * @brief Writes one request whose payload is read from a source, and blocks until its response is decoded.
+ * The payload is produced and written one WRITE_CHUNK_SIZE piece at a time.
+ * @param code The request code.
+ * @param source Produces the payload of the request.
+ * @param clientID The client ID.
+ * @param sink Takes the response payload; nullptr to keep it in the event.
+ * @return The response event, or std::nullopt if the server violated the protocol (see lastError()).
+ * @throws boost::system::system_error on network errors.
+ * @throws std::runtime_error if the source fails; the connection cannot be used any more.
+ */
+std::optional<ProtocolEvent> Communicator::exchange(RequestCode code, PayloadSource& source, const std::vector<uint8_t>& clientID, PayloadSink* sink) {
+    if (!source.rewind()) {
+        throw std::runtime_error("Failed to read the request payload.");
+    }
+    LOG_TRACE("transport", "Request", logField("code", code), logField("size", source.size()), logField("streamed", true));
+    allocateBuffer(_writeBuffer, _writeBufferCharge, WRITE_CHUNK_SIZE);
+    _engine.beginRequest(code, source.size(), clientID, sink);
+    while (_engine.requestPayloadRemaining() > 0) {
+        size_t count = source.read(_writeBuffer.data(), std::min(_writeBuffer.size(), _engine.requestPayloadRemaining()));
+        if (count == 0) {
+            // The server has part of the request already, so the caller must drop the connection.
+            throw std::runtime_error("Failed to read the request payload.");
         }
-        header.version = CLIENT_VERSION;
-        header.code = code;
-        header.payloadSize = static_cast<uint32_t>(payload.size());
-
-        // Send header and payload
-        boost::asio::write(_socket, boost::asio::buffer(&header, sizeof(header)));
-        if (!payload.empty()) {
-            boost::asio::write(_socket, boost::asio::buffer(payload));
+        _engine.appendPayload(_writeBuffer.data(), count);
+        writeOutgoing();
+    }
+    writeOutgoing();
+    return readResponse();
+}
+
+/**
+ * @brief Feeds the engine until it has decoded the response to the request in flight.
+ * @return The response event, or std::nullopt if the server violated the protocol (see lastError()).
+ * @throws boost::system::system_error on network errors.
+ */
+std::optional<ProtocolEvent> Communicator::readResponse() {
+    allocateBuffer(_readBuffer, _readBufferCharge, READ_CHUNK_SIZE);
+    std::optional<ProtocolEvent> event;
+    while (!(event = takeResponse())) {
+        if (_engine.failed()) {
+            _lastError = "Protocol error: " + _engine.error();
+            return std::nullopt;
         }
+        size_t toRead = std::min(_readBuffer.size(), std::max<size_t>(_engine.bytesNeeded(), 1));
+        size_t received = _socket.read_some(boost::asio::buffer(_readBuffer.data(), toRead));
+        _engine.receive(_readBuffer.data(), received);
+    }
+    LOG_TRACE("transport", "Response", logField("request", event->request), logField("code", event->code), logField("size", event->payload.size()));
+    return event;
+}
+
+/**
+ * @brief Sizes a working buffer, waiting up to MEMORY_WAIT_TIMEOUT for room in the memory budget.
+ * @param buffer The buffer.
+ * @param charge The charge of the buffer.
+ * @param size The size it needs.
+ * @throws std::runtime_error if the budget has no room for it in time.
+ */
+void Communicator::allocateBuffer(std::vector<uint8_t>& buffer, MemoryCharge& charge, size_t size) {
+    if (buffer.size() == size) {
+        return;
+    }
+    if (!charge.waitUpdate(size, MEMORY_WAIT_TIMEOUT)) {
+        throw std::runtime_error("The memory budget has no room for the transfer buffers.");
+    }
+    buffer.resize(size);
+}
+
+/**
+ * @brief Reads once from the socket into the engine, giving up after the timeout.
+ * The blocking socket API has no timeouts, so the read is started asynchronously and
+ * the I/O context is run for at most the timeout.
+ * @param timeout How long to wait for data.
+ * @return True if data was read, false on timeout.
+ * @throws boost::system::system_error on network errors.
+ */
+bool Communicator::readFor(std::chrono::milliseconds timeout) {
+    allocateBuffer(_readBuffer, _readBufferCharge, READ_CHUNK_SIZE);
+    boost::system::error_code result = boost::asio::error::would_block;
+    size_t received = 0;
+    _socket.async_read_some(boost::asio::buffer(_readBuffer), [&](const boost::system::error_code& ec, size_t count) {
+        result = ec;
+        received = count;
+    });
+    _io_context.restart();
+    _io_context.run_for(timeout);
+    if (result == boost::asio::error::would_block) {
+        // Timed out: cancel the read and let its handler run before the locals go out of scope.
+        _socket.cancel();
+        _io_context.restart();
+        _io_context.run();
+    }
+    if (result == boost::asio::error::operation_aborted) {
+        return false;
+    }
+    if (result) {
+        throw boost::system::system_error(result);
+    }
+    _engine.receive(_readBuffer.data(), received);
+    return true;
+}
+
+/**
+ * @brief Returns false, setting the last error, if the payload is larger than the server accepts.
+ * @param payloadSize The size of the request payload.
+ */
+bool Communicator::checkFrameSize(size_t payloadSize) {
+    if (payloadSize <= _capabilities->maxFrameSize) {
+        return true;
+    }
+    _lastError = "Request of " + std::to_string(payloadSize) + " bytes exceeds the server limit of "
+        + std::to_string(_capabilities->maxFrameSize) + " bytes.";
+    return false;
+}
 
-        // Read response header
-        ResponseHeader responseHeader{};
-        boost::asio::read(_socket, boost::asio::buffer(&responseHeader, sizeof(responseHeader)));
+/**
+ * @brief Sends a request to the server and receives a response.
+ * @param code The request code.
+ * @param payload The payload of the request.
+ * @param clientID The client ID.
+ * @param sink Takes the response payload as it arrives; nullptr to return it.
+ * @return An optional vector of bytes containing the response payload, or std::nullopt on error (see lastError()).
+ */
+std::optional<std::vector<uint8_t>> Communicator::sendAndReceive(RequestCode code, const std::vector<uint8_t>& payload, const std::vector<uint8_t>& clientID, PayloadSink* sink) {
+    return request(payload.size(), [&]() { return exchange(code, payload, clientID, sink); });
+}
+
+/**
+ * @brief Sends a request whose payload is read from a source while it is written, and receives a response.
+ * @param code The request code.
+ * @param source Produces the payload of the request; rewound before every attempt.
+ * @param clientID The client ID.
+ * @param sink Takes the response payload as it arrives; nullptr to return it.
+ * @return An optional vector of bytes containing the response payload, or std::nullopt on error (see lastError()).
+ */
+std::optional<std::vector<uint8_t>> Communicator::sendAndReceive(RequestCode code, PayloadSource& source, const std::vector<uint8_t>& clientID, PayloadSink* sink) {
+    return request(source.size(), [&]() { return exchange(code, source, clientID, sink); });
+}
 
-        if (static_cast<ResponseCode>(responseHeader.code) == (ResponseCode::GENERAL_ERROR)) {
-            std::cerr << "Server responded with an error." << std::endl;
+/**
+ * @brief Runs one exchange with the server and returns the response payload.
+ * If the server supports persistent connections the connection is kept open for the next
+ * request; otherwise a new connection is made for each request.
+ * @param payloadSize The size of the request payload.
+ * @param exchangeOnce Writes the request and reads its response over the open connection.
+ * @return An optional vector of bytes containing the response payload, or std::nullopt on error (see lastError()).
+ */
+std::optional<std::vector<uint8_t>> Communicator::request(size_t payloadSize, const std::function<std::optional<ProtocolEvent>()>& exchangeOnce) {
+    _lastError.clear();
+    try {
+        bool reused = _socket.is_open();
+        if (!reused) {
+            connect();
+        }
+        if (!checkFrameSize(payloadSize)) {
             return std::nullopt;
         }
 
-        // Read response payload
-        std::vector<uint8_t> responsePayload(responseHeader.payloadSize);
-        if (responseHeader.payloadSize > 0) {
-            boost::asio::read(_socket, boost::asio::buffer(responsePayload));
+        std::optional<ProtocolEvent> event;
+        try {
+            event = exchangeOnce();
         }
+        catch (const boost::system::system_error&) {
+            if (!reused) {
+                throw;
+            }
+            // The server may have closed the idle connection; reconnect once and retry.
+            LOG_WARN("transport", "Stale connection, reconnecting");
+            disconnect();
+            connect();
+            event = exchangeOnce();
+        }
+        if (!event || !_capabilities->supports(CAP_PERSISTENT_CONNECTION)) {
+            disconnect();
+        }
+        if (!event) {
+            LOG_WARN("transport", "Request failed", logField("error", _lastError));
+            return std::nullopt;
+        }
+        if (event->isError()) {
+            _lastError = "Server responded with an error.";
+            LOG_DEBUG("transport", "Error response", logField("request", event->request));
+            return std::nullopt;
+        }
+        return std::move(event->payload);
+    }
+    catch (const boost::system::system_error& e) {
+        disconnect();
+        _lastError = std::string("Network error: ") + e.what();
+        LOG_WARN("transport", "Network error", logField("error", std::string_view(e.what())));
+        return std::nullopt;
+    }
+    catch (const std::runtime_error& e) {
+        disconnect();
+        _lastError = e.what();
+        LOG_WARN("transport", "Request failed", logField("error", _lastError));
+        return std::nullopt;
+    }
+}
 
-        // Close socket
-        boost::system::error_code ec;
-        _socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
-        _socket.close();
+/**
+ * @brief Sends a request the server does not answer over the open connection.
+ * @param code The request code.
+ * @param payload The payload of the request.
+ * @param clientID The client ID.
+ * @return True if the request was written; false otherwise (see lastError()).
+ */
+bool Communicator::post(RequestCode code, const std::vector<uint8_t>& payload, const std::vector<uint8_t>& clientID) {
+    _lastError.clear();
+    if (!_socket.is_open()) {
+        _lastError = "Not connected.";
+        return false;
+    }
+    if (!checkFrameSize(payload.size())) {
+        return false;
+    }
+    try {
+        _engine.sendRequest(code, payload, clientID);
+        writeOutgoing();
+        return true;
+    }
+    catch (const boost::system::system_error& e) {
+        disconnect();
+        _lastError = std::string("Network error: ") + e.what();
+        LOG_WARN("transport", "Network error", logField("error", std::string_view(e.what())));
+        return false;
+    }
+}
 
-        return responsePayload;
+/**
+ * @brief Waits for a push from the server, connecting first if needed.
+ * @param timeout How long to wait.
+ * @return The push, or std::nullopt on timeout or error (lastError() is empty on timeout).
+ */
+std::optional<ProtocolEvent> Communicator::waitForPush(std::chrono::milliseconds timeout) {
+    _lastError.clear();
+    try {
+        if (_pushes.empty() && !_socket.is_open()) {
+            connect();
+        }
+        // Pushes are only sent on a connection that stays open and negotiated streams.
+        if (!_capabilities->supports(CAP_STREAMS) || !_capabilities->supports(CAP_PERSISTENT_CONNECTION)) {
+            disconnect();
+            _lastError = "The server does not support streams.";
+            return std::nullopt;
+        }
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (_pushes.empty()) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0 || !readFor(remaining)) {
+                return std::nullopt;
+            }
+            // No request is in flight, so anything decoded here is a push (or a protocol error).
+            takeResponse();
+            if (_engine.failed()) {
+                disconnect();
+                _lastError = "Protocol error: " + _engine.error();
+                LOG_WARN("transport", "Protocol error", logField("error", _lastError));
+                return std::nullopt;
+            }
+        }
     }
     catch (const boost::system::system_error& e) {
-        std::cerr << "Network error: " << e.what() << std::endl;
+        disconnect();
+        _lastError = std::string("Network error: ") + e.what();
+        LOG_WARN("transport", "Network error", logField("error", std::string_view(e.what())));
         return std::nullopt;
     }
-}
\ No newline at end of file
+    catch (const std::runtime_error& e) {
+        disconnect();
+        _lastError = e.what();
+        LOG_WARN("transport", "Request failed", logField("error", _lastError));
+        return std::nullopt;
+    }
+    ProtocolEvent push = std::move(_pushes.front());
+    _pushes.pop_front();
+    _queuedPushBytes -= push.payload.size();
+    _pushCharge.update(_queuedPushBytes);
+    return push;
+}
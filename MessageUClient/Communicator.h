@@ -2,12 +2,39 @@
 // author: Ariel Cohen ID: 329599187
 
 #pragma once
-#include "Protocol.h"
+#include "ProtocolEngine.h"
 #include <boost/asio.hpp>
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <optional>
 
+constexpr size_t READ_CHUNK_SIZE = 64 * 1024; ///< Maximum number of bytes requested from the socket per read.
+constexpr size_t WRITE_CHUNK_SIZE = 64 * 1024; ///< Bytes of a streamed request payload produced per write.
+constexpr size_t MAX_QUEUED_PUSH_BYTES = 64 * 1024 * 1024; ///< Pushes beyond this many unread bytes are dropped.
+
+/**
+ * @brief What the server agreed to in the HELLO exchange.
+ */
+struct ServerCapabilities {
+    bool negotiated = false;        ///< False for servers that do not understand HELLO (version 2 behavior).
+    uint32_t flags = 0;             ///< CAP_* bits supported by both sides.
+    uint32_t maxFrameSize = UINT32_MAX; ///< Largest request payload the server accepts.
+    uint16_t maxBatch = 0;          ///< Max messages per pull response; 0 if unlimited.
+
+    /**
+     * @brief Returns true if both sides support the given CAP_* bit.
+     */
+    bool supports(uint32_t capability) const { return (flags & capability) != 0; }
+};
+
 /**
  * @brief Represents a TCP communicator for sending requests and receiving responses over a network connection.
+ * It is a blocking driver for the sans-I/O ProtocolEngine: it only moves bytes between the socket and the engine.
+ * Each new connection starts with a HELLO exchange whose result is cached and used to pick the
+ * fastest mode both sides support, e.g. keeping the connection open between requests.
+ * Request and response payloads can be streamed through a PayloadSource and a PayloadSink, so
+ * a transfer of any size only holds the fixed-size read and write buffers in memory.
  */
 class Communicator {
 public:
@@ -23,12 +50,104 @@ public:
      * @param code The request code indicating the type of operation to perform.
      * @param payload The data to send as the request payload.
      * @param clientID The identifier of the client making the request.
-     * @return An optional vector of bytes containing the response data if available; std::nullopt if no response is received.
+     * @param sink Takes the response payload as it arrives; nullptr to return it.
+     * @return An optional vector of bytes containing the response data if available (empty if it went to the sink); std::nullopt if no response is received.
+     */
+    std::optional<std::vector<uint8_t>> sendAndReceive(RequestCode code, const std::vector<uint8_t>& payload, const std::vector<uint8_t>& clientID, PayloadSink* sink = nullptr);
+
+    /**
+     * @brief Sends a request whose payload is read from a source while it is written, and receives an optional response.
+     * The source is rewound if the request has to be sent again after reconnecting.
+     * @param code The request code indicating the type of operation to perform.
+     * @param source Produces the request payload.
+     * @param clientID The identifier of the client making the request.
+     * @param sink Takes the response payload as it arrives; nullptr to return it.
+     * @return An optional vector of bytes containing the response data if available (empty if it went to the sink); std::nullopt if no response is received.
+     */
+    std::optional<std::vector<uint8_t>> sendAndReceive(RequestCode code, PayloadSource& source, const std::vector<uint8_t>& clientID, PayloadSink* sink = nullptr);
+
+    /**
+     * @brief Sends a request the server does not answer (e.g. STREAM_DATA) over the open connection.
+     * It never reconnects, since such requests refer to state kept on the current connection.
+     * @param code The request code.
+     * @param payload The data to send as the request payload.
+     * @param clientID The identifier of the client making the request.
+     * @return True if the request was written; false otherwise (see lastError()).
+     */
+    bool post(RequestCode code, const std::vector<uint8_t>& payload, const std::vector<uint8_t>& clientID);
+
+    /**
+     * @brief Waits for a push from the server, connecting first if needed.
+     * Pushes that arrived while waiting for responses are returned first, without waiting.
+     * @param timeout How long to wait.
+     * @return The push, or std::nullopt on timeout or error (lastError() is empty on timeout).
+     */
+    std::optional<ProtocolEvent> waitForPush(std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Returns true if a push has already been received and not yet taken.
+     */
+    bool hasPush() const { return !_pushes.empty(); }
+
+    /**
+     * @brief Returns the number of pushes dropped because MAX_QUEUED_PUSH_BYTES was reached or they did not fit the memory budget.
+     */
+    size_t droppedPushes() const { return _droppedPushes + _engine.droppedPushes(); }
+
+    /**
+     * @brief Sets the client ID sent with HELLO, so the server knows where to push right after connecting.
+     */
+    void setClientID(const std::vector<uint8_t>& clientID) { _clientID = clientID; }
+
+    /**
+     * @brief Returns a description of the last error, or an empty string if the last request succeeded.
      */
-    std::optional<std::vector<uint8_t>> sendAndReceive(RequestCode code, const std::vector<uint8_t>& payload, const std::vector<uint8_t>& clientID);
+    const std::string& lastError() const { return _lastError; }
+
+    /**
+     * @brief Returns the capabilities negotiated with the server (all defaults before the first request).
+     */
+    ServerCapabilities capabilities() const { return _capabilities.value_or(ServerCapabilities()); }
 
 private:
+    // Opens a new connection and performs the HELLO exchange unless the server is known not to support it
+    void connect();
+    // Closes the connection, if open
+    void disconnect();
+    // Performs the HELLO exchange on the current connection and caches the result
+    void negotiate();
+    // Connects if needed, runs one exchange (retrying once on a stale connection) and returns the response payload
+    std::optional<std::vector<uint8_t>> request(size_t payloadSize, const std::function<std::optional<ProtocolEvent>()>& exchangeOnce);
+    // Writes one request and blocks until its response is decoded; std::nullopt on a protocol error
+    std::optional<ProtocolEvent> exchange(RequestCode code, const std::vector<uint8_t>& payload, const std::vector<uint8_t>& clientID, PayloadSink* sink = nullptr);
+    // Writes one request read from a source and blocks until its response is decoded; std::nullopt on a protocol error
+    std::optional<ProtocolEvent> exchange(RequestCode code, PayloadSource& source, const std::vector<uint8_t>& clientID, PayloadSink* sink);
+    // Blocks until the response to the request in flight is decoded; std::nullopt on a protocol error
+    std::optional<ProtocolEvent> readResponse();
+    // Writes all bytes the engine has framed
+    void writeOutgoing();
+    // Sizes a working buffer, waiting for room in the memory budget
+    static void allocateBuffer(std::vector<uint8_t>& buffer, MemoryCharge& charge, size_t size);
+    // Reads once from the socket into the engine; false if nothing arrived within the timeout
+    bool readFor(std::chrono::milliseconds timeout);
+    // Takes decoded events from the engine, queuing pushes, until a response is found
+    std::optional<ProtocolEvent> takeResponse();
+    // Returns false (setting the last error) if the payload is larger than the server accepts
+    bool checkFrameSize(size_t payloadSize);
+
 	boost::asio::io_context _io_context;        // ASIO I/O context
 	boost::asio::ip::tcp::socket _socket;       // TCP socket for communication
 	boost::asio::ip::tcp::endpoint _endpoint;   // represents the server endpoint
+	ProtocolEngine _engine;                     // framing and response matching
+	std::vector<uint8_t> _readBuffer;           // scratch buffer for socket reads
+	std::vector<uint8_t> _writeBuffer;          // scratch buffer for streamed request payloads
+	std::optional<ServerCapabilities> _capabilities; // cached HELLO result, std::nullopt until first connect
+	std::vector<uint8_t> _clientID;             // sent with HELLO; empty before registration
+	std::deque<ProtocolEvent> _pushes;          // pushes received but not yet taken
+	size_t _queuedPushBytes = 0;                // total payload size of _pushes
+	size_t _droppedPushes = 0;                  // pushes dropped because the queue was full
+	std::string _lastError;                     // description of the last error
+	MemoryCharge _readBufferCharge{MemorySubsystem::TRANSPORT}; // capacity of _readBuffer
+	MemoryCharge _writeBufferCharge{MemorySubsystem::TRANSPORT}; // capacity of _writeBuffer
+	MemoryCharge _pushCharge{MemorySubsystem::TRANSPORT};       // payloads held in _pushes
 };
\ No newline at end of file
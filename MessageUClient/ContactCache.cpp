@@ -0,0 +1,151 @@
+// ContactCache.cpp
+// author: Ariel Cohen ID: 329599187
+
+#include "ContactCache.h"
+
+/**
+ * @brief Constructs an empty cache.
+ * @param capacity The number of contacts kept before evicting; 0 for no limit.
+ */
+ContactCache::ContactCache(size_t capacity) : _capacity(capacity) {}
+
+/**
+ * @brief Changes the capacity, evicting contacts that no longer fit.
+ * @param capacity The number of contacts kept before evicting; 0 for no limit.
+ */
+void ContactCache::setCapacity(size_t capacity) {
+    _capacity = capacity;
+    evict();
+}
+
+/**
+ * @brief Finds a contact by UUID and marks it as the most recently used.
+ * @param id The UUID of the contact.
+ * @return A pointer to the contact, or nullptr if it is not cached.
+ */
+ClientInfo* ContactCache::findByID(const std::vector<uint8_t>& id) {
+    auto it = _byID.find(idKey(id));
+    if (it == _byID.end()) {
+        return nullptr;
+    }
+    touch(it->second);
+    return &*it->second;
+}
+
+/**
+ * @brief Finds a contact by name and marks it as the most recently used.
+ * @param name The name of the contact.
+ * @return A pointer to the contact, or nullptr if it is not cached.
+ */
+ClientInfo* ContactCache::findByName(const std::string& name) {
+    auto it = _byName.find(name);
+    if (it == _byName.end()) {
+        return nullptr;
+    }
+    touch(it->second);
+    return &*it->second;
+}
+
+/**
+ * @brief Adds a contact, or updates the cached one with the same UUID, as the most recently used.
+ * The contact takes over its name in the name index, since a name is registered to the UUID
+ * the server last returned it for; a cached contact that had the name is then found by UUID only.
+ * A lookup returns no symmetric key, and a clients list no public key either, so the keys
+ * already held for the contact are kept unless the new one has its own.
+ * @param client The contact.
+ * @return The cached contact.
+ */
+ClientInfo& ContactCache::put(ClientInfo client) {
+    std::string key = idKey(client.id);
+    auto it = _byID.find(key);
+    if (it != _byID.end()) {
+        Entry entry = it->second;
+        if (entry->name != client.name) {
+            unindexName(entry);
+            _byName[client.name] = entry;
+            entry->name = std::move(client.name);
+        }
+        if (!client.publicKey.empty()) {
+            entry->publicKey = std::move(client.publicKey);
+        }
+        if (!client.symKey.empty()) {
+            entry->symKey = std::move(client.symKey);
+        }
+        touch(entry);
+        return *entry;
+    }
+    _entries.push_front(std::move(client));
+    _byID.emplace(std::move(key), _entries.begin());
+    _byName[_entries.front().name] = _entries.begin();
+    evict();
+    return _entries.front();
+}
+
+/**
+ * @brief Returns the approximate memory held by the cache.
+ * Besides the contacts themselves, each one costs a list node and an entry in each index.
+ * @return The number of bytes.
+ */
+size_t ContactCache::bytes() const {
+    constexpr size_t nodeSize = sizeof(ClientInfo) + 2 * sizeof(void*);
+    constexpr size_t indexEntrySize = sizeof(std::pair<const std::string, Entry>) + 2 * sizeof(void*);
+    size_t bytes = (_byID.bucket_count() + _byName.bucket_count()) * sizeof(void*);
+    for (const auto& client : _entries) {
+        bytes += nodeSize + 2 * indexEntrySize;
+        // The indexes hold copies of the UUID and name.
+        bytes += 2 * (client.id.capacity() + client.name.capacity()) + client.publicKey.capacity() + client.symKey.capacity();
+    }
+    return bytes;
+}
+
+/**
+ * @brief Moves a contact to the front of the list; iterators to it stay valid.
+ * @param entry The contact.
+ */
+void ContactCache::touch(Entry entry) {
+    _entries.splice(_entries.begin(), _entries, entry);
+}
+
+/**
+ * @brief Removes a contact's name from the name index, unless the name now leads to another contact.
+ * @param entry The contact.
+ */
+void ContactCache::unindexName(Entry entry) {
+    auto it = _byName.find(entry->name);
+    if (it != _byName.end() && it->second == entry) {
+        _byName.erase(it);
+    }
+}
+
+/**
+ * @brief Evicts the least recently used contacts until the cache fits its capacity.
+ * Pinned contacts are skipped, and so is the front one, which the caller has just used.
+ */
+void ContactCache::evict() {
+    if (_capacity == 0) {
+        return;
+    }
+    auto it = _entries.end();
+    while (_entries.size() > _capacity && it != _entries.begin()) {
+        --it;
+        if (it == _entries.begin()) {
+            break;
+        }
+        if (!it->symKey.empty()) {
+            continue;
+        }
+        _byID.erase(idKey(it->id));
+        unindexName(it);
+        it = _entries.erase(it);
+        _evictions++;
+    }
+}
+
+/**
+ * @brief Returns the key of a UUID in the UUID index.
+ * @param id The UUID.
+ * @return The UUID bytes as a string.
+ */
+std::string ContactCache::idKey(const std::vector<uint8_t>& id) {
+    return std::string(id.begin(), id.end());
+}
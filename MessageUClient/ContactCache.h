@@ -0,0 +1,94 @@
+// ContactCache.h
+// author: Ariel Cohen ID: 329599187
+
+#pragma once
+#include "Protocol.h"
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+constexpr size_t DEFAULT_CONTACT_CACHE_SIZE = 1024; ///< Contacts kept by default before the least recently used are evicted.
+
+/**
+ * @brief A bounded cache of the clients this session talks to, evicting the least recently used.
+ * Contacts with a symmetric key are pinned: the key cannot be fetched again from the server,
+ * so they are never evicted and may take the cache past its capacity. Any other contact can be
+ * looked up again from the server by UUID or name when it is needed.
+ * A pointer to a contact stays valid until it is evicted, which only happens when another
+ * contact is put in the cache.
+ */
+class ContactCache {
+public:
+    /**
+     * @brief Constructs an empty cache.
+     * @param capacity The number of contacts kept before evicting; 0 for no limit.
+     */
+    explicit ContactCache(size_t capacity = DEFAULT_CONTACT_CACHE_SIZE);
+
+    ContactCache(const ContactCache&) = delete;
+    ContactCache& operator=(const ContactCache&) = delete;
+
+    /**
+     * @brief Changes the capacity, evicting contacts that no longer fit.
+     * @param capacity The number of contacts kept before evicting; 0 for no limit.
+     */
+    void setCapacity(size_t capacity);
+
+    /**
+     * @brief Returns the number of contacts kept before evicting; 0 for no limit.
+     */
+    size_t capacity() const { return _capacity; }
+
+    /**
+     * @brief Returns the number of contacts in the cache.
+     */
+    size_t size() const { return _entries.size(); }
+
+    /**
+     * @brief Returns the number of contacts evicted so far.
+     */
+    size_t evictions() const { return _evictions; }
+
+    /**
+     * @brief Finds a contact by UUID and marks it as the most recently used.
+     * @return A pointer to the contact, or nullptr if it is not cached.
+     */
+    ClientInfo* findByID(const std::vector<uint8_t>& id);
+
+    /**
+     * @brief Finds a contact by name and marks it as the most recently used.
+     * @return A pointer to the contact, or nullptr if it is not cached.
+     */
+    ClientInfo* findByName(const std::string& name);
+
+    /**
+     * @brief Adds a contact, or updates the cached one with the same UUID, as the most recently used.
+     * @param client The contact; keys it lacks are kept from the cached contact.
+     * @return The cached contact.
+     */
+    ClientInfo& put(ClientInfo client);
+
+    /**
+     * @brief Returns the approximate memory held by the cache, including its indexes.
+     */
+    size_t bytes() const;
+
+private:
+    using Entry = std::list<ClientInfo>::iterator;
+
+    // Moves a contact to the front of the list
+    void touch(Entry entry);
+    // Removes a contact's name from _byName if it still leads to that contact
+    void unindexName(Entry entry);
+    // Evicts the least recently used unpinned contacts, other than the front one, until the cache fits
+    void evict();
+    // Returns the key of a UUID in _byID
+    static std::string idKey(const std::vector<uint8_t>& id);
+
+    std::list<ClientInfo> _entries;                  // the contacts, most recently used first
+    std::unordered_map<std::string, Entry> _byID;    // _entries by UUID
+    std::unordered_map<std::string, Entry> _byName;  // _entries by name; the last put wins a shared name
+    size_t _capacity;                                // contacts kept before evicting; 0 for no limit
+    size_t _evictions = 0;                           // contacts evicted so far
+};
@@ -7,7 +7,12 @@
 #include <cryptopp/files.h>
 #include <cryptopp/aes.h>
 #include <cryptopp/modes.h>
+#include <cryptopp/hmac.h>
+#include <cryptopp/sha.h>
 #include <stdexcept>
+#include <future>
+#include <thread>
+#include <algorithm>
 
 /**
  * @brief Generates a 1024-bit RSA key pair.
@@ -135,6 +140,73 @@ std::vector<uint8_t> CryptoWrapper::aesDecrypt(const std::vector<uint8_t>& key,
     return plaintext;
 }
 
+/**
+ * @brief Decrypts a batch of ciphertexts with the same AES key in parallel.
+ * The batch is split into one contiguous slice per hardware thread.
+ * @param key The AES key to use for decryption.
+ * @param ciphertexts The ciphertexts to decrypt.
+ * @return The plaintexts, in the same order; std::nullopt for entries that failed to decrypt.
+ */
+std::vector<std::optional<std::vector<uint8_t>>> CryptoWrapper::aesDecryptBatch(const std::vector<uint8_t>& key, const std::vector<std::vector<uint8_t>>& ciphertexts) {
+    std::vector<std::optional<std::vector<uint8_t>>> results(ciphertexts.size());
+    size_t workers = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), ciphertexts.size()));
+    size_t sliceSize = (ciphertexts.size() + workers - 1) / workers;
+
+    std::vector<std::future<void>> tasks;
+    for (size_t begin = 0; begin < ciphertexts.size(); begin += sliceSize) {
+        size_t end = std::min(begin + sliceSize, ciphertexts.size());
+        // Each task writes only to its own slice of the results, so no locking is needed.
+        tasks.push_back(std::async(std::launch::async, [&, begin, end]() {
+            for (size_t i = begin; i < end; i++) {
+                try {
+                    results[i] = aesDecrypt(key, ciphertexts[i]);
+                }
+                catch (const std::exception&) {
+                    results[i] = std::nullopt;
+                }
+            }
+        }));
+    }
+    for (auto& task : tasks) {
+        task.get();
+    }
+    return results;
+}
+
+/**
+ * @brief Computes an HMAC-SHA256 over the concatenation of several byte ranges.
+ * @param key The MAC key.
+ * @param parts The (data, size) ranges, in order.
+ * @param mac Receives the 32-byte MAC.
+ */
+void CryptoWrapper::hmacSha256(const std::vector<uint8_t>& key, std::initializer_list<std::pair<const uint8_t*, size_t>> parts, uint8_t* mac) {
+    try {
+        CryptoPP::HMAC<CryptoPP::SHA256> hmac(key.data(), key.size());
+        for (const auto& part : parts) {
+            hmac.Update(part.first, part.second);
+        }
+        hmac.Final(mac);
+    }
+    catch (const CryptoPP::Exception& e) {
+        throw std::runtime_error(e.what());
+    }
+}
+
+/**
+ * @brief Compares two MACs in constant time, so a forger learns nothing from how long a check takes.
+ * @param a The first MAC.
+ * @param b The second MAC.
+ * @param size The size of both.
+ * @return True if they are equal.
+ */
+bool CryptoWrapper::macEqual(const uint8_t* a, const uint8_t* b, size_t size) {
+    uint8_t difference = 0;
+    for (size_t i = 0; i < size; i++) {
+        difference |= a[i] ^ b[i];
+    }
+    return difference == 0;
+}
+
 /**
  * @brief Generates a 128-bit AES key.
  * @return The generated AES key.
@@ -144,4 +216,76 @@ std::vector<uint8_t> CryptoWrapper::generateAesKey() {
     std::vector<uint8_t> key(CryptoPP::AES::DEFAULT_KEYLENGTH);
     rng.GenerateBlock(key.data(), key.size());
     return key;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Starts encrypting or decrypting with the given key.
+ * @param key The AES key.
+ * @param direction Whether to encrypt or decrypt.
+ * @param iv The CBC initialization vector; empty for the all-zero IV of the protocol.
+ */
+AesStream::AesStream(const std::vector<uint8_t>& key, Direction direction, const std::vector<uint8_t>& iv) {
+    // IV is all zeros as per specification, unless the caller derives its own
+    static const std::vector<uint8_t> zeroIv(CryptoPP::AES::BLOCKSIZE, 0);
+    const std::vector<uint8_t>& chainStart = iv.empty() ? zeroIv : iv;
+    if (chainStart.size() != CryptoPP::AES::BLOCKSIZE) {
+        throw std::runtime_error("invalid AES IV size");
+    }
+    try {
+        if (direction == Direction::ENCRYPT) {
+            _cipher = std::make_unique<CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption>();
+        }
+        else {
+            _cipher = std::make_unique<CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption>();
+        }
+        _cipher->SetKeyWithIV(key.data(), key.size(), chainStart.data(), chainStart.size());
+        _filter = std::make_unique<CryptoPP::StreamTransformationFilter>(*_cipher, new CryptoPP::VectorSink(_output));
+    }
+    catch (const CryptoPP::Exception& e) {
+        throw std::runtime_error(e.what());
+    }
+}
+
+AesStream::~AesStream() = default;
+
+/**
+ * @brief Processes the next bytes of the input.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @param out The output ready so far is appended to this.
+ */
+void AesStream::update(const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+    try {
+        _filter->Put(data, size);
+    }
+    catch (const CryptoPP::Exception& e) {
+        throw std::runtime_error(e.what());
+    }
+    out.insert(out.end(), _output.begin(), _output.end());
+    _output.clear();
+}
+
+/**
+ * @brief Ends the input, adding or checking the padding.
+ * @param out The rest of the output is appended to this.
+ */
+void AesStream::finish(std::vector<uint8_t>& out) {
+    try {
+        _filter->MessageEnd();
+    }
+    catch (const CryptoPP::Exception& e) {
+        throw std::runtime_error(e.what());
+    }
+    out.insert(out.end(), _output.begin(), _output.end());
+    _output.clear();
+}
+
+/**
+ * @brief Returns the size of the ciphertext of a plaintext of the given size.
+ * PKCS#7 padding always adds between 1 and a whole block.
+ * @param plaintextSize The size of the plaintext.
+ * @return The size of the ciphertext.
+ */
+uint64_t AesStream::ciphertextSize(uint64_t plaintextSize) {
+    return (plaintextSize / CryptoPP::AES::BLOCKSIZE + 1) * CryptoPP::AES::BLOCKSIZE;
+}
@@ -4,7 +4,12 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <memory>
+#include <optional>
+#include <initializer_list>
+#include <utility>
 #include <cryptopp/rsa.h>
+#include <cryptopp/filters.h>
 
 /**
  * @brief A wrapper class for cryptographic operations using Crypto++.
@@ -78,9 +83,79 @@ public:
      */
     static std::vector<uint8_t> aesDecrypt(const std::vector<uint8_t>& key, const std::vector<uint8_t>& ciphertext);
 
+    /**
+     * @brief Decrypts a batch of ciphertexts with the same AES key in parallel.
+     * @param key The AES key to use for decryption.
+     * @param ciphertexts The ciphertexts to decrypt.
+     * @return The plaintexts, in the same order; std::nullopt for entries that failed to decrypt.
+     */
+    static std::vector<std::optional<std::vector<uint8_t>>> aesDecryptBatch(const std::vector<uint8_t>& key, const std::vector<std::vector<uint8_t>>& ciphertexts);
+
+    /**
+     * @brief Computes an HMAC-SHA256 over the concatenation of several byte ranges.
+     * @param key The MAC key.
+     * @param parts The (data, size) ranges, in order.
+     * @param mac Receives the 32-byte MAC.
+     */
+    static void hmacSha256(const std::vector<uint8_t>& key, std::initializer_list<std::pair<const uint8_t*, size_t>> parts, uint8_t* mac);
+
+    /**
+     * @brief Compares two MACs in constant time.
+     */
+    static bool macEqual(const uint8_t* a, const uint8_t* b, size_t size);
+
     /**
      * @brief Generates a 128-bit AES key.
      * @return The generated AES key.
      */
     static std::vector<uint8_t> generateAesKey();
-}; 
+};
+
+/**
+ * @brief Encrypts or decrypts with AES piece by piece.
+ * The output, joined, is exactly what CryptoWrapper::aesEncrypt or aesDecrypt produce for the
+ * whole input, so content of any size can be processed through a fixed-size buffer.
+ */
+class AesStream {
+public:
+    enum class Direction { ENCRYPT, DECRYPT };
+
+    /**
+     * @brief Starts encrypting or decrypting with the given key.
+     * @param key The AES key.
+     * @param direction Whether to encrypt or decrypt.
+     * @param iv The CBC initialization vector; empty for the all-zero IV of the protocol.
+     * @throws std::runtime_error if the key or IV is invalid.
+     */
+    AesStream(const std::vector<uint8_t>& key, Direction direction, const std::vector<uint8_t>& iv = {});
+    ~AesStream();
+
+    AesStream(const AesStream&) = delete;
+    AesStream& operator=(const AesStream&) = delete;
+
+    /**
+     * @brief Processes the next bytes of the input.
+     * @param data The bytes.
+     * @param size The number of bytes.
+     * @param out The output ready so far is appended to this.
+     * @throws std::runtime_error on failure.
+     */
+    void update(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+
+    /**
+     * @brief Ends the input, adding or checking the padding.
+     * @param out The rest of the output is appended to this.
+     * @throws std::runtime_error if the input cannot be decrypted.
+     */
+    void finish(std::vector<uint8_t>& out);
+
+    /**
+     * @brief Returns the size of the ciphertext of a plaintext of the given size.
+     */
+    static uint64_t ciphertextSize(uint64_t plaintextSize);
+
+private:
+    std::unique_ptr<CryptoPP::SymmetricCipher> _cipher;             // the AES-CBC encryption or decryption
+    std::unique_ptr<CryptoPP::StreamTransformationFilter> _filter;  // buffers partial blocks and handles padding
+    std::vector<uint8_t> _output;                                   // output of the filter not yet handed out
+};
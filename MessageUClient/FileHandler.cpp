@@ -38,8 +38,30 @@ std::string FileHandler::bytesToHex(const std::vector<uint8_t>& bytes) {
     return ss.str();
 }
 
+/**
+ * @brief Parses an "ip:port" line.
+ * @param line The line to parse.
+ * @return The address, or std::nullopt if the line has no colon or an invalid port.
+ */
+static std::optional<ServerInfo> parseServerAddress(const std::string& line) {
+    size_t colon_pos = line.find(':');
+    if (colon_pos == std::string::npos) {
+        return std::nullopt;
+    }
+    ServerInfo info;
+    info.ip = line.substr(0, colon_pos);
+    try {
+        info.port = static_cast<uint16_t>(std::stoi(line.substr(colon_pos + 1)));
+    } catch (const std::exception&) {
+        return std::nullopt;
+    }
+    return info;
+}
+
 /**
  * @brief Reads server connection details from server.info.
+ * The first line is the server's "ip:port"; each further line is a read-only replica that
+ * directory requests (clients list, public keys) can be sent to. Invalid replica lines are skipped.
  * @param filename The name of the file to read from.
  * @return An optional ServerInfo struct, or std::nullopt if the file cannot be read.
  */
@@ -49,16 +71,19 @@ std::optional<ServerInfo> FileHandler::readServerInfo(const std::string& filenam
         return std::nullopt;
     }
     std::string line;
-    if (std::getline(file, line)) {
-        size_t colon_pos = line.find(':');
-        if (colon_pos != std::string::npos) {
-            ServerInfo info;
-            info.ip = line.substr(0, colon_pos);
-            info.port = std::stoi(line.substr(colon_pos + 1));
-            return info;
+    if (!std::getline(file, line)) {
+        return std::nullopt;
+    }
+    auto info = parseServerAddress(line);
+    if (!info) {
+        return std::nullopt;
+    }
+    while (std::getline(file, line)) {
+        if (auto replica = parseServerAddress(line)) {
+            info->replicas.push_back(std::move(*replica));
         }
     }
-    return std::nullopt;
+    return info;
 }
 
 /**
@@ -133,6 +158,20 @@ std::optional<std::vector<uint8_t>> FileHandler::readFileContent(const std::stri
  * @return The full path to the newly created file.
  */
 std::string FileHandler::writeToTempFile(const std::vector<uint8_t>& content) {
+    std::string fullPath = tempFilePath();
+    std::ofstream file(fullPath, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Failed to open temp file for writing: " + fullPath);
+    }
+    file.write(reinterpret_cast<const char*>(content.data()), content.size());
+    return fullPath;
+}
+
+/**
+ * @brief Returns a new unique file name in the system's temp directory, without creating the file.
+ * @return The full path.
+ */
+std::string FileHandler::tempFilePath() {
     // get temp directory in cross-platform way using boost
     boost::filesystem::path tempDir = boost::filesystem::temp_directory_path();
 
@@ -140,12 +179,5 @@ std::string FileHandler::writeToTempFile(const std::vector<uint8_t>& content) {
     auto timestamp = std::chrono::high_resolution_clock::now().time_since_epoch().count();
     std::string filename = "msgU_" + std::to_string(timestamp);
 
-    boost::filesystem::path fullPath = tempDir / filename;
-
-    std::ofstream file(fullPath.string(), std::ios::binary);
-    if (!file) {
-        throw std::runtime_error("Failed to open temp file for writing: " + fullPath.string());
-    }
-    file.write(reinterpret_cast<const char*>(content.data()), content.size());
-    return fullPath.string();
+    return (tempDir / filename).string();
 }
\ No newline at end of file
@@ -12,6 +12,7 @@
 struct ServerInfo {
     std::string ip;
     uint16_t port;
+    std::vector<ServerInfo> replicas; // Read-only replicas for directory requests, from the following lines.
 };
 
 /**
@@ -30,6 +31,7 @@ class FileHandler {
 public:
     /**
      * @brief Reads server connection details from server.info.
+     * The first line is the server's "ip:port"; each further line is a read-only replica.
      * @param filename The name of the file to read from.
      * @return An optional ServerInfo struct, or std::nullopt if the file cannot be read.
      */
@@ -71,6 +73,12 @@ public:
      */
     static std::string writeToTempFile(const std::vector<uint8_t>& content);
 
+    /**
+     * @brief Returns a new unique file name in the system's temp directory, without creating the file.
+     * @return The full path.
+     */
+    static std::string tempFilePath();
+
     /**
      * @brief Converts a vector of bytes to a hex string.
      * @param bytes The vector of bytes to convert.
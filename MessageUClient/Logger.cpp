@@ -0,0 +1,328 @@
+// Logger.cpp
+// author: Ariel Cohen ID: 329599187
+
+#include "Logger.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+// A record waiting in the ring; the time and level are formatted by the writer thread.
+struct Record {
+    std::chrono::system_clock::time_point time;
+    LogLevel level = LogLevel::OFF;
+    const char* component = "";
+    std::string text;
+};
+
+/**
+ * @brief The ring of queued records and the writer thread that empties it.
+ * It is destroyed with the other statics, writing what is left before the process exits.
+ */
+class LogWriter {
+public:
+    LogWriter() {
+        const char* path = std::getenv("MESSAGEU_LOG_FILE");
+        if (path && *path) {
+            open(path);
+        }
+    }
+
+    ~LogWriter() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _ready.notify_one();
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        if (_file) {
+            fclose(_file);
+        }
+    }
+
+    /**
+     * @brief Queues a record, starting the writer thread with the first one.
+     * @return False if the ring is full.
+     */
+    bool push(Record&& record) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_stopping) {
+                return false;
+            }
+            // The ring is allocated with the first record, so a process that never logs pays nothing.
+            if (_ring.empty()) {
+                _ring.resize(LOG_RING_CAPACITY);
+            }
+            if (_count == _ring.size()) {
+                return false;
+            }
+            _ring[(_head + _count) % _ring.size()] = std::move(record);
+            _count++;
+            _queued++;
+            if (!_thread.joinable()) {
+                _thread = std::thread(&LogWriter::run, this);
+            }
+        }
+        _ready.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Waits until every record queued so far is written.
+     */
+    void flush() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        uint64_t target = _queued;
+        _written.wait(lock, [&] { return _writtenCount >= target || !_thread.joinable(); });
+    }
+
+    /**
+     * @brief Opens a file to append records to, closing the previous one; empty for stderr.
+     * @return False if the file cannot be opened.
+     */
+    bool open(const std::string& path) {
+        FILE* file = nullptr;
+        if (!path.empty()) {
+            file = fopen(path.c_str(), "ab");
+            if (!file) {
+                return false;
+            }
+        }
+        std::lock_guard<std::mutex> lock(_outputMutex);
+        if (_file) {
+            fclose(_file);
+        }
+        _file = file;
+        return true;
+    }
+
+private:
+    // Writes batches of records until the writer is destroyed and the ring is empty
+    void run() {
+        std::vector<Record> batch;
+        std::string out;
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            _ready.wait(lock, [&] { return _count > 0 || _stopping; });
+            if (_count == 0) {
+                return;
+            }
+            batch.clear();
+            while (_count > 0) {
+                batch.push_back(std::move(_ring[_head]));
+                _head = (_head + 1) % _ring.size();
+                _count--;
+            }
+            uint64_t upTo = _queued;
+            lock.unlock();
+
+            out.clear();
+            for (const auto& record : batch) {
+                format(out, record);
+            }
+            {
+                std::lock_guard<std::mutex> outputLock(_outputMutex);
+                FILE* file = _file ? _file : stderr;
+                fwrite(out.data(), 1, out.size(), file);
+                fflush(file);
+            }
+
+            lock.lock();
+            _writtenCount = upTo;
+            _written.notify_all();
+        }
+    }
+
+    // Appends one record as a line of logfmt
+    static void format(std::string& out, const Record& record) {
+        static const char* const levelNames[] = { "trace", "debug", "info", "warn", "error", "off" };
+        auto sinceEpoch = record.time.time_since_epoch();
+        std::time_t seconds = std::chrono::duration_cast<std::chrono::seconds>(sinceEpoch).count();
+        int millis = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(sinceEpoch).count() % 1000);
+        std::tm utc{};
+#if defined(_WIN32)
+        gmtime_s(&utc, &seconds);
+#else
+        gmtime_r(&seconds, &utc);
+#endif
+        char prefix[48];
+        int length = snprintf(prefix, sizeof(prefix), "ts=%04d-%02d-%02dT%02d:%02d:%02d.%03dZ level=",
+            utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec, millis);
+        out.append(prefix, length);
+        out += levelNames[static_cast<size_t>(record.level)];
+        out += " component=";
+        out += record.component;
+        out += ' ';
+        out += record.text;
+        out += '\n';
+    }
+
+    std::vector<Record> _ring;          // queued records, _count of them starting at _head
+    size_t _head = 0;                   // the oldest queued record
+    size_t _count = 0;                  // the number of queued records
+    uint64_t _queued = 0;               // records queued since the start
+    uint64_t _writtenCount = 0;         // records written since the start
+    bool _stopping = false;             // set when the writer is destroyed
+    std::mutex _mutex;                  // guards the ring and the counters
+    std::condition_variable _ready;     // signaled when a record is queued
+    std::condition_variable _written;   // signaled when a batch is written
+    std::thread _thread;                // the writer thread, started with the first record
+    std::mutex _outputMutex;            // guards _file while a batch is written
+    FILE* _file = nullptr;              // the file records go to; stderr if null
+};
+
+LogWriter writer;
+
+/**
+ * @brief Returns the level set by MESSAGEU_LOG_LEVEL, or the build's default.
+ */
+uint8_t initialLevel() {
+    LogLevel level;
+    const char* name = std::getenv("MESSAGEU_LOG_LEVEL");
+    if (name && Logger::parseLevel(name, level)) {
+        return static_cast<uint8_t>(level);
+    }
+#ifdef DEBUG
+    return static_cast<uint8_t>(LogLevel::DBG);
+#else
+    return static_cast<uint8_t>(LogLevel::OFF);
+#endif
+}
+
+} // namespace
+
+std::atomic<uint8_t> Logger::_level{initialLevel()};
+std::atomic<uint64_t> Logger::_dropped{0};
+
+/**
+ * @brief Changes the lowest level that is logged.
+ * @param level The level; LogLevel::OFF stops logging.
+ */
+void Logger::setLevel(LogLevel level) {
+    _level.store(static_cast<uint8_t>(level), std::memory_order_relaxed);
+}
+
+/**
+ * @brief Parses a level name.
+ * @param name trace, debug, info, warn, error or off.
+ * @param level Receives the level.
+ * @return True if the name was recognized.
+ */
+bool Logger::parseLevel(const std::string& name, LogLevel& level) {
+    static const std::pair<const char*, LogLevel> names[] = {
+        { "trace", LogLevel::TRACE }, { "debug", LogLevel::DBG }, { "info", LogLevel::INFO },
+        { "warn", LogLevel::WARN }, { "error", LogLevel::ERR }, { "off", LogLevel::OFF },
+    };
+    for (const auto& entry : names) {
+        if (name == entry.first) {
+            level = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Writes records to a file, appending, instead of stderr.
+ * Records already queued may still go to the previous destination.
+ * @param path The file; empty for stderr.
+ * @return False if the file cannot be opened.
+ */
+bool Logger::setFile(const std::string& path) {
+    return writer.open(path);
+}
+
+/**
+ * @brief Waits until every record queued so far is written.
+ */
+void Logger::flush() {
+    writer.flush();
+}
+
+/**
+ * @brief Appends a string, quoted and escaped if needed so the line stays parseable.
+ * @param text The record.
+ * @param value The string.
+ */
+void Logger::appendString(std::string& text, std::string_view value) {
+    bool quote = value.empty();
+    for (char c : value) {
+        if (c == ' ' || c == '"' || c == '=' || c == '\\' || static_cast<unsigned char>(c) < 0x20) {
+            quote = true;
+            break;
+        }
+    }
+    if (!quote) {
+        text += value;
+        return;
+    }
+    text += '"';
+    for (char c : value) {
+        switch (c) {
+        case '"': text += "\\\""; break;
+        case '\\': text += "\\\\"; break;
+        case '\n': text += "\\n"; break;
+        case '\r': text += "\\r"; break;
+        case '\t': text += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\x%02x", static_cast<unsigned char>(c));
+                text += escaped;
+            }
+            else {
+                text += c;
+            }
+        }
+    }
+    text += '"';
+}
+
+/**
+ * @brief Appends a number with up to 3 decimals.
+ * @param text The record.
+ * @param value The number.
+ */
+void Logger::appendDouble(std::string& text, double value) {
+    char digits[32];
+    int length = snprintf(digits, sizeof(digits), "%.3f", value);
+    text.append(digits, length);
+}
+
+/**
+ * @brief Appends bytes as lowercase hex.
+ * @param text The record.
+ * @param bytes The bytes.
+ */
+void Logger::appendHex(std::string& text, const std::vector<uint8_t>& bytes) {
+    static const char digits[] = "0123456789abcdef";
+    for (uint8_t byte : bytes) {
+        text += digits[byte >> 4];
+        text += digits[byte & 0x0f];
+    }
+}
+
+/**
+ * @brief Queues a formatted record for the writer thread.
+ * @param level The level.
+ * @param component The part of the client the record comes from; must be a string literal.
+ * @param text The message and fields.
+ */
+void Logger::push(LogLevel level, const char* component, std::string&& text) {
+    Record record;
+    record.time = std::chrono::system_clock::now();
+    record.level = level;
+    record.component = component;
+    record.text = std::move(text);
+    if (!writer.push(std::move(record))) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,166 @@
+// Logger.h
+// author: Ariel Cohen ID: 329599187
+
+#pragma once
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+constexpr size_t LOG_RING_CAPACITY = 8192; ///< Records queued for the writer thread before new ones are dropped.
+
+/**
+ * @brief The severity of a log record, from the most detailed.
+ * DBG and ERR are abbreviated because DEBUG is the debug build flag and ERROR a <windows.h> macro.
+ */
+enum class LogLevel : uint8_t {
+    TRACE, ///< Every request and response.
+    DBG,   ///< Steps of an operation, e.g. the messages of a pull.
+    INFO,  ///< Connections and other rare events.
+    WARN,  ///< Failures the client recovers from, e.g. a stale connection.
+    ERR,   ///< Failures reported to the caller.
+    OFF,   ///< Nothing is logged.
+};
+
+/**
+ * @brief A key and value attached to a log record; create it with logField().
+ */
+template <typename T>
+struct LogField {
+    const char* key; ///< The field name, written as is.
+    const T& value;  ///< The value, formatted only if the record is logged.
+};
+
+/**
+ * @brief Attaches a key and value to a log record.
+ */
+template <typename T>
+LogField<T> logField(const char* key, const T& value) { return LogField<T>{key, value}; }
+
+/**
+ * @brief A process-wide, leveled logger writing structured records on a background thread.
+ * Each record is a line of logfmt: time, level, component, message and key=value fields.
+ * The LOG_* macros compare the level with one relaxed atomic load and evaluate nothing else
+ * when the record is not logged, so logging can stay in release builds. A logged record is
+ * formatted by the calling thread and queued in a bounded ring; a writer thread, started with
+ * the first record, adds the time and level and writes whole batches to the file or stderr.
+ * When the ring is full records are dropped and counted rather than blocking the caller.
+ * The initial level and file come from the MESSAGEU_LOG_LEVEL (trace, debug, info, warn, error,
+ * off) and MESSAGEU_LOG_FILE environment variables; without them nothing is logged, or debug
+ * and up in builds with DEBUG defined. All functions are thread-safe.
+ */
+class Logger {
+public:
+    /**
+     * @brief Returns true if records of the given level are logged.
+     */
+    static bool enabled(LogLevel level) { return static_cast<uint8_t>(level) >= _level.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Changes the lowest level that is logged, e.g. LogLevel::OFF to stop logging.
+     */
+    static void setLevel(LogLevel level);
+
+    /**
+     * @brief Returns the lowest level that is logged.
+     */
+    static LogLevel level() { return static_cast<LogLevel>(_level.load(std::memory_order_relaxed)); }
+
+    /**
+     * @brief Parses a level name (trace, debug, info, warn, error, off).
+     * @return True if the name was recognized.
+     */
+    static bool parseLevel(const std::string& name, LogLevel& level);
+
+    /**
+     * @brief Writes records to a file, appending, instead of stderr; empty for stderr.
+     * @return False if the file cannot be opened, in which case records keep going where they went.
+     */
+    static bool setFile(const std::string& path);
+
+    /**
+     * @brief Waits until every record queued so far is written.
+     */
+    static void flush();
+
+    /**
+     * @brief Returns the number of records dropped because the ring was full.
+     */
+    static uint64_t dropped() { return _dropped.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Formats and queues a record; use the LOG_* macros, which skip disabled levels.
+     * @param level The level.
+     * @param component The part of the client the record comes from, e.g. "transport".
+     * @param message What happened.
+     * @param fields Values attached with logField().
+     */
+    template <typename... Fields>
+    static void write(LogLevel level, const char* component, const char* message, const Fields&... fields) {
+        std::string text;
+        text.reserve(128);
+        text += "msg=";
+        appendString(text, message);
+        (appendField(text, fields), ...);
+        push(level, component, std::move(text));
+    }
+
+private:
+    template <typename T>
+    static void appendField(std::string& text, const LogField<T>& field) {
+        text += ' ';
+        text += field.key;
+        text += '=';
+        appendValue(text, field.value);
+    }
+
+    template <typename T>
+    static void appendValue(std::string& text, const T& value) {
+        if constexpr (std::is_same_v<T, bool>) {
+            text += value ? "true" : "false";
+        }
+        else if constexpr (std::is_enum_v<T>) {
+            appendValue(text, static_cast<std::underlying_type_t<T>>(value));
+        }
+        else if constexpr (std::is_integral_v<T>) {
+            char digits[24];
+            auto result = std::to_chars(digits, digits + sizeof(digits), static_cast<std::conditional_t<std::is_signed_v<T>, int64_t, uint64_t>>(value));
+            text.append(digits, result.ptr);
+        }
+        else if constexpr (std::is_floating_point_v<T>) {
+            appendDouble(text, static_cast<double>(value));
+        }
+        else if constexpr (std::is_same_v<T, std::vector<uint8_t>>) {
+            appendHex(text, value);
+        }
+        else {
+            appendString(text, std::string_view(value));
+        }
+    }
+
+    // Appends a string, quoted and escaped if it holds spaces, quotes, '=' or control characters
+    static void appendString(std::string& text, std::string_view value);
+    // Appends a number with up to 3 decimals
+    static void appendDouble(std::string& text, double value);
+    // Appends bytes as lowercase hex
+    static void appendHex(std::string& text, const std::vector<uint8_t>& bytes);
+    // Queues a formatted record for the writer thread, starting it if needed
+    static void push(LogLevel level, const char* component, std::string&& text);
+
+    static std::atomic<uint8_t> _level;     // the lowest level logged
+    static std::atomic<uint64_t> _dropped;  // records dropped because the ring was full
+};
+
+/**
+ * @brief Logs a record if its level is enabled; the arguments are only evaluated if it is.
+ * Usage: LOG_DEBUG("session", "Pulled messages", logField("count", n));
+ */
+#define MU_LOG(level, ...) do { if (Logger::enabled(level)) { Logger::write(level, __VA_ARGS__); } } while (0)
+#define LOG_TRACE(...) MU_LOG(LogLevel::TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) MU_LOG(LogLevel::DBG, __VA_ARGS__)
+#define LOG_INFO(...) MU_LOG(LogLevel::INFO, __VA_ARGS__)
+#define LOG_WARN(...) MU_LOG(LogLevel::WARN, __VA_ARGS__)
+#define LOG_ERROR(...) MU_LOG(LogLevel::ERR, __VA_ARGS__)
@@ -0,0 +1,215 @@
+// MemoryStats.cpp
+// author: Ariel Cohen ID: 329599187
+
+#include "MemoryStats.h"
+#include <condition_variable>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+
+std::array<MemoryStats::Counters, static_cast<size_t>(MemorySubsystem::COUNT)> MemoryStats::_subsystems;
+MemoryStats::Counters MemoryStats::_total;
+std::atomic<uint64_t> MemoryStats::_budget{0};
+std::atomic<int> MemoryStats::_waiters{0};
+
+// Threads waiting in reserveWithin sleep on this until a charge is released.
+static std::mutex releasedMutex;
+static std::condition_variable released;
+
+/**
+ * @brief Reads one set of counters.
+ * @param live The live bytes counter.
+ * @param peak The peak bytes counter.
+ * @param allocations The allocations counter.
+ * @return Their values.
+ */
+static MemoryUsage read(const std::atomic<uint64_t>& live, const std::atomic<uint64_t>& peak, const std::atomic<uint64_t>& allocations) {
+    MemoryUsage usage;
+    usage.liveBytes = live.load(std::memory_order_relaxed);
+    usage.peakBytes = peak.load(std::memory_order_relaxed);
+    usage.allocations = allocations.load(std::memory_order_relaxed);
+    return usage;
+}
+
+/**
+ * @brief Returns the memory charged to a subsystem.
+ * @param subsystem The subsystem.
+ * @return Its live bytes, peak bytes and allocations.
+ */
+MemoryUsage MemoryStats::usage(MemorySubsystem subsystem) {
+    const Counters& counters = _subsystems[static_cast<size_t>(subsystem)];
+    return read(counters.live, counters.peak, counters.allocations);
+}
+
+/**
+ * @brief Returns the memory charged to all subsystems.
+ * @return The total live bytes and allocations, and the peak of the total.
+ */
+MemoryUsage MemoryStats::total() {
+    return read(_total.live, _total.peak, _total.allocations);
+}
+
+/**
+ * @brief Sets every peak to the bytes held right now.
+ */
+void MemoryStats::resetPeaks() {
+    for (auto& counters : _subsystems) {
+        counters.peak.store(counters.live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    _total.peak.store(_total.live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+/**
+ * @brief Returns the name of a subsystem.
+ * @param subsystem The subsystem.
+ * @return A static string.
+ */
+const char* MemoryStats::name(MemorySubsystem subsystem) {
+    switch (subsystem) {
+    case MemorySubsystem::TRANSPORT: return "transport";
+    case MemorySubsystem::CRYPTO: return "crypto";
+    case MemorySubsystem::FILE_IO: return "file I/O";
+    case MemorySubsystem::DIRECTORY: return "directory";
+    default: return "unknown";
+    }
+}
+
+/**
+ * @brief Returns a table of live bytes, peak bytes and allocations per subsystem and in total.
+ * @return The table, one line per subsystem.
+ */
+std::string MemoryStats::report() {
+    std::ostringstream out;
+    auto line = [&out](const char* name, const MemoryUsage& usage) {
+        out << std::left << std::setw(12) << name << std::right
+            << std::setw(14) << usage.liveBytes << std::setw(14) << usage.peakBytes
+            << std::setw(13) << usage.allocations << "\n";
+    };
+    out << std::left << std::setw(12) << "subsystem" << std::right
+        << std::setw(14) << "live bytes" << std::setw(14) << "peak bytes" << std::setw(13) << "allocations" << "\n";
+    for (size_t i = 0; i < _subsystems.size(); i++) {
+        auto subsystem = static_cast<MemorySubsystem>(i);
+        line(name(subsystem), usage(subsystem));
+    }
+    line("total", total());
+    return out.str();
+}
+
+/**
+ * @brief Returns true if the given bytes could be reserved right now.
+ * @param bytes The bytes to reserve.
+ * @return True if there is no budget or the bytes fit in what is left of it.
+ */
+bool MemoryStats::fits(uint64_t bytes) {
+    uint64_t limit = budget();
+    return limit == 0 || _total.live.load(std::memory_order_relaxed) + bytes <= limit;
+}
+
+/**
+ * @brief Records a change of the bytes held by one buffer.
+ * @param subsystem The subsystem the buffer is charged to.
+ * @param oldBytes The bytes charged before.
+ * @param newBytes The bytes charged now.
+ */
+void MemoryStats::change(MemorySubsystem subsystem, uint64_t oldBytes, uint64_t newBytes) {
+    apply(_subsystems[static_cast<size_t>(subsystem)], oldBytes, newBytes);
+    apply(_total, oldBytes, newBytes);
+    if (newBytes < oldBytes) {
+        notifyReleased();
+    }
+}
+
+/**
+ * @brief Records a change of the bytes held by one buffer, but only if the growth fits the budget.
+ * The total is raised with a compare-and-swap against the budget, so concurrent reservations
+ * can never overshoot it together.
+ * @param subsystem The subsystem the buffer is charged to.
+ * @param oldBytes The bytes charged before.
+ * @param newBytes The bytes to charge.
+ * @return True if the change was recorded, false if it does not fit.
+ */
+bool MemoryStats::reserve(MemorySubsystem subsystem, uint64_t oldBytes, uint64_t newBytes) {
+    uint64_t limit = budget();
+    if (newBytes <= oldBytes || limit == 0) {
+        change(subsystem, oldBytes, newBytes);
+        return true;
+    }
+    uint64_t growth = newBytes - oldBytes;
+    uint64_t live = _total.live.load(std::memory_order_relaxed);
+    do {
+        if (live + growth > limit) {
+            return false;
+        }
+    } while (!_total.live.compare_exchange_weak(live, live + growth, std::memory_order_relaxed));
+    _total.allocations.fetch_add(1, std::memory_order_relaxed);
+    raisePeak(_total, live + growth);
+    apply(_subsystems[static_cast<size_t>(subsystem)], oldBytes, newBytes);
+    return true;
+}
+
+/**
+ * @brief Like reserve(), but waits up to the timeout for other charges to be released.
+ * @param subsystem The subsystem the buffer is charged to.
+ * @param oldBytes The bytes charged before.
+ * @param newBytes The bytes to charge.
+ * @param timeout How long to wait.
+ * @return True if the change was recorded, false if it did not fit in time.
+ */
+bool MemoryStats::reserveWithin(MemorySubsystem subsystem, uint64_t oldBytes, uint64_t newBytes, std::chrono::milliseconds timeout) {
+    if (reserve(subsystem, oldBytes, newBytes)) {
+        return true;
+    }
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    _waiters.fetch_add(1);
+    // Pairs with the fence in notifyReleased: either this thread sees the release, or the releaser sees the waiter.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool reserved;
+    {
+        std::unique_lock<std::mutex> lock(releasedMutex);
+        while (!(reserved = reserve(subsystem, oldBytes, newBytes))
+            && released.wait_until(lock, deadline) != std::cv_status::timeout) {
+        }
+        if (!reserved) {
+            reserved = reserve(subsystem, oldBytes, newBytes);
+        }
+    }
+    _waiters.fetch_sub(1);
+    return reserved;
+}
+
+/**
+ * @brief Wakes the threads waiting in reserveWithin, if any.
+ */
+void MemoryStats::notifyReleased() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_waiters.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(releasedMutex);
+        released.notify_all();
+    }
+}
+
+/**
+ * @brief Adds to or subtracts from one set of counters, raising its peak if needed.
+ * @param counters The counters to change.
+ * @param oldBytes The bytes charged before.
+ * @param newBytes The bytes charged now.
+ */
+void MemoryStats::apply(Counters& counters, uint64_t oldBytes, uint64_t newBytes) {
+    if (newBytes < oldBytes) {
+        counters.live.fetch_sub(oldBytes - newBytes, std::memory_order_relaxed);
+        return;
+    }
+    counters.allocations.fetch_add(1, std::memory_order_relaxed);
+    raisePeak(counters, counters.live.fetch_add(newBytes - oldBytes, std::memory_order_relaxed) + newBytes - oldBytes);
+}
+
+/**
+ * @brief Raises the peak of a set of counters to the live bytes given, unless it is already higher.
+ * @param counters The counters to change.
+ * @param live The live bytes right after a change.
+ */
+void MemoryStats::raisePeak(Counters& counters, uint64_t live) {
+    uint64_t peak = counters.peak.load(std::memory_order_relaxed);
+    while (live > peak && !counters.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+}
@@ -0,0 +1,178 @@
+// MemoryStats.h
+// author: Ariel Cohen ID: 329599187
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+constexpr std::chrono::milliseconds MEMORY_WAIT_TIMEOUT{30000}; ///< How long a fixed-size working buffer waits for room in the budget.
+
+/**
+ * @brief The parts of the client that memory is charged to.
+ */
+enum class MemorySubsystem {
+    TRANSPORT, ///< Framed requests, response payloads and queued pushes.
+    CRYPTO,    ///< Plaintexts and ciphertexts produced by encryption and decryption.
+    FILE_IO,   ///< File content read from disk, including parked messages.
+    DIRECTORY, ///< The contact cache and the keys held for each contact.
+    COUNT      ///< The number of subsystems.
+};
+
+/**
+ * @brief The memory charged to one subsystem, or to all of them.
+ */
+struct MemoryUsage {
+    uint64_t liveBytes = 0;   ///< Bytes held right now.
+    uint64_t peakBytes = 0;   ///< Most bytes held at once since the start, or since resetPeaks().
+    uint64_t allocations = 0; ///< Number of times a buffer was allocated or grown.
+};
+
+/**
+ * @brief Process-wide accounting of the large buffers the client holds, by subsystem.
+ * Buffers are charged explicitly by their owners through MemoryCharge, so the cost is a few
+ * relaxed atomic operations per buffer allocated or resized, never per byte, and the accounting
+ * can stay on in release builds. Small objects and the internal buffers of Crypto++ and Boost
+ * are not charged. All functions are thread-safe.
+ * The charges also draw from an optional budget: buffers sized by a payload are reserved with
+ * MemoryCharge::tryUpdate or waitUpdate, and an operation whose buffer does not fit streams its
+ * data through a fixed-size buffer, waits for memory to be released, or fails, but never
+ * allocates past the budget.
+ */
+class MemoryStats {
+public:
+    /**
+     * @brief Returns the memory charged to a subsystem.
+     */
+    static MemoryUsage usage(MemorySubsystem subsystem);
+
+    /**
+     * @brief Returns the memory charged to all subsystems; its peak is the peak of their sum.
+     */
+    static MemoryUsage total();
+
+    /**
+     * @brief Sets every peak to the bytes held right now, e.g. before measuring one operation.
+     */
+    static void resetPeaks();
+
+    /**
+     * @brief Returns a table of live bytes, peak bytes and allocations per subsystem.
+     */
+    static std::string report();
+
+    /**
+     * @brief Returns the name of a subsystem, as used in the report.
+     */
+    static const char* name(MemorySubsystem subsystem);
+
+    /**
+     * @brief Sets the most bytes all charges may hold together; 0 (the default) for no limit.
+     * Lowering it below the bytes held right now frees nothing; new reservations fail until enough is released.
+     */
+    static void setBudget(uint64_t bytes) { _budget.store(bytes, std::memory_order_relaxed); }
+
+    /**
+     * @brief Returns the budget, or 0 if there is none.
+     */
+    static uint64_t budget() { return _budget.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Returns true if the given bytes could be reserved right now.
+     */
+    static bool fits(uint64_t bytes);
+
+private:
+    friend class MemoryCharge;
+
+    // The counters of one subsystem, or of the total.
+    struct Counters {
+        std::atomic<uint64_t> live{0};
+        std::atomic<uint64_t> peak{0};
+        std::atomic<uint64_t> allocations{0};
+    };
+
+    // Records a change of the bytes held by one buffer.
+    static void change(MemorySubsystem subsystem, uint64_t oldBytes, uint64_t newBytes);
+    // Like change(), but only if the growth fits the budget.
+    static bool reserve(MemorySubsystem subsystem, uint64_t oldBytes, uint64_t newBytes);
+    // Like reserve(), waiting up to the timeout for other charges to be released.
+    static bool reserveWithin(MemorySubsystem subsystem, uint64_t oldBytes, uint64_t newBytes, std::chrono::milliseconds timeout);
+    // Adds to or subtracts from one set of counters, raising its peak if needed.
+    static void apply(Counters& counters, uint64_t oldBytes, uint64_t newBytes);
+    // Raises the peak of a set of counters to the live bytes given.
+    static void raisePeak(Counters& counters, uint64_t live);
+    // Wakes the threads waiting in reserveWithin, if any.
+    static void notifyReleased();
+
+    static std::array<Counters, static_cast<size_t>(MemorySubsystem::COUNT)> _subsystems;
+    static Counters _total;
+    static std::atomic<uint64_t> _budget;
+    static std::atomic<int> _waiters;
+};
+
+/**
+ * @brief The charge of one buffer to a subsystem, released when the charge is destroyed.
+ * The owner of a buffer keeps a charge next to it and calls update() with the buffer's size
+ * (or capacity) whenever it changes; growing counts as an allocation. Buffers sized by a payload
+ * call tryUpdate() or waitUpdate() before allocating instead, and allocate only if it succeeds.
+ */
+class MemoryCharge {
+public:
+    /**
+     * @brief Charges bytes to a subsystem.
+     * @param subsystem The subsystem the buffer belongs to.
+     * @param bytes The bytes the buffer holds; 0 to start empty.
+     */
+    explicit MemoryCharge(MemorySubsystem subsystem, size_t bytes = 0) : _subsystem(subsystem) { update(bytes); }
+    ~MemoryCharge() { update(0); }
+
+    MemoryCharge(const MemoryCharge&) = delete;
+    MemoryCharge& operator=(const MemoryCharge&) = delete;
+
+    /**
+     * @brief Changes the bytes charged to the new size of the buffer.
+     */
+    void update(size_t bytes) {
+        if (bytes != _bytes) {
+            MemoryStats::change(_subsystem, _bytes, bytes);
+            _bytes = bytes;
+        }
+    }
+
+    /**
+     * @brief Changes the bytes charged if the growth fits the budget.
+     * @return True if the bytes are charged; false, leaving the charge unchanged, if they do not fit.
+     */
+    bool tryUpdate(size_t bytes) {
+        if (!MemoryStats::reserve(_subsystem, _bytes, bytes)) {
+            return false;
+        }
+        _bytes = bytes;
+        return true;
+    }
+
+    /**
+     * @brief Changes the bytes charged once the growth fits the budget, waiting for other charges to be released.
+     * @return True if the bytes are charged; false, leaving the charge unchanged, if they did not fit in time.
+     */
+    bool waitUpdate(size_t bytes, std::chrono::milliseconds timeout) {
+        if (!MemoryStats::reserveWithin(_subsystem, _bytes, bytes, timeout)) {
+            return false;
+        }
+        _bytes = bytes;
+        return true;
+    }
+
+    /**
+     * @brief Returns the bytes charged.
+     */
+    size_t bytes() const { return _bytes; }
+
+private:
+    MemorySubsystem _subsystem; // the subsystem charged
+    size_t _bytes = 0;          // the bytes charged
+};
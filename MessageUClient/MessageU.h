@@ -0,0 +1,324 @@
+/**
+ * @file MessageU.h
+ * @brief The C API of the embeddable MessageU client library (MessageUCore).
+ * The API is stable: handles are opaque, all functions return an mu_status, and
+ * structs passed to callbacks start with their own size so fields can be appended later.
+ * No function writes to the console.
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#if defined(MESSAGEU_EXPORTS)
+#define MESSAGEU_API __declspec(dllexport)
+#else
+#define MESSAGEU_API __declspec(dllimport)
+#endif
+#else
+#define MESSAGEU_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MU_API_VERSION 1 ///< Bumped only on incompatible changes.
+
+/**
+ * @brief Result codes of all API functions.
+ */
+typedef enum mu_status {
+    MU_OK = 0,                     ///< The operation succeeded.
+    MU_ERR_NOT_REGISTERED = 1,     ///< No identity is loaded; register first.
+    MU_ERR_ALREADY_REGISTERED = 2, ///< An identity file already exists.
+    MU_ERR_UNKNOWN_CLIENT = 3,     ///< The named client is not known to the server.
+    MU_ERR_NO_PUBLIC_KEY = 4,      ///< The recipient's public key could not be retrieved.
+    MU_ERR_NO_SYM_KEY = 5,         ///< No symmetric key is established with the recipient.
+    MU_ERR_FILE = 6,               ///< A local file could not be read or written.
+    MU_ERR_REQUEST_FAILED = 7,     ///< The server returned an error or could not be reached.
+    MU_ERR_CRYPTO = 8,             ///< An encryption or key generation step failed.
+    MU_ERR_INVALID_ARGUMENT = 9,   ///< A required argument was NULL.
+    MU_ERR_INTERNAL = 10,          ///< An unexpected internal error occurred.
+    MU_ERR_NOT_SUPPORTED = 11,     ///< The server does not support the operation.
+    MU_ERR_UNKNOWN_STREAM = 12,    ///< No stream with the given ID is open in this session.
+    MU_ERR_EVENTS_LOST = 13,       ///< Live events were dropped unread, e.g. stream chunks; those that arrived were reported.
+} mu_status;
+
+/**
+ * @brief The outcome of processing a pulled message.
+ */
+typedef enum mu_message_status {
+    MU_MESSAGE_DELIVERED = 0,      ///< Processed; content (if any) is available.
+    MU_MESSAGE_DEFERRED = 1,       ///< No key yet; parked and reported again once the key arrives.
+    MU_MESSAGE_NO_SYM_KEY = 2,     ///< No key yet and the pending queue is full; the message is lost.
+    MU_MESSAGE_DECRYPT_FAILED = 3, ///< The content could not be decrypted or saved.
+    MU_MESSAGE_REPAIRING = 4,      ///< Some chunks of a chunked file were damaged and requested again; reported again once they arrive.
+} mu_message_status;
+
+/**
+ * @brief A pulled message. Valid only for the duration of the callback.
+ */
+typedef struct mu_message {
+    size_t struct_size;          ///< sizeof(mu_message) of the library that filled it.
+    const uint8_t* sender_id;    ///< The sender's 16-byte UUID.
+    const char* sender_name;     ///< The sender's name, "Unknown" if the server does not know them.
+    uint32_t message_id;         ///< The server-side message ID.
+    uint8_t type;                ///< The protocol message type (1 key request, 2 key, 3 text, 4 file, 5 stream, 6 chunked file, 7 chunk request, 8 directory).
+    mu_message_status status;    ///< The outcome of processing the message.
+    const uint8_t* content;      ///< Decrypted text for text messages, NULL otherwise.
+    size_t content_size;         ///< Size of content in bytes.
+    const char* file_path;       ///< Path of the saved file for file and stream messages, of the unpacked directory for directories, of the file sent again for chunk requests, NULL otherwise.
+    int deferred;                ///< Non-zero if the message was parked earlier and decrypted later.
+    uint64_t sequence;           ///< The message's number in its conversation with the sender; 0 if not numbered.
+    uint64_t skipped;            ///< Numbers skipped right before this one: messages from the sender lost, or still to come.
+} mu_message;
+
+/**
+ * @brief What happened to a live stream.
+ */
+typedef enum mu_stream_event_type {
+    MU_STREAM_OPEN = 1,   ///< A stream was opened.
+    MU_STREAM_DATA = 2,   ///< A chunk arrived.
+    MU_STREAM_CLOSE = 3,  ///< The sender closed the stream.
+    MU_STREAM_ABORT = 4,  ///< The sender disconnected without closing the stream.
+    MU_STREAM_STORED = 5, ///< The rest of the stream will arrive as a pulled message (type 5).
+} mu_stream_event_type;
+
+/**
+ * @brief A live stream event. Valid only for the duration of the callback.
+ */
+typedef struct mu_stream_event {
+    size_t struct_size;          ///< sizeof(mu_stream_event) of the library that filled it.
+    const uint8_t* sender_id;    ///< The sender's 16-byte UUID.
+    const char* sender_name;     ///< The sender's name, "Unknown" if the server does not know them.
+    uint32_t stream_id;          ///< The server-assigned stream ID.
+    mu_stream_event_type type;   ///< What happened.
+    mu_message_status status;    ///< For MU_STREAM_DATA: whether data could be decrypted.
+    const uint8_t* data;         ///< The decrypted chunk for MU_STREAM_DATA, NULL otherwise.
+    size_t data_size;            ///< Size of data in bytes.
+} mu_stream_event;
+
+/**
+ * @brief The presence of a watched client. Valid only for the duration of the callback.
+ */
+typedef struct mu_presence {
+    size_t struct_size;          ///< sizeof(mu_presence) of the library that filled it.
+    const uint8_t* client_id;    ///< The client's 16-byte UUID.
+    const char* name;            ///< The client's name, "Unknown" if it is no longer watched.
+    int online;                  ///< Non-zero while the client has an open connection to the server.
+} mu_presence;
+
+/**
+ * @brief The parts of the library that memory is charged to.
+ */
+typedef enum mu_memory_subsystem {
+    MU_MEMORY_TRANSPORT = 0, ///< Framed requests, response payloads and queued pushes.
+    MU_MEMORY_CRYPTO = 1,    ///< Plaintexts and ciphertexts produced by encryption and decryption.
+    MU_MEMORY_FILE_IO = 2,   ///< File content read from disk, including parked messages.
+    MU_MEMORY_DIRECTORY = 3, ///< The contact cache and the keys held for each contact.
+    MU_MEMORY_TOTAL = 4,     ///< All of the above; its peak is the peak of their sum.
+} mu_memory_subsystem;
+
+/**
+ * @brief The memory charged to a subsystem, for all sessions of the process.
+ */
+typedef struct mu_memory_usage {
+    size_t struct_size;          ///< Set by the caller to sizeof(mu_memory_usage).
+    uint64_t live_bytes;         ///< Bytes held right now.
+    uint64_t peak_bytes;         ///< Most bytes held at once since the library was loaded, or since mu_memory_reset_peaks.
+    uint64_t allocations;        ///< Number of times a buffer was allocated or grown.
+} mu_memory_usage;
+
+/**
+ * @brief The levels of the diagnostic log, from the most detailed.
+ */
+typedef enum mu_log_level {
+    MU_LOG_TRACE = 0, ///< Every request and response.
+    MU_LOG_DEBUG = 1, ///< Steps of an operation, e.g. the messages of a pull.
+    MU_LOG_INFO = 2,  ///< Connections and other rare events.
+    MU_LOG_WARN = 3,  ///< Failures the library recovers from, e.g. a stale connection.
+    MU_LOG_ERROR = 4, ///< Failures reported to the caller.
+    MU_LOG_OFF = 5,   ///< Nothing is logged (the default).
+} mu_log_level;
+
+typedef struct mu_session mu_session; ///< An open identity and its connection to the server.
+
+typedef void (*mu_message_cb)(const mu_message* message, void* user_data);
+typedef void (*mu_stream_cb)(const mu_stream_event* event, void* user_data);
+typedef void (*mu_presence_cb)(const mu_presence* presence, void* user_data);
+typedef void (*mu_completion_cb)(mu_status status, void* user_data);
+
+/**
+ * @brief Returns MU_API_VERSION of the loaded library.
+ */
+MESSAGEU_API uint32_t mu_api_version(void);
+
+/**
+ * @brief Returns a static, human-readable description of a status code.
+ */
+MESSAGEU_API const char* mu_status_string(mu_status status);
+
+/**
+ * @brief Opens an identity.
+ * @param server_info_path Path of the server.info file (NULL for "server.info").
+ * @param my_info_path Path of the identity file (NULL for "my.info"); it may not exist yet.
+ * @param pending_dir Directory for messages awaiting their sender's key (NULL for "pending").
+ * @param out_session Receives the session handle on success.
+ */
+MESSAGEU_API mu_status mu_open(const char* server_info_path, const char* my_info_path, const char* pending_dir, mu_session** out_session);
+
+/**
+ * @brief Waits for all queued asynchronous operations and closes the session.
+ */
+MESSAGEU_API void mu_close(mu_session* session);
+
+/**
+ * @brief Registers a new user and writes the identity file given to mu_open.
+ */
+MESSAGEU_API mu_status mu_register(mu_session* session, const char* username);
+
+/**
+ * @brief Returns non-zero if the session has an identity loaded.
+ */
+MESSAGEU_API int mu_is_registered(mu_session* session);
+
+/**
+ * @brief Requests the recipient's symmetric key.
+ */
+MESSAGEU_API mu_status mu_request_sym_key(mu_session* session, const char* username);
+
+/**
+ * @brief Generates and sends a new symmetric key to the recipient.
+ */
+MESSAGEU_API mu_status mu_send_sym_key(mu_session* session, const char* username);
+
+/**
+ * @brief Sends an encrypted text message.
+ */
+MESSAGEU_API mu_status mu_send_text(mu_session* session, const char* username, const char* text);
+
+/**
+ * @brief Sends an encrypted file.
+ */
+MESSAGEU_API mu_status mu_send_file(mu_session* session, const char* username, const char* file_path);
+
+/**
+ * @brief Sends a directory, subdirectories included, as one encrypted message.
+ * The recipient's pull reports it with type 8 and the path of the directory it was unpacked into.
+ */
+MESSAGEU_API mu_status mu_send_directory(mu_session* session, const char* username, const char* dir_path);
+
+/**
+ * @brief Queues a text message to be sent on the session's worker thread.
+ * The arguments are copied. on_done (may be NULL) is called from the worker thread.
+ */
+MESSAGEU_API mu_status mu_send_text_async(mu_session* session, const char* username, const char* text, mu_completion_cb on_done, void* user_data);
+
+/**
+ * @brief Queues a file to be sent on the session's worker thread.
+ * The arguments are copied. on_done (may be NULL) is called from the worker thread.
+ */
+MESSAGEU_API mu_status mu_send_file_async(mu_session* session, const char* username, const char* file_path, mu_completion_cb on_done, void* user_data);
+
+/**
+ * @brief Queues a directory to be sent on the session's worker thread.
+ * The arguments are copied. on_done (may be NULL) is called from the worker thread.
+ */
+MESSAGEU_API mu_status mu_send_directory_async(mu_session* session, const char* username, const char* dir_path, mu_completion_cb on_done, void* user_data);
+
+/**
+ * @brief Pulls all waiting messages, calling on_message once per message in order.
+ * Each message is reported as soon as it is processed. The session is unlocked while
+ * on_message runs, so it may call any function of the API, on this session too.
+ */
+MESSAGEU_API mu_status mu_pull(mu_session* session, mu_message_cb on_message, void* user_data);
+
+/**
+ * @brief Opens a stream to the recipient. Requires an established symmetric key.
+ * @param out_stream_id Receives the stream ID.
+ * @param out_live Receives non-zero if chunks are relayed live, zero if they are stored for later (may be NULL).
+ */
+MESSAGEU_API mu_status mu_stream_open(mu_session* session, const char* username, uint32_t* out_stream_id, int* out_live);
+
+/**
+ * @brief Encrypts and sends one chunk of an open stream, without waiting for the server.
+ */
+MESSAGEU_API mu_status mu_stream_write(mu_session* session, uint32_t stream_id, const uint8_t* data, size_t size);
+
+/**
+ * @brief Closes a stream. Returns MU_ERR_REQUEST_FAILED if the server did not receive every chunk.
+ */
+MESSAGEU_API mu_status mu_stream_close(mu_session* session, uint32_t stream_id);
+
+/**
+ * @brief Waits up to timeout_ms for live stream events, calling on_event once per event in order.
+ * Returns MU_OK on timeout. The session is locked while waiting, but not while on_event runs.
+ * Returns MU_ERR_EVENTS_LOST, after reporting the events that arrived, if events were dropped
+ * since the last call because more than 64 MB of them were left unread.
+ */
+MESSAGEU_API mu_status mu_wait_streams(mu_session* session, uint32_t timeout_ms, mu_stream_cb on_event, void* user_data);
+
+/**
+ * @brief Watches the presence of the named clients, replacing any earlier set (count 0 stops watching).
+ * Calls on_change once per client with its current presence before returning, with the session
+ * unlocked; later changes are reported by mu_wait_events, batched by the server.
+ */
+MESSAGEU_API mu_status mu_watch_presence(mu_session* session, const char* const* usernames, size_t count, mu_presence_cb on_change, void* user_data);
+
+/**
+ * @brief Waits up to timeout_ms for live stream events and presence changes.
+ * Either callback may be NULL to drop that kind of event. Returns MU_OK on timeout.
+ * The session is locked while waiting, but not while the callbacks run.
+ * Returns MU_ERR_EVENTS_LOST like mu_wait_streams.
+ */
+MESSAGEU_API mu_status mu_wait_events(mu_session* session, uint32_t timeout_ms, mu_stream_cb on_stream, mu_presence_cb on_presence, void* user_data);
+
+/**
+ * @brief Sets how many contacts the session keeps in memory (1024 by default; 0 for no limit).
+ * The least recently used are evicted and looked up again on the server when needed;
+ * contacts with a symmetric key are never evicted.
+ */
+MESSAGEU_API mu_status mu_set_contact_cache_size(mu_session* session, size_t capacity);
+
+/**
+ * @brief Reads the memory charged to a subsystem. Large buffers are counted, small objects are not.
+ * @param out Receives the usage; its struct_size must be set by the caller.
+ */
+MESSAGEU_API mu_status mu_memory_stats(mu_memory_subsystem subsystem, mu_memory_usage* out);
+
+/**
+ * @brief Sets every peak to the memory held right now, e.g. before measuring one operation.
+ */
+MESSAGEU_API void mu_memory_reset_peaks(void);
+
+/**
+ * @brief Caps the memory held at once by all sessions of the process; 0 (the default) means no cap.
+ * Sends, pulls and parked messages of any size stay within the cap by working through files in
+ * fixed-size chunks. Set it before opening sessions: lowering it below the memory already held
+ * makes new allocations wait for memory to be freed, and fail after a while.
+ */
+MESSAGEU_API void mu_memory_set_budget(uint64_t bytes);
+
+/**
+ * @brief Sets the lowest level of the diagnostic log, for all sessions of the process.
+ * Records are logfmt lines written by a background thread; keys and message contents are never
+ * logged. The initial level and file may also be set with the MESSAGEU_LOG_LEVEL and
+ * MESSAGEU_LOG_FILE environment variables.
+ */
+MESSAGEU_API mu_status mu_log_set_level(mu_log_level level);
+
+/**
+ * @brief Appends the diagnostic log to a file; NULL or "" for stderr.
+ */
+MESSAGEU_API mu_status mu_log_set_file(const char* path);
+
+/**
+ * @brief Waits until every log record queued so far is written.
+ */
+MESSAGEU_API void mu_log_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
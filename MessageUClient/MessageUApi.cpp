@@ -0,0 +1,442 @@
+// MessageUApi.cpp
+// author: Ariel Cohen ID: 329599187
+
+#include "MessageU.h"
+#include "Logger.h"
+#include "Session.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/**
+ * @brief The object behind an mu_session handle.
+ * All access to the Session is serialized by the mutex; asynchronous operations are
+ * queued and executed in order by a single worker thread. The mutex is released while a
+ * callback given to the API runs and taken again after it, so the callback may call the API again.
+ */
+struct mu_session {
+    std::unique_ptr<Session> session;             // the wrapped session
+    std::mutex mutex;                             // serializes access to the session
+    std::mutex queueMutex;                        // guards the task queue
+    std::condition_variable queueChanged;         // signals the worker thread
+    std::deque<std::function<void()>> tasks;      // pending asynchronous operations
+    bool stopping = false;                        // set by mu_close
+    std::thread worker;                           // runs asynchronous operations
+};
+
+/**
+ * @brief Converts a session status to its C API counterpart.
+ */
+static mu_status toStatus(SessionStatus status) {
+    switch (status) {
+    case SessionStatus::OK: return MU_OK;
+    case SessionStatus::NOT_REGISTERED: return MU_ERR_NOT_REGISTERED;
+    case SessionStatus::ALREADY_REGISTERED: return MU_ERR_ALREADY_REGISTERED;
+    case SessionStatus::UNKNOWN_CLIENT: return MU_ERR_UNKNOWN_CLIENT;
+    case SessionStatus::NO_PUBLIC_KEY: return MU_ERR_NO_PUBLIC_KEY;
+    case SessionStatus::NO_SYM_KEY: return MU_ERR_NO_SYM_KEY;
+    case SessionStatus::FILE_ERROR: return MU_ERR_FILE;
+    case SessionStatus::REQUEST_FAILED: return MU_ERR_REQUEST_FAILED;
+    case SessionStatus::CRYPTO_ERROR: return MU_ERR_CRYPTO;
+    case SessionStatus::NOT_SUPPORTED: return MU_ERR_NOT_SUPPORTED;
+    case SessionStatus::UNKNOWN_STREAM: return MU_ERR_UNKNOWN_STREAM;
+    case SessionStatus::EVENTS_LOST: return MU_ERR_EVENTS_LOST;
+    }
+    return MU_ERR_INTERNAL;
+}
+
+/**
+ * @brief Converts a pulled message's status to its C API counterpart.
+ */
+static mu_message_status toMessageStatus(MessageStatus status) {
+    switch (status) {
+    case MessageStatus::DELIVERED: return MU_MESSAGE_DELIVERED;
+    case MessageStatus::DEFERRED: return MU_MESSAGE_DEFERRED;
+    case MessageStatus::NO_SYM_KEY: return MU_MESSAGE_NO_SYM_KEY;
+    case MessageStatus::DECRYPT_FAILED: return MU_MESSAGE_DECRYPT_FAILED;
+    case MessageStatus::REPAIRING: return MU_MESSAGE_REPAIRING;
+    case MessageStatus::DUPLICATE: break; // never reported
+    }
+    return MU_MESSAGE_DECRYPT_FAILED;
+}
+
+/**
+ * @brief Reports a pulled message through a C message callback.
+ */
+static void reportMessage(const IncomingMessage& msg, mu_message_cb on_message, void* user_data) {
+    mu_message out{};
+    out.struct_size = sizeof(mu_message);
+    out.sender_id = msg.senderID.data();
+    out.sender_name = msg.senderName.c_str();
+    out.message_id = msg.messageID;
+    out.type = static_cast<uint8_t>(msg.type);
+    out.status = toMessageStatus(msg.status);
+    if (msg.type == MessageType::TEXT_MESSAGE && msg.status == MessageStatus::DELIVERED) {
+        out.content = reinterpret_cast<const uint8_t*>(msg.text.data());
+        out.content_size = msg.text.size();
+    }
+    if (!msg.filePath.empty()) {
+        out.file_path = msg.filePath.c_str();
+    }
+    out.deferred = msg.deferred ? 1 : 0;
+    out.sequence = msg.sequence;
+    out.skipped = msg.skipped;
+    on_message(&out, user_data);
+}
+
+/**
+ * @brief Reports a live stream event through a C stream callback.
+ */
+static void reportStreamEvent(const StreamEvent& event, mu_stream_cb on_event, void* user_data) {
+    mu_stream_event out{};
+    out.struct_size = sizeof(mu_stream_event);
+    out.sender_id = event.senderID.data();
+    out.sender_name = event.senderName.c_str();
+    out.stream_id = event.streamID;
+    out.type = static_cast<mu_stream_event_type>(event.type);
+    out.status = toMessageStatus(event.status);
+    if (event.type == StreamEventType::DATA && event.status == MessageStatus::DELIVERED) {
+        out.data = event.data.data();
+        out.data_size = event.data.size();
+    }
+    on_event(&out, user_data);
+}
+
+/**
+ * @brief Reports a presence change through a C presence callback.
+ */
+static void reportPresence(const PresenceChange& change, mu_presence_cb on_change, void* user_data) {
+    mu_presence out{};
+    out.struct_size = sizeof(mu_presence);
+    out.client_id = change.clientID.data();
+    out.name = change.name.c_str();
+    out.online = change.online ? 1 : 0;
+    on_change(&out, user_data);
+}
+
+/**
+ * @brief Runs a session operation under the session lock, never letting an exception cross the C boundary.
+ */
+template <typename F>
+static mu_status guarded(mu_session* handle, F&& operation) {
+    if (!handle) {
+        return MU_ERR_INVALID_ARGUMENT;
+    }
+    try {
+        std::lock_guard<std::mutex> lock(handle->mutex);
+        return toStatus(operation(*handle->session));
+    }
+    catch (...) {
+        return MU_ERR_INTERNAL;
+    }
+}
+
+/**
+ * @brief Runs a session operation like guarded, handing it the lock so that it can release the
+ * session while a callback runs.
+ */
+template <typename F>
+static mu_status guardedUnlocking(mu_session* handle, F&& operation) {
+    if (!handle) {
+        return MU_ERR_INVALID_ARGUMENT;
+    }
+    try {
+        std::unique_lock<std::mutex> lock(handle->mutex);
+        return toStatus(operation(*handle->session, lock));
+    }
+    catch (...) {
+        return MU_ERR_INTERNAL;
+    }
+}
+
+/**
+ * @brief Wraps a C stream callback as a Session callback that runs it with the session unlocked
+ * (empty if the callback is NULL).
+ */
+static Session::StreamCallback toStreamCallback(mu_stream_cb on_event, void* user_data, std::unique_lock<std::mutex>& lock) {
+    if (!on_event) { return nullptr; }
+    return [on_event, user_data, &lock](const StreamEvent& event) {
+        lock.unlock();
+        reportStreamEvent(event, on_event, user_data);
+        lock.lock();
+    };
+}
+
+/**
+ * @brief Wraps a C presence callback as a Session callback that runs it with the session unlocked
+ * (empty if the callback is NULL).
+ */
+static Session::PresenceCallback toPresenceCallback(mu_presence_cb on_change, void* user_data, std::unique_lock<std::mutex>& lock) {
+    if (!on_change) { return nullptr; }
+    return [on_change, user_data, &lock](const PresenceChange& change) {
+        lock.unlock();
+        reportPresence(change, on_change, user_data);
+        lock.lock();
+    };
+}
+
+/**
+ * @brief The worker thread: executes queued operations until the session is closed and the queue is empty.
+ */
+static void workerLoop(mu_session* handle) {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(handle->queueMutex);
+            handle->queueChanged.wait(lock, [handle] { return handle->stopping || !handle->tasks.empty(); });
+            if (handle->tasks.empty()) {
+                return;
+            }
+            task = std::move(handle->tasks.front());
+            handle->tasks.pop_front();
+        }
+        task();
+    }
+}
+
+/**
+ * @brief Queues an operation for the worker thread and reports its result through on_done.
+ */
+template <typename F>
+static mu_status enqueue(mu_session* handle, F&& operation, mu_completion_cb onDone, void* userData) {
+    try {
+        std::lock_guard<std::mutex> lock(handle->queueMutex);
+        handle->tasks.emplace_back([handle, operation = std::forward<F>(operation), onDone, userData]() {
+            mu_status status = guarded(handle, operation);
+            if (onDone) {
+                onDone(status, userData);
+            }
+        });
+    }
+    catch (...) {
+        return MU_ERR_INTERNAL;
+    }
+    handle->queueChanged.notify_one();
+    return MU_OK;
+}
+
+uint32_t mu_api_version(void) {
+    return MU_API_VERSION;
+}
+
+const char* mu_status_string(mu_status status) {
+    switch (status) {
+    case MU_OK: return "OK";
+    case MU_ERR_NOT_REGISTERED: return "not registered";
+    case MU_ERR_ALREADY_REGISTERED: return "already registered";
+    case MU_ERR_UNKNOWN_CLIENT: return "unknown client";
+    case MU_ERR_NO_PUBLIC_KEY: return "public key not available";
+    case MU_ERR_NO_SYM_KEY: return "no symmetric key established";
+    case MU_ERR_FILE: return "file error";
+    case MU_ERR_REQUEST_FAILED: return "request failed";
+    case MU_ERR_CRYPTO: return "cryptographic error";
+    case MU_ERR_INVALID_ARGUMENT: return "invalid argument";
+    case MU_ERR_INTERNAL: return "internal error";
+    case MU_ERR_NOT_SUPPORTED: return "not supported by the server";
+    case MU_ERR_UNKNOWN_STREAM: return "unknown stream";
+    case MU_ERR_EVENTS_LOST: return "events lost";
+    }
+    return "unknown status";
+}
+
+mu_status mu_open(const char* server_info_path, const char* my_info_path, const char* pending_dir, mu_session** out_session) {
+    if (!out_session) {
+        return MU_ERR_INVALID_ARGUMENT;
+    }
+    *out_session = nullptr;
+    SessionConfig config;
+    if (server_info_path) { config.serverInfoFile = server_info_path; }
+    if (my_info_path) { config.myInfoFile = my_info_path; }
+    if (pending_dir) { config.pendingDirectory = pending_dir; }
+    try {
+        auto handle = std::make_unique<mu_session>();
+        handle->session = std::make_unique<Session>(config);
+        handle->worker = std::thread(workerLoop, handle.get());
+        *out_session = handle.release();
+        return MU_OK;
+    }
+    catch (const std::runtime_error&) {
+        // Thrown when the server info file is missing or invalid.
+        return MU_ERR_FILE;
+    }
+    catch (...) {
+        return MU_ERR_INTERNAL;
+    }
+}
+
+void mu_close(mu_session* session) {
+    if (!session) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(session->queueMutex);
+        session->stopping = true;
+    }
+    session->queueChanged.notify_one();
+    if (session->worker.joinable()) {
+        session->worker.join();
+    }
+    delete session;
+}
+
+mu_status mu_register(mu_session* session, const char* username) {
+    if (!username) { return MU_ERR_INVALID_ARGUMENT; }
+    return guarded(session, [&](Session& s) { return s.registerUser(username); });
+}
+
+int mu_is_registered(mu_session* session) {
+    if (!session) { return 0; }
+    std::lock_guard<std::mutex> lock(session->mutex);
+    return session->session->isRegistered() ? 1 : 0;
+}
+
+mu_status mu_request_sym_key(mu_session* session, const char* username) {
+    if (!username) { return MU_ERR_INVALID_ARGUMENT; }
+    return guarded(session, [&](Session& s) { return s.sendSymKeyRequest(username); });
+}
+
+mu_status mu_send_sym_key(mu_session* session, const char* username) {
+    if (!username) { return MU_ERR_INVALID_ARGUMENT; }
+    return guarded(session, [&](Session& s) { return s.sendSymKey(username); });
+}
+
+mu_status mu_send_text(mu_session* session, const char* username, const char* text) {
+    if (!username || !text) { return MU_ERR_INVALID_ARGUMENT; }
+    return guarded(session, [&](Session& s) { return s.sendText(username, text); });
+}
+
+mu_status mu_send_file(mu_session* session, const char* username, const char* file_path) {
+    if (!username || !file_path) { return MU_ERR_INVALID_ARGUMENT; }
+    return guarded(session, [&](Session& s) { return s.sendFile(username, file_path); });
+}
+
+mu_status mu_send_directory(mu_session* session, const char* username, const char* dir_path) {
+    if (!username || !dir_path) { return MU_ERR_INVALID_ARGUMENT; }
+    return guarded(session, [&](Session& s) { return s.sendDirectory(username, dir_path); });
+}
+
+mu_status mu_send_text_async(mu_session* session, const char* username, const char* text, mu_completion_cb on_done, void* user_data) {
+    if (!session || !username || !text) { return MU_ERR_INVALID_ARGUMENT; }
+    return enqueue(session, [to = std::string(username), body = std::string(text)](Session& s) {
+        return s.sendText(to, body);
+    }, on_done, user_data);
+}
+
+mu_status mu_send_file_async(mu_session* session, const char* username, const char* file_path, mu_completion_cb on_done, void* user_data) {
+    if (!session || !username || !file_path) { return MU_ERR_INVALID_ARGUMENT; }
+    return enqueue(session, [to = std::string(username), path = std::string(file_path)](Session& s) {
+        return s.sendFile(to, path);
+    }, on_done, user_data);
+}
+
+mu_status mu_send_directory_async(mu_session* session, const char* username, const char* dir_path, mu_completion_cb on_done, void* user_data) {
+    if (!session || !username || !dir_path) { return MU_ERR_INVALID_ARGUMENT; }
+    return enqueue(session, [to = std::string(username), path = std::string(dir_path)](Session& s) {
+        return s.sendDirectory(to, path);
+    }, on_done, user_data);
+}
+
+mu_status mu_pull(mu_session* session, mu_message_cb on_message, void* user_data) {
+    if (!on_message) { return MU_ERR_INVALID_ARGUMENT; }
+    // Each message is reported as soon as it is processed, so only one is held at a time.
+    return guardedUnlocking(session, [&](Session& s, std::unique_lock<std::mutex>& lock) {
+        return s.pullMessages([&](const IncomingMessage& msg) {
+            lock.unlock();
+            reportMessage(msg, on_message, user_data);
+            lock.lock();
+        });
+    });
+}
+
+mu_status mu_stream_open(mu_session* session, const char* username, uint32_t* out_stream_id, int* out_live) {
+    if (!username || !out_stream_id) { return MU_ERR_INVALID_ARGUMENT; }
+    return guarded(session, [&](Session& s) {
+        bool live = false;
+        SessionStatus status = s.openStream(username, *out_stream_id, live);
+        if (out_live) {
+            *out_live = live ? 1 : 0;
+        }
+        return status;
+    });
+}
+
+mu_status mu_stream_write(mu_session* session, uint32_t stream_id, const uint8_t* data, size_t size) {
+    if (!data && size > 0) { return MU_ERR_INVALID_ARGUMENT; }
+    return guarded(session, [&](Session& s) {
+        return s.writeStream(stream_id, std::vector<uint8_t>(data, data + size));
+    });
+}
+
+mu_status mu_stream_close(mu_session* session, uint32_t stream_id) {
+    return guarded(session, [&](Session& s) { return s.closeStream(stream_id); });
+}
+
+mu_status mu_wait_streams(mu_session* session, uint32_t timeout_ms, mu_stream_cb on_event, void* user_data) {
+    if (!on_event) { return MU_ERR_INVALID_ARGUMENT; }
+    return guardedUnlocking(session, [&](Session& s, std::unique_lock<std::mutex>& lock) {
+        return s.waitForStreams(toStreamCallback(on_event, user_data, lock), std::chrono::milliseconds(timeout_ms));
+    });
+}
+
+mu_status mu_watch_presence(mu_session* session, const char* const* usernames, size_t count, mu_presence_cb on_change, void* user_data) {
+    if ((count > 0 && !usernames) || !on_change) { return MU_ERR_INVALID_ARGUMENT; }
+    std::vector<std::string> names;
+    names.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (!usernames[i]) { return MU_ERR_INVALID_ARGUMENT; }
+        names.emplace_back(usernames[i]);
+    }
+    return guardedUnlocking(session, [&](Session& s, std::unique_lock<std::mutex>& lock) {
+        return s.watchPresence(names, toPresenceCallback(on_change, user_data, lock));
+    });
+}
+
+mu_status mu_wait_events(mu_session* session, uint32_t timeout_ms, mu_stream_cb on_stream, mu_presence_cb on_presence, void* user_data) {
+    return guardedUnlocking(session, [&](Session& s, std::unique_lock<std::mutex>& lock) {
+        return s.waitForEvents(toStreamCallback(on_stream, user_data, lock), toPresenceCallback(on_presence, user_data, lock),
+            std::chrono::milliseconds(timeout_ms));
+    });
+}
+
+mu_status mu_set_contact_cache_size(mu_session* session, size_t capacity) {
+    return guarded(session, [&](Session& s) {
+        s.setContactCacheSize(capacity);
+        return SessionStatus::OK;
+    });
+}
+
+mu_status mu_memory_stats(mu_memory_subsystem subsystem, mu_memory_usage* out) {
+    if (!out || out->struct_size < sizeof(mu_memory_usage) || subsystem < MU_MEMORY_TRANSPORT || subsystem > MU_MEMORY_TOTAL) {
+        return MU_ERR_INVALID_ARGUMENT;
+    }
+    MemoryUsage usage = subsystem == MU_MEMORY_TOTAL ? MemoryStats::total() : MemoryStats::usage(static_cast<MemorySubsystem>(subsystem));
+    out->live_bytes = usage.liveBytes;
+    out->peak_bytes = usage.peakBytes;
+    out->allocations = usage.allocations;
+    return MU_OK;
+}
+
+void mu_memory_reset_peaks(void) {
+    MemoryStats::resetPeaks();
+}
+
+void mu_memory_set_budget(uint64_t bytes) {
+    MemoryStats::setBudget(bytes);
+}
+
+mu_status mu_log_set_level(mu_log_level level) {
+    if (level < MU_LOG_TRACE || level > MU_LOG_OFF) {
+        return MU_ERR_INVALID_ARGUMENT;
+    }
+    Logger::setLevel(static_cast<LogLevel>(level));
+    return MU_OK;
+}
+
+mu_status mu_log_set_file(const char* path) {
+    return Logger::setFile(path ? path : "") ? MU_OK : MU_ERR_FILE;
+}
+
+void mu_log_flush(void) {
+    Logger::flush();
+}
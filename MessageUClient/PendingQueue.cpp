@@ -0,0 +1,148 @@
+// PendingQueue.cpp
+// author: Ariel Cohen ID: 329599187
+
+#include "PendingQueue.h"
+#include "FileHandler.h"
+#include "Logger.h"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+
+namespace {
+
+/**
+ * @brief Parses the name of a parked message's file, "<messageID>_<type>" without its extension.
+ * @param stem The file name without its extension.
+ * @param messageID Receives the message ID.
+ * @param type Receives the message type.
+ * @return False if the name is not of that form, e.g. a file not written by park().
+ */
+bool parseFileName(const std::string& stem, uint32_t& messageID, MessageType& type) {
+    size_t sep = stem.find('_');
+    if (sep == std::string::npos) {
+        return false;
+    }
+    const char* end = stem.data() + stem.size();
+    auto id = std::from_chars(stem.data(), stem.data() + sep, messageID);
+    uint8_t typeValue;
+    auto parsedType = std::from_chars(stem.data() + sep + 1, end, typeValue);
+    if (id.ec != std::errc() || id.ptr != stem.data() + sep || parsedType.ec != std::errc() || parsedType.ptr != end) {
+        return false;
+    }
+    type = static_cast<MessageType>(typeValue);
+    return true;
+}
+
+} // namespace
+
+/**
+ * @brief Constructs a pending queue rooted at the given directory.
+ * @param directory The directory in which parked messages are stored.
+ */
+PendingQueue::PendingQueue(const std::string& directory) : _directory(directory) {}
+
+/**
+ * @brief Returns the directory holding the parked messages of a sender.
+ * @param senderID The UUID of the sender.
+ * @return The path of the sender's directory.
+ */
+std::string PendingQueue::senderDirectory(const std::vector<uint8_t>& senderID) const {
+    return (boost::filesystem::path(_directory) / FileHandler::bytesToHex(senderID)).string();
+}
+
+/**
+ * @brief Parks an undecryptable message for later.
+ * Each message is stored in its own file named "<messageID>_<type>.msg".
+ * @param senderID The UUID of the sender.
+ * @param messageID The server-side message ID.
+ * @param type The message type.
+ * @param content The encrypted content, copied to disk a chunk at a time.
+ * @return True if the message was parked, false if the sender's queue is full or the write failed.
+ */
+bool PendingQueue::park(const std::vector<uint8_t>& senderID, uint32_t messageID, MessageType type, const ContentSource& content) {
+    boost::system::error_code ec;
+    boost::filesystem::path dir(senderDirectory(senderID));
+    boost::filesystem::create_directories(dir, ec);
+    if (ec) {
+        return false;
+    }
+
+    // Enforce the per-sender bounds before writing anything.
+    size_t messages = 0;
+    uint64_t bytes = 0;
+    for (const auto& entry : boost::filesystem::directory_iterator(dir, ec)) {
+        if (boost::filesystem::is_regular_file(entry.path())) {
+            messages++;
+            bytes += boost::filesystem::file_size(entry.path(), ec);
+        }
+    }
+    if (messages >= MAX_PENDING_PER_SENDER || bytes + content.size() > MAX_PENDING_BYTES_PER_SENDER) {
+        return false;
+    }
+
+    std::string filename = std::to_string(messageID) + "_" + std::to_string(static_cast<int>(type)) + ".msg";
+    std::ofstream file((dir / filename).string(), std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    bool written = content.forEachChunk([&file](const uint8_t* data, size_t size) {
+        return static_cast<bool>(file.write(reinterpret_cast<const char*>(data), size));
+    });
+    file.close();
+    if (!written || !file) {
+        boost::filesystem::remove(dir / filename, ec);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Returns all messages parked for a sender, ordered by message ID.
+ * The content stays on disk until clear() is called, so parked messages of any size can be
+ * decrypted without loading them, and are not lost if the client stops halfway through.
+ * @param senderID The UUID of the sender.
+ * Files in the sender's directory whose names park() would not have written are skipped.
+ * @return The parked messages, empty if there are none.
+ */
+std::vector<PendingMessage> PendingQueue::messages(const std::vector<uint8_t>& senderID) const {
+    std::vector<PendingMessage> messages;
+    boost::system::error_code ec;
+    boost::filesystem::path dir(senderDirectory(senderID));
+    if (!boost::filesystem::is_directory(dir, ec)) {
+        return messages;
+    }
+
+    for (const auto& entry : boost::filesystem::directory_iterator(dir, ec)) {
+        const auto& path = entry.path();
+        if (path.extension() != ".msg") {
+            continue;
+        }
+        // The file name encodes the message ID and type: "<messageID>_<type>".
+        PendingMessage msg;
+        if (!parseFileName(path.stem().string(), msg.messageID, msg.type)) {
+            LOG_WARN("session", "Skipping a file that is not a parked message", logField("path", path.string()));
+            continue;
+        }
+        uint64_t size = boost::filesystem::file_size(path, ec);
+        if (ec) {
+            continue;
+        }
+        msg.path = path.string();
+        msg.size = size;
+        messages.push_back(std::move(msg));
+    }
+
+    std::sort(messages.begin(), messages.end(),
+        [](const PendingMessage& a, const PendingMessage& b) { return a.messageID < b.messageID; });
+    return messages;
+}
+
+/**
+ * @brief Removes all messages parked for a sender.
+ * @param senderID The UUID of the sender.
+ */
+void PendingQueue::clear(const std::vector<uint8_t>& senderID) {
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(senderDirectory(senderID), ec);
+}
@@ -0,0 +1,69 @@
+// PendingQueue.h
+// author: Ariel Cohen ID: 329599187
+
+#pragma once
+#include "Protocol.h"
+#include "Spool.h"
+#include <string>
+#include <vector>
+
+constexpr size_t MAX_PENDING_PER_SENDER = 256;                       ///< Max parked messages kept for a single sender.
+constexpr uint64_t MAX_PENDING_BYTES_PER_SENDER = 64ULL * 1024 * 1024; ///< Max bytes of parked content kept for a single sender.
+
+/**
+ * @brief A message that could not be decrypted when it was pulled and was parked on disk.
+ */
+struct PendingMessage {
+    uint32_t messageID;           ///< The server-side message ID, used to keep the original order.
+    MessageType type;             ///< The type as received, MESSAGE_SEQUENCED included.
+    std::string path;             ///< The file holding the encrypted content, exactly as received.
+    uint64_t size;                ///< The size of the content.
+
+    /**
+     * @brief Returns the content, which stays in its file.
+     */
+    ContentSource content() const { return ContentSource::file(path, 0, size); }
+};
+
+/**
+ * @brief A bounded, disk-backed queue of messages waiting for their sender's symmetric key.
+ * The server deletes messages once they are pulled, so messages that arrive before the key
+ * are parked here (one directory per sender) instead of being lost.
+ */
+class PendingQueue {
+public:
+    /**
+     * @brief Constructs a pending queue rooted at the given directory.
+     * @param directory The directory in which parked messages are stored.
+     */
+    explicit PendingQueue(const std::string& directory = "pending");
+
+    /**
+     * @brief Parks an undecryptable message for later.
+     * @param senderID The UUID of the sender.
+     * @param messageID The server-side message ID.
+     * @param type The message type.
+     * @param content The encrypted content, copied to disk a chunk at a time.
+     * @return True if the message was parked, false if the sender's queue is full or the write failed.
+     */
+    bool park(const std::vector<uint8_t>& senderID, uint32_t messageID, MessageType type, const ContentSource& content);
+
+    /**
+     * @brief Returns all messages parked for a sender, ordered by message ID, leaving them on disk.
+     * @param senderID The UUID of the sender.
+     * @return The parked messages, empty if there are none.
+     */
+    std::vector<PendingMessage> messages(const std::vector<uint8_t>& senderID) const;
+
+    /**
+     * @brief Removes all messages parked for a sender, e.g. once they have been decrypted.
+     * @param senderID The UUID of the sender.
+     */
+    void clear(const std::vector<uint8_t>& senderID);
+
+private:
+    // Returns the directory holding the parked messages of a sender.
+    std::string senderDirectory(const std::vector<uint8_t>& senderID) const;
+
+    std::string _directory; // root directory of the queue
+};
@@ -11,11 +11,44 @@
 
 // --- Protocol Constants ---
 
-constexpr uint8_t CLIENT_VERSION = 2;        ///< Current client version. V2 supports file transfer.
+constexpr uint8_t CLIENT_VERSION = 3;        ///< Current client version. V2 supports file transfer, V3 compact framing.
 constexpr size_t CLIENT_ID_SIZE = 16;        ///< 128-bit UUID for each client.
 constexpr size_t USERNAME_SIZE = 255;        ///< Max length for a client's username.
 constexpr size_t PUBLIC_KEY_SIZE = 160;      ///< 1024-bit RSA public key in X.509 format.
 constexpr size_t SYM_KEY_SIZE = 16;          ///< 128-bit AES symmetric key.
+constexpr uint16_t CLIENT_MAX_BATCH = 1000;  ///< Max messages per pull response the client asks for in HELLO.
+constexpr size_t FILE_ID_SIZE = 16;          ///< Random ID naming a FILE_CHUNKED transfer.
+constexpr size_t CHUNK_MAC_SIZE = 32;        ///< HMAC-SHA256 of a FILE_CHUNKED chunk or manifest.
+constexpr uint8_t FILE_MANIFEST_VERSION = 2; ///< Layout of the FILE_CHUNKED manifest. V2 adds the sequence number.
+constexpr uint8_t MESSAGE_SEQUENCED = 0x80;  ///< Set in the type of a TEXT_MESSAGE or FILE_SEND whose plaintext starts with a SequenceHeader.
+constexpr uint8_t BUNDLE_VERSION = 1;             ///< Layout of the FILE_BUNDLE index.
+constexpr size_t MAX_BUNDLE_PATH_SIZE = 1024;     ///< Max length of a file's path within a FILE_BUNDLE.
+constexpr uint32_t MAX_BUNDLE_ENTRIES = 1u << 20; ///< Max files in a FILE_BUNDLE.
+
+// --- Capabilities ---
+// Bits exchanged in HELLO. A feature is used on a connection only if both sides set its bit.
+
+constexpr uint32_t CAP_PERSISTENT_CONNECTION = 1u << 0; ///< Many requests may be sent over one connection.
+constexpr uint32_t CAP_STREAMS = 1u << 1;               ///< Streams may be opened, and live streams are pushed to this connection.
+constexpr uint32_t CAP_PRESENCE = 1u << 2;              ///< Presence changes of subscribed clients are pushed to this connection.
+constexpr uint32_t CAP_CLIENT_LOOKUP = 1u << 3;         ///< Single clients may be looked up by ID or name instead of listing them all.
+constexpr uint32_t CAP_COMPACT_FRAMING = 1u << 4;       ///< Frames after the HELLO exchange have compact (v3) headers, see below.
+constexpr uint32_t CLIENT_CAPABILITIES = CAP_PERSISTENT_CONNECTION | CAP_STREAMS | CAP_PRESENCE | CAP_CLIENT_LOOKUP | CAP_COMPACT_FRAMING; ///< Everything this client implements.
+
+// --- Compact (v3) Framing ---
+// Once CAP_COMPACT_FRAMING is negotiated, every frame after the HELLO response, in both directions,
+// starts with a compact header instead of RequestHeader / ResponseHeader. Numbers are unsigned
+// LEB128 varints (7 bits per byte, low bits first, the high bit set on all but the last byte):
+//     request:  varint(code << 1 | bind), clientID[CLIENT_ID_SIZE] if bind is 1, varint(payloadSize)
+//     response: varint(code), varint(payloadSize)
+// The client ID is bound to the connection: it is the one in the HELLO request's header until a
+// request with bind set replaces it, so it is only sent again when it changes (after registering).
+// The version is the one of the HELLO exchange. A small SEND_MESSAGE has a 3-byte header instead
+// of 23, and its response a 3-byte header instead of 7.
+
+constexpr size_t MAX_VARINT_SIZE = 5; ///< Bytes of a varint holding a 32-bit value.
+constexpr size_t MAX_COMPACT_REQUEST_HEADER_SIZE = 2 * MAX_VARINT_SIZE + CLIENT_ID_SIZE; ///< Largest compact request header.
+constexpr size_t MAX_COMPACT_RESPONSE_HEADER_SIZE = 2 * MAX_VARINT_SIZE; ///< Largest compact response header.
 
 // --- Protocol Codes ---
 
@@ -28,6 +61,12 @@ enum class RequestCode : uint16_t {
     PUBLIC_KEY = 1102,        ///< Request for a specific user's public key.
     SEND_MESSAGE = 1103,      ///< Send a message to another client (via the server).
     PULL_MESSAGES = 1104,     ///< Request to pull all waiting messages.
+    HELLO = 1105,             ///< Capability negotiation, sent once per connection.
+    STREAM_OPEN = 1106,       ///< Open a stream to another client.
+    STREAM_DATA = 1107,       ///< One chunk of an open stream; the server sends no response.
+    STREAM_CLOSE = 1108,      ///< Close a stream.
+    PRESENCE_SUBSCRIBE = 1109, ///< Replace the set of clients whose presence is pushed to this connection.
+    CLIENT_LOOKUP = 1110,     ///< Request for one client, by ID or by name, with its public key.
 };
 
 /**
@@ -39,6 +78,13 @@ enum class ResponseCode : uint16_t {
     PUBLIC_KEY = 2102,           ///< Response containing a user's public key.
     MESSAGE_SENT = 2103,         ///< Confirmation that a message was received by the server.
     PULL_MESSAGES = 2104,        ///< Response containing waiting messages.
+    HELLO = 2105,                ///< Response containing the negotiated capabilities.
+    STREAM_OPENED = 2106,        ///< A stream was opened, with its ID and delivery mode.
+    STREAM_CLOSED = 2107,        ///< A stream was closed, with the number of chunks received.
+    STREAM_PUSH = 2108,          ///< Sent unsolicited to the recipient of a live stream.
+    PRESENCE = 2109,             ///< The current presence of the clients just subscribed to.
+    PRESENCE_PUSH = 2110,        ///< Sent unsolicited: presence changes of subscribed clients since the last push.
+    CLIENT_INFO = 2111,          ///< Response containing one client and its public key.
     GENERAL_ERROR = 9000,        ///< A generic error response.
 };
 
@@ -50,6 +96,29 @@ enum class MessageType : uint8_t {
     SYM_KEY_SEND = 2,       ///< A message containing a symmetric key.
     TEXT_MESSAGE = 3,       ///< A standard text message.
     FILE_SEND = 4,          ///< A message containing file content.
+    STREAM = 5,             ///< The chunks of a stream whose recipient was offline, stored as one message.
+    FILE_CHUNKED = 6,       ///< A large file: a manifest of authenticated chunk MACs, then separately encrypted chunks.
+    FILE_CHUNK_REQUEST = 7, ///< Asks the sender of a FILE_CHUNKED message to send some of its chunks again.
+    FILE_BUNDLE = 8,        ///< A directory: an index of its files, then their contents, encrypted as one stream.
+};
+
+/**
+ * @brief How the chunks of a stream reach the recipient.
+ */
+enum class StreamDelivery : uint8_t {
+    LIVE = 1,   ///< Relayed as they arrive to the recipient's open connection.
+    STORED = 2, ///< Collected and stored as one STREAM message when the stream is closed.
+};
+
+/**
+ * @brief The events pushed to the recipient of a live stream.
+ */
+enum class StreamEventType : uint8_t {
+    OPEN = 1,   ///< A stream was opened.
+    DATA = 2,   ///< A chunk of the stream.
+    CLOSE = 3,  ///< The sender closed the stream.
+    ABORT = 4,  ///< The sender disconnected without closing the stream.
+    STORED = 5, ///< The rest of the stream will be delivered as a STREAM message.
 };
 
 // Use pragma pack to ensure structs are packed without padding.
@@ -94,6 +163,15 @@ struct PublicKeyRequest {
     uint8_t clientID[CLIENT_ID_SIZE];
 };
 
+/**
+ * @brief Payload for a client lookup request (1110).
+ * The client is looked up by ID, or by name if the ID is all zeros.
+ */
+struct ClientLookupRequest {
+    uint8_t clientID[CLIENT_ID_SIZE];
+    char name[USERNAME_SIZE];
+};
+
 /**
  * @brief Header part of the payload for a send-message request (1103).
  * The actual encrypted content follows this header in the payload.
@@ -104,6 +182,32 @@ struct SendMessageHeader {
     uint32_t contentSize;
 };
 
+/**
+ * @brief Payload of a HELLO request (1105) and of its response (2105).
+ * The request carries the client's capabilities and limits; the response carries the
+ * negotiated capabilities (the intersection) and the limits the server enforces.
+ */
+struct HelloPayload {
+    uint32_t capabilities; ///< CAP_* bits.
+    uint32_t maxFrameSize; ///< Largest payload the sender accepts.
+    uint16_t maxBatch;     ///< Max messages per pull response.
+};
+
+/**
+ * @brief Payload for a stream open request (1106).
+ */
+struct StreamOpenRequest {
+    uint8_t clientID[CLIENT_ID_SIZE]; ///< The recipient's ID.
+};
+
+/**
+ * @brief Payload of a stream close request (1108), and header of a stream data request (1107).
+ * For stream data, the encrypted chunk follows this header.
+ */
+struct StreamRequestHeader {
+    uint32_t streamID;
+};
+
 // --- Response Payload Structures ---
 
 /**
@@ -130,6 +234,15 @@ struct PublicKeyResponse {
     uint8_t publicKey[PUBLIC_KEY_SIZE];
 };
 
+/**
+ * @brief Payload for a client lookup response (2111).
+ */
+struct ClientLookupResponse {
+    uint8_t clientID[CLIENT_ID_SIZE];
+    char name[USERNAME_SIZE];
+    uint8_t publicKey[PUBLIC_KEY_SIZE];
+};
+
 /**
  * @brief Payload for a message sent confirmation (2103).
  */
@@ -149,6 +262,110 @@ struct MessageHeader {
     uint32_t messageSize;
 };
 
+/**
+ * @brief Payload for a stream opened response (2106).
+ */
+struct StreamOpenedResponse {
+    uint32_t streamID;
+    StreamDelivery delivery;
+};
+
+/**
+ * @brief Payload for a stream closed response (2107).
+ * The message ID is that of the stored STREAM message, or 0 if every chunk was relayed live.
+ */
+struct StreamClosedResponse {
+    uint32_t streamID;
+    uint32_t chunkCount; ///< Chunks the server received.
+    uint32_t messageID;
+};
+
+/**
+ * @brief Header of a stream push (2108). For DATA events the encrypted chunk follows this header.
+ */
+struct StreamPushHeader {
+    uint8_t clientID[CLIENT_ID_SIZE]; ///< The sender's ID.
+    uint32_t streamID;
+    StreamEventType event;
+};
+
+/**
+ * @brief The presence of one client. Presence responses (2109) and pushes (2110) are a series of these;
+ * a presence subscription (1109) is a series of client IDs.
+ */
+struct PresenceEntry {
+    uint8_t clientID[CLIENT_ID_SIZE];
+    uint8_t online; ///< 1 if the client has an open connection, 0 otherwise.
+};
+
+/**
+ * @brief Precedes each chunk in the content of a stored STREAM message.
+ */
+struct StreamChunkHeader {
+    uint32_t chunkSize;
+};
+
+/**
+ * @brief Starts the content of a FILE_CHUNKED message.
+ * It is followed by entryCount FileManifestEntry, a CHUNK_MAC_SIZE MAC of the header and entries,
+ * and then the ciphertext of each listed chunk, in the order of the entries.
+ */
+struct FileManifestHeader {
+    uint8_t version;              ///< FILE_MANIFEST_VERSION.
+    uint8_t fileID[FILE_ID_SIZE]; ///< Names the file in FILE_CHUNK_REQUEST; the MACs are bound to it.
+    uint64_t fileSize;            ///< Plaintext size of the whole file.
+    uint32_t chunkSize;           ///< Plaintext bytes per chunk; the last chunk may be shorter.
+    uint32_t entryCount;          ///< Chunks in this message: all of them, or those sent again.
+    uint64_t sequence;            ///< The file's number in its conversation; 0 when chunks are sent again.
+};
+
+/**
+ * @brief One chunk listed in a FILE_CHUNKED manifest.
+ */
+struct FileManifestEntry {
+    uint32_t index;               ///< The chunk's position in the file.
+    uint32_t size;                ///< The size of its ciphertext.
+    uint8_t mac[CHUNK_MAC_SIZE];  ///< HMAC-SHA256 of the file ID, the index and the ciphertext.
+};
+
+/**
+ * @brief Starts the plaintext of a FILE_CHUNK_REQUEST message; count chunk indexes (uint32_t) follow.
+ */
+struct FileChunkRequestHeader {
+    uint8_t fileID[FILE_ID_SIZE]; ///< The file, as named by its manifest.
+    uint32_t count;               ///< The number of chunks asked for.
+};
+
+/**
+ * @brief Starts the plaintext of a FILE_BUNDLE, after its SequenceHeader.
+ * It is followed by entryCount BundleEntry, each followed by its path, and then the contents of
+ * the files, back to back in the order of the entries.
+ */
+struct BundleHeader {
+    uint8_t version;     ///< BUNDLE_VERSION.
+    uint32_t entryCount; ///< The number of files.
+};
+
+/**
+ * @brief One file listed in a FILE_BUNDLE index.
+ * It is followed by pathSize bytes of the file's path relative to the directory sent: UTF-8,
+ * components separated by '/', none of them empty, "." or "..". Entries are in ascending order
+ * of their paths' bytes, so no path is listed twice.
+ */
+struct BundleEntry {
+    uint64_t size;     ///< The size of the file.
+    uint16_t pathSize; ///< The length of the path that follows.
+};
+
+/**
+ * @brief Starts the plaintext of a TEXT_MESSAGE or FILE_SEND sent with MESSAGE_SEQUENCED.
+ * Messages sent under one symmetric key are numbered from 1, separately in each direction, so
+ * the recipient can drop duplicates and notice gaps; a new key starts a new conversation.
+ */
+struct SequenceHeader {
+    uint64_t sequence; ///< The message's number in its conversation.
+};
+
 #pragma pack(pop)
 
 // --- In-Memory Helper Structures ---
@@ -0,0 +1,354 @@
+// ProtocolCodec.cpp
+// author: Ariel Cohen ID: 329599187
+
+#include "ProtocolCodec.h"
+#include <algorithm>
+#include <cstring>
+
+/**
+ * @brief Encodes a registration request (1100).
+ * @param username The name to register; truncated to fit the protocol field.
+ * @param publicKey The X.509 encoded public key.
+ * @return The request payload.
+ */
+std::vector<uint8_t> ProtocolCodec::encodeRegistration(const std::string& username, const std::vector<uint8_t>& publicKey) {
+    RegistrationRequest req{};
+    // Leave room for the terminating null character.
+    memcpy(req.name, username.data(), std::min(username.size(), sizeof(req.name) - 1));
+    std::copy_n(publicKey.begin(), std::min(publicKey.size(), PUBLIC_KEY_SIZE), req.publicKey);
+
+    std::vector<uint8_t> payload(sizeof(req));
+    memcpy(payload.data(), &req, sizeof(req));
+    return payload;
+}
+
+/**
+ * @brief Encodes a public key request (1102).
+ * @param clientID The UUID of the client whose key is requested.
+ * @return The request payload.
+ */
+std::vector<uint8_t> ProtocolCodec::encodePublicKeyRequest(const std::vector<uint8_t>& clientID) {
+    PublicKeyRequest req{};
+    std::copy_n(clientID.begin(), std::min(clientID.size(), CLIENT_ID_SIZE), req.clientID);
+
+    std::vector<uint8_t> payload(sizeof(req));
+    memcpy(payload.data(), &req, sizeof(req));
+    return payload;
+}
+
+/**
+ * @brief Encodes a client lookup request (1110).
+ * @param clientID The UUID of the client, or empty to look the client up by name.
+ * @param name The client's name; ignored if clientID is given.
+ * @return The request payload.
+ */
+std::vector<uint8_t> ProtocolCodec::encodeClientLookup(const std::vector<uint8_t>& clientID, const std::string& name) {
+    ClientLookupRequest req{};
+    if (!clientID.empty()) {
+        std::copy_n(clientID.begin(), std::min(clientID.size(), CLIENT_ID_SIZE), req.clientID);
+    }
+    else {
+        // Leave room for the terminating null character.
+        memcpy(req.name, name.data(), std::min(name.size(), sizeof(req.name) - 1));
+    }
+
+    std::vector<uint8_t> payload(sizeof(req));
+    memcpy(payload.data(), &req, sizeof(req));
+    return payload;
+}
+
+/**
+ * @brief Encodes a send-message request (1103): a SendMessageHeader followed by the content.
+ * @param recipientID The recipient's UUID.
+ * @param type The message type.
+ * @param content The (already encrypted) content; may be empty.
+ * @return The request payload.
+ */
+std::vector<uint8_t> ProtocolCodec::encodeSendMessage(const std::vector<uint8_t>& recipientID, MessageType type, const std::vector<uint8_t>& content) {
+    SendMessageHeader msgHeader{};
+    std::copy_n(recipientID.begin(), std::min(recipientID.size(), CLIENT_ID_SIZE), msgHeader.clientID);
+    msgHeader.type = type;
+    msgHeader.contentSize = static_cast<uint32_t>(content.size());
+
+    std::vector<uint8_t> payload(sizeof(msgHeader) + content.size());
+    memcpy(payload.data(), &msgHeader, sizeof(msgHeader));
+    if (!content.empty()) {
+        memcpy(payload.data() + sizeof(msgHeader), content.data(), content.size());
+    }
+    return payload;
+}
+
+/**
+ * @brief Encodes a stream open request (1106).
+ * @param recipientID The recipient's UUID.
+ * @return The request payload.
+ */
+std::vector<uint8_t> ProtocolCodec::encodeStreamOpen(const std::vector<uint8_t>& recipientID) {
+    StreamOpenRequest req{};
+    std::copy_n(recipientID.begin(), std::min(recipientID.size(), CLIENT_ID_SIZE), req.clientID);
+
+    std::vector<uint8_t> payload(sizeof(req));
+    memcpy(payload.data(), &req, sizeof(req));
+    return payload;
+}
+
+/**
+ * @brief Encodes a stream data request (1107): a StreamRequestHeader followed by the chunk.
+ * @param streamID The stream ID.
+ * @param chunk The (already encrypted) chunk.
+ * @return The request payload.
+ */
+std::vector<uint8_t> ProtocolCodec::encodeStreamData(uint32_t streamID, const std::vector<uint8_t>& chunk) {
+    StreamRequestHeader header{ streamID };
+    std::vector<uint8_t> payload(sizeof(header) + chunk.size());
+    memcpy(payload.data(), &header, sizeof(header));
+    if (!chunk.empty()) {
+        memcpy(payload.data() + sizeof(header), chunk.data(), chunk.size());
+    }
+    return payload;
+}
+
+/**
+ * @brief Encodes a stream close request (1108).
+ * @param streamID The stream ID.
+ * @return The request payload.
+ */
+std::vector<uint8_t> ProtocolCodec::encodeStreamClose(uint32_t streamID) {
+    StreamRequestHeader req{ streamID };
+    std::vector<uint8_t> payload(sizeof(req));
+    memcpy(payload.data(), &req, sizeof(req));
+    return payload;
+}
+
+/**
+ * @brief Encodes a presence subscription (1109): the UUIDs of the clients to watch, back to back.
+ * @param clientIDs The UUIDs of the clients to watch; replaces any earlier subscription.
+ * @return The request payload.
+ */
+std::vector<uint8_t> ProtocolCodec::encodePresenceSubscribe(const std::vector<std::vector<uint8_t>>& clientIDs) {
+    std::vector<uint8_t> payload(clientIDs.size() * CLIENT_ID_SIZE);
+    for (size_t i = 0; i < clientIDs.size(); ++i) {
+        std::copy_n(clientIDs[i].begin(), std::min(clientIDs[i].size(), CLIENT_ID_SIZE), payload.begin() + i * CLIENT_ID_SIZE);
+    }
+    return payload;
+}
+
+/**
+ * @brief Encodes a HELLO request (1105).
+ * @param capabilities The CAP_* bits the client implements.
+ * @param maxFrameSize The largest response payload the client accepts.
+ * @param maxBatch The largest number of messages the client wants per pull response.
+ * @return The request payload.
+ */
+std::vector<uint8_t> ProtocolCodec::encodeHello(uint32_t capabilities, uint32_t maxFrameSize, uint16_t maxBatch) {
+    HelloPayload hello{ capabilities, maxFrameSize, maxBatch };
+    std::vector<uint8_t> payload(sizeof(hello));
+    memcpy(payload.data(), &hello, sizeof(hello));
+    return payload;
+}
+
+/**
+ * @brief Decodes a HELLO response (2105).
+ * @param payload The response payload.
+ * @return The negotiated capabilities and server limits, or std::nullopt if the payload is malformed.
+ */
+std::optional<HelloPayload> ProtocolCodec::decodeHello(const std::vector<uint8_t>& payload) {
+    if (payload.size() != sizeof(HelloPayload)) {
+        return std::nullopt;
+    }
+    HelloPayload hello;
+    memcpy(&hello, payload.data(), sizeof(hello));
+    return hello;
+}
+
+/**
+ * @brief Decodes a registration success response (2100).
+ * @param payload The response payload.
+ * @return The new client ID, or std::nullopt if the payload is malformed.
+ */
+std::optional<std::vector<uint8_t>> ProtocolCodec::decodeRegistration(const std::vector<uint8_t>& payload) {
+    if (payload.size() != sizeof(RegistrationSuccessResponse)) {
+        return std::nullopt;
+    }
+    const auto* resp = reinterpret_cast<const RegistrationSuccessResponse*>(payload.data());
+    return std::vector<uint8_t>(resp->clientID, resp->clientID + CLIENT_ID_SIZE);
+}
+
+/**
+ * @brief Decodes a clients list response (2101), a series of ClientInfoResponse entries.
+ * @param payload The response payload.
+ * @return The listed clients (without keys); a trailing partial entry is ignored.
+ */
+std::vector<ClientInfo> ProtocolCodec::decodeClientsList(const std::vector<uint8_t>& payload) {
+    std::vector<ClientInfo> clients;
+    size_t entrySize = sizeof(ClientInfoResponse);
+    clients.reserve(payload.size() / entrySize);
+    for (size_t i = 0; i + entrySize <= payload.size(); i += entrySize) {
+        const auto* info = reinterpret_cast<const ClientInfoResponse*>(payload.data() + i);
+        ClientInfo client;
+        client.id.assign(info->clientID, info->clientID + CLIENT_ID_SIZE);
+        // The name is null padded but not necessarily null terminated.
+        client.name = std::string(info->name, strnlen(info->name, USERNAME_SIZE));
+        clients.push_back(std::move(client));
+    }
+    return clients;
+}
+
+/**
+ * @brief Decodes a public key response (2102).
+ * @param payload The response payload.
+ * @return The public key, or std::nullopt if the payload is malformed.
+ */
+std::optional<std::vector<uint8_t>> ProtocolCodec::decodePublicKey(const std::vector<uint8_t>& payload) {
+    if (payload.size() != sizeof(PublicKeyResponse)) {
+        return std::nullopt;
+    }
+    const auto* resp = reinterpret_cast<const PublicKeyResponse*>(payload.data());
+    return std::vector<uint8_t>(resp->publicKey, resp->publicKey + PUBLIC_KEY_SIZE);
+}
+
+/**
+ * @brief Decodes a client lookup response (2111).
+ * @param payload The response payload.
+ * @return The client with its public key, or std::nullopt if the payload is malformed.
+ */
+std::optional<ClientInfo> ProtocolCodec::decodeClientInfo(const std::vector<uint8_t>& payload) {
+    if (payload.size() != sizeof(ClientLookupResponse)) {
+        return std::nullopt;
+    }
+    const auto* resp = reinterpret_cast<const ClientLookupResponse*>(payload.data());
+    ClientInfo client;
+    client.id.assign(resp->clientID, resp->clientID + CLIENT_ID_SIZE);
+    client.name = std::string(resp->name, strnlen(resp->name, USERNAME_SIZE));
+    client.publicKey.assign(resp->publicKey, resp->publicKey + PUBLIC_KEY_SIZE);
+    return client;
+}
+
+/**
+ * @brief Decodes a message sent confirmation (2103).
+ * @param payload The response payload.
+ * @return The server-side message ID, or std::nullopt if the payload is malformed.
+ */
+std::optional<uint32_t> ProtocolCodec::decodeMessageSent(const std::vector<uint8_t>& payload) {
+    if (payload.size() != sizeof(MessageSentResponse)) {
+        return std::nullopt;
+    }
+    return reinterpret_cast<const MessageSentResponse*>(payload.data())->messageID;
+}
+
+/**
+ * @brief Decodes a pull messages response (2104), a series of MessageHeader + content entries.
+ * @param payload The response payload.
+ * @return The pulled messages, or std::nullopt if the payload is truncated.
+ */
+std::optional<std::vector<PulledMessage>> ProtocolCodec::decodePulledMessages(const std::vector<uint8_t>& payload) {
+    std::vector<PulledMessage> messages;
+    size_t offset = 0;
+    while (offset < payload.size()) {
+        if (payload.size() - offset < sizeof(MessageHeader)) {
+            return std::nullopt;
+        }
+        const auto* header = reinterpret_cast<const MessageHeader*>(payload.data() + offset);
+        offset += sizeof(MessageHeader);
+        if (header->messageSize > payload.size() - offset) {
+            return std::nullopt;
+        }
+        PulledMessage msg;
+        msg.senderID.assign(header->clientID, header->clientID + CLIENT_ID_SIZE);
+        msg.messageID = header->messageID;
+        msg.type = header->type;
+        msg.content.assign(payload.data() + offset, payload.data() + offset + header->messageSize);
+        offset += header->messageSize;
+        messages.push_back(std::move(msg));
+    }
+    return messages;
+}
+
+/**
+ * @brief Decodes a stream opened response (2106).
+ * @param payload The response payload.
+ * @return The stream ID and delivery mode, or std::nullopt if the payload is malformed.
+ */
+std::optional<StreamOpenedResponse> ProtocolCodec::decodeStreamOpened(const std::vector<uint8_t>& payload) {
+    if (payload.size() != sizeof(StreamOpenedResponse)) {
+        return std::nullopt;
+    }
+    StreamOpenedResponse resp;
+    memcpy(&resp, payload.data(), sizeof(resp));
+    return resp;
+}
+
+/**
+ * @brief Decodes a stream closed response (2107).
+ * @param payload The response payload.
+ * @return The close confirmation, or std::nullopt if the payload is malformed.
+ */
+std::optional<StreamClosedResponse> ProtocolCodec::decodeStreamClosed(const std::vector<uint8_t>& payload) {
+    if (payload.size() != sizeof(StreamClosedResponse)) {
+        return std::nullopt;
+    }
+    StreamClosedResponse resp;
+    memcpy(&resp, payload.data(), sizeof(resp));
+    return resp;
+}
+
+/**
+ * @brief Decodes a stream push (2108), a StreamPushHeader followed by the chunk for DATA events.
+ * @param payload The push payload; consumed.
+ * @return The push, or std::nullopt if the payload is malformed.
+ */
+std::optional<StreamPush> ProtocolCodec::decodeStreamPush(std::vector<uint8_t>&& payload) {
+    if (payload.size() < sizeof(StreamPushHeader)) {
+        return std::nullopt;
+    }
+    const auto* header = reinterpret_cast<const StreamPushHeader*>(payload.data());
+    StreamPush push;
+    push.senderID.assign(header->clientID, header->clientID + CLIENT_ID_SIZE);
+    push.streamID = header->streamID;
+    push.event = header->event;
+    // Reuse the payload buffer for the chunk instead of copying it.
+    payload.erase(payload.begin(), payload.begin() + sizeof(StreamPushHeader));
+    push.content = std::move(payload);
+    return push;
+}
+
+/**
+ * @brief Decodes a presence response (2109) or push (2110), a series of PresenceEntry.
+ * @param payload The response payload.
+ * @return The presence of each listed client, or std::nullopt if the payload is malformed.
+ */
+std::optional<std::vector<PresenceUpdate>> ProtocolCodec::decodePresence(const std::vector<uint8_t>& payload) {
+    if (payload.size() % sizeof(PresenceEntry) != 0) {
+        return std::nullopt;
+    }
+    std::vector<PresenceUpdate> updates;
+    updates.reserve(payload.size() / sizeof(PresenceEntry));
+    for (size_t i = 0; i < payload.size(); i += sizeof(PresenceEntry)) {
+        const auto* entry = reinterpret_cast<const PresenceEntry*>(payload.data() + i);
+        updates.push_back({ std::vector<uint8_t>(entry->clientID, entry->clientID + CLIENT_ID_SIZE), entry->online != 0 });
+    }
+    return updates;
+}
+
+/**
+ * @brief Splits the content of a stored STREAM message, a series of StreamChunkHeader + chunk entries.
+ * @param content The message content.
+ * @return The encrypted chunks in order, or std::nullopt if the content is truncated.
+ */
+std::optional<std::vector<std::vector<uint8_t>>> ProtocolCodec::decodeStoredStream(const std::vector<uint8_t>& content) {
+    std::vector<std::vector<uint8_t>> chunks;
+    size_t offset = 0;
+    while (offset < content.size()) {
+        if (content.size() - offset < sizeof(StreamChunkHeader)) {
+            return std::nullopt;
+        }
+        const auto* header = reinterpret_cast<const StreamChunkHeader*>(content.data() + offset);
+        offset += sizeof(StreamChunkHeader);
+        if (header->chunkSize > content.size() - offset) {
+            return std::nullopt;
+        }
+        chunks.emplace_back(content.data() + offset, content.data() + offset + header->chunkSize);
+        offset += header->chunkSize;
+    }
+    return chunks;
+}
@@ -0,0 +1,174 @@
+// ProtocolCodec.h
+// author: Ariel Cohen ID: 329599187
+
+#pragma once
+#include "Protocol.h"
+#include <optional>
+
+/**
+ * @brief A message parsed from a pull response (2104), still encrypted.
+ */
+struct PulledMessage {
+    std::vector<uint8_t> senderID; ///< The sender's UUID.
+    uint32_t messageID;            ///< The server-side message ID.
+    MessageType type;              ///< The message type.
+    std::vector<uint8_t> content;  ///< The message content as sent.
+};
+
+/**
+ * @brief A stream push (2108) parsed from the server, still encrypted.
+ */
+struct StreamPush {
+    std::vector<uint8_t> senderID; ///< The sender's UUID.
+    uint32_t streamID;             ///< The server-assigned stream ID.
+    StreamEventType event;         ///< What happened to the stream.
+    std::vector<uint8_t> content;  ///< The encrypted chunk for DATA events, empty otherwise.
+};
+
+/**
+ * @brief The presence of one client, from a presence response (2109) or push (2110).
+ */
+struct PresenceUpdate {
+    std::vector<uint8_t> clientID; ///< The client's UUID.
+    bool online;                   ///< True if the client has an open connection.
+};
+
+/**
+ * @brief A static utility class that encodes request payloads and decodes response payloads.
+ * Like the ProtocolEngine it performs no I/O; it only converts between bytes and values.
+ */
+class ProtocolCodec {
+public:
+    /**
+     * @brief Encodes a registration request (1100).
+     * @param username The name to register; truncated to fit the protocol field.
+     * @param publicKey The X.509 encoded public key.
+     */
+    static std::vector<uint8_t> encodeRegistration(const std::string& username, const std::vector<uint8_t>& publicKey);
+
+    /**
+     * @brief Encodes a public key request (1102).
+     * @param clientID The UUID of the client whose key is requested.
+     */
+    static std::vector<uint8_t> encodePublicKeyRequest(const std::vector<uint8_t>& clientID);
+
+    /**
+     * @brief Encodes a client lookup request (1110).
+     * @param clientID The UUID of the client, or empty to look the client up by name.
+     * @param name The client's name; ignored if clientID is given.
+     */
+    static std::vector<uint8_t> encodeClientLookup(const std::vector<uint8_t>& clientID, const std::string& name);
+
+    /**
+     * @brief Encodes a send-message request (1103).
+     * @param recipientID The recipient's UUID.
+     * @param type The message type.
+     * @param content The (already encrypted) content; may be empty.
+     */
+    static std::vector<uint8_t> encodeSendMessage(const std::vector<uint8_t>& recipientID, MessageType type, const std::vector<uint8_t>& content);
+
+    /**
+     * @brief Encodes a stream open request (1106).
+     * @param recipientID The recipient's UUID.
+     */
+    static std::vector<uint8_t> encodeStreamOpen(const std::vector<uint8_t>& recipientID);
+
+    /**
+     * @brief Encodes a stream data request (1107).
+     * @param streamID The stream ID.
+     * @param chunk The (already encrypted) chunk.
+     */
+    static std::vector<uint8_t> encodeStreamData(uint32_t streamID, const std::vector<uint8_t>& chunk);
+
+    /**
+     * @brief Encodes a stream close request (1108).
+     * @param streamID The stream ID.
+     */
+    static std::vector<uint8_t> encodeStreamClose(uint32_t streamID);
+
+    /**
+     * @brief Encodes a presence subscription (1109).
+     * @param clientIDs The UUIDs of the clients to watch; replaces any earlier subscription.
+     */
+    static std::vector<uint8_t> encodePresenceSubscribe(const std::vector<std::vector<uint8_t>>& clientIDs);
+
+    /**
+     * @brief Encodes a HELLO request (1105).
+     * @param capabilities The CAP_* bits the client implements.
+     * @param maxFrameSize The largest response payload the client accepts.
+     * @param maxBatch The largest number of messages the client wants per pull response.
+     */
+    static std::vector<uint8_t> encodeHello(uint32_t capabilities, uint32_t maxFrameSize, uint16_t maxBatch);
+
+    /**
+     * @brief Decodes a HELLO response (2105).
+     * @return The negotiated capabilities and server limits, or std::nullopt if the payload is malformed.
+     */
+    static std::optional<HelloPayload> decodeHello(const std::vector<uint8_t>& payload);
+
+    /**
+     * @brief Decodes a registration success response (2100).
+     * @return The new client ID, or std::nullopt if the payload is malformed.
+     */
+    static std::optional<std::vector<uint8_t>> decodeRegistration(const std::vector<uint8_t>& payload);
+
+    /**
+     * @brief Decodes a clients list response (2101).
+     * @return The listed clients (without keys).
+     */
+    static std::vector<ClientInfo> decodeClientsList(const std::vector<uint8_t>& payload);
+
+    /**
+     * @brief Decodes a public key response (2102).
+     * @return The public key, or std::nullopt if the payload is malformed.
+     */
+    static std::optional<std::vector<uint8_t>> decodePublicKey(const std::vector<uint8_t>& payload);
+
+    /**
+     * @brief Decodes a client lookup response (2111).
+     * @return The client with its public key, or std::nullopt if the payload is malformed.
+     */
+    static std::optional<ClientInfo> decodeClientInfo(const std::vector<uint8_t>& payload);
+
+    /**
+     * @brief Decodes a message sent confirmation (2103).
+     * @return The server-side message ID, or std::nullopt if the payload is malformed.
+     */
+    static std::optional<uint32_t> decodeMessageSent(const std::vector<uint8_t>& payload);
+
+    /**
+     * @brief Decodes a pull messages response (2104).
+     * @return The pulled messages, or std::nullopt if the payload is truncated.
+     */
+    static std::optional<std::vector<PulledMessage>> decodePulledMessages(const std::vector<uint8_t>& payload);
+
+    /**
+     * @brief Decodes a stream opened response (2106).
+     * @return The stream ID and delivery mode, or std::nullopt if the payload is malformed.
+     */
+    static std::optional<StreamOpenedResponse> decodeStreamOpened(const std::vector<uint8_t>& payload);
+
+    /**
+     * @brief Decodes a stream closed response (2107).
+     * @return The close confirmation, or std::nullopt if the payload is malformed.
+     */
+    static std::optional<StreamClosedResponse> decodeStreamClosed(const std::vector<uint8_t>& payload);
+
+    /**
+     * @brief Decodes a stream push (2108).
+     * @return The push, or std::nullopt if the payload is malformed.
+     */
+    static std::optional<StreamPush> decodeStreamPush(std::vector<uint8_t>&& payload);
+
+    /**
+     * @brief Decodes a presence response (2109) or push (2110).
+     * @return The presence of each listed client, or std::nullopt if the payload is malformed.
+     */
+    static std::optional<std::vector<PresenceUpdate>> decodePresence(const std::vector<uint8_t>& payload);
+
+    /**
+     * @brief Splits the content of a stored STREAM message into its chunks.
+     * @return The encrypted chunks in order, or std::nullopt if the content is truncated.
+     */
+    static std::optional<std::vector<std::vector<uint8_t>>> decodeStoredStream(const std::vector<uint8_t>& content);
+};
@@ -0,0 +1,348 @@
+// ProtocolEngine.cpp
+// author: Ariel Cohen ID: 329599187
+
+#include "ProtocolEngine.h"
+#include "Logger.h"
+#include <algorithm>
+#include <cstring>
+
+static_assert(sizeof(ResponseHeader) <= MAX_COMPACT_RESPONSE_HEADER_SIZE, "the header buffer holds either framing");
+
+namespace {
+
+/**
+ * @brief Appends a LEB128 varint to a buffer.
+ */
+void appendVarint(std::vector<uint8_t>& buffer, uint32_t value) {
+    while (value >= 0x80) {
+        buffer.push_back(static_cast<uint8_t>(value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<uint8_t>(value));
+}
+
+/**
+ * @brief Decodes a LEB128 varint of at most MAX_VARINT_SIZE bytes.
+ * @param data The bytes; the varint starts at the first one.
+ * @param size The number of bytes.
+ * @param value Receives the value.
+ * @return The bytes the varint takes, 0 if it is not complete yet, or SIZE_MAX if it is too long.
+ */
+size_t decodeVarint(const uint8_t* data, size_t size, uint64_t& value) {
+    value = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (i == MAX_VARINT_SIZE) {
+            return SIZE_MAX;
+        }
+        value |= static_cast<uint64_t>(data[i] & 0x7F) << (7 * i);
+        if (!(data[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return size < MAX_VARINT_SIZE ? 0 : SIZE_MAX;
+}
+
+} // namespace
+
+/**
+ * @brief Constructs an engine with no requests in flight.
+ * @param maxPayloadSize Response payloads larger than this put the engine in the failed state.
+ */
+ProtocolEngine::ProtocolEngine(size_t maxPayloadSize) : _maxPayloadSize(maxPayloadSize) {}
+
+/**
+ * @brief Frames a request and appends it to the outgoing bytes.
+ * @param code The request code.
+ * @param payload The request payload.
+ * @param clientID The sender's client ID (empty for registration).
+ * @param sink Takes the payload of the response; nullptr to buffer it.
+ */
+void ProtocolEngine::sendRequest(RequestCode code, const std::vector<uint8_t>& payload, const std::vector<uint8_t>& clientID, PayloadSink* sink) {
+    beginRequest(code, payload.size(), clientID, sink);
+    appendPayload(payload.data(), payload.size());
+}
+
+/**
+ * @brief Frames a request header; its payload follows in appendPayload calls.
+ * @param code The request code.
+ * @param payloadSize The size of the whole payload.
+ * @param clientID The sender's client ID (empty for registration).
+ * @param sink Takes the payload of the response; nullptr to buffer it.
+ */
+void ProtocolEngine::beginRequest(RequestCode code, size_t payloadSize, const std::vector<uint8_t>& clientID, PayloadSink* sink) {
+    uint8_t id[CLIENT_ID_SIZE]{};
+    if (!clientID.empty()) {
+        std::copy_n(clientID.begin(), std::min(clientID.size(), CLIENT_ID_SIZE), id);
+    }
+    // Drop already written bytes before growing the buffer.
+    if (_outgoingOffset == _outgoing.size()) {
+        _outgoing.clear();
+        _outgoingOffset = 0;
+    }
+    appendHeader(code, payloadSize, id);
+    _outgoingCharge.update(_outgoing.capacity());
+    _requestRemaining = payloadSize;
+    if (expectsResponse(code)) {
+        _inFlight.push_back({code, sink});
+    }
+}
+
+/**
+ * @brief Appends a request header in the current framing to the outgoing bytes.
+ * A compact header carries the client ID only when it differs from the one bound to the
+ * connection, which it then replaces.
+ * @param code The request code.
+ * @param payloadSize The size of the whole payload.
+ * @param clientID The sender's client ID, CLIENT_ID_SIZE bytes.
+ */
+void ProtocolEngine::appendHeader(RequestCode code, size_t payloadSize, const uint8_t* clientID) {
+    bool bind = memcmp(clientID, _boundClientID, CLIENT_ID_SIZE) != 0;
+    memcpy(_boundClientID, clientID, CLIENT_ID_SIZE);
+    if (_compact) {
+        appendVarint(_outgoing, (static_cast<uint32_t>(code) << 1) | (bind ? 1u : 0u));
+        if (bind) {
+            _outgoing.insert(_outgoing.end(), clientID, clientID + CLIENT_ID_SIZE);
+        }
+        appendVarint(_outgoing, static_cast<uint32_t>(payloadSize));
+        return;
+    }
+    RequestHeader header{};
+    memcpy(header.clientID, clientID, CLIENT_ID_SIZE);
+    header.version = CLIENT_VERSION;
+    header.code = code;
+    header.payloadSize = static_cast<uint32_t>(payloadSize);
+    const auto* headerBytes = reinterpret_cast<const uint8_t*>(&header);
+    _outgoing.insert(_outgoing.end(), headerBytes, headerBytes + sizeof(header));
+}
+
+/**
+ * @brief Appends the next bytes of the payload announced by beginRequest to the outgoing bytes.
+ * @param data The bytes.
+ * @param size The number of bytes; at most requestPayloadRemaining().
+ */
+void ProtocolEngine::appendPayload(const uint8_t* data, size_t size) {
+    size = std::min(size, _requestRemaining);
+    if (size == 0) {
+        return;
+    }
+    if (_outgoingOffset == _outgoing.size()) {
+        _outgoing.clear();
+        _outgoingOffset = 0;
+    }
+    _outgoing.insert(_outgoing.end(), data, data + size);
+    _outgoingCharge.update(_outgoing.capacity());
+    _requestRemaining -= size;
+}
+
+/**
+ * @brief Marks bytes as written.
+ * Once everything is written a small buffer is kept for the next request, but the buffer of
+ * a large request (a file) is freed rather than held until the next large one.
+ * @param count The number of bytes the transport accepted.
+ */
+void ProtocolEngine::consumeOutgoing(size_t count) {
+    _outgoingOffset = std::min(_outgoingOffset + count, _outgoing.size());
+    if (_outgoingOffset == _outgoing.size()) {
+        if (_outgoing.capacity() > MAX_IDLE_OUTGOING_CAPACITY) {
+            _outgoing = std::vector<uint8_t>();
+        }
+        else {
+            _outgoing.clear();
+        }
+        _outgoingOffset = 0;
+        _outgoingCharge.update(_outgoing.capacity());
+    }
+}
+
+/**
+ * @brief Returns how many more bytes complete the current header or payload.
+ * @return The number of bytes still missing.
+ */
+size_t ProtocolEngine::bytesNeeded() const {
+    if (_inPayload) {
+        return _header.payloadSize - _payloadReceived;
+    }
+    if (!_compact) {
+        return sizeof(ResponseHeader) - _headerReceived;
+    }
+    // The length of a compact header is only known as it arrives: count each varint not yet
+    // complete as ending with its next byte, so a read never goes past the header.
+    uint64_t value;
+    size_t codeSize = decodeVarint(_headerBuffer, _headerReceived, value);
+    return codeSize == 0 ? 2 : 1;
+}
+
+/**
+ * @brief Feeds bytes read from the transport into the engine.
+ * The header is assembled in a fixed buffer and the payload is either passed on to the
+ * request's sink or appended directly to a buffer reserved for its announced size, so each
+ * byte is copied once.
+ * @param data The bytes read.
+ * @param size The number of bytes read.
+ */
+void ProtocolEngine::receive(const uint8_t* data, size_t size) {
+    while (size > 0 && !failed()) {
+        size_t take = std::min(size, bytesNeeded());
+        if (!_inPayload) {
+            memcpy(_headerBuffer + _headerReceived, data, take);
+            _headerReceived += take;
+            if (_compact ? decodeCompactHeader() : _headerReceived == sizeof(ResponseHeader)) {
+                onHeader();
+            }
+        }
+        else {
+            if (_sink) {
+                if (!_sink->write(data, take)) {
+                    _error = "Failed to store the response payload.";
+                    return;
+                }
+            }
+            else if (!_skipping) {
+                _payload.insert(_payload.end(), data, data + take);
+            }
+            _payloadReceived += take;
+            if (_payloadReceived == _header.payloadSize) {
+                onResponse();
+            }
+        }
+        data += take;
+        size -= take;
+    }
+}
+
+/**
+ * @brief Decodes the compact response header received so far. Once it is complete, it is
+ * rewritten at the start of _headerBuffer as a ResponseHeader, which onHeader reads.
+ * @return True if the header is complete; false if more bytes are needed or it is malformed (see failed()).
+ */
+bool ProtocolEngine::decodeCompactHeader() {
+    uint64_t code = 0;
+    uint64_t payloadSize = 0;
+    size_t codeSize = decodeVarint(_headerBuffer, _headerReceived, code);
+    size_t sizeSize = codeSize == 0 || codeSize == SIZE_MAX ? codeSize
+        : decodeVarint(_headerBuffer + codeSize, _headerReceived - codeSize, payloadSize);
+    if (codeSize == SIZE_MAX || sizeSize == SIZE_MAX || code > UINT16_MAX || payloadSize > UINT32_MAX) {
+        _error = "Malformed compact response header.";
+        return false;
+    }
+    if (sizeSize == 0) {
+        return false;
+    }
+    ResponseHeader header{};
+    header.version = 0; // Compact headers carry no version; it is the one of the HELLO exchange.
+    header.code = static_cast<ResponseCode>(code);
+    header.payloadSize = static_cast<uint32_t>(payloadSize);
+    memcpy(_headerBuffer, &header, sizeof(header));
+    return true;
+}
+
+/**
+ * @brief Handles a complete response header.
+ * The payload goes to the request's sink if it has one. Otherwise it is buffered, which
+ * requires room for all of it in the memory budget: a response that does not fit fails the
+ * engine, while a push that does not fit is skipped, like pushes dropped when too many queue up.
+ */
+void ProtocolEngine::onHeader() {
+    memcpy(&_header, _headerBuffer, sizeof(_header));
+    _headerReceived = 0;
+    // Pushes may arrive at any time, including between a request and its response.
+    bool push = _header.code == ResponseCode::STREAM_PUSH || _header.code == ResponseCode::PRESENCE_PUSH;
+    if (!push && _inFlight.empty()) {
+        _error = "Received a response with no request in flight.";
+        return;
+    }
+    if (_header.payloadSize > _maxPayloadSize) {
+        _error = "Response payload of " + std::to_string(_header.payloadSize) + " bytes exceeds the limit.";
+        return;
+    }
+    PayloadSink* sink = push ? nullptr : _inFlight.front().sink;
+    if (sink && !sink->begin(_header.payloadSize)) {
+        _error = "Cannot store a response payload of " + std::to_string(_header.payloadSize) + " bytes.";
+        return;
+    }
+    if (_header.payloadSize == 0) {
+        onResponse();
+        return;
+    }
+    _inPayload = true;
+    _payloadReceived = 0;
+    _sink = sink;
+    if (_sink) {
+        return;
+    }
+    _payload.clear();
+    if (!_payloadCharge.tryUpdate(_header.payloadSize)) {
+        if (push) {
+            LOG_WARN("transport", "Push exceeds the memory budget, dropping push", logField("code", _header.code), logField("size", _header.payloadSize));
+            _skipping = true;
+            return;
+        }
+        _error = "Response payload of " + std::to_string(_header.payloadSize) + " bytes exceeds the memory budget.";
+        return;
+    }
+    _payload.reserve(_header.payloadSize);
+    _payloadCharge.update(_payload.capacity());
+}
+
+/**
+ * @brief Handles a complete response (header and payload) by queuing an event.
+ * A push does not answer a request, so it leaves the requests in flight untouched.
+ */
+void ProtocolEngine::onResponse() {
+    _inPayload = false;
+    _sink = nullptr;
+    if (_skipping) {
+        _skipping = false;
+        _droppedPushes++;
+        return;
+    }
+    ProtocolEvent event;
+    event.code = _header.code;
+    event.payload = std::move(_payload);
+    if (!event.isPush()) {
+        event.request = _inFlight.front().code;
+        _inFlight.pop_front();
+    }
+    _eventsCharge.update(_eventsCharge.bytes() + event.payload.capacity());
+    _events.push_back(std::move(event));
+    _payload = std::vector<uint8_t>();
+    _payloadCharge.update(0);
+}
+
+/**
+ * @brief Returns the next decoded response or push, if one is complete.
+ * @return The event, or std::nullopt if more bytes are needed.
+ */
+std::optional<ProtocolEvent> ProtocolEngine::nextEvent() {
+    if (_events.empty()) {
+        return std::nullopt;
+    }
+    ProtocolEvent event = std::move(_events.front());
+    _events.pop_front();
+    // From here on the payload is charged by whoever takes the event.
+    _eventsCharge.update(_eventsCharge.bytes() - event.payload.capacity());
+    return event;
+}
+
+/**
+ * @brief Discards all buffered bytes, requests in flight and events.
+ */
+void ProtocolEngine::reset() {
+    _outgoing = std::vector<uint8_t>();
+    _outgoingOffset = 0;
+    _requestRemaining = 0;
+    _compact = false;
+    memset(_boundClientID, 0, sizeof(_boundClientID));
+    _inFlight.clear();
+    _headerReceived = 0;
+    _inPayload = false;
+    _payloadReceived = 0;
+    _sink = nullptr;
+    _skipping = false;
+    _payload = std::vector<uint8_t>();
+    _events.clear();
+    _error.clear();
+    _outgoingCharge.update(0);
+    _payloadCharge.update(0);
+    _eventsCharge.update(0);
+}
@@ -0,0 +1,246 @@
+// ProtocolEngine.h
+// author: Ariel Cohen ID: 329599187
+
+#pragma once
+#include "MemoryStats.h"
+#include "Protocol.h"
+#include <deque>
+#include <optional>
+
+constexpr size_t MAX_RESPONSE_PAYLOAD_SIZE = 1ULL << 31; ///< Larger response payloads are treated as a protocol violation.
+constexpr size_t MAX_IDLE_OUTGOING_CAPACITY = 1024 * 1024; ///< A larger outgoing buffer is freed once written instead of kept for reuse.
+
+/**
+ * @brief A complete response, or an unsolicited push, decoded by the protocol engine.
+ */
+struct ProtocolEvent {
+    RequestCode request{};        ///< The request this response answers; unset for pushes.
+    ResponseCode code;            ///< The response code sent by the server.
+    std::vector<uint8_t> payload; ///< The response payload.
+
+    /**
+     * @brief Returns true if the server answered with an error.
+     */
+    bool isError() const { return code == ResponseCode::GENERAL_ERROR; }
+
+    /**
+     * @brief Returns true if the server sent this on its own rather than in answer to a request.
+     */
+    bool isPush() const { return code == ResponseCode::STREAM_PUSH || code == ResponseCode::PRESENCE_PUSH; }
+};
+
+/**
+ * @brief Takes a response payload piece by piece as it arrives, instead of the engine buffering it whole.
+ */
+class PayloadSink {
+public:
+    virtual ~PayloadSink() = default;
+
+    /**
+     * @brief Called when a response payload starts; may be called again for the response to a retried request.
+     * @param size The size of the payload.
+     * @return False if the payload cannot be taken; the engine then fails.
+     */
+    virtual bool begin(size_t size) = 0;
+
+    /**
+     * @brief Called with the next bytes of the payload.
+     * @return False on failure; the engine then fails.
+     */
+    virtual bool write(const uint8_t* data, size_t size) = 0;
+};
+
+/**
+ * @brief Produces a request payload piece by piece, so it is never held in memory whole.
+ */
+class PayloadSource {
+public:
+    virtual ~PayloadSource() = default;
+
+    /**
+     * @brief Returns the size of the whole payload.
+     */
+    virtual size_t size() const = 0;
+
+    /**
+     * @brief Starts over from the first byte, e.g. to send the request again after reconnecting.
+     * @return False on failure.
+     */
+    virtual bool rewind() = 0;
+
+    /**
+     * @brief Fills a buffer with the next bytes of the payload.
+     * @return The number of bytes written, at most capacity; 0 only on failure.
+     */
+    virtual size_t read(uint8_t* buffer, size_t capacity) = 0;
+};
+
+/**
+ * @brief A sans-I/O implementation of the client side of the protocol.
+ * The engine never touches a socket: requests are turned into bytes the caller writes
+ * (outgoingData/consumeOutgoing), and bytes the caller reads are fed in (receive) and
+ * turned into events (nextEvent). This lets it be driven by a blocking socket, any
+ * event loop, or directly from memory.
+ * The buffers it holds are charged to MemorySubsystem::TRANSPORT. A response payload is only
+ * buffered if it fits the memory budget; larger ones must go to a PayloadSink, and a push too
+ * large for the budget is skipped and counted in droppedPushes().
+ * Frames have the version 2 headers until useCompactFraming() switches to the compact ones.
+ */
+class ProtocolEngine {
+public:
+    /**
+     * @brief Constructs an engine with no requests in flight.
+     * @param maxPayloadSize Response payloads larger than this put the engine in the failed state.
+     */
+    explicit ProtocolEngine(size_t maxPayloadSize = MAX_RESPONSE_PAYLOAD_SIZE);
+
+    /**
+     * @brief Frames a request and appends it to the outgoing bytes.
+     * @param code The request code.
+     * @param payload The request payload.
+     * @param clientID The sender's client ID (empty for registration).
+     * @param sink Takes the payload of the response instead of the response event; nullptr to buffer it.
+     */
+    void sendRequest(RequestCode code, const std::vector<uint8_t>& payload, const std::vector<uint8_t>& clientID, PayloadSink* sink = nullptr);
+
+    /**
+     * @brief Frames a request header; its payload follows in appendPayload calls.
+     * No other request may be sent until the whole payload has been appended.
+     * @param code The request code.
+     * @param payloadSize The size of the whole payload.
+     * @param clientID The sender's client ID (empty for registration).
+     * @param sink Takes the payload of the response instead of the response event; nullptr to buffer it.
+     */
+    void beginRequest(RequestCode code, size_t payloadSize, const std::vector<uint8_t>& clientID, PayloadSink* sink = nullptr);
+
+    /**
+     * @brief Appends the next bytes of the payload announced by beginRequest to the outgoing bytes.
+     * @param data The bytes.
+     * @param size The number of bytes; at most requestPayloadRemaining().
+     */
+    void appendPayload(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Returns how many payload bytes of the request begun last are still to be appended.
+     */
+    size_t requestPayloadRemaining() const { return _requestRemaining; }
+
+    /**
+     * @brief Switches to compact (v3) framing, in both directions, for every frame from now on.
+     * Call it once the HELLO response that negotiated CAP_COMPACT_FRAMING has been decoded, before
+     * more bytes are fed in. The client ID of the HELLO request stays bound to the connection.
+     */
+    void useCompactFraming() { _compact = true; }
+
+    /**
+     * @brief Returns true once compact framing is used.
+     */
+    bool compactFraming() const { return _compact; }
+
+    /**
+     * @brief Returns false for requests the server never answers.
+     */
+    static bool expectsResponse(RequestCode code) { return code != RequestCode::STREAM_DATA; }
+
+    /**
+     * @brief Returns true if there are bytes waiting to be written.
+     */
+    bool wantsWrite() const { return _outgoingOffset < _outgoing.size(); }
+
+    /**
+     * @brief Returns a pointer to the bytes waiting to be written.
+     */
+    const uint8_t* outgoingData() const { return _outgoing.data() + _outgoingOffset; }
+
+    /**
+     * @brief Returns the number of bytes waiting to be written.
+     */
+    size_t outgoingSize() const { return _outgoing.size() - _outgoingOffset; }
+
+    /**
+     * @brief Marks bytes as written.
+     * @param count The number of bytes the transport accepted.
+     */
+    void consumeOutgoing(size_t count);
+
+    /**
+     * @brief Returns true if a response is still expected for some request.
+     */
+    bool wantsRead() const { return !_inFlight.empty(); }
+
+    /**
+     * @brief Returns how many more bytes complete the current header or payload.
+     * Useful for sizing reads; reading more than this is allowed.
+     */
+    size_t bytesNeeded() const;
+
+    /**
+     * @brief Feeds bytes read from the transport into the engine.
+     * @param data The bytes read.
+     * @param size The number of bytes read.
+     */
+    void receive(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Returns the next decoded response or push, if one is complete.
+     */
+    std::optional<ProtocolEvent> nextEvent();
+
+    /**
+     * @brief Returns true if the byte stream violated the protocol; the connection must be dropped.
+     */
+    bool failed() const { return !_error.empty(); }
+
+    /**
+     * @brief Returns a description of the protocol violation, if any.
+     */
+    const std::string& error() const { return _error; }
+
+    /**
+     * @brief Returns the number of pushes skipped because they did not fit the memory budget.
+     */
+    size_t droppedPushes() const { return _droppedPushes; }
+
+    /**
+     * @brief Discards all buffered bytes, requests in flight and events, e.g. after reconnecting.
+     */
+    void reset();
+
+private:
+    // A request awaiting its response
+    struct InFlight {
+        RequestCode code;  // the request code
+        PayloadSink* sink; // takes the response payload, or nullptr
+    };
+
+    // Appends a request header in the current framing to _outgoing
+    void appendHeader(RequestCode code, size_t payloadSize, const uint8_t* clientID);
+    // Decodes the compact response header in _headerBuffer; false if more bytes are needed
+    bool decodeCompactHeader();
+    // Handles a complete response header
+    void onHeader();
+    // Handles a complete response (header and payload)
+    void onResponse();
+
+    size_t _maxPayloadSize;                   // upper bound on accepted payload sizes
+    std::vector<uint8_t> _outgoing;           // framed requests not yet written
+    size_t _outgoingOffset = 0;               // bytes of _outgoing already written
+    size_t _requestRemaining = 0;             // payload bytes of the current request not yet appended
+    bool _compact = false;                    // true once compact framing is used
+    uint8_t _boundClientID[CLIENT_ID_SIZE]{}; // client ID of the last request header sent
+    std::deque<InFlight> _inFlight;           // requests awaiting a response, in order
+    uint8_t _headerBuffer[MAX_COMPACT_RESPONSE_HEADER_SIZE]{}; // the response header being received, in either framing
+    size_t _headerReceived = 0;               // bytes of the header received so far
+    ResponseHeader _header{};                 // the current response header, once complete
+    bool _inPayload = false;                  // true while receiving a payload
+    size_t _payloadReceived = 0;              // bytes of the current payload received so far
+    PayloadSink* _sink = nullptr;             // takes the current payload, or nullptr to buffer it
+    bool _skipping = false;                   // true while skipping a push that does not fit the budget
+    size_t _droppedPushes = 0;                // pushes skipped
+    std::vector<uint8_t> _payload;            // the payload being received
+    std::deque<ProtocolEvent> _events;        // decoded responses not yet taken
+    std::string _error;                       // description of a protocol violation
+    MemoryCharge _outgoingCharge{MemorySubsystem::TRANSPORT}; // capacity of _outgoing
+    MemoryCharge _payloadCharge{MemorySubsystem::TRANSPORT};  // capacity of _payload
+    MemoryCharge _eventsCharge{MemorySubsystem::TRANSPORT};   // payloads held in _events
+};
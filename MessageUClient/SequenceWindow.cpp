@@ -0,0 +1,39 @@
+// SequenceWindow.cpp
+// author: Ariel Cohen ID: 329599187
+
+#include "SequenceWindow.h"
+
+/**
+ * @brief Returns true if the number was received already, or is too old to tell.
+ * Numbers start at 1, so 0 is never a valid one and counts as received.
+ * @param sequence The number.
+ */
+bool SequenceWindow::contains(uint64_t sequence) const {
+    if (sequence == 0) {
+        return true;
+    }
+    if (sequence > _highest) {
+        return false;
+    }
+    uint64_t age = _highest - sequence;
+    return age >= SEQUENCE_WINDOW_SIZE || (_received >> age & 1) != 0;
+}
+
+/**
+ * @brief Records a number as received.
+ * A number above the highest slides the window up to it; one below fills its place in the window.
+ * @param sequence The number; must not be contained already.
+ * @return The numbers skipped right before it, if it is the highest so far; 0 otherwise.
+ */
+uint64_t SequenceWindow::add(uint64_t sequence) {
+    if (sequence <= _highest) {
+        _received |= uint64_t{1} << (_highest - sequence);
+        return 0;
+    }
+    uint64_t skipped = sequence - _highest - 1;
+    uint64_t shift = sequence - _highest;
+    _received = shift >= SEQUENCE_WINDOW_SIZE ? 0 : _received << shift;
+    _received |= 1;
+    _highest = sequence;
+    return skipped;
+}
@@ -0,0 +1,37 @@
+// SequenceWindow.h
+// author: Ariel Cohen ID: 329599187
+
+#pragma once
+#include <cstdint>
+
+constexpr uint64_t SEQUENCE_WINDOW_SIZE = 64; ///< Sequence numbers below the highest one received that are still told apart.
+
+/**
+ * @brief The sequence numbers received from one peer in the current conversation.
+ * Only the highest number and a bitmap of the SEQUENCE_WINDOW_SIZE numbers below it are kept,
+ * so checking and recording a number takes constant time and space whatever the history.
+ * Numbers older than the window cannot be told apart from duplicates and are treated as such.
+ */
+class SequenceWindow {
+public:
+    /**
+     * @brief Returns true if the number was received already, or is too old to tell.
+     */
+    bool contains(uint64_t sequence) const;
+
+    /**
+     * @brief Records a number as received.
+     * @param sequence The number; must not be contained already.
+     * @return The numbers skipped right before it, if it is the highest so far; 0 otherwise.
+     */
+    uint64_t add(uint64_t sequence);
+
+    /**
+     * @brief Returns the highest number received, 0 if none.
+     */
+    uint64_t highest() const { return _highest; }
+
+private:
+    uint64_t _highest = 0;  // the highest number received
+    uint64_t _received = 0; // bit i is set if _highest - i was received
+};
@@ -0,0 +1,1595 @@
+// Session.cpp
+// author: Ariel Cohen ID: 329599187
+
+#include "Session.h"
+#include "Bundle.h"
+#include "Logger.h"
+#include <boost/filesystem.hpp>
+#include <cryptopp/osrng.h>
+#include <cstring>
+#include <fstream>
+#include <random>
+
+constexpr size_t MAX_SYM_KEY_CONTENT = 4096; ///< Larger SYM_KEY_SEND content cannot be an RSA-encrypted key.
+constexpr size_t MAX_SENT_FILES = 16;        ///< FILE_CHUNKED files kept to send chunks again; older ones are forgotten.
+constexpr unsigned MAX_CHUNK_REQUESTS = 3;   ///< FILE_CHUNK_REQUESTs sent for one file before giving up on it.
+
+namespace {
+
+/**
+ * @brief Splits the type of a received message into its message type and whether it is numbered.
+ * @param type The type as received.
+ * @param sequenced Receives true if MESSAGE_SEQUENCED is set.
+ * @return The type without the flag.
+ */
+MessageType receivedType(MessageType type, bool& sequenced) {
+    uint8_t raw = static_cast<uint8_t>(type);
+    sequenced = (raw & MESSAGE_SEQUENCED) != 0;
+    return static_cast<MessageType>(raw & ~MESSAGE_SEQUENCED);
+}
+
+/**
+ * @brief The payload of a SEND_MESSAGE request whose content is encrypted while it is sent.
+ * Only one chunk of plaintext and its ciphertext are held at a time, whatever the content size.
+ */
+class EncryptingSource : public PayloadSource {
+public:
+    /**
+     * @brief Prepares the payload.
+     * @param recipientID The recipient's UUID.
+     * @param type The message type.
+     * @param symKey The symmetric key to encrypt with.
+     * @param plaintext The content to encrypt.
+     * @param prefix Plaintext encrypted before the content, such as its SequenceHeader.
+     * @throws std::runtime_error if the key is invalid.
+     */
+    EncryptingSource(const std::vector<uint8_t>& recipientID, MessageType type, const std::vector<uint8_t>& symKey, const ContentSource& plaintext,
+        const std::vector<uint8_t>& prefix = {})
+        : _symKey(symKey), _prefix(prefix), _reader(plaintext), _contentSize(AesStream::ciphertextSize(prefix.size() + plaintext.size())),
+          _aes(std::make_unique<AesStream>(symKey, AesStream::Direction::ENCRYPT)) {
+        std::copy_n(recipientID.begin(), std::min(recipientID.size(), CLIENT_ID_SIZE), _header.clientID);
+        _header.type = type;
+        _header.contentSize = static_cast<uint32_t>(_contentSize);
+    }
+
+    size_t size() const override { return static_cast<size_t>(sizeof(_header) + _contentSize); }
+
+    /**
+     * @brief Returns true if the plaintext could not be read or encrypted.
+     */
+    bool failed() const { return _failed; }
+
+    /**
+     * @brief Starts over with a fresh encryption of the plaintext.
+     */
+    bool rewind() override {
+        _position = 0;
+        _pending.clear();
+        _pendingOffset = 0;
+        _prefixEncrypted = _prefix.empty();
+        _finished = false;
+        if (!_buffersCharge.waitUpdate(2 * CONTENT_CHUNK_SIZE + CryptoPP::AES::BLOCKSIZE, MEMORY_WAIT_TIMEOUT) || !_reader.rewind()) {
+            _failed = true;
+            return false;
+        }
+        _aes = std::make_unique<AesStream>(_symKey, AesStream::Direction::ENCRYPT);
+        _chunk.resize(CONTENT_CHUNK_SIZE);
+        return true;
+    }
+
+    /**
+     * @brief Produces the header, then the ciphertext one chunk at a time.
+     */
+    size_t read(uint8_t* buffer, size_t capacity) override {
+        size_t produced = 0;
+        while (produced < capacity && _position < size()) {
+            size_t count;
+            if (_position < sizeof(_header)) {
+                count = std::min(capacity - produced, static_cast<size_t>(sizeof(_header) - _position));
+                memcpy(buffer + produced, reinterpret_cast<const uint8_t*>(&_header) + _position, count);
+            }
+            else {
+                if (_pendingOffset == _pending.size() && !encryptNextChunk()) {
+                    _failed = true;
+                    return 0;
+                }
+                count = std::min(capacity - produced, _pending.size() - _pendingOffset);
+                memcpy(buffer + produced, _pending.data() + _pendingOffset, count);
+                _pendingOffset += count;
+            }
+            produced += count;
+            _position += count;
+        }
+        return produced;
+    }
+
+private:
+    // Encrypts the prefix, the next chunk of plaintext, or the padding after the last one, into _pending
+    bool encryptNextChunk() {
+        _pending.clear();
+        _pendingOffset = 0;
+        try {
+            while (_pending.empty()) {
+                if (!_prefixEncrypted) {
+                    _aes->update(_prefix.data(), _prefix.size(), _pending);
+                    _prefixEncrypted = true;
+                }
+                else if (_reader.remaining() > 0) {
+                    size_t count = _reader.read(_chunk.data(), _chunk.size());
+                    if (count == 0) {
+                        return false;
+                    }
+                    _aes->update(_chunk.data(), count, _pending);
+                }
+                else if (!_finished) {
+                    _aes->finish(_pending);
+                    _finished = true;
+                }
+                else {
+                    return false;
+                }
+            }
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    SendMessageHeader _header{};       // precedes the content
+    std::vector<uint8_t> _symKey;      // the key the content is encrypted with
+    std::vector<uint8_t> _prefix;      // plaintext encrypted before the content
+    ContentReader _reader;             // reads the plaintext
+    uint64_t _contentSize;             // the size of the ciphertext
+    std::unique_ptr<AesStream> _aes;   // encrypts the plaintext read so far
+    std::vector<uint8_t> _chunk;       // the plaintext chunk being encrypted
+    std::vector<uint8_t> _pending;     // ciphertext not yet produced
+    size_t _pendingOffset = 0;         // bytes of _pending already produced
+    uint64_t _position = 0;            // bytes of the payload already produced
+    bool _prefixEncrypted = false;     // true once the prefix has been encrypted
+    bool _finished = false;            // true once the padding has been encrypted
+    bool _failed = false;              // true if the plaintext could not be read or encrypted
+    MemoryCharge _buffersCharge{MemorySubsystem::CRYPTO}; // _chunk and _pending
+};
+
+} // namespace
+
+/**
+ * @brief Opens a session.
+ * Reads server info from the server info file and user data from the identity file if it exists.
+ * @param config The file locations to use.
+ */
+Session::Session(const SessionConfig& config)
+    : _config(config), _contacts(config.contactCacheSize), _pendingQueue(config.pendingDirectory) {
+    // Load server IP and port from the configuration file.
+    auto serverInfo = FileHandler::readServerInfo(_config.serverInfoFile);
+    if (!serverInfo) {
+        throw std::runtime_error(_config.serverInfoFile + " file not found or is invalid.");
+    }
+    _communicator = std::make_unique<Communicator>(serverInfo->ip, serverInfo->port);
+    // Directory requests go to one of the replicas, picked at random to spread the clients over them.
+    if (!serverInfo->replicas.empty()) {
+        std::random_device random;
+        const ServerInfo& replica = serverInfo->replicas[random() % serverInfo->replicas.size()];
+        _directory = std::make_unique<Communicator>(replica.ip, replica.port);
+        LOG_INFO("session", "Directory requests go to a replica", logField("ip", replica.ip), logField("port", replica.port));
+    }
+
+    // If an identity file exists, load the user's identity.
+    _userInfo = FileHandler::readMyInfo(_config.myInfoFile);
+    if (_userInfo) {
+        LOG_INFO("session", "Loaded identity", logField("user", _userInfo->username));
+        // The private key is stored in Base64, so it needs to be decoded.
+        CryptoWrapper::base64ToPrivateKey(_userInfo->privateKey, _privateKey);
+        _communicator->setClientID(_userInfo->uuid);
+    }
+}
+
+/**
+ * @brief Closes the session.
+ * Files whose damaged chunks were requested again but have not arrived are incomplete, so
+ * they are deleted; the sender only keeps the files it sent for its own session.
+ */
+Session::~Session() {
+    while (!_partialFiles.empty()) {
+        discardPartialFile(_partialFiles.begin()->first);
+    }
+}
+
+/**
+ * @brief Registers a new user.
+ * Generates a new RSA key pair, sends the username and public key to the server,
+ * and saves the returned UUID and private key to the identity file.
+ * @param username The name to register.
+ * @return The status of the operation.
+ */
+SessionStatus Session::registerUser(const std::string& username) {
+    // Prevent re-registration if user info already exists.
+    if (FileHandler::myInfoExists(_config.myInfoFile)) {
+        return SessionStatus::ALREADY_REGISTERED;
+    }
+
+    // Generate a new RSA key pair for the user.
+    LOG_DEBUG("session", "Generating RSA key pair for registration");
+    CryptoPP::RSA::PrivateKey privateKey;
+    CryptoPP::RSA::PublicKey publicKey;
+    CryptoWrapper::generateRsaKeys(privateKey, publicKey);
+
+    // Pack the registration request according to the protocol.
+    auto payload = ProtocolCodec::encodeRegistration(username, CryptoWrapper::publicKeyToBytes(publicKey));
+
+    LOG_DEBUG("session", "Sending registration request", logField("user", username));
+    auto response = _communicator->sendAndReceive(RequestCode::REGISTER, payload, {});
+    auto clientID = response ? ProtocolCodec::decodeRegistration(*response) : std::nullopt;
+    if (!clientID) {
+        return SessionStatus::REQUEST_FAILED;
+    }
+
+    // On successful registration, save the new user info.
+    UserInfo info;
+    info.username = username;
+    info.uuid = std::move(*clientID);
+    info.privateKey = CryptoWrapper::privateKeyToBase64(privateKey);
+
+    if (!FileHandler::writeMyInfo(info, _config.myInfoFile)) {
+        return SessionStatus::FILE_ERROR;
+    }
+    // Update the current session with the new user info.
+    _userInfo = info;
+    _privateKey = privateKey;
+    _communicator->setClientID(info.uuid);
+    return SessionStatus::OK;
+}
+
+/**
+ * @brief Requests the list of all registered clients from the server.
+ * The list is handed to the caller rather than kept, so a large directory is only held
+ * while it is used; the contact cache is left as it is.
+ * @param clients Receives the clients (without keys).
+ * @return The status of the operation.
+ */
+SessionStatus Session::listClients(std::vector<ClientInfo>& clients) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    LOG_DEBUG("session", "Requesting clients list");
+    auto response = directoryRequest(RequestCode::CLIENTS_LIST, {});
+    if (!response) {
+        return SessionStatus::REQUEST_FAILED;
+    }
+    clients = ProtocolCodec::decodeClientsList(*response);
+    return SessionStatus::OK;
+}
+
+/**
+ * @brief Charges the memory held by the contact cache and the watched names to MemorySubsystem::DIRECTORY.
+ * Called whenever the contacts or the keys they hold change.
+ */
+void Session::chargeDirectory() {
+    size_t bytes = _contacts.bytes();
+    for (const auto& watched : _watched) {
+        bytes += sizeof(watched) + 3 * sizeof(void*) + watched.first.capacity() + watched.second.capacity();
+    }
+    for (const auto& conversation : _conversations) {
+        bytes += sizeof(conversation) + 3 * sizeof(void*) + conversation.first.capacity();
+    }
+    _directoryCharge.update(bytes);
+}
+
+/**
+ * @brief Finds a cached contact by their username.
+ * @param name The name of the client to find.
+ * @return A pointer to the ClientInfo struct, or nullptr if not found.
+ */
+ClientInfo* Session::findClientByName(const std::string& name) {
+    return _contacts.findByName(name);
+}
+
+/**
+ * @brief Finds a cached contact by their UUID.
+ * @param id The UUID of the client to find.
+ * @return A pointer to the ClientInfo struct, or nullptr if not found.
+ */
+ClientInfo* Session::findClientByID(const std::vector<uint8_t>& id) {
+    return _contacts.findByID(id);
+}
+
+/**
+ * @brief Finds a client by name, looking it up on the server if it is not cached.
+ * @param name The name of the client to find.
+ * @return A pointer to the ClientInfo struct, or nullptr if not found.
+ */
+ClientInfo* Session::resolveClient(const std::string& name) {
+    ClientInfo* client = findClientByName(name);
+    return client ? client : lookupClient({}, name);
+}
+
+/**
+ * @brief Finds a client by UUID, looking it up on the server if it is not cached.
+ * @param id The UUID of the client to find.
+ * @return A pointer to the ClientInfo struct, or nullptr if not found.
+ */
+ClientInfo* Session::resolveClientByID(const std::vector<uint8_t>& id) {
+    ClientInfo* client = findClientByID(id);
+    return client ? client : lookupClient(id, {});
+}
+
+/**
+ * @brief Looks a client up on the server and puts it in the contact cache.
+ * A lookup returns one client with its public key. Servers without CAP_CLIENT_LOOKUP can only
+ * list every client, so for them the list is fetched and only the match is kept.
+ * @param id The UUID of the client, or empty to look the client up by name.
+ * @param name The name of the client; ignored if id is given.
+ * @return A pointer to the cached client, or nullptr if the server does not know it.
+ */
+ClientInfo* Session::lookupClient(const std::vector<uint8_t>& id, const std::string& name) {
+    if (!_userInfo) { return nullptr; }
+    auto caps = _communicator->capabilities();
+    if (!caps.negotiated || caps.supports(CAP_CLIENT_LOOKUP)) {
+        LOG_DEBUG("session", "Looking up client", logField("id", id), logField("name", name));
+        auto response = directoryRequest(RequestCode::CLIENT_LOOKUP, ProtocolCodec::encodeClientLookup(id, name));
+        auto found = response ? ProtocolCodec::decodeClientInfo(*response) : std::nullopt;
+        if (found) {
+            ClientInfo& client = _contacts.put(std::move(*found));
+            chargeDirectory();
+            return &client;
+        }
+        // A server that negotiated the lookup does not know the client.
+        if (_communicator->capabilities().supports(CAP_CLIENT_LOOKUP)) {
+            return nullptr;
+        }
+    }
+
+    std::vector<ClientInfo> clients;
+    if (listClients(clients) != SessionStatus::OK) {
+        return nullptr;
+    }
+    for (auto& client : clients) {
+        if (id.empty() ? client.name == name : client.id == id) {
+            ClientInfo& cached = _contacts.put(std::move(client));
+            chargeDirectory();
+            return &cached;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * @brief Changes how many contacts are kept in memory, evicting those that no longer fit.
+ * @param capacity The number of contacts; 0 for no limit.
+ */
+void Session::setContactCacheSize(size_t capacity) {
+    _contacts.setCapacity(capacity);
+    chargeDirectory();
+}
+
+/**
+ * @brief Fetches a client's public key from the server and stores it in the contact cache.
+ * @param client The client whose key is requested.
+ * @return The status of the operation.
+ */
+SessionStatus Session::fetchPublicKey(ClientInfo& client) {
+    LOG_DEBUG("session", "Requesting public key", logField("user", client.name));
+    auto payload = ProtocolCodec::encodePublicKeyRequest(client.id);
+    auto response = directoryRequest(RequestCode::PUBLIC_KEY, payload);
+    auto publicKey = response ? ProtocolCodec::decodePublicKey(*response) : std::nullopt;
+    if (!publicKey) {
+        return SessionStatus::NO_PUBLIC_KEY;
+    }
+    // Store the received public key with the cached contact.
+    client.publicKey = std::move(*publicKey);
+    chargeDirectory();
+    return SessionStatus::OK;
+}
+
+/**
+ * @brief Sends a directory request to the replica, or to the server if there is no replica.
+ * A replica may be down, or not yet have a client who registered a moment ago; the server
+ * has the whole directory, so a request the replica fails is sent to the server.
+ * @param code CLIENTS_LIST or PUBLIC_KEY.
+ * @param payload The request payload.
+ * @return The response payload, or std::nullopt if the server failed the request as well.
+ */
+std::optional<std::vector<uint8_t>> Session::directoryRequest(RequestCode code, const std::vector<uint8_t>& payload) {
+    if (_directory) {
+        auto response = _directory->sendAndReceive(code, payload, _userInfo->uuid);
+        if (response) {
+            return response;
+        }
+        LOG_WARN("session", "Replica failed a directory request; asking the server", logField("code", code), logField("error", _directory->lastError()));
+    }
+    return _communicator->sendAndReceive(code, payload, _userInfo->uuid);
+}
+
+/**
+ * @brief Requests the public key for a specific user from the server.
+ * @param username The client's name.
+ * @return The status of the operation.
+ */
+SessionStatus Session::requestPublicKey(const std::string& username) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    ClientInfo* client = resolveClient(username);
+    if (!client) {
+        return SessionStatus::UNKNOWN_CLIENT;
+    }
+    return fetchPublicKey(*client);
+}
+
+/**
+ * @brief Sends a SEND_MESSAGE request carrying the given type and content.
+ * @param client The recipient.
+ * @param type The message type.
+ * @param content The (already encrypted) content; may be empty.
+ * @return The status of the operation.
+ */
+SessionStatus Session::sendMessage(const ClientInfo& client, MessageType type, const std::vector<uint8_t>& content) {
+    LOG_DEBUG("session", "Sending message", logField("to", client.name), logField("type", type), logField("size", content.size()));
+    auto payload = ProtocolCodec::encodeSendMessage(client.id, type, content);
+    MemoryCharge payloadCharge(MemorySubsystem::TRANSPORT, payload.capacity());
+    auto response = _communicator->sendAndReceive(RequestCode::SEND_MESSAGE, payload, _userInfo->uuid);
+    if (response && ProtocolCodec::decodeMessageSent(*response)) {
+        return SessionStatus::OK;
+    }
+    return SessionStatus::REQUEST_FAILED;
+}
+
+/**
+ * @brief Sends a SEND_MESSAGE request whose content is encrypted while it is sent.
+ * The content is read, encrypted and written one chunk at a time, so neither the plaintext
+ * nor the ciphertext is ever held whole. It is numbered in the conversation with the client:
+ * a SequenceHeader is encrypted before it and MESSAGE_SEQUENCED is set in its type.
+ * @param client The recipient; its symmetric key must be established.
+ * @param type The message type, TEXT_MESSAGE, FILE_SEND or FILE_BUNDLE.
+ * @param plaintext The content to encrypt.
+ * @return The status of the operation.
+ */
+SessionStatus Session::sendEncrypted(const ClientInfo& client, MessageType type, const ContentSource& plaintext) {
+    if (AesStream::ciphertextSize(sizeof(SequenceHeader) + plaintext.size()) > UINT32_MAX - sizeof(SendMessageHeader)) {
+        return SessionStatus::FILE_ERROR;
+    }
+    // A number is used even if the send fails: the message may have been stored before the
+    // failure, and reusing its number would get the next message dropped as its duplicate.
+    SequenceHeader sequence{ nextSequence(client.id) };
+    std::vector<uint8_t> prefix(reinterpret_cast<const uint8_t*>(&sequence), reinterpret_cast<const uint8_t*>(&sequence) + sizeof(sequence));
+    std::unique_ptr<EncryptingSource> source;
+    try {
+        source = std::make_unique<EncryptingSource>(client.id, static_cast<MessageType>(static_cast<uint8_t>(type) | MESSAGE_SEQUENCED),
+            client.symKey, plaintext, prefix);
+    }
+    catch (const std::exception&) {
+        return SessionStatus::CRYPTO_ERROR;
+    }
+    LOG_DEBUG("session", "Sending message", logField("to", client.name), logField("type", type), logField("sequence", sequence.sequence),
+        logField("plaintext", plaintext.size()), logField("ciphertext", source->size() - sizeof(SendMessageHeader)));
+    auto response = _communicator->sendAndReceive(RequestCode::SEND_MESSAGE, *source, _userInfo->uuid);
+    if (response && ProtocolCodec::decodeMessageSent(*response)) {
+        return SessionStatus::OK;
+    }
+    return source->failed() ? SessionStatus::FILE_ERROR : SessionStatus::REQUEST_FAILED;
+}
+
+/**
+ * @brief Starts numbering the messages exchanged with a client afresh.
+ * Called whenever a new symmetric key is shared with the client, in either direction: both
+ * sides then number their messages from 1 again.
+ * @param clientID The client's UUID.
+ */
+void Session::startConversation(const std::vector<uint8_t>& clientID) {
+    _conversations[clientID] = Conversation();
+    chargeDirectory();
+}
+
+/**
+ * @brief Returns the number of the next message sent to a client.
+ * @param clientID The client's UUID.
+ */
+uint64_t Session::nextSequence(const std::vector<uint8_t>& clientID) {
+    return ++_conversations[clientID].lastSent;
+}
+
+/**
+ * @brief Records the number of a message received from a client.
+ * @param msg The message; its sequence and skipped numbers are set.
+ * @param sequence The number the sender gave it.
+ * @return False if the number was received already in this conversation, or is too old to tell.
+ */
+bool Session::acceptSequence(IncomingMessage& msg, uint64_t sequence) {
+    SequenceWindow& received = _conversations[msg.senderID].received;
+    msg.sequence = sequence;
+    if (received.contains(sequence)) {
+        LOG_INFO("session", "Dropped duplicate message", logField("from", msg.senderName), logField("id", msg.messageID),
+            logField("sequence", sequence), logField("highest", received.highest()));
+        return false;
+    }
+    msg.skipped = received.add(sequence);
+    if (msg.skipped > 0) {
+        LOG_WARN("session", "Messages missing in conversation", logField("from", msg.senderName), logField("sequence", sequence),
+            logField("skipped", msg.skipped));
+    }
+    return true;
+}
+
+/**
+ * @brief Sends an encrypted text message to another user.
+ * Requires a symmetric key to be established first.
+ * @param username The recipient's name.
+ * @param message The text to send.
+ * @return The status of the operation.
+ */
+SessionStatus Session::sendText(const std::string& username, const std::string& message) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    ClientInfo* client = resolveClient(username);
+    if (!client) {
+        return SessionStatus::UNKNOWN_CLIENT;
+    }
+    // A symmetric key is required for sending text messages.
+    if (client->symKey.empty()) {
+        return SessionStatus::NO_SYM_KEY;
+    }
+
+    // Encrypt the message with the shared symmetric key while it is sent.
+    return sendEncrypted(*client, MessageType::TEXT_MESSAGE,
+        ContentSource::memory(reinterpret_cast<const uint8_t*>(message.data()), message.size()));
+}
+
+/**
+ * @brief Sends a request to another user, asking them to send their symmetric key.
+ * @param username The recipient's name.
+ * @return The status of the operation.
+ */
+SessionStatus Session::sendSymKeyRequest(const std::string& username) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    ClientInfo* client = resolveClient(username);
+    if (!client) {
+        return SessionStatus::UNKNOWN_CLIENT;
+    }
+
+    // The payload for a key request is just the header, with no content.
+    return sendMessage(*client, MessageType::SYM_KEY_REQUEST, {});
+}
+
+/**
+ * @brief Sends a new symmetric key to another user.
+ * The key is generated locally, encrypted with the recipient's public RSA key,
+ * and then sent.
+ * @param username The recipient's name.
+ * @return The status of the operation.
+ */
+SessionStatus Session::sendSymKey(const std::string& username) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    ClientInfo* client = resolveClient(username);
+    if (!client) {
+        return SessionStatus::UNKNOWN_CLIENT;
+    }
+
+    // We must have the recipient's public key to encrypt the symmetric key.
+    if (client->publicKey.empty()) {
+        SessionStatus status = fetchPublicKey(*client);
+        if (status != SessionStatus::OK) {
+            return status;
+        }
+    }
+
+    std::vector<uint8_t> symKey;
+    std::vector<uint8_t> encryptedSymKey;
+    try {
+        // Generate a new AES key.
+        symKey = CryptoWrapper::generateAesKey();
+
+        // Encrypt the new AES key with the recipient's public RSA key.
+        CryptoPP::RSA::PublicKey publicKey;
+        CryptoWrapper::bytesToPublicKey(client->publicKey, publicKey);
+        encryptedSymKey = CryptoWrapper::rsaEncrypt(publicKey, symKey);
+    }
+    catch (const std::exception& e) {
+        LOG_ERROR("session", "Failed to encrypt a symmetric key", logField("to", username), logField("error", e.what()));
+        return SessionStatus::CRYPTO_ERROR;
+    }
+
+    SessionStatus status = sendMessage(*client, MessageType::SYM_KEY_SEND, encryptedSymKey);
+    if (status == SessionStatus::OK) {
+        // Store the new key for our own use with this client.
+        client->symKey = symKey;
+        startConversation(client->id);
+    }
+    return status;
+}
+
+/**
+ * @brief Sends an encrypted file to another user.
+ * Requires a symmetric key to be established first.
+ * @param username The recipient's name.
+ * @param filepath The path of the file to send.
+ * @return The status of the operation.
+ */
+SessionStatus Session::sendFile(const std::string& username, const std::string& filepath) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    ClientInfo* client = resolveClient(username);
+    if (!client) {
+        return SessionStatus::UNKNOWN_CLIENT;
+    }
+    // A symmetric key is required for sending files.
+    if (client->symKey.empty()) {
+        return SessionStatus::NO_SYM_KEY;
+    }
+
+    // The file is read and encrypted a chunk at a time while it is sent, so any size fits the memory budget.
+    boost::system::error_code ec;
+    uint64_t fileSize = boost::filesystem::file_size(filepath, ec);
+    if (ec) {
+        return SessionStatus::FILE_ERROR;
+    }
+    if (fileSize < FILE_CHUNKED_THRESHOLD) {
+        return sendEncrypted(*client, MessageType::FILE_SEND, ContentSource::file(filepath, 0, fileSize));
+    }
+
+    // Large files are authenticated chunk by chunk, so a damaged chunk is found on its own and
+    // sent again instead of failing the whole file. The chunks are encrypted once to build the
+    // manifest of their MACs, and again while they are sent.
+    FileID fileID;
+    CryptoPP::AutoSeededRandomPool rng;
+    rng.GenerateBlock(fileID.data(), fileID.size());
+    SentFile sent{ client->id, filepath, client->symKey, {} };
+    try {
+        sent.manifest = FileManifest::build(filepath, fileSize, ChunkCipher(sent.symKey, fileID));
+    }
+    catch (const std::exception& e) {
+        LOG_ERROR("session", "Failed to build a file manifest", logField("path", filepath), logField("error", e.what()));
+        return SessionStatus::FILE_ERROR;
+    }
+    sent.manifest.header.sequence = nextSequence(client->id);
+    SessionStatus status = sendChunks(*client, sent, sent.manifest);
+    if (status == SessionStatus::OK) {
+        if (_sentOrder.size() == MAX_SENT_FILES) {
+            _sentFiles.erase(_sentOrder.front());
+            _sentOrder.pop_front();
+        }
+        _sentFiles.emplace(fileID, std::move(sent));
+        _sentOrder.push_back(fileID);
+    }
+    return status;
+}
+
+/**
+ * @brief Sends a directory and its subdirectories as one encrypted FILE_BUNDLE message.
+ * Requires a symmetric key to be established first.
+ * @param username The recipient's name.
+ * @param dirpath The path of the directory to send.
+ * @return The status of the operation.
+ */
+SessionStatus Session::sendDirectory(const std::string& username, const std::string& dirpath) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    ClientInfo* client = resolveClient(username);
+    if (!client) {
+        return SessionStatus::UNKNOWN_CLIENT;
+    }
+    if (client->symKey.empty()) {
+        return SessionStatus::NO_SYM_KEY;
+    }
+
+    // Only the index is built up front; the files are read and encrypted, one chunk at a time and
+    // one file after another, while the single request is sent.
+    std::unique_ptr<DirectoryBundle> bundle;
+    try {
+        bundle = std::make_unique<DirectoryBundle>(dirpath);
+    }
+    catch (const std::exception& e) {
+        LOG_ERROR("session", "Failed to index a directory", logField("path", dirpath), logField("error", e.what()));
+        return SessionStatus::FILE_ERROR;
+    }
+    LOG_DEBUG("session", "Sending directory", logField("path", dirpath), logField("files", bundle->fileCount()));
+    return sendEncrypted(*client, MessageType::FILE_BUNDLE, bundle->content());
+}
+
+/**
+ * @brief Sends the chunks a manifest lists as a FILE_CHUNKED message.
+ * @param client The recipient.
+ * @param file The file the chunks belong to.
+ * @param manifest The chunks to send: all of them, or those the recipient asked for again.
+ * @return The status of the operation.
+ */
+SessionStatus Session::sendChunks(const ClientInfo& client, const SentFile& file, const FileManifest& manifest) {
+    if (manifest.contentSize() > UINT32_MAX - sizeof(SendMessageHeader)) {
+        return SessionStatus::FILE_ERROR;
+    }
+    std::unique_ptr<ChunkCipher> cipher;
+    std::unique_ptr<ChunkedFileSource> source;
+    try {
+        cipher = std::make_unique<ChunkCipher>(file.symKey, manifest.fileID());
+        source = std::make_unique<ChunkedFileSource>(client.id, file.path, manifest, *cipher);
+    }
+    catch (const std::exception&) {
+        return SessionStatus::CRYPTO_ERROR;
+    }
+    LOG_DEBUG("session", "Sending file chunks", logField("to", client.name), logField("path", file.path),
+        logField("chunks", manifest.entries.size()), logField("ciphertext", source->size() - sizeof(SendMessageHeader)));
+    auto response = _communicator->sendAndReceive(RequestCode::SEND_MESSAGE, *source, _userInfo->uuid);
+    if (response && ProtocolCodec::decodeMessageSent(*response)) {
+        return SessionStatus::OK;
+    }
+    return source->failed() ? SessionStatus::FILE_ERROR : SessionStatus::REQUEST_FAILED;
+}
+
+/**
+ * @brief Verifies and saves the chunks of a FILE_CHUNKED message.
+ * The first message of a file carries every chunk and starts a partial file; later ones carry
+ * the chunks asked for again and must come from the same sender. The MACs of the first manifest
+ * are the ones trusted, so a later manifest cannot swap a chunk for another. Chunks that fail
+ * verification are asked for again with a FILE_CHUNK_REQUEST, up to MAX_CHUNK_REQUESTS times.
+ * @param msg The message; filePath is set once the file is complete, error while it is not.
+ * @param symKey The sender's symmetric key.
+ * @param content The content: the manifest, then the chunks.
+ * @return DELIVERED if the file is complete, REPAIRING if chunks were asked for again, or
+ *         DUPLICATE if the file was received already.
+ * @throws std::runtime_error if the content is invalid or the file cannot be completed; the partial file is deleted.
+ */
+MessageStatus Session::receiveChunkedFile(IncomingMessage& msg, const std::vector<uint8_t>& symKey, const ContentSource& content) {
+    ContentReader reader(content);
+    FileManifest manifest = FileManifest::read(reader, content.size(), symKey);
+    FileID fileID = manifest.fileID();
+    auto found = _partialFiles.find(fileID);
+    if (found == _partialFiles.end()) {
+        if (manifest.entries.size() != manifest.chunkCount()) {
+            throw std::runtime_error("chunks sent again for a file that is not being received");
+        }
+        // The number is checked before anything is written, so a copy of the file costs only its manifest.
+        if (manifest.header.sequence != 0 && !acceptSequence(msg, manifest.header.sequence)) {
+            return MessageStatus::DUPLICATE;
+        }
+        PartialFile file;
+        file.senderID = msg.senderID;
+        file.path = FileHandler::tempFilePath();
+        file.fileSize = manifest.header.fileSize;
+        file.chunkSize = manifest.header.chunkSize;
+        for (const auto& entry : manifest.entries) {
+            std::copy_n(entry.mac, CHUNK_MAC_SIZE, file.missing[entry.index].begin());
+        }
+        std::ofstream(file.path, std::ios::binary);
+        boost::system::error_code ec;
+        boost::filesystem::resize_file(file.path, file.fileSize, ec);
+        if (ec) {
+            boost::filesystem::remove(file.path, ec);
+            throw std::runtime_error("Failed to create temp file " + file.path);
+        }
+        found = _partialFiles.emplace(fileID, std::move(file)).first;
+    }
+    else if (found->second.senderID != msg.senderID || found->second.fileSize != manifest.header.fileSize
+        || found->second.chunkSize != manifest.header.chunkSize) {
+        throw std::runtime_error("chunks sent again do not match the file being received");
+    }
+    PartialFile& file = found->second;
+
+    uint32_t failed;
+    try {
+        failed = receiveChunks(reader, manifest, ChunkCipher(symKey, fileID), file);
+    }
+    catch (const std::exception&) {
+        discardPartialFile(fileID);
+        throw;
+    }
+    if (file.missing.empty()) {
+        msg.filePath = file.path;
+        _partialFiles.erase(found);
+        return MessageStatus::DELIVERED;
+    }
+    LOG_WARN("session", "File chunks failed verification", logField("from", msg.senderName), logField("failed", failed),
+        logField("missing", file.missing.size()), logField("requests", file.requests));
+    if (file.requests == MAX_CHUNK_REQUESTS) {
+        size_t missing = file.missing.size();
+        discardPartialFile(fileID);
+        throw std::runtime_error(std::to_string(missing) + " chunks still failed verification after "
+            + std::to_string(MAX_CHUNK_REQUESTS) + " requests");
+    }
+
+    // Ask the sender for every chunk still missing, encrypted like any other content.
+    FileChunkRequestHeader header{};
+    std::copy(fileID.begin(), fileID.end(), header.fileID);
+    header.count = static_cast<uint32_t>(file.missing.size());
+    std::vector<uint8_t> request(reinterpret_cast<const uint8_t*>(&header), reinterpret_cast<const uint8_t*>(&header) + sizeof(header));
+    for (const auto& chunk : file.missing) {
+        const uint8_t* index = reinterpret_cast<const uint8_t*>(&chunk.first);
+        request.insert(request.end(), index, index + sizeof(chunk.first));
+    }
+    ClientInfo* sender = resolveClientByID(msg.senderID);
+    if (!sender || sender->symKey.empty()
+        || sendMessage(*sender, MessageType::FILE_CHUNK_REQUEST, CryptoWrapper::aesEncrypt(symKey, request)) != SessionStatus::OK) {
+        discardPartialFile(fileID);
+        throw std::runtime_error("Failed to ask the sender for the damaged chunks again.");
+    }
+    file.requests++;
+    msg.error = std::to_string(file.missing.size()) + " of " + std::to_string(manifest.chunkCount())
+        + " chunks failed verification and were requested again";
+    return MessageStatus::REPAIRING;
+}
+
+/**
+ * @brief Sends the chunks a FILE_CHUNK_REQUEST asks for again.
+ * Only files this session sent to the requesting client are sent again, and only the chunks
+ * their manifest lists, re-encrypted from the file on disk.
+ * @param msg The message; its status is set to DELIVERED or DECRYPT_FAILED.
+ * @param sender The client asking; its symmetric key must be established.
+ * @param content The encrypted request.
+ */
+void Session::resendChunks(IncomingMessage& msg, const ClientInfo& sender, const ContentSource& content) {
+    try {
+        MemoryCharge requestCharge(MemorySubsystem::CRYPTO);
+        if (!requestCharge.tryUpdate(2 * content.size())) {
+            throw std::runtime_error("A chunk request of " + std::to_string(content.size()) + " bytes does not fit the memory budget.");
+        }
+        std::vector<uint8_t> ciphertext;
+        if (!content.read(ciphertext)) {
+            throw std::runtime_error("Failed to read the message content.");
+        }
+        auto request = CryptoWrapper::aesDecrypt(sender.symKey, ciphertext);
+        FileChunkRequestHeader header{};
+        if (request.size() < sizeof(header)) {
+            throw std::runtime_error("truncated chunk request");
+        }
+        memcpy(&header, request.data(), sizeof(header));
+        if (request.size() - sizeof(header) != static_cast<uint64_t>(header.count) * sizeof(uint32_t)) {
+            throw std::runtime_error("malformed chunk request");
+        }
+        std::vector<uint32_t> indexes(header.count);
+        if (!indexes.empty()) {
+            memcpy(indexes.data(), request.data() + sizeof(header), indexes.size() * sizeof(uint32_t));
+        }
+
+        FileID fileID;
+        std::copy_n(header.fileID, FILE_ID_SIZE, fileID.begin());
+        auto found = _sentFiles.find(fileID);
+        if (found == _sentFiles.end() || found->second.recipientID != msg.senderID) {
+            throw std::runtime_error("chunks requested of a file not sent to this client in this session");
+        }
+        const SentFile& sent = found->second;
+        msg.filePath = sent.path;
+        FileManifest part = sent.manifest.subset(indexes);
+        if (part.entries.empty()) {
+            throw std::runtime_error("no chunks of the file requested");
+        }
+        if (sendChunks(sender, sent, part) != SessionStatus::OK) {
+            throw std::runtime_error("Failed to send " + std::to_string(part.entries.size()) + " chunks of " + sent.path + " again.");
+        }
+        msg.text = "Sent " + std::to_string(part.entries.size()) + " chunks of " + sent.path + " again.";
+        msg.status = MessageStatus::DELIVERED;
+    }
+    catch (const std::exception& e) {
+        msg.status = MessageStatus::DECRYPT_FAILED;
+        msg.error = e.what();
+    }
+}
+
+/**
+ * @brief Deletes a partially received file and forgets it.
+ * @param fileID The file's ID.
+ */
+void Session::discardPartialFile(const FileID& fileID) {
+    auto found = _partialFiles.find(fileID);
+    if (found == _partialFiles.end()) {
+        return;
+    }
+    boost::system::error_code ec;
+    boost::filesystem::remove(found->second.path, ec);
+    _partialFiles.erase(found);
+}
+
+/**
+ * @brief Stores decrypted plaintext into the message.
+ * Text is kept as-is, file and stream content is saved to a temporary file.
+ * @param msg The message to fill.
+ * @param plaintext The decrypted content; the SequenceHeader of a numbered message is removed from it.
+ * @param sequenced True if the plaintext starts with a SequenceHeader.
+ * @return False if the message is a duplicate; nothing is stored.
+ * @throws std::runtime_error if the plaintext is too short or cannot be saved.
+ */
+bool Session::storePlaintext(IncomingMessage& msg, std::vector<uint8_t>& plaintext, bool sequenced) {
+    if (sequenced) {
+        SequenceHeader header{};
+        if (plaintext.size() < sizeof(header)) {
+            throw std::runtime_error("truncated sequence header");
+        }
+        memcpy(&header, plaintext.data(), sizeof(header));
+        plaintext.erase(plaintext.begin(), plaintext.begin() + sizeof(header));
+        if (!acceptSequence(msg, header.sequence)) {
+            return false;
+        }
+    }
+    if (msg.type == MessageType::FILE_SEND || msg.type == MessageType::STREAM) {
+        // Save the decrypted content to a temporary file.
+        msg.filePath = FileHandler::writeToTempFile(plaintext);
+    }
+    else {
+        msg.text.assign(plaintext.begin(), plaintext.end());
+    }
+    return true;
+}
+
+/**
+ * @brief Decrypts the content of a text, file, directory or stream message.
+ * Files and streams are decrypted a chunk at a time into a temp file, and a directory into a
+ * temp directory. Text is returned in
+ * memory, so it is only decrypted if it fits the memory budget along with its ciphertext.
+ * @param msg The message to fill; its status is set to DELIVERED, REPAIRING, DUPLICATE or DECRYPT_FAILED.
+ * @param symKey The sender's symmetric key.
+ * @param content The encrypted content.
+ * @param sequenced True if the plaintext starts with a SequenceHeader.
+ */
+void Session::decryptContent(IncomingMessage& msg, const std::vector<uint8_t>& symKey, const ContentSource& content, bool sequenced) {
+    try {
+        if (msg.type == MessageType::FILE_CHUNKED) {
+            msg.status = receiveChunkedFile(msg, symKey, content);
+            return;
+        }
+        if (msg.type == MessageType::FILE_SEND || msg.type == MessageType::STREAM) {
+            std::function<bool(uint64_t)> accept;
+            if (sequenced) {
+                accept = [this, &msg](uint64_t sequence) { return acceptSequence(msg, sequence); };
+            }
+            msg.filePath = decryptToFile(msg.type, symKey, content, accept);
+            msg.status = msg.filePath.empty() ? MessageStatus::DUPLICATE : MessageStatus::DELIVERED;
+        }
+        else if (msg.type == MessageType::FILE_BUNDLE) {
+            std::function<bool(uint64_t)> accept;
+            if (sequenced) {
+                accept = [this, &msg](uint64_t sequence) { return acceptSequence(msg, sequence); };
+            }
+            msg.filePath = decryptToDirectory(symKey, content, accept);
+            msg.status = msg.filePath.empty() ? MessageStatus::DUPLICATE : MessageStatus::DELIVERED;
+        }
+        else {
+            MemoryCharge textCharge(MemorySubsystem::CRYPTO);
+            if (!textCharge.tryUpdate(2 * content.size())) {
+                throw std::runtime_error("A text of " + std::to_string(content.size()) + " bytes does not fit the memory budget.");
+            }
+            std::vector<uint8_t> ciphertext;
+            if (!content.read(ciphertext)) {
+                throw std::runtime_error("Failed to read the message content.");
+            }
+            auto plaintext = CryptoWrapper::aesDecrypt(symKey, ciphertext);
+            msg.status = storePlaintext(msg, plaintext, sequenced) ? MessageStatus::DELIVERED : MessageStatus::DUPLICATE;
+        }
+    }
+    catch (const std::exception& e) {
+        msg.status = MessageStatus::DECRYPT_FAILED;
+        msg.error = e.what();
+    }
+}
+
+/**
+ * @brief Decrypts file or stream content a chunk at a time into a new temp file.
+ * A stored stream is a series of separately encrypted chunks, each preceded by its size, which
+ * are decrypted in order and joined.
+ * @param type FILE_SEND or STREAM.
+ * @param symKey The sender's symmetric key.
+ * @param content The encrypted content.
+ * @param acceptSequence For a numbered FILE_SEND, called with the number from its SequenceHeader
+ *        as soon as it is decrypted; returning false stops decrypting. Empty if not numbered.
+ * @return The path of the temp file, or "" if acceptSequence returned false.
+ * @throws std::runtime_error if the content cannot be read or decrypted; no file is left behind.
+ */
+std::string Session::decryptToFile(MessageType type, const std::vector<uint8_t>& symKey, const ContentSource& content,
+    const std::function<bool(uint64_t)>& acceptSequence) {
+    std::string path = FileHandler::tempFilePath();
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Failed to open temp file for writing: " + path);
+    }
+    MemoryCharge plaintextCharge(MemorySubsystem::CRYPTO);
+    if (!plaintextCharge.waitUpdate(CONTENT_CHUNK_SIZE + CryptoPP::AES::BLOCKSIZE, MEMORY_WAIT_TIMEOUT)) {
+        throw std::runtime_error("The memory budget has no room for decrypting.");
+    }
+    std::vector<uint8_t> plaintext;
+    plaintext.reserve(CONTENT_CHUNK_SIZE + CryptoPP::AES::BLOCKSIZE);
+    auto flush = [&file, &plaintext]() {
+        file.write(reinterpret_cast<const char*>(plaintext.data()), plaintext.size());
+        plaintext.clear();
+        return static_cast<bool>(file);
+    };
+
+    try {
+        bool decrypted;
+        bool duplicate = false;
+        if (type == MessageType::FILE_SEND) {
+            // A numbered file starts with its SequenceHeader, which is taken off the plaintext and
+            // checked before anything is written.
+            SequenceHeader header{};
+            size_t headerReceived = acceptSequence ? 0 : sizeof(header);
+            auto takeHeader = [&]() {
+                if (headerReceived == sizeof(header)) {
+                    return true;
+                }
+                size_t take = std::min(plaintext.size(), sizeof(header) - headerReceived);
+                memcpy(reinterpret_cast<uint8_t*>(&header) + headerReceived, plaintext.data(), take);
+                plaintext.erase(plaintext.begin(), plaintext.begin() + take);
+                headerReceived += take;
+                duplicate = headerReceived == sizeof(header) && !acceptSequence(header.sequence);
+                return !duplicate;
+            };
+            AesStream aes(symKey, AesStream::Direction::DECRYPT);
+            decrypted = content.forEachChunk([&](const uint8_t* data, size_t size) {
+                aes.update(data, size, plaintext);
+                return takeHeader() && flush();
+            });
+            if (decrypted) {
+                aes.finish(plaintext);
+                decrypted = takeHeader() && flush();
+            }
+            if (!duplicate && headerReceived != sizeof(header)) {
+                throw std::runtime_error("truncated sequence header");
+            }
+        }
+        else {
+            StreamChunkHeader header{};
+            size_t headerReceived = 0;
+            uint64_t chunkRemaining = 0;
+            std::unique_ptr<AesStream> aes;
+            decrypted = content.forEachChunk([&](const uint8_t* data, size_t size) {
+                while (size > 0) {
+                    if (!aes) {
+                        size_t take = std::min(size, sizeof(header) - headerReceived);
+                        memcpy(reinterpret_cast<uint8_t*>(&header) + headerReceived, data, take);
+                        headerReceived += take;
+                        data += take;
+                        size -= take;
+                        if (headerReceived < sizeof(header)) {
+                            continue;
+                        }
+                        headerReceived = 0;
+                        chunkRemaining = header.chunkSize;
+                        aes = std::make_unique<AesStream>(symKey, AesStream::Direction::DECRYPT);
+                    }
+                    size_t take = static_cast<size_t>(std::min<uint64_t>(size, chunkRemaining));
+                    aes->update(data, take, plaintext);
+                    data += take;
+                    size -= take;
+                    chunkRemaining -= take;
+                    if (chunkRemaining == 0) {
+                        aes->finish(plaintext);
+                        aes.reset();
+                    }
+                    if (!flush()) {
+                        return false;
+                    }
+                }
+                return true;
+            });
+            if (aes || headerReceived != 0) {
+                throw std::runtime_error("truncated stream");
+            }
+        }
+        if (duplicate) {
+            file.close();
+            boost::system::error_code ec;
+            boost::filesystem::remove(path, ec);
+            return std::string();
+        }
+        if (!decrypted) {
+            throw std::runtime_error("Failed to decrypt the message content to " + path);
+        }
+    }
+    catch (const std::exception&) {
+        file.close();
+        boost::system::error_code ec;
+        boost::filesystem::remove(path, ec);
+        throw;
+    }
+    return path;
+}
+
+/**
+ * @brief Decrypts FILE_BUNDLE content a chunk at a time, unpacking it into a new temp directory.
+ * Each file is written as its bytes are decrypted, so neither the bundle nor a file of it is
+ * ever held whole.
+ * @param symKey The sender's symmetric key.
+ * @param content The encrypted content.
+ * @param acceptSequence For a numbered bundle, called with the number from its SequenceHeader
+ *        as soon as it is decrypted; returning false stops decrypting. Empty if not numbered.
+ * @return The path of the directory, or "" if acceptSequence returned false.
+ * @throws std::runtime_error if the content cannot be read, decrypted or unpacked; no directory is left behind.
+ */
+std::string Session::decryptToDirectory(const std::vector<uint8_t>& symKey, const ContentSource& content,
+    const std::function<bool(uint64_t)>& acceptSequence) {
+    BundleUnpacker bundle(FileHandler::tempFilePath());
+    MemoryCharge plaintextCharge(MemorySubsystem::CRYPTO);
+    if (!plaintextCharge.waitUpdate(CONTENT_CHUNK_SIZE + CryptoPP::AES::BLOCKSIZE, MEMORY_WAIT_TIMEOUT)) {
+        throw std::runtime_error("The memory budget has no room for decrypting.");
+    }
+    std::vector<uint8_t> plaintext;
+    plaintext.reserve(CONTENT_CHUNK_SIZE + CryptoPP::AES::BLOCKSIZE);
+
+    // The SequenceHeader is taken off the plaintext and checked before anything is unpacked.
+    SequenceHeader header{};
+    size_t headerReceived = acceptSequence ? 0 : sizeof(header);
+    bool duplicate = false;
+    auto unpack = [&]() {
+        size_t offset = 0;
+        if (headerReceived < sizeof(header)) {
+            offset = std::min(plaintext.size(), sizeof(header) - headerReceived);
+            memcpy(reinterpret_cast<uint8_t*>(&header) + headerReceived, plaintext.data(), offset);
+            headerReceived += offset;
+            duplicate = headerReceived == sizeof(header) && !acceptSequence(header.sequence);
+            if (duplicate) {
+                return false;
+            }
+        }
+        bundle.write(plaintext.data() + offset, plaintext.size() - offset);
+        plaintext.clear();
+        return true;
+    };
+    AesStream aes(symKey, AesStream::Direction::DECRYPT);
+    bool decrypted = content.forEachChunk([&](const uint8_t* data, size_t size) {
+        aes.update(data, size, plaintext);
+        return unpack();
+    });
+    if (decrypted) {
+        aes.finish(plaintext);
+        decrypted = unpack();
+    }
+    if (duplicate) {
+        return std::string();
+    }
+    if (!decrypted) {
+        throw std::runtime_error("Failed to decrypt the message content to " + bundle.directory());
+    }
+    if (headerReceived != sizeof(header)) {
+        throw std::runtime_error("truncated sequence header");
+    }
+    bundle.finish();
+    return bundle.directory();
+}
+
+/**
+ * @brief Decrypts all messages parked for a sender and reports them through the callback.
+ * Called once a SYM_KEY_SEND from the sender has been processed. Parked texts and files that
+ * fit the memory budget together are loaded and decrypted as one parallel batch; stored streams,
+ * chunked files and anything larger are decrypted from their files a chunk at a time. All are then reported
+ * in their original order and removed from the queue.
+ * @param keyMessage The SYM_KEY_SEND message that carried the key.
+ * @param symKey The sender's symmetric key.
+ * @param onMessage The callback to report messages through.
+ */
+void Session::drainPendingMessages(const IncomingMessage& keyMessage, const std::vector<uint8_t>& symKey, const MessageCallback& onMessage) {
+    auto parked = _pendingQueue.messages(keyMessage.senderID);
+    if (parked.empty()) {
+        return;
+    }
+    LOG_DEBUG("session", "Decrypting deferred messages", logField("from", keyMessage.senderName), logField("count", parked.size()));
+
+    // Messages are parked with their type as received, so whether each is numbered is known again here.
+    std::vector<MessageType> types(parked.size());
+    std::vector<bool> sequenced(parked.size());
+    for (size_t i = 0; i < parked.size(); i++) {
+        bool numbered;
+        types[i] = receivedType(parked[i].type, numbered);
+        sequenced[i] = numbered;
+    }
+
+    // Each batched message is charged twice its size, leaving room for its plaintext.
+    std::vector<std::vector<uint8_t>> ciphertexts(parked.size());
+    std::vector<bool> batched(parked.size(), false);
+    MemoryCharge batchCharge(MemorySubsystem::FILE_IO);
+    for (size_t i = 0; i < parked.size(); i++) {
+        if (types[i] != MessageType::STREAM && types[i] != MessageType::FILE_CHUNKED && types[i] != MessageType::FILE_BUNDLE && batchCharge.tryUpdate(batchCharge.bytes() + 2 * parked[i].size)) {
+            batched[i] = parked[i].content().read(ciphertexts[i]);
+        }
+    }
+    auto plaintexts = CryptoWrapper::aesDecryptBatch(symKey, ciphertexts);
+    ciphertexts.clear();
+
+    for (size_t i = 0; i < parked.size(); i++) {
+        IncomingMessage msg;
+        msg.senderID = keyMessage.senderID;
+        msg.senderName = keyMessage.senderName;
+        msg.messageID = parked[i].messageID;
+        msg.type = types[i];
+        msg.deferred = true;
+        if (!batched[i]) {
+            decryptContent(msg, symKey, parked[i].content(), sequenced[i]);
+        }
+        else if (!plaintexts[i]) {
+            msg.status = MessageStatus::DECRYPT_FAILED;
+            msg.error = "decryption failed";
+        }
+        else {
+            try {
+                if (!storePlaintext(msg, *plaintexts[i], sequenced[i])) {
+                    msg.status = MessageStatus::DUPLICATE;
+                }
+            }
+            catch (const std::exception& e) {
+                msg.status = MessageStatus::DECRYPT_FAILED;
+                msg.error = e.what();
+            }
+            plaintexts[i].reset();
+        }
+        if (msg.status != MessageStatus::DUPLICATE) {
+            onMessage(msg);
+        }
+    }
+    _pendingQueue.clear(keyMessage.senderID);
+}
+
+/**
+ * @brief Fetches and processes all waiting messages from the server.
+ * This function handles different message types like key requests, keys, text, and files.
+ * @param onMessage Called once per processed message, in order.
+ * @return The status of the operation.
+ */
+SessionStatus Session::pullMessages(const MessageCallback& onMessage) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    // A server that limits the batch size keeps the rest for the next pull, so pull again
+    // until a response comes back short.
+    for (;;) {
+        // The response is a stream of messages, indexed as it arrives and kept in memory or,
+        // if it does not fit the memory budget, in a temp file.
+        PullSpool spool;
+        auto response = _communicator->sendAndReceive(RequestCode::PULL_MESSAGES, {}, _userInfo->uuid, &spool);
+        if (!response) {
+            return SessionStatus::REQUEST_FAILED;
+        }
+        if (!spool.complete()) {
+            LOG_ERROR("session", "Truncated message in pull response", logField("messages", spool.messages().size()));
+            return SessionStatus::REQUEST_FAILED;
+        }
+        LOG_DEBUG("session", "Pulled messages", logField("count", spool.messages().size()), logField("spilled", spool.spilled()));
+        for (const auto& pulledMessage : spool.messages()) {
+            ContentSource content = spool.content(pulledMessage);
+            IncomingMessage msg;
+            msg.senderID = pulledMessage.senderID;
+            msg.messageID = pulledMessage.messageID;
+            bool sequenced;
+            msg.type = receivedType(pulledMessage.type, sequenced);
+
+            // Find the sender among the contacts, looking them up if they are not cached.
+            auto* sender = resolveClientByID(msg.senderID);
+            msg.senderName = sender ? sender->name : "Unknown";
+            LOG_DEBUG("session", "Received message", logField("from", msg.senderName), logField("id", msg.messageID),
+                logField("type", msg.type), logField("size", content.size()));
+
+            // Handle the message based on its type.
+            switch (msg.type) {
+            case MessageType::SYM_KEY_REQUEST:
+                onMessage(msg);
+                break;
+            case MessageType::SYM_KEY_SEND: {
+                std::vector<uint8_t> symKey;
+                try {
+                    // Decrypt the symmetric key with our private RSA key.
+                    std::vector<uint8_t> encryptedKey;
+                    if (content.size() > MAX_SYM_KEY_CONTENT || !content.read(encryptedKey)) {
+                        throw std::runtime_error("invalid symmetric key content");
+                    }
+                    symKey = CryptoWrapper::rsaDecrypt(_privateKey, encryptedKey);
+                }
+                catch (...) {
+                    msg.status = MessageStatus::DECRYPT_FAILED;
+                    msg.error = "Failed to decrypt symmetric key.";
+                }
+                if (msg.status == MessageStatus::DELIVERED && sender) {
+                    sender->symKey = symKey;
+                }
+                if (msg.status == MessageStatus::DELIVERED) {
+                    startConversation(msg.senderID);
+                }
+                onMessage(msg);
+                // Messages from this sender that arrived before the key can be decrypted now.
+                if (msg.status == MessageStatus::DELIVERED) {
+                    drainPendingMessages(msg, symKey, onMessage);
+                }
+                break;
+            }
+            case MessageType::TEXT_MESSAGE:
+            case MessageType::FILE_SEND:
+            case MessageType::FILE_CHUNKED:
+            case MessageType::FILE_BUNDLE:
+            case MessageType::STREAM:
+                if (sender && !sender->symKey.empty()) {
+                    // Decrypt the content with the shared symmetric key.
+                    decryptContent(msg, sender->symKey, content, sequenced);
+                }
+                else if (_pendingQueue.park(msg.senderID, msg.messageID, pulledMessage.type, content)) {
+                    // The server has already deleted the message, so keep it until the key arrives.
+                    msg.status = MessageStatus::DEFERRED;
+                }
+                else {
+                    msg.status = MessageStatus::NO_SYM_KEY;
+                }
+                // A copy of a message received already, e.g. stored twice by a retried send, is dropped.
+                if (msg.status != MessageStatus::DUPLICATE) {
+                    onMessage(msg);
+                }
+                break;
+            case MessageType::FILE_CHUNK_REQUEST:
+                // Only the sender of a file asks for its chunks, so the key is already established;
+                // a request that cannot be decrypted is not parked.
+                if (sender && !sender->symKey.empty()) {
+                    resendChunks(msg, *sender, content);
+                }
+                else {
+                    msg.status = MessageStatus::NO_SYM_KEY;
+                }
+                onMessage(msg);
+                break;
+            default:
+                onMessage(msg);
+            }
+        }
+        size_t maxBatch = _communicator->capabilities().maxBatch;
+        if (maxBatch == 0 || spool.messages().size() < maxBatch) {
+            break;
+        }
+    }
+    return SessionStatus::OK;
+}
+
+/**
+ * @brief Opens a stream to another client.
+ * Streams live on the current connection, so they require a server that negotiated
+ * both streams and persistent connections.
+ * @param username The recipient's name.
+ * @param streamID Receives the stream ID.
+ * @param live Receives true if the chunks are relayed live.
+ * @return The status of the operation.
+ */
+SessionStatus Session::openStream(const std::string& username, uint32_t& streamID, bool& live) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    ClientInfo* client = resolveClient(username);
+    if (!client) {
+        return SessionStatus::UNKNOWN_CLIENT;
+    }
+    // Every chunk is encrypted with the shared symmetric key.
+    if (client->symKey.empty()) {
+        return SessionStatus::NO_SYM_KEY;
+    }
+    // resolveClient has connected and negotiated by now, unless the clients list was already known.
+    auto caps = _communicator->capabilities();
+    if (caps.negotiated && !(caps.supports(CAP_STREAMS) && caps.supports(CAP_PERSISTENT_CONNECTION))) {
+        return SessionStatus::NOT_SUPPORTED;
+    }
+
+    auto response = _communicator->sendAndReceive(RequestCode::STREAM_OPEN, ProtocolCodec::encodeStreamOpen(client->id), _userInfo->uuid);
+    auto opened = response ? ProtocolCodec::decodeStreamOpened(*response) : std::nullopt;
+    if (!opened) {
+        caps = _communicator->capabilities();
+        return caps.supports(CAP_STREAMS) ? SessionStatus::REQUEST_FAILED : SessionStatus::NOT_SUPPORTED;
+    }
+    streamID = opened->streamID;
+    live = opened->delivery == StreamDelivery::LIVE;
+    _streams[streamID] = OutgoingStream{ client->id, 0 };
+    LOG_DEBUG("session", "Opened stream", logField("stream", streamID), logField("to", username), logField("live", live));
+    return SessionStatus::OK;
+}
+
+/**
+ * @brief Encrypts and sends one chunk of an open stream.
+ * The chunk is written without waiting for the server, so chunks can be sent as fast
+ * as they are produced; closeStream confirms how many arrived.
+ * @param streamID The stream ID returned by openStream.
+ * @param data The chunk.
+ * @return The status of the operation.
+ */
+SessionStatus Session::writeStream(uint32_t streamID, const std::vector<uint8_t>& data) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    auto it = _streams.find(streamID);
+    if (it == _streams.end()) {
+        return SessionStatus::UNKNOWN_STREAM;
+    }
+    ClientInfo* client = findClientByID(it->second.recipientID);
+    if (!client || client->symKey.empty()) {
+        return SessionStatus::NO_SYM_KEY;
+    }
+
+    std::vector<uint8_t> ciphertext;
+    try {
+        ciphertext = CryptoWrapper::aesEncrypt(client->symKey, data);
+    }
+    catch (const std::exception&) {
+        return SessionStatus::CRYPTO_ERROR;
+    }
+    MemoryCharge ciphertextCharge(MemorySubsystem::CRYPTO, ciphertext.capacity());
+    if (!_communicator->post(RequestCode::STREAM_DATA, ProtocolCodec::encodeStreamData(streamID, ciphertext), _userInfo->uuid)) {
+        return SessionStatus::REQUEST_FAILED;
+    }
+    it->second.chunksSent++;
+    return SessionStatus::OK;
+}
+
+/**
+ * @brief Closes a stream and checks that the server received every chunk.
+ * @param streamID The stream ID returned by openStream.
+ * @return The status of the operation.
+ */
+SessionStatus Session::closeStream(uint32_t streamID) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    auto it = _streams.find(streamID);
+    if (it == _streams.end()) {
+        return SessionStatus::UNKNOWN_STREAM;
+    }
+    uint32_t chunksSent = it->second.chunksSent;
+    _streams.erase(it);
+
+    auto response = _communicator->sendAndReceive(RequestCode::STREAM_CLOSE, ProtocolCodec::encodeStreamClose(streamID), _userInfo->uuid);
+    auto closed = response ? ProtocolCodec::decodeStreamClosed(*response) : std::nullopt;
+    if (!closed || closed->chunkCount != chunksSent) {
+        LOG_ERROR("session", "Stream closed with chunks missing", logField("stream", streamID),
+            logField("received", closed ? closed->chunkCount : 0), logField("sent", chunksSent));
+        return SessionStatus::REQUEST_FAILED;
+    }
+    return SessionStatus::OK;
+}
+
+/**
+ * @brief Decodes, decrypts and reports a stream push.
+ * @param push The push received from the server.
+ * @param onEvent The callback to report the event through.
+ */
+void Session::deliverStreamPush(ProtocolEvent&& push, const StreamCallback& onEvent) {
+    auto decoded = ProtocolCodec::decodeStreamPush(std::move(push.payload));
+    if (!decoded) {
+        LOG_WARN("session", "Malformed stream push", logField("size", push.payload.size()));
+        return;
+    }
+    StreamEvent event;
+    event.senderID = std::move(decoded->senderID);
+    event.streamID = decoded->streamID;
+    event.type = decoded->event;
+
+    auto* sender = resolveClientByID(event.senderID);
+    event.senderName = sender ? sender->name : "Unknown";
+
+    if (event.type == StreamEventType::DATA) {
+        if (!sender || sender->symKey.empty()) {
+            event.status = MessageStatus::NO_SYM_KEY;
+        }
+        else {
+            try {
+                event.data = CryptoWrapper::aesDecrypt(sender->symKey, decoded->content);
+            }
+            catch (const std::exception&) {
+                event.status = MessageStatus::DECRYPT_FAILED;
+            }
+        }
+    }
+    MemoryCharge dataCharge(MemorySubsystem::CRYPTO, event.data.capacity());
+    onEvent(event);
+}
+
+/**
+ * @brief Waits for live stream events and reports them through the callback.
+ * Presence changes that arrive meanwhile are dropped; use waitForEvents to receive both.
+ * @param onEvent Called once per event, in order.
+ * @param timeout How long to wait for the first event.
+ * @return OK (also on timeout), EVENTS_LOST, NOT_SUPPORTED, or REQUEST_FAILED.
+ */
+SessionStatus Session::waitForStreams(const StreamCallback& onEvent, std::chrono::milliseconds timeout) {
+    return waitForEvents(onEvent, nullptr, timeout);
+}
+
+/**
+ * @brief Decodes and reports presence entries.
+ * @param payload A presence response (2109) or push (2110) payload.
+ * @param onChange The callback to report each entry through.
+ */
+void Session::deliverPresence(const std::vector<uint8_t>& payload, const PresenceCallback& onChange) {
+    auto updates = ProtocolCodec::decodePresence(payload);
+    if (!updates) {
+        LOG_WARN("session", "Malformed presence payload", logField("size", payload.size()));
+        return;
+    }
+    for (auto& update : *updates) {
+        auto watched = _watched.find(update.clientID);
+        PresenceChange change;
+        change.name = watched != _watched.end() ? watched->second : "Unknown";
+        change.clientID = std::move(update.clientID);
+        change.online = update.online;
+        onChange(change);
+    }
+}
+
+/**
+ * @brief Watches the presence of the named clients, replacing any earlier set.
+ * @param usernames The clients to watch; empty to stop watching.
+ * @param onChange Called once per watched client with its current presence.
+ * @return OK, UNKNOWN_CLIENT, NOT_SUPPORTED, or REQUEST_FAILED.
+ */
+SessionStatus Session::watchPresence(const std::vector<std::string>& usernames, const PresenceCallback& onChange) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    std::vector<ClientInfo> clients;
+    clients.reserve(usernames.size());
+    for (const auto& username : usernames) {
+        ClientInfo* client = resolveClient(username);
+        if (!client) {
+            return SessionStatus::UNKNOWN_CLIENT;
+        }
+        ClientInfo watched;
+        watched.id = client->id;
+        watched.name = client->name;
+        clients.push_back(std::move(watched));
+    }
+    return watchPresence(clients, onChange);
+}
+
+/**
+ * @brief Watches the presence of clients already known, replacing any earlier set.
+ * Their names are kept for as long as they are watched, so changes are reported by name
+ * without keeping them in the contact cache.
+ * @param clients The clients to watch; empty to stop watching.
+ * @param onChange Called once per watched client with its current presence.
+ * @return OK, NOT_SUPPORTED, or REQUEST_FAILED.
+ */
+SessionStatus Session::watchPresence(const std::vector<ClientInfo>& clients, const PresenceCallback& onChange) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    std::vector<std::vector<uint8_t>> clientIDs;
+    clientIDs.reserve(clients.size());
+    for (const auto& client : clients) {
+        clientIDs.push_back(client.id);
+    }
+    // Changes are pushed over the connection, so it has to stay open.
+    auto caps = _communicator->capabilities();
+    if (caps.negotiated && !(caps.supports(CAP_PRESENCE) && caps.supports(CAP_PERSISTENT_CONNECTION))) {
+        return SessionStatus::NOT_SUPPORTED;
+    }
+
+    auto response = _communicator->sendAndReceive(RequestCode::PRESENCE_SUBSCRIBE, ProtocolCodec::encodePresenceSubscribe(clientIDs), _userInfo->uuid);
+    if (!response) {
+        caps = _communicator->capabilities();
+        return caps.supports(CAP_PRESENCE) ? SessionStatus::REQUEST_FAILED : SessionStatus::NOT_SUPPORTED;
+    }
+    _watched.clear();
+    for (const auto& client : clients) {
+        _watched[client.id] = client.name;
+    }
+    chargeDirectory();
+    deliverPresence(*response, onChange);
+    return SessionStatus::OK;
+}
+
+/**
+ * @brief Waits for live stream events and presence changes and reports them through the callbacks.
+ * Pushes dropped since the last call, while waiting or while a request was answered, are
+ * reported as EVENTS_LOST after the events that did arrive.
+ * @param onStream Called once per stream event, in order; events are dropped if empty.
+ * @param onPresence Called once per presence change; changes are dropped if empty.
+ * @param timeout How long to wait for the first event.
+ * @return OK (also on timeout), EVENTS_LOST, NOT_SUPPORTED, or REQUEST_FAILED.
+ */
+SessionStatus Session::waitForEvents(const StreamCallback& onStream, const PresenceCallback& onPresence, std::chrono::milliseconds timeout) {
+    if (!_userInfo) { return SessionStatus::NOT_REGISTERED; }
+    auto push = _communicator->waitForPush(timeout);
+    if (!push) {
+        if (_communicator->lastError().empty()) {
+            return checkDroppedPushes();
+        }
+        auto caps = _communicator->capabilities();
+        return caps.supports(CAP_STREAMS) || caps.supports(CAP_PRESENCE) ? SessionStatus::REQUEST_FAILED : SessionStatus::NOT_SUPPORTED;
+    }
+    // Report everything that arrived together without waiting again.
+    while (push) {
+        if (push->code == ResponseCode::PRESENCE_PUSH) {
+            if (onPresence) {
+                deliverPresence(push->payload, onPresence);
+            }
+        }
+        else if (onStream) {
+            deliverStreamPush(std::move(*push), onStream);
+        }
+        push.reset();
+        if (_communicator->hasPush()) {
+            push = _communicator->waitForPush(std::chrono::milliseconds(0));
+        }
+    }
+    return checkDroppedPushes();
+}
+
+/**
+ * @brief Checks whether the communicator dropped pushes since the last check.
+ * A push is dropped when the unread ones exceed MAX_QUEUED_PUSH_BYTES or one does not fit
+ * the memory budget; a stream then misses chunks, or a presence change is not seen.
+ * @return EVENTS_LOST if it did, once per batch of drops; OK otherwise.
+ */
+SessionStatus Session::checkDroppedPushes() {
+    size_t dropped = _communicator->droppedPushes();
+    if (dropped == _droppedPushesReported) {
+        return SessionStatus::OK;
+    }
+    LOG_ERROR("session", "Pushes were dropped before they were read", logField("count", dropped - _droppedPushesReported));
+    _droppedPushesReported = dropped;
+    return SessionStatus::EVENTS_LOST;
+}
@@ -0,0 +1,380 @@
+// Session.h
+// author: Ariel Cohen ID: 329599187
+
+#pragma once
+#include "ChunkedFile.h"
+#include "Communicator.h"
+#include "ContactCache.h"
+#include "CryptoWrapper.h"
+#include "FileHandler.h"
+#include "MemoryStats.h"
+#include "PendingQueue.h"
+#include "ProtocolCodec.h"
+#include "SequenceWindow.h"
+#include "Spool.h"
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+
+/**
+ * @brief Result codes returned by Session operations.
+ */
+enum class SessionStatus {
+    OK,                 ///< The operation succeeded.
+    NOT_REGISTERED,     ///< No identity is loaded; register first.
+    ALREADY_REGISTERED, ///< An identity file already exists.
+    UNKNOWN_CLIENT,     ///< The named client is not known to the server.
+    NO_PUBLIC_KEY,      ///< The recipient's public key could not be retrieved.
+    NO_SYM_KEY,         ///< No symmetric key is established with the recipient.
+    FILE_ERROR,         ///< A local file could not be read or written.
+    REQUEST_FAILED,     ///< The server returned an error or could not be reached.
+    CRYPTO_ERROR,       ///< An encryption or key generation step failed.
+    NOT_SUPPORTED,      ///< The server does not support the operation.
+    UNKNOWN_STREAM,     ///< No stream with the given ID is open in this session.
+    EVENTS_LOST,        ///< Pushes were dropped because too many were left unread; the events that arrived were still reported.
+};
+
+/**
+ * @brief The outcome of processing a single pulled message.
+ */
+enum class MessageStatus {
+    DELIVERED,      ///< The message was processed; decrypted content (if any) is available.
+    DEFERRED,       ///< No symmetric key yet; the message was parked in the pending queue.
+    NO_SYM_KEY,     ///< No symmetric key yet and the pending queue is full; the message is lost.
+    DECRYPT_FAILED, ///< The content could not be decrypted or saved.
+    REPAIRING,      ///< Some chunks of a FILE_CHUNKED file failed verification and were requested again from the sender.
+    DUPLICATE,      ///< A copy of a message received already; it is dropped and never reported.
+};
+
+/**
+ * @brief A message pulled from the server, after decryption.
+ */
+struct IncomingMessage {
+    std::vector<uint8_t> senderID; ///< The sender's UUID.
+    std::string senderName;        ///< The sender's name, or "Unknown" if the server does not know them.
+    uint32_t messageID = 0;        ///< The server-side message ID.
+    MessageType type{};            ///< The message type.
+    MessageStatus status = MessageStatus::DELIVERED;
+    std::string text;              ///< Decrypted text for TEXT_MESSAGE.
+    std::string filePath;          ///< Path of the saved file for FILE_SEND, FILE_CHUNKED and STREAM; of the unpacked directory for FILE_BUNDLE; of the file sent again for FILE_CHUNK_REQUEST.
+    std::string error;             ///< Error details when status is DECRYPT_FAILED or REPAIRING.
+    bool deferred = false;         ///< True if the message was parked earlier and decrypted from the pending queue.
+    uint64_t sequence = 0;         ///< The message's number in its conversation with the sender; 0 if it is not numbered.
+    uint64_t skipped = 0;          ///< Numbers skipped right before this one: messages from the sender lost, or still to come.
+};
+
+/**
+ * @brief An event of a live stream from another client, after decryption.
+ */
+struct StreamEvent {
+    std::vector<uint8_t> senderID; ///< The sender's UUID.
+    std::string senderName;        ///< The sender's name, or "Unknown" if the server does not know them.
+    uint32_t streamID = 0;         ///< The server-assigned stream ID.
+    StreamEventType type{};        ///< What happened to the stream.
+    MessageStatus status = MessageStatus::DELIVERED; ///< DATA events only: NO_SYM_KEY or DECRYPT_FAILED if data is unavailable.
+    std::vector<uint8_t> data;     ///< The decrypted chunk for DATA events.
+};
+
+/**
+ * @brief The presence of a watched client.
+ */
+struct PresenceChange {
+    std::vector<uint8_t> clientID; ///< The client's UUID.
+    std::string name;              ///< The client's name, or "Unknown" if it is no longer watched.
+    bool online = false;           ///< True while the client has an open connection to the server.
+};
+
+/**
+ * @brief Paths of the files a Session reads and writes.
+ */
+struct SessionConfig {
+    std::string serverInfoFile = "server.info"; ///< Server address file.
+    std::string myInfoFile = "my.info";         ///< Identity file (name, UUID, private key).
+    std::string pendingDirectory = "pending";   ///< Root of the pending (undecryptable) message queue.
+    size_t contactCacheSize = DEFAULT_CONTACT_CACHE_SIZE; ///< Contacts kept in memory before evicting; 0 for no limit.
+};
+
+/**
+ * @brief A MessageU session: identity, contacts, keys, and the protocol operations.
+ * This class holds all protocol, crypto and transport logic and performs no console I/O,
+ * so it can be used both by the console client and by the embeddable library.
+ * The large buffers it holds while sending and pulling are charged to MemoryStats and stay
+ * within its budget: texts and files are encrypted while they are sent, pulled messages are
+ * decrypted a chunk at a time, and a pull too large for the budget is spilled to a temp file.
+ * It is not thread-safe; callers must serialize access.
+ */
+class Session {
+public:
+    using MessageCallback = std::function<void(const IncomingMessage&)>;
+    using StreamCallback = std::function<void(const StreamEvent&)>;
+    using PresenceCallback = std::function<void(const PresenceChange&)>;
+
+    /**
+     * @brief Opens a session: reads the server address and, if present, the identity file.
+     * @param config The file locations to use.
+     * @throws std::runtime_error if the server info file is missing or invalid.
+     */
+    explicit Session(const SessionConfig& config = SessionConfig());
+
+    /**
+     * @brief Closes the session, deleting files whose chunks are still being received.
+     */
+    ~Session();
+
+    /**
+     * @brief Returns true if an identity (my.info) is loaded.
+     */
+    bool isRegistered() const { return _userInfo.has_value(); }
+
+    /**
+     * @brief Returns the loaded identity, if any.
+     */
+    const std::optional<UserInfo>& userInfo() const { return _userInfo; }
+
+    /**
+     * @brief Returns a description of the last transport or server error.
+     */
+    const std::string& lastError() const { return _communicator->lastError(); }
+
+    /**
+     * @brief Registers a new user, generating an RSA key pair and writing the identity file.
+     * @param username The name to register.
+     */
+    SessionStatus registerUser(const std::string& username);
+
+    /**
+     * @brief Fetches the list of registered clients from the server.
+     * The list is only returned, not kept: contacts are looked up one by one as they are used.
+     * @param clients Receives the clients (without keys).
+     */
+    SessionStatus listClients(std::vector<ClientInfo>& clients);
+
+    /**
+     * @brief Finds a client by name among the cached contacts.
+     * @return A pointer to the client, valid until another contact is cached, or nullptr if not found.
+     */
+    ClientInfo* findClientByName(const std::string& name);
+
+    /**
+     * @brief Finds a client by UUID among the cached contacts.
+     * @return A pointer to the client, valid until another contact is cached, or nullptr if not found.
+     */
+    ClientInfo* findClientByID(const std::vector<uint8_t>& id);
+
+    /**
+     * @brief Finds a client by name, looking it up on the server if it is not cached.
+     * @return A pointer to the client, valid until another contact is cached, or nullptr if not found.
+     */
+    ClientInfo* resolveClient(const std::string& name);
+
+    /**
+     * @brief Finds a client by UUID, looking it up on the server if it is not cached.
+     * @return A pointer to the client, valid until another contact is cached, or nullptr if not found.
+     */
+    ClientInfo* resolveClientByID(const std::vector<uint8_t>& id);
+
+    /**
+     * @brief Changes how many contacts are kept in memory, evicting those that no longer fit.
+     * Contacts with a symmetric key are never evicted.
+     * @param capacity The number of contacts; 0 for no limit.
+     */
+    void setContactCacheSize(size_t capacity);
+
+    /**
+     * @brief Requests a client's public key from the server and stores it with the cached contact.
+     * @param username The client's name.
+     */
+    SessionStatus requestPublicKey(const std::string& username);
+
+    /**
+     * @brief Sends an encrypted text message. Requires an established symmetric key.
+     * @param username The recipient's name.
+     * @param message The text to send.
+     */
+    SessionStatus sendText(const std::string& username, const std::string& message);
+
+    /**
+     * @brief Asks another client to send us a symmetric key.
+     * @param username The recipient's name.
+     */
+    SessionStatus sendSymKeyRequest(const std::string& username);
+
+    /**
+     * @brief Generates a new symmetric key and sends it, encrypted with the recipient's public key.
+     * The public key is requested from the server first if it is not known yet.
+     * @param username The recipient's name.
+     */
+    SessionStatus sendSymKey(const std::string& username);
+
+    /**
+     * @brief Sends an encrypted file. Requires an established symmetric key.
+     * Files of FILE_CHUNKED_THRESHOLD bytes or more are sent as FILE_CHUNKED, authenticated
+     * chunk by chunk, and kept track of so the recipient can ask for damaged chunks again.
+     * @param username The recipient's name.
+     * @param filepath The path of the file to send.
+     */
+    SessionStatus sendFile(const std::string& username, const std::string& filepath);
+
+    /**
+     * @brief Sends a directory, subdirectories included, as one encrypted FILE_BUNDLE message.
+     * Requires an established symmetric key. The regular files are indexed, then read and
+     * encrypted one after another into a single request; the recipient unpacks them into a new
+     * directory as the message is decrypted.
+     * @param username The recipient's name.
+     * @param dirpath The path of the directory to send.
+     */
+    SessionStatus sendDirectory(const std::string& username, const std::string& dirpath);
+
+    /**
+     * @brief Pulls all waiting messages and reports each one through the callback.
+     * Messages that cannot be decrypted yet are parked and reported again, decrypted,
+     * once their sender's symmetric key arrives. Copies of numbered messages received already,
+     * e.g. stored twice by a retried send, are dropped. A FILE_CHUNKED file with damaged chunks is
+     * reported as REPAIRING and again, complete, with the pull that brings the chunks sent again.
+     * @param onMessage Called once per processed message, in order, as soon as it is processed;
+     * it may call back into the session, as no reference into the session is held across it.
+     */
+    SessionStatus pullMessages(const MessageCallback& onMessage);
+
+    /**
+     * @brief Opens a stream to another client. Requires an established symmetric key.
+     * If the recipient is online its chunks are relayed live; otherwise they are stored
+     * as one STREAM message when the stream is closed.
+     * @param username The recipient's name.
+     * @param streamID Receives the stream ID.
+     * @param live Receives true if the chunks are relayed live.
+     */
+    SessionStatus openStream(const std::string& username, uint32_t& streamID, bool& live);
+
+    /**
+     * @brief Encrypts and sends one chunk of an open stream without waiting for the server.
+     * @param streamID The stream ID returned by openStream.
+     * @param data The chunk.
+     */
+    SessionStatus writeStream(uint32_t streamID, const std::vector<uint8_t>& data);
+
+    /**
+     * @brief Closes a stream.
+     * @param streamID The stream ID returned by openStream.
+     * @return REQUEST_FAILED if the server did not receive every chunk.
+     */
+    SessionStatus closeStream(uint32_t streamID);
+
+    /**
+     * @brief Waits for live stream events and reports them through the callback.
+     * Returns after the timeout, or right after reporting the events that arrived together.
+     * @param onEvent Called once per event, in order.
+     * @param timeout How long to wait for the first event.
+     */
+    SessionStatus waitForStreams(const StreamCallback& onEvent, std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Watches the presence of the named clients, replacing any earlier set.
+     * Their current presence is reported through onChange before returning; later changes
+     * arrive with waitForEvents, batched by the server.
+     * @param usernames The clients to watch; empty to stop watching.
+     * @param onChange Called once per watched client with its current presence.
+     */
+    SessionStatus watchPresence(const std::vector<std::string>& usernames, const PresenceCallback& onChange);
+
+    /**
+     * @brief Watches the presence of clients already known, e.g. from listClients, without looking them up.
+     * @param clients The clients to watch; empty to stop watching.
+     * @param onChange Called once per watched client with its current presence.
+     */
+    SessionStatus watchPresence(const std::vector<ClientInfo>& clients, const PresenceCallback& onChange);
+
+    /**
+     * @brief Waits for live stream events and presence changes and reports them through the callbacks.
+     * Returns after the timeout, or right after reporting the events that arrived together.
+     * @param onStream Called once per stream event, in order; events are dropped if empty.
+     * @param onPresence Called once per presence change; changes are dropped if empty.
+     * @param timeout How long to wait for the first event.
+     * @return EVENTS_LOST if pushes were dropped since the last call, e.g. stream chunks.
+     */
+    SessionStatus waitForEvents(const StreamCallback& onStream, const PresenceCallback& onPresence, std::chrono::milliseconds timeout);
+
+private:
+    // A stream opened by this session
+    struct OutgoingStream {
+        std::vector<uint8_t> recipientID; // the recipient's UUID
+        uint32_t chunksSent = 0;          // chunks written so far
+    };
+
+    // The numbering of the messages exchanged with a client under the current symmetric key
+    struct Conversation {
+        uint64_t lastSent = 0;   // the number of the last message sent to the client
+        SequenceWindow received; // the numbers received from the client
+    };
+
+    // A FILE_CHUNKED file sent by this session, kept to send chunks again on request
+    struct SentFile {
+        std::vector<uint8_t> recipientID; // the recipient's UUID
+        std::string path;                 // the file
+        std::vector<uint8_t> symKey;      // the key it was encrypted with
+        FileManifest manifest;            // every chunk of it
+    };
+
+    // Sends a SEND_MESSAGE request with the given type and content to a client
+    SessionStatus sendMessage(const ClientInfo& client, MessageType type, const std::vector<uint8_t>& content);
+    // Sends a SEND_MESSAGE request whose content is encrypted with the client's symmetric key while it is sent
+    SessionStatus sendEncrypted(const ClientInfo& client, MessageType type, const ContentSource& plaintext);
+    // Starts numbering the messages exchanged with a client afresh, when a new symmetric key is shared
+    void startConversation(const std::vector<uint8_t>& clientID);
+    // Returns the number of the next message sent to a client
+    uint64_t nextSequence(const std::vector<uint8_t>& clientID);
+    // Records the number of a message received in msg; returns false if it is a duplicate
+    bool acceptSequence(IncomingMessage& msg, uint64_t sequence);
+    // Fetches a client's public key from the server into the contact cache
+    SessionStatus fetchPublicKey(ClientInfo& client);
+    // Looks a client up on the server by UUID, or by name if id is empty, and caches it
+    ClientInfo* lookupClient(const std::vector<uint8_t>& id, const std::string& name);
+    // Sends a directory request (clients list, lookup, public key) to the replica, falling back to the server
+    std::optional<std::vector<uint8_t>> directoryRequest(RequestCode code, const std::vector<uint8_t>& payload);
+    // Reports a stream push through the callback
+    void deliverStreamPush(ProtocolEvent&& push, const StreamCallback& onEvent);
+    // Reports presence entries through the callback
+    void deliverPresence(const std::vector<uint8_t>& payload, const PresenceCallback& onChange);
+    // Decrypts the content of a text, file, directory or stream message into msg
+    void decryptContent(IncomingMessage& msg, const std::vector<uint8_t>& symKey, const ContentSource& content, bool sequenced);
+    // Decrypts file or stream content a chunk at a time into a new temp file and returns its path, or "" for a duplicate
+    static std::string decryptToFile(MessageType type, const std::vector<uint8_t>& symKey, const ContentSource& content,
+        const std::function<bool(uint64_t)>& acceptSequence = {});
+    // Decrypts FILE_BUNDLE content a chunk at a time into a new temp directory and returns its path, or "" for a duplicate
+    static std::string decryptToDirectory(const std::vector<uint8_t>& symKey, const ContentSource& content,
+        const std::function<bool(uint64_t)>& acceptSequence = {});
+    // Sends the chunks a manifest lists as a FILE_CHUNKED message
+    SessionStatus sendChunks(const ClientInfo& client, const SentFile& file, const FileManifest& manifest);
+    // Verifies and saves the chunks of a FILE_CHUNKED message; returns DELIVERED, REPAIRING or DUPLICATE
+    MessageStatus receiveChunkedFile(IncomingMessage& msg, const std::vector<uint8_t>& symKey, const ContentSource& content);
+    // Sends the chunks a FILE_CHUNK_REQUEST asks for again
+    void resendChunks(IncomingMessage& msg, const ClientInfo& sender, const ContentSource& content);
+    // Deletes a partially received file
+    void discardPartialFile(const FileID& fileID);
+    // Stores decrypted plaintext into msg (text or saved file); returns false if it is a duplicate
+    bool storePlaintext(IncomingMessage& msg, std::vector<uint8_t>& plaintext, bool sequenced);
+    // Decrypts all messages parked for a sender and reports them through the callback
+    void drainPendingMessages(const IncomingMessage& keyMessage, const std::vector<uint8_t>& symKey, const MessageCallback& onMessage);
+    // Charges the memory held by the contact cache to the directory subsystem
+    void chargeDirectory();
+    // Returns EVENTS_LOST, once, if the communicator dropped pushes since the last call; OK otherwise
+    SessionStatus checkDroppedPushes();
+
+    SessionConfig _config;                       // file locations
+    std::unique_ptr<Communicator> _communicator; // transport to the server
+    std::unique_ptr<Communicator> _directory;    // transport to a read-only replica, if server.info lists any
+    std::optional<UserInfo> _userInfo;           // the current user's identity
+    CryptoPP::RSA::PrivateKey _privateKey;       // the current user's private key
+    ContactCache _contacts;                      // the clients recently used, and those with a symmetric key
+    PendingQueue _pendingQueue;                  // messages received before their sender's symmetric key
+    std::map<uint32_t, OutgoingStream> _streams; // streams opened by this session, by stream ID
+    std::map<FileID, SentFile> _sentFiles;       // the last FILE_CHUNKED files sent, by file ID
+    std::deque<FileID> _sentOrder;               // the keys of _sentFiles, oldest first
+    std::map<FileID, PartialFile> _partialFiles; // FILE_CHUNKED files with chunks still missing, by file ID
+    std::map<std::vector<uint8_t>, Conversation> _conversations; // message numbering with each client a key is shared with, by UUID
+    std::map<std::vector<uint8_t>, std::string> _watched; // names of the clients whose presence is watched, by UUID
+    MemoryCharge _directoryCharge{MemorySubsystem::DIRECTORY}; // memory held by _contacts, _watched and _conversations
+    size_t _droppedPushesReported = 0;           // pushes dropped by _communicator that waitForEvents already reported
+};
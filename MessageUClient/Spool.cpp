@@ -0,0 +1,305 @@
+// Spool.cpp
+// author: Ariel Cohen ID: 329599187
+
+#include "Spool.h"
+#include "FileHandler.h"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <cstring>
+
+/**
+ * @brief Refers to bytes in memory.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @return The content.
+ */
+ContentSource ContentSource::memory(const uint8_t* data, size_t size) {
+    ContentSource source;
+    source._data = data;
+    source._size = size;
+    return source;
+}
+
+/**
+ * @brief Refers to a region of a file.
+ * @param path The file.
+ * @param offset Where the region starts.
+ * @param size The size of the region.
+ * @return The content.
+ */
+ContentSource ContentSource::file(const std::string& path, uint64_t offset, uint64_t size) {
+    ContentSource source;
+    source._path = path;
+    source._offset = offset;
+    source._size = size;
+    return source;
+}
+
+/**
+ * @brief Refers to the bytes of several contents, one after another.
+ * @param parts The contents, which are not copied: they must outlive the result.
+ * @return The content.
+ */
+ContentSource ContentSource::concat(const std::vector<ContentSource>& parts) {
+    ContentSource source;
+    source._parts = &parts;
+    for (const auto& part : parts) {
+        source._size += part._size;
+    }
+    return source;
+}
+
+/**
+ * @brief Reads all bytes into a buffer.
+ * @param out Receives the bytes.
+ * @return False if the file cannot be read.
+ */
+bool ContentSource::read(std::vector<uint8_t>& out) const {
+    out.resize(static_cast<size_t>(_size));
+    if (_size == 0) {
+        return true;
+    }
+    if (_data) {
+        std::copy_n(_data, out.size(), out.begin());
+        return true;
+    }
+    ContentReader reader(*this);
+    size_t filled = 0;
+    while (filled < out.size()) {
+        size_t count = reader.read(out.data() + filled, out.size() - filled);
+        if (count == 0) {
+            return false;
+        }
+        filled += count;
+    }
+    return true;
+}
+
+/**
+ * @brief Passes all bytes to a function, one chunk of at most CONTENT_CHUNK_SIZE bytes at a time.
+ * Content in memory is passed in place; content in a file is read into a buffer charged to
+ * MemorySubsystem::FILE_IO.
+ * @param consume Called once per chunk; returning false stops.
+ * @return False if consume returned false, the file cannot be read, or the budget has no room for the buffer.
+ */
+bool ContentSource::forEachChunk(const std::function<bool(const uint8_t*, size_t)>& consume) const {
+    if (_size == 0) {
+        return true;
+    }
+    if (_data) {
+        for (uint64_t offset = 0; offset < _size; offset += CONTENT_CHUNK_SIZE) {
+            if (!consume(_data + offset, static_cast<size_t>(std::min<uint64_t>(CONTENT_CHUNK_SIZE, _size - offset)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    MemoryCharge bufferCharge(MemorySubsystem::FILE_IO);
+    if (!bufferCharge.waitUpdate(CONTENT_CHUNK_SIZE, MEMORY_WAIT_TIMEOUT)) {
+        return false;
+    }
+    std::vector<uint8_t> buffer(CONTENT_CHUNK_SIZE);
+    ContentReader reader(*this);
+    while (reader.remaining() > 0) {
+        size_t count = reader.read(buffer.data(), buffer.size());
+        if (count == 0 || !consume(buffer.data(), count)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Opens the content for reading.
+ * @param source The content.
+ */
+ContentReader::ContentReader(const ContentSource& source) : _source(source) {
+    rewind();
+}
+
+/**
+ * @brief Starts over from the first byte.
+ * @return False if the file cannot be read.
+ */
+bool ContentReader::rewind() {
+    _position = 0;
+    if (_source._data) {
+        return true;
+    }
+    if (_source._parts) {
+        // Parts are opened as they are reached, so only one file is open at a time.
+        _part.reset();
+        _nextPart = 0;
+        return true;
+    }
+    if (!_file.is_open()) {
+        _file.open(_source._path, std::ios::binary);
+    }
+    _file.clear();
+    _file.seekg(static_cast<std::streamoff>(_source._offset));
+    return static_cast<bool>(_file);
+}
+
+/**
+ * @brief Reads the next bytes.
+ * @param buffer Receives the bytes.
+ * @param capacity The size of the buffer.
+ * @return The number of bytes read; 0 at the end or if the file cannot be read.
+ */
+size_t ContentReader::read(uint8_t* buffer, size_t capacity) {
+    size_t count = static_cast<size_t>(std::min<uint64_t>(capacity, remaining()));
+    if (count == 0) {
+        return 0;
+    }
+    if (_source._data) {
+        memcpy(buffer, _source._data + _position, count);
+    }
+    else if (_source._parts) {
+        size_t filled = 0;
+        while (filled < count) {
+            if (!_part || _part->remaining() == 0) {
+                if (_nextPart == _source._parts->size()) {
+                    return 0;
+                }
+                _part = std::make_unique<ContentReader>((*_source._parts)[_nextPart++]);
+                continue;
+            }
+            size_t got = _part->read(buffer + filled, count - filled);
+            if (got == 0) {
+                return 0;
+            }
+            filled += got;
+        }
+    }
+    else if (!_file.read(reinterpret_cast<char*>(buffer), count)) {
+        return 0;
+    }
+    _position += count;
+    return count;
+}
+
+/**
+ * @brief Deletes the temp file, if any.
+ */
+PullSpool::~PullSpool() {
+    removeFile();
+}
+
+/**
+ * @brief Starts a new payload, discarding any earlier one.
+ * The payload is kept in memory if the budget has room for it twice over, leaving as much
+ * again for decrypting the messages in it; otherwise it goes to a temp file.
+ * @param size The size of the payload.
+ * @return False if the temp file cannot be created.
+ */
+bool PullSpool::begin(size_t size) {
+    removeFile();
+    _buffer = std::vector<uint8_t>();
+    _bufferCharge.update(0);
+    _size = size;
+    _received = 0;
+    _headerReceived = 0;
+    _contentRemaining = 0;
+    _messages.clear();
+
+    if (MemoryStats::fits(2 * static_cast<uint64_t>(size)) && _bufferCharge.tryUpdate(size)) {
+        _buffer.reserve(size);
+        _bufferCharge.update(_buffer.capacity());
+        return true;
+    }
+    _path = FileHandler::tempFilePath();
+    _file.open(_path, std::ios::binary | std::ios::trunc);
+    return static_cast<bool>(_file);
+}
+
+/**
+ * @brief Stores the next bytes of the payload and indexes the message headers among them.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @return False if the temp file cannot be written.
+ */
+bool PullSpool::write(const uint8_t* data, size_t size) {
+    index(data, size);
+    _received += size;
+    if (!spilled()) {
+        _buffer.insert(_buffer.end(), data, data + size);
+        return true;
+    }
+    _file.write(reinterpret_cast<const char*>(data), size);
+    if (_received == _size) {
+        _file.close();
+    }
+    return !_file.fail();
+}
+
+/**
+ * @brief Finds the message headers among bytes of the payload, skipping the content between them.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ */
+void PullSpool::index(const uint8_t* data, size_t size) {
+    uint64_t position = _received;
+    while (size > 0) {
+        if (_contentRemaining > 0) {
+            size_t skip = static_cast<size_t>(std::min<uint64_t>(size, _contentRemaining));
+            _contentRemaining -= skip;
+            data += skip;
+            size -= skip;
+            position += skip;
+            continue;
+        }
+        size_t take = std::min(size, sizeof(MessageHeader) - _headerReceived);
+        memcpy(_header + _headerReceived, data, take);
+        _headerReceived += take;
+        data += take;
+        size -= take;
+        position += take;
+        if (_headerReceived == sizeof(MessageHeader)) {
+            MessageHeader header;
+            memcpy(&header, _header, sizeof(header));
+            SpooledMessage message;
+            message.senderID.assign(header.clientID, header.clientID + CLIENT_ID_SIZE);
+            message.messageID = header.messageID;
+            message.type = header.type;
+            message.offset = position;
+            message.size = header.messageSize;
+            _messages.push_back(std::move(message));
+            _headerReceived = 0;
+            _contentRemaining = header.messageSize;
+        }
+    }
+}
+
+/**
+ * @brief Returns true if the whole payload was received and every message in it is complete.
+ */
+bool PullSpool::complete() const {
+    return _received == _size && _headerReceived == 0 && _contentRemaining == 0;
+}
+
+/**
+ * @brief Returns the content of one of the messages.
+ * @param message A message from messages().
+ * @return The content, in memory or in the temp file.
+ */
+ContentSource PullSpool::content(const SpooledMessage& message) const {
+    if (spilled()) {
+        return ContentSource::file(_path, message.offset, message.size);
+    }
+    return ContentSource::memory(_buffer.data() + message.offset, static_cast<size_t>(message.size));
+}
+
+/**
+ * @brief Deletes the temp file, if any.
+ */
+void PullSpool::removeFile() {
+    if (_path.empty()) {
+        return;
+    }
+    if (_file.is_open()) {
+        _file.close();
+    }
+    boost::system::error_code ec;
+    boost::filesystem::remove(_path, ec);
+    _path.clear();
+}
@@ -0,0 +1,176 @@
+// Spool.h
+// author: Ariel Cohen ID: 329599187
+
+#pragma once
+#include "MemoryStats.h"
+#include "Protocol.h"
+#include "ProtocolEngine.h"
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+constexpr size_t CONTENT_CHUNK_SIZE = 64 * 1024; ///< Bytes of content read, encrypted or decrypted at a time.
+
+/**
+ * @brief Message content held in memory, in a region of a file, or in a sequence of such parts.
+ * It does not own the bytes: the memory, file or parts must outlive it. Content of any size can be
+ * processed in CONTENT_CHUNK_SIZE pieces, so it is only loaded whole where a caller asks.
+ */
+class ContentSource {
+public:
+    /**
+     * @brief Refers to bytes in memory.
+     */
+    static ContentSource memory(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Refers to a region of a file.
+     */
+    static ContentSource file(const std::string& path, uint64_t offset, uint64_t size);
+
+    /**
+     * @brief Refers to the bytes of several contents, one after another.
+     */
+    static ContentSource concat(const std::vector<ContentSource>& parts);
+
+    /**
+     * @brief Returns the number of bytes.
+     */
+    uint64_t size() const { return _size; }
+
+    /**
+     * @brief Reads all bytes into a buffer; the caller charges the buffer to the budget first.
+     * @param out Receives the bytes.
+     * @return False if the file cannot be read.
+     */
+    bool read(std::vector<uint8_t>& out) const;
+
+    /**
+     * @brief Passes all bytes to a function, one chunk of at most CONTENT_CHUNK_SIZE bytes at a time.
+     * @param consume Called once per chunk; returning false stops.
+     * @return False if consume returned false, the file cannot be read, or the budget has no room for the chunk buffer.
+     */
+    bool forEachChunk(const std::function<bool(const uint8_t*, size_t)>& consume) const;
+
+private:
+    friend class ContentReader;
+
+    const uint8_t* _data = nullptr; // the bytes, if in memory
+    const std::vector<ContentSource>* _parts = nullptr; // the parts holding the bytes, if concatenated
+    std::string _path;              // the file holding the bytes, otherwise
+    uint64_t _offset = 0;           // where the bytes start in the file
+    uint64_t _size = 0;             // the number of bytes
+};
+
+/**
+ * @brief Reads a ContentSource from the start, one piece at a time.
+ */
+class ContentReader {
+public:
+    /**
+     * @brief Opens the content for reading.
+     */
+    explicit ContentReader(const ContentSource& source);
+
+    /**
+     * @brief Starts over from the first byte.
+     * @return False if the file cannot be read.
+     */
+    bool rewind();
+
+    /**
+     * @brief Reads the next bytes.
+     * @return The number of bytes read, at most capacity; 0 at the end or if the file cannot be read.
+     */
+    size_t read(uint8_t* buffer, size_t capacity);
+
+    /**
+     * @brief Returns the number of bytes not read yet.
+     */
+    uint64_t remaining() const { return _source._size - _position; }
+
+private:
+    ContentSource _source; // what is read
+    std::ifstream _file;   // the open file, for content in a file
+    uint64_t _position = 0; // bytes read so far
+    std::unique_ptr<ContentReader> _part; // the part being read, for concatenated content
+    size_t _nextPart = 0;   // the index of the part after it
+};
+
+/**
+ * @brief A message within a pulled messages response, whose content stays in the PullSpool.
+ */
+struct SpooledMessage {
+    std::vector<uint8_t> senderID; ///< The sender's UUID.
+    uint32_t messageID = 0;        ///< The server-side message ID.
+    MessageType type{};            ///< The message type.
+    uint64_t offset = 0;           ///< Where the content starts in the response payload.
+    uint64_t size = 0;             ///< The size of the content.
+};
+
+/**
+ * @brief Takes a pulled messages response (2104) as it arrives and indexes its messages.
+ * The payload is kept in memory if it fits the memory budget with room left to decrypt it, and
+ * is spilled to a temp file otherwise, so a pull of any size holds no more than a chunk of it.
+ * The temp file is deleted with the spool.
+ */
+class PullSpool : public PayloadSink {
+public:
+    PullSpool() = default;
+    ~PullSpool() override;
+
+    PullSpool(const PullSpool&) = delete;
+    PullSpool& operator=(const PullSpool&) = delete;
+
+    /**
+     * @brief Starts a new payload, discarding any earlier one.
+     * @param size The size of the payload.
+     * @return False if the temp file cannot be created.
+     */
+    bool begin(size_t size) override;
+
+    /**
+     * @brief Stores the next bytes of the payload and indexes the message headers among them.
+     * @return False if the temp file cannot be written.
+     */
+    bool write(const uint8_t* data, size_t size) override;
+
+    /**
+     * @brief Returns true if the whole payload was received and every message in it is complete.
+     */
+    bool complete() const;
+
+    /**
+     * @brief Returns the messages in the payload, in order.
+     */
+    const std::vector<SpooledMessage>& messages() const { return _messages; }
+
+    /**
+     * @brief Returns the content of one of the messages.
+     */
+    ContentSource content(const SpooledMessage& message) const;
+
+    /**
+     * @brief Returns true if the payload was spilled to a temp file.
+     */
+    bool spilled() const { return !_path.empty(); }
+
+private:
+    // Finds the message headers among bytes of the payload
+    void index(const uint8_t* data, size_t size);
+    // Deletes the temp file, if any
+    void removeFile();
+
+    std::vector<uint8_t> _buffer;                 // the payload, if kept in memory
+    std::string _path;                            // the temp file holding the payload, otherwise
+    std::ofstream _file;                          // the temp file while it is written
+    uint64_t _size = 0;                           // the size of the payload
+    uint64_t _received = 0;                       // bytes of the payload received so far
+    uint8_t _header[sizeof(MessageHeader)]{};     // the message header being received
+    size_t _headerReceived = 0;                   // bytes of that header received so far
+    uint64_t _contentRemaining = 0;               // bytes of the current message's content still to come
+    std::vector<SpooledMessage> _messages;        // the messages indexed so far
+    MemoryCharge _bufferCharge{MemorySubsystem::TRANSPORT}; // capacity of _buffer
+};
@@ -0,0 +1,145 @@
+# async_data_manager.py
+# author: Ariel Cohen ID: 329599187
+
+import asyncio    # For awaiting database calls from the event loop
+import logging    # For logging failed calls nobody waits for
+import threading  # For the thread that owns the database connection
+from collections import deque  # For the queues of calls waiting for the database thread
+from concurrent.futures import Future, ThreadPoolExecutor
+from data_manager import SQLiteDataManager
+from memory_data_manager import MemoryDataManager
+from lsm_data_manager import LSMDataManager
+
+# The storage engines, and the file (or, for lsm, directory) each keeps its data in by default.
+STORAGE_ENGINES = {'sqlite': SQLiteDataManager, 'memory': MemoryDataManager, 'lsm': LSMDataManager}
+DEFAULT_DB_FILES = {'sqlite': 'dpmmn15.db', 'memory': 'dpmmn15.mem', 'lsm': 'dpmmn15.lsm'}
+
+LARGE_ARGUMENT = 64 * 1024  # A call with a bytes argument larger than this is a large call.
+# Calls that move message content, large whatever their arguments.
+LARGE_CALLS = ('get_message_content', 'add_message_file', 'delete_messages', 'get_outbox', 'delete_outbox', 'add_messages',
+               'backup')
+SMALL_BURST = 16  # Most small calls run in a row while a large call is waiting.
+# Directory lookups run on the reader thread, when the engine has a reader (see StorageEngine.open_reader).
+READER_CALLS = ('get_client_by_id', 'get_client_by_name')
+
+
+class AsyncDataManager:
+    """
+    Runs a storage engine (see StorageEngine) on a thread of its own, so database calls never block
+    the event loop. Every method of the engine is available as a coroutine with the same name and
+    arguments:
+
+        client = await data_manager.get_client_by_id(client_id)
+
+    The thread runs one call at a time, small calls first: a call that stores or reads message
+    content of more than LARGE_ARGUMENT bytes runs once no small call is waiting, or after
+    SMALL_BURST small calls in a row. A directory lookup therefore waits for at most the one large
+    call already running, and large transfers still progress under a steady stream of small calls.
+    If the engine can open a reader, READER_CALLS do not even wait for that: they run on a second
+    thread, beside the large call.
+    Between calls, and while it has none, the thread syncs the writes the engine reports due (see
+    StorageEngine.pending_sync).
+    """
+    def __init__(self, db_file, storage='sqlite'):
+        self._small = deque()
+        self._large = deque()
+        self._ready = threading.Condition()
+        self._closing = False
+        self.storage = storage  # The name of the engine.
+        opened = Future()
+        self._thread = threading.Thread(target=self._run, args=(STORAGE_ENGINES[storage], db_file, opened),
+                                        name="database", daemon=True)
+        self._thread.start()
+        # Open the database on its thread, since an SQLite connection stays on the thread that made it.
+        self._data_manager = opened.result()
+        # The reader too is opened on the one thread it runs on.
+        self._reader_thread = ThreadPoolExecutor(1, thread_name_prefix="database-reader")
+        self._reader = self._reader_thread.submit(self._data_manager.open_reader).result()
+        if self._reader is None:
+            self._reader_thread.shutdown()
+
+    def __getattr__(self, name):
+        """Returns a coroutine function that runs the engine's method `name` on the database thread."""
+        submit = self._submitter(name)
+
+        async def call(*args, **kwargs):
+            return await asyncio.wrap_future(submit(*args, **kwargs))
+        return call
+
+    def post(self, name, *args):
+        """Runs the engine's method `name` without waiting for it; a failure is only logged."""
+        result = self._submitter(name)(*args)
+        result.add_done_callback(
+            lambda f: f.exception() and logging.error(f"Database call {name} failed: {f.exception()}"))
+
+    def close(self):
+        """Closes the database once the calls already queued are done."""
+        if self._reader is not None:
+            self._reader_thread.submit(self._reader.close)
+            self._reader_thread.shutdown()
+        with self._ready:
+            self._closing = True
+            self._ready.notify()
+        self._thread.join()
+
+    def _submitter(self, name):
+        """Returns a function that queues a call of the method `name` and returns its Future."""
+        if name in READER_CALLS and self._reader is not None:
+            return lambda *args, **kwargs: self._reader_thread.submit(getattr(self._reader, name), *args, **kwargs)
+        method = getattr(self._data_manager, name)
+
+        def submit(*args, **kwargs):
+            large = name in LARGE_CALLS or any(
+                isinstance(arg, (bytes, bytearray)) and len(arg) > LARGE_ARGUMENT
+                for arg in args + tuple(kwargs.values()))
+            result = Future()
+            with self._ready:
+                (self._large if large else self._small).append((method, args, kwargs, result))
+                self._ready.notify()
+            return result
+        return submit
+
+    def _run(self, engine, db_file, opened):
+        """The database thread: opens the database, then runs queued calls until closed."""
+        try:
+            data_manager = engine(db_file)
+        except Exception as e:
+            opened.set_exception(e)
+            return
+        opened.set_result(data_manager)
+        small_in_a_row = 0
+        while True:
+            self._sync_if_due(data_manager)
+            with self._ready:
+                while not self._small and not self._large and not self._closing:
+                    due = data_manager.pending_sync()
+                    if due is not None and due <= 0:
+                        break
+                    self._ready.wait(due)
+                if self._large and (not self._small or small_in_a_row >= SMALL_BURST):
+                    method, args, kwargs, result = self._large.popleft()
+                    small_in_a_row = 0
+                elif self._small:
+                    method, args, kwargs, result = self._small.popleft()
+                    small_in_a_row += 1
+                elif self._closing:
+                    break  # Closing, and every queued call is done.
+                else:
+                    continue  # Idle, and a sync is due.
+            if not result.set_running_or_notify_cancel():
+                continue
+            try:
+                result.set_result(method(*args, **kwargs))
+            except Exception as e:
+                result.set_exception(e)
+        data_manager.close()
+
+    @staticmethod
+    def _sync_if_due(data_manager):
+        """Syncs the engine's writes if they are due; a failure is only logged, the next write tries again."""
+        due = data_manager.pending_sync()
+        if due is not None and due <= 0:
+            try:
+                data_manager.sync()
+            except Exception as e:
+                logging.error(f"Syncing the database failed: {e}")
@@ -0,0 +1,202 @@
+# backup.py
+# author: Ariel Cohen ID: 329599187
+
+"""
+Online backups of the server database, taken while the server keeps serving.
+
+A backup is started by an ADMIN_BACKUP request from the server's own host, or by SIGUSR1 where
+the platform has it. To request one from the command line:
+
+    python backup.py [--server HOST:PORT]
+
+The path of the finished backup is printed. Backups are written to the server's --backup-dir.
+"""
+
+import argparse   # For command line options
+import asyncio    # For awaiting the backup thread from the event loop
+import datetime   # For naming the backup files
+import logging    # For logging backups
+import os         # For the backup directory and the atomic rename
+import shutil     # For removing a failed backup of a store kept in a directory
+import socket     # For requesting a backup from the command line
+import sqlite3    # For the backup API
+import time       # For timing backups
+from data_manager import WAL_AUTOCHECKPOINT
+from protocol_structs import *  # Import all protocol definitions
+
+BACKUP_STEP_PAGES = 256   # Database pages copied per step (1 MB with the default 4 KB pages).
+BACKUP_STEP_PAUSE = 0.01  # Seconds the backup thread sleeps between steps, leaving the disk to the server.
+BACKUP_FLUSH_STEPS = 8    # Steps after which the copy is flushed to disk.
+CLIENT_VERSION = 2        # The protocol version the backup request carries.
+
+
+class DatabaseBackup:
+    """
+    Copies the live database to a backup file without stopping the server.
+
+    The copy runs on a thread of the event loop's executor, on a connection of its own, so the
+    database thread keeps serving requests. The connection opens a read transaction first and
+    holds it to the end: the database is in WAL mode, so the server's commits go on meanwhile,
+    and the copy is the database exactly as it was when the backup started. The pages are copied
+    with the SQLite backup API BACKUP_STEP_PAGES at a time, pausing between steps, so a large
+    database never holds the disk for long.
+    While the snapshot is held the WAL cannot be checkpointed and grows with every commit, and
+    each automatic checkpoint would scan all of it on the database thread; automatic checkpoints
+    are therefore off during the copy, and the backup thread checkpoints the WAL once it is done.
+    The copy is written to a temporary file and renamed when complete; a failed backup leaves no
+    file behind. One backup runs at a time: a request made while one is running gets that
+    backup's result.
+    The other storage engines have no second connection to copy from: their backup is taken by
+    the engine itself, on the database thread (see StorageEngine.backup), so requests wait for it.
+    """
+    def __init__(self, data_manager, db_file, backup_dir, step_pages=BACKUP_STEP_PAGES, step_pause=BACKUP_STEP_PAUSE):
+        self._data_manager = data_manager
+        self._db_file = db_file
+        self._backup_dir = backup_dir
+        self._step_pages = step_pages
+        self._step_pause = step_pause
+        self._running = None  # The task of the backup in progress, if any.
+
+    async def run(self):
+        """
+        Takes a backup, or waits for the one in progress.
+
+        Returns:
+            str: The path of the backup file.
+        Raises:
+            sqlite3.Error, OSError: If the backup failed.
+        """
+        if self._running is None or self._running.done():
+            self._running = asyncio.ensure_future(self._run())
+        # Shielded, so a requester that goes away leaves the backup to finish.
+        return await asyncio.shield(self._running)
+
+    def start(self):
+        """Starts a backup without waiting for it; its result or failure is only logged."""
+        async def run_logged():
+            try:
+                await self.run()
+            except (sqlite3.Error, OSError) as e:
+                logging.error(f"Backup failed: {e}")
+        asyncio.ensure_future(run_logged())
+
+    async def _run(self):
+        """Copies the database on the backup thread, with automatic checkpoints off meanwhile."""
+        if self._data_manager.storage != 'sqlite':
+            return await self._engine_backup()
+        await self._data_manager.set_wal_autocheckpoint(0)
+        try:
+            return await asyncio.get_running_loop().run_in_executor(None, self._copy)
+        finally:
+            await self._data_manager.set_wal_autocheckpoint(WAL_AUTOCHECKPOINT)
+
+    def _backup_path(self):
+        """Returns the path of a new backup: the database's name and extension, with the date and time."""
+        stamp = datetime.datetime.now().strftime("%Y%m%d-%H%M%S")
+        name, extension = os.path.splitext(os.path.basename(os.path.normpath(self._db_file)))
+        return os.path.join(self._backup_dir, f"{name}-{stamp}{extension}")
+
+    async def _engine_backup(self):
+        """Has a storage engine other than SQLite write its backup, and returns its path."""
+        started = time.monotonic()
+        path = self._backup_path()
+        partial = path + ".part"
+        try:
+            os.makedirs(self._backup_dir, exist_ok=True)
+            await self._data_manager.backup(partial)
+            os.replace(partial, path)
+        except Exception:
+            if os.path.isdir(partial):
+                shutil.rmtree(partial)
+            elif os.path.exists(partial):
+                os.remove(partial)
+            raise
+        logging.info(f"Backed up the {self._data_manager.storage} store to {path} in {time.monotonic() - started:.2f} s.")
+        return path
+
+    def _copy(self):
+        """The backup thread: copies the database to a new file in the backup directory and returns its path."""
+        started = time.monotonic()
+        path = self._backup_path()
+        partial = path + ".part"
+        source = target = None
+        try:
+            os.makedirs(self._backup_dir, exist_ok=True)
+            # Opened for writing only so that it can checkpoint; it never changes the database.
+            source = sqlite3.connect(self._db_file, isolation_level=None)
+            # Reading inside an explicit transaction pins the snapshot until the copy is done.
+            source.execute("BEGIN")
+            source.execute("SELECT COUNT(*) FROM sqlite_master").fetchone()
+            target = sqlite3.connect(partial)
+            with open(partial, 'rb') as flushed:
+                steps = 0
+
+                def step_done(status, remaining, total):
+                    # Flushing every few steps keeps the kernel from writing the copy back in bursts
+                    # that would hold up the server's own commits; the backup API only sleeps when
+                    # the database is busy, so the pause between steps is taken here as well.
+                    nonlocal steps
+                    steps += 1
+                    if steps % BACKUP_FLUSH_STEPS == 0:
+                        os.fsync(flushed.fileno())
+                    time.sleep(self._step_pause)
+                source.backup(target, pages=self._step_pages, progress=step_done)
+            source.execute("COMMIT")
+            # A passive checkpoint never blocks the server's commits.
+            source.execute("PRAGMA wal_checkpoint(PASSIVE)").fetchone()
+            # The copy is a single file: it needs no WAL until a server opens it.
+            target.execute("PRAGMA journal_mode = DELETE")
+            pages = target.execute("PRAGMA page_count").fetchone()[0]
+            target.close()
+            target = None
+            os.replace(partial, path)
+        except Exception:
+            if target is not None:
+                target.close()
+            if os.path.exists(partial):
+                os.remove(partial)
+            raise
+        finally:
+            if source is not None:
+                source.close()
+        logging.info(f"Backed up the database to {path}: {pages} pages in {time.monotonic() - started:.2f} s.")
+        return path
+
+
+def request_backup(host, port):
+    """
+    Asks a server on this host for a backup and waits until it is written.
+
+    Returns:
+        str: The path of the backup file, as seen by the server.
+    Raises:
+        RuntimeError: If the server answered with an error.
+        OSError: If the server cannot be reached.
+    """
+    with socket.create_connection((host, port)) as sock:
+        sock.sendall(RequestHeader(bytes(CLIENT_ID_SIZE), CLIENT_VERSION, RequestCode.ADMIN_BACKUP, 0).pack())
+        reader = sock.makefile('rb')
+        data = reader.read(ResponseHeader.size)
+        if len(data) < ResponseHeader.size:
+            raise RuntimeError("The server closed the connection.")
+        header = ResponseHeader.unpack(data)
+        payload = reader.read(header.payload_size)
+    if header.code != ResponseCode.BACKUP_DONE:
+        raise RuntimeError("The server could not take a backup; see its log.")
+    return payload.decode('utf-8')
+
+
+def main():
+    """The main entry point of the backup command."""
+    parser = argparse.ArgumentParser(description="Takes an online backup of a running MessageU server's database")
+    parser.add_argument("--server", default="127.0.0.1:1357", help="server on this host (default: %(default)s)")
+    args = parser.parse_args()
+    host, port = args.server.rsplit(':', 1)
+    try:
+        print(request_backup(host, int(port)))
+    except (OSError, RuntimeError) as e:
+        raise SystemExit(f"Backup failed: {e}")
+
+
+if __name__ == "__main__":
+    main()
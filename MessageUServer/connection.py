@@ -0,0 +1,227 @@
+# connection.py
+# author: Ariel Cohen ID: 329599187
+
+import asyncio  # For the stream the connection reads and writes
+from protocol_structs import *  # Import all protocol definitions
+from upload_spool import SPOOL_CHUNK, SPOOL_THRESHOLD
+
+# Requests whose payload, when larger than SPOOL_THRESHOLD, is read in part before the request is
+# handled: the size of that part. The handler reads the rest itself (see Connection.read_body).
+PARTIAL_REQUESTS = {RequestCode.SEND_MESSAGE: SendMessageRequestPayloadHeader.size}
+
+
+class ProtocolError(Exception):
+    """Raised when a client sends bytes that cannot be a valid request; the connection must be closed."""
+
+
+class Connection:
+    """
+    Holds the state of one client connection, on top of its asyncio stream.
+    Requests are read whole (header and payload), however many TCP segments they arrive in, but
+    for large PARTIAL_REQUESTS, of which only the first part is read; the handler then reads the
+    rest in chunks, after checking that first part, so a large upload is never held in memory.
+    Responses are written in order; a response may also be an async iterator of byte chunks,
+    which is only advanced as the socket drains, so it is never held in memory as a whole.
+    Bytes queued for this connection by other connections (pushes) while such a response is
+    being written follow it. It also remembers what was negotiated with HELLO for this connection.
+    With COMPACT_FRAMING negotiated, frames after the HELLO response have compact headers: they
+    are read into a RequestHeader carrying the bound client ID, and the ResponseHeader that starts
+    each response is rewritten as it is written, so handlers never see the difference.
+    The rest of a large payload is read one slice at a time, each after a turn given by the
+    scheduler (see SliceScheduler), so small requests on other connections go first.
+    """
+    def __init__(self, reader, writer, scheduler):
+        self.addr = writer.get_extra_info('peername')
+        self._reader = reader
+        self._writer = writer
+        self._scheduler = scheduler
+        self._producing = False  # True while a response made of chunks is being written.
+        self._deferred = []      # Bytes queued while _producing, written after that response.
+        # Negotiated with HELLO; until then the connection behaves like a version 2 client.
+        self.capabilities = Capability.NONE
+        # A client that never sends HELLO pulls once and expects everything, as from a version 2
+        # server, so its pulls are not capped (-1); the response is streamed, so memory stays bounded.
+        self.max_batch = -1
+        self.negotiated = False
+        self.compact = False          # True once compact headers are used in both directions.
+        self._compact_next = False    # True from HELLO until its response is written.
+        self._version = 0             # The version of the HELLO request, for compact requests.
+        self._bound_client_id = bytes(CLIENT_ID_SIZE)  # The client ID compact requests are sent under.
+        self._response_left = 0       # Payload bytes of the response being written, after its header.
+        self.client_id = None  # The client whose live streams are pushed here, once known.
+        self.peer_node = None  # The federation node on the other end, once it sent PEER_HELLO.
+        self.body_left = 0     # Bytes of the current request's payload not read yet.
+
+    async def next_request(self):
+        """
+        Reads the next complete request.
+
+        Returns:
+            tuple: (RequestHeader, payload bytes), or None if the client closed the connection.
+            For a large PARTIAL_REQUEST the payload is only its first part, and body_left
+            tells how much of it is still to be read with read_body.
+        Raises:
+            ProtocolError: If the announced payload is larger than the server accepts,
+                or the client closed the connection in the middle of a request.
+        """
+        # Whatever the previous request's handler left unread is not part of this request.
+        await self.discard_body()
+        try:
+            if self.compact:
+                header = await self._read_compact_header()
+            else:
+                header = RequestHeader.unpack(await self._reader.readexactly(RequestHeader.size))
+                self._version, self._bound_client_id = header.version, header.client_id
+        except asyncio.IncompleteReadError as e:
+            if e.partial:
+                raise ProtocolError("Connection closed in the middle of a request header.")
+            return None
+        if header is None:
+            return None
+        # A forwarded message may carry a maximal message plus its forwarding header.
+        limit = MAX_REQUEST_PAYLOAD + (ForwardedMessageHeader.size if self.peer_node is not None else 0)
+        if header.payload_size > limit:
+            raise ProtocolError(f"Request payload of {header.payload_size} bytes exceeds the limit.")
+        size = header.payload_size
+        if header.code in PARTIAL_REQUESTS and size > SPOOL_THRESHOLD:
+            size = PARTIAL_REQUESTS[header.code]
+        try:
+            payload = await self._reader.readexactly(size)
+        except asyncio.IncompleteReadError:
+            raise ProtocolError("Connection closed in the middle of a request payload.")
+        self.body_left = header.payload_size - size
+        return header, payload
+
+    async def _read_compact_header(self):
+        """
+        Reads a compact request header (see protocol_structs), binding the client ID it carries.
+
+        Returns:
+            RequestHeader: The header as a version 2 client would have sent it, or None if the
+            client closed the connection before it.
+        """
+        first = await self._reader.read(1)
+        if not first:
+            return None
+        try:
+            code_and_bind = await self._read_varint(first[0])
+            if code_and_bind & 1:
+                self._bound_client_id = await self._reader.readexactly(CLIENT_ID_SIZE)
+            payload_size = await self._read_varint((await self._reader.readexactly(1))[0])
+        except asyncio.IncompleteReadError:
+            raise ProtocolError("Connection closed in the middle of a request header.")
+        return RequestHeader(self._bound_client_id, self._version, code_and_bind >> 1, payload_size)
+
+    async def _read_varint(self, byte):
+        """Reads the rest of a varint whose first byte is `byte`."""
+        value = byte & 0x7F
+        shift = 7
+        while byte & 0x80:
+            if shift >= 7 * MAX_VARINT_SIZE:
+                raise ProtocolError("Varint in a request header is too long.")
+            byte = (await self._reader.readexactly(1))[0]
+            value |= (byte & 0x7F) << shift
+            shift += 7
+        return value
+
+    async def read_body(self, size):
+        """
+        Reads the next `size` bytes of the current request's payload, after a turn given by the scheduler.
+
+        Raises:
+            ProtocolError: If more is asked for than is left, or the client closed the connection.
+        """
+        if size > self.body_left:
+            raise ProtocolError("Read past the end of a request payload.")
+        await self._scheduler.turn()
+        try:
+            data = await self._reader.readexactly(size)
+        except asyncio.IncompleteReadError:
+            raise ProtocolError("Connection closed in the middle of a request payload.")
+        self.body_left -= size
+        return data
+
+    async def discard_body(self):
+        """Reads and drops the rest of the current request's payload, e.g. after rejecting the request."""
+        while self.body_left:
+            await self.read_body(min(self.body_left, SPOOL_CHUNK))
+
+    def queue(self, data):
+        """Appends bytes to be sent to the client without waiting for them to be sent (used for pushes)."""
+        if not data:
+            return
+        if self._producing:
+            self._deferred.append(data)
+        elif not self._writer.is_closing():
+            self._write(data)
+
+    def _write(self, data):
+        """
+        Writes response bytes to the stream. With compact framing, the ResponseHeader starting
+        each response is replaced with a compact header as it passes; payload bytes pass as they
+        are. A header always comes whole at the start of a write, as every response packs it so.
+        """
+        if not self.compact:
+            self._writer.write(data)
+            return
+        position = 0
+        while position < len(data):
+            if self._response_left:
+                # Payload: written as it is, without a copy when it is all of the data.
+                take = min(self._response_left, len(data) - position)
+                self._writer.write(data if take == len(data) else data[position:position + take])
+                self._response_left -= take
+                position += take
+                continue
+            header = ResponseHeader.unpack(bytes(data[position:position + ResponseHeader.size]))
+            self._writer.write(pack_compact_response_header(header.code, header.payload_size))
+            self._response_left = header.payload_size
+            position += ResponseHeader.size
+
+    async def send(self, response):
+        """
+        Sends a response and waits until the socket has taken most of it.
+
+        Args:
+            response: Bytes, or an async iterator of byte chunks.
+        """
+        if isinstance(response, (bytes, bytearray)):
+            self.queue(response)
+        elif response is not None:
+            self._producing = True
+            try:
+                async for chunk in response:
+                    self._write(chunk)
+                    await self._writer.drain()
+            finally:
+                self._producing = False
+                deferred, self._deferred = self._deferred, []
+                for data in deferred:
+                    self.queue(data)
+        # The HELLO response itself goes out with the old framing; everything after it is compact.
+        if self._compact_next:
+            self._compact_next = False
+            self.compact = True
+        await self._writer.drain()
+
+    def pending_bytes(self):
+        """Returns the number of queued bytes the socket has not accepted yet."""
+        return self._writer.transport.get_write_buffer_size() + sum(len(data) for data in self._deferred)
+
+    def close(self):
+        """Closes the connection once the bytes already queued are sent."""
+        self._writer.close()
+
+    def negotiate(self, client_capabilities, max_batch):
+        """
+        Records the result of a HELLO exchange.
+
+        Returns:
+            HelloPayload: The negotiated capabilities and the limits the server enforces.
+        """
+        self.capabilities = Capability(client_capabilities) & SERVER_CAPABILITIES
+        # A client asking for 0 leaves the batch size to the server.
+        self.max_batch = min(max_batch, DEFAULT_MAX_BATCH) if max_batch else DEFAULT_MAX_BATCH
+        self.negotiated = True
+        self._compact_next = Capability.COMPACT_FRAMING in self.capabilities and not self.compact
+        return HelloPayload(int(self.capabilities), MAX_REQUEST_PAYLOAD, self.max_batch)
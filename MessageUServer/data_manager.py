@@ -4,10 +4,17 @@
 import sqlite3  # For database operations
 import datetime  # For timestamping
 import logging  # For logging events
+import os  # For removing a used snapshot
+import time  # For timing the preload
+from directory_cache import DirectoryCache
+from storage_engine import CONTENT_CHUNK, StorageEngine
 
-class SQLiteDataManager:
+WAL_SIZE_LIMIT = 64 * 1024 * 1024  # Bytes the write-ahead log is truncated to after a checkpoint.
+WAL_AUTOCHECKPOINT = 1000  # WAL pages after which a commit checkpoints (SQLite's default).
+
+class SQLiteDataManager(StorageEngine):
     """
-    This class is responsible for all database operations.
+    The SQLite storage engine, and the server's default.
     It handles the connection to the SQLite database, table creation,
     and all CRUD (Create, Read, Update, Delete) operations for clients and messages.
     """
@@ -16,15 +23,62 @@ class SQLiteDataManager:
         logging.basicConfig(level=logging.INFO, format='%(asctime)s - %(levelname)s - %(message)s')
 
         # Establish a connection to the database file.
+        self._db_file = db_file
         self._conn = sqlite3.connect(db_file)
         # Set the row factory to access columns by name.
         self._conn.row_factory = sqlite3.Row
+        # In WAL mode readers do not block commits, so an online backup can hold a snapshot open.
+        self._conn.execute("PRAGMA journal_mode = WAL")
+        # Truncate the WAL after a checkpoint instead of keeping it at the largest size it ever reached.
+        self._conn.execute(f"PRAGMA journal_size_limit = {WAL_SIZE_LIMIT}")
         logging.info("Database connection established.")
         # Create necessary tables if they don't exist.
         self._create_tables()
+        # The client directory and mailbox counters in memory, once preloaded.
+        self._cache = None
+        self._snapshot_file = None
+
+    def preload(self, snapshot_file=None):
+        """
+        Loads the client directory and the number of messages waiting for each client into memory,
+        from `snapshot_file` if it matches the database, else in one pass over the database.
+        Lookups are answered from memory from then on. With a snapshot file, the cache is saved
+        to it again when the database is closed, for the next start.
+
+        Returns:
+            dict: The number of clients and of mailboxes with messages, where they were loaded
+            from ('snapshot' or 'database') and the seconds it took.
+        """
+        started = time.monotonic()
+        cache = DirectoryCache()
+        source = 'database'
+        if snapshot_file and cache.load_snapshot(snapshot_file, self.snapshot_stamp()):
+            source = 'snapshot'
+        else:
+            cache.load(self._conn)
+        self._cache = cache
+        self._snapshot_file = snapshot_file
+        if snapshot_file and source == 'snapshot':
+            # A crash from now on leaves the database ahead of the snapshot, so it is not trusted.
+            self._remove_snapshot()
+        return {'clients': cache.client_count, 'mailboxes': cache.mailbox_count, 'source': source,
+                'seconds': time.monotonic() - started}
+
+    def snapshot_stamp(self):
+        """Returns a tuple that changes with every change to the clients or messages, to validate a snapshot."""
+        clients, seq = self._conn.execute("SELECT COUNT(*), COALESCE(MAX(Seq), 0) FROM clients").fetchone()
+        messages, last_id = self._conn.execute("SELECT COUNT(*), COALESCE(MAX(ID), 0) FROM messages").fetchone()
+        return (clients, seq, messages, last_id)
+
+    def _remove_snapshot(self):
+        """Removes the snapshot file, if there is one."""
+        try:
+            os.remove(self._snapshot_file)
+        except FileNotFoundError:
+            pass
 
     def _create_tables(self):
-        """Create the 'clients' and 'messages' tables if they don't already exist."""
+        """Create the 'clients', 'messages', 'peers' and 'outbox' tables if they don't already exist."""
         logging.info("Creating database tables if they don't exist...")
         cursor = self._conn.cursor()
         # SQL statement to create the 'clients' table.
@@ -33,9 +87,21 @@ class SQLiteDataManager:
                 ID BLOB(16) PRIMARY KEY,
                 UserName VARCHAR(255) NOT NULL UNIQUE,
                 PublicKey BLOB(160) NOT NULL,
-                LastSeen DATETIME NOT NULL
+                LastSeen DATETIME NOT NULL,
+                Home INTEGER,
+                Seq INTEGER
             )
         ''')
+        # Databases created before federation lack the Home and Seq columns.
+        columns = {row['name'] for row in cursor.execute("PRAGMA table_info(clients)")}
+        if 'Home' not in columns:
+            cursor.execute("ALTER TABLE clients ADD COLUMN Home INTEGER")
+        if 'Seq' not in columns:
+            cursor.execute("ALTER TABLE clients ADD COLUMN Seq INTEGER")
+            cursor.execute("UPDATE clients SET Seq = rowid")
+        # Home is NULL for clients registered here, else the node they are homed on.
+        # Seq orders the directory as a change stream that peers copy incrementally.
+        cursor.execute("CREATE INDEX IF NOT EXISTS clients_seq ON clients(Seq)")
         # SQL statement to create the 'messages' table.
         cursor.execute('''
             CREATE TABLE IF NOT EXISTS messages (
@@ -48,6 +114,27 @@ class SQLiteDataManager:
                 FOREIGN KEY(FromClient) REFERENCES clients(ID)
             )
         ''')
+        # A pull looks up the recipient's messages oldest first, without scanning everyone else's.
+        cursor.execute("CREATE INDEX IF NOT EXISTS messages_to ON messages(ToClient, ID)")
+        # The directory position received from each federation peer.
+        cursor.execute('''
+            CREATE TABLE IF NOT EXISTS peers (
+                Node INTEGER PRIMARY KEY,
+                DirectorySeq INTEGER NOT NULL
+            )
+        ''')
+        # Messages for clients homed on other nodes, waiting to be forwarded.
+        cursor.execute('''
+            CREATE TABLE IF NOT EXISTS outbox (
+                ID INTEGER PRIMARY KEY AUTOINCREMENT,
+                Node INTEGER NOT NULL,
+                ToClient BLOB(16) NOT NULL,
+                FromClient BLOB(16) NOT NULL,
+                Type TINYINT NOT NULL,
+                Content BLOB
+            )
+        ''')
+        cursor.execute("CREATE INDEX IF NOT EXISTS outbox_node ON outbox(Node, ID)")
         # Commit the changes to the database.
         self._conn.commit()
         logging.info("Tables created successfully.")
@@ -57,14 +144,19 @@ class SQLiteDataManager:
         logging.info(f"Adding new client: {username}")
         cursor = self._conn.cursor()
         # Insert a new record into the 'clients' table.
-        cursor.execute("INSERT INTO clients (ID, UserName, PublicKey, LastSeen) VALUES (?,?,?,?)",
+        cursor.execute("INSERT INTO clients (ID, UserName, PublicKey, LastSeen, Seq) "
+                       "VALUES (?,?,?,?,(SELECT COALESCE(MAX(Seq), 0) + 1 FROM clients))",
                        (client_id, username, public_key, datetime.datetime.now()))
         self._conn.commit()
+        if self._cache:
+            self._cache.add_client(client_id, username)
         logging.info(f"Client {username} added successfully.")
 
     def username_exists(self, username):
         """Check if a username already exists in the database."""
         logging.info(f"Checking if username '{username}' exists.")
+        if self._cache:
+            return self._cache.has_username(username)
         cursor = self._conn.cursor()
         cursor.execute("SELECT distinct 1 FROM clients WHERE UserName =?", (username,))
         exists = cursor.fetchone() is not None
@@ -73,6 +165,8 @@ class SQLiteDataManager:
 
     def client_id_exists(self, client_id):
         """Check if a client ID already exists in the database."""
+        if self._cache:
+            return self._cache.has_client(client_id)
         cursor = self._conn.cursor()
         cursor.execute("SELECT distinct 1 FROM clients WHERE ID =?", (client_id,))
         return cursor.fetchone() is not None
@@ -85,10 +179,22 @@ class SQLiteDataManager:
 
     def get_client_by_id(self, client_id):
         """Fetch a single client's details by their ID."""
+        if self._cache and not self._cache.has_client(client_id):
+            return None
         cursor = self._conn.cursor()
         cursor.execute("SELECT * FROM clients WHERE ID =?", (client_id,))
         return cursor.fetchone()
 
+    def get_client_by_name(self, username):
+        """Fetch a single client's details by their username."""
+        if self._cache:
+            # Looked up by the primary key, the cache having resolved the name.
+            client_id = self._cache.client_id_of(username)
+            return self.get_client_by_id(client_id) if client_id is not None else None
+        cursor = self._conn.cursor()
+        cursor.execute("SELECT * FROM clients WHERE UserName =?", (username,))
+        return cursor.fetchone()
+
     def update_last_seen(self, client_id):
         """Update the 'LastSeen' timestamp for a specific client."""
         cursor = self._conn.cursor()
@@ -102,28 +208,267 @@ class SQLiteDataManager:
         cursor.execute("INSERT INTO messages (ToClient, FromClient, Type, Content) VALUES (?,?,?,?)",
                        (to_client_id, from_client_id, msg_type, content))
         self._conn.commit()
+        if self._cache:
+            self._cache.messages_added(to_client_id)
         last_id = cursor.lastrowid
         logging.info(f"Message added with ID: {last_id}")
         return last_id
 
-    def get_messages_for_client(self, client_id):
-        """Retrieve all pending messages for a specific client."""
+    def add_message_file(self, to_client_id, from_client_id, msg_type, path, size):
+        """
+        Store a new message whose content is in a file. The row is inserted with a zero-filled
+        BLOB of the content's size, which is then written through the blob API in chunks, all in
+        one transaction; Python before 3.11 has no blob API, and reads the content whole instead.
+        """
+        logging.info(f"Adding message of {size} bytes from {from_client_id} to {to_client_id}.")
+        cursor = self._conn.cursor()
+        with open(path, 'rb') as f:
+            if not hasattr(self._conn, 'blobopen'):
+                cursor.execute("INSERT INTO messages (ToClient, FromClient, Type, Content) VALUES (?,?,?,?)",
+                               (to_client_id, from_client_id, msg_type, f.read(size)))
+            else:
+                cursor.execute("INSERT INTO messages (ToClient, FromClient, Type, Content) VALUES (?,?,?,zeroblob(?))",
+                               (to_client_id, from_client_id, msg_type, size))
+                with self._conn.blobopen("messages", "Content", cursor.lastrowid) as blob:
+                    while chunk := f.read(min(CONTENT_CHUNK, size - blob.tell())):
+                        blob.write(chunk)
+        self._conn.commit()
+        if self._cache:
+            self._cache.messages_added(to_client_id)
+        return cursor.lastrowid
+
+    def get_mailbox_summary(self, client_id, limit=-1):
+        """
+        Count the oldest `limit` (-1 for all) pending messages of a client and sum their sizes.
+        LENGTH of a BLOB is read from the row header, so no content is loaded.
+        Returns (count, total size, last ID), or (0, 0, 0) if none are pending.
+        """
+        # Most pulls find nothing waiting; the counters answer those without a query.
+        if self._cache and not self._cache.waiting(client_id):
+            return 0, 0, 0
+        cursor = self._conn.cursor()
+        cursor.execute("SELECT COUNT(*), COALESCE(SUM(LENGTH(Content)), 0), COALESCE(MAX(ID), 0) FROM "
+                       "(SELECT ID, Content FROM messages WHERE ToClient =? ORDER BY ID LIMIT ?)", (client_id, limit))
+        return tuple(cursor.fetchone())
+
+    def get_messages_for_client(self, client_id, limit=-1, after_id=0):
+        """
+        Retrieve the pending messages for a specific client with an ID above `after_id`, oldest
+        first, at most `limit` (-1 for all). Only the size of each message's content is returned
+        (as Size); the content itself is read in slices with get_message_content.
+        """
         logging.info(f"Retrieving messages for client {client_id}.")
+        if self._cache and not self._cache.waiting(client_id):
+            return []
         cursor = self._conn.cursor()
-        cursor.execute("SELECT ID, FromClient, Type, Content FROM messages WHERE ToClient =?", (client_id,))
+        cursor.execute("SELECT ID, FromClient, Type, COALESCE(LENGTH(Content), 0) AS Size FROM messages "
+                       "WHERE ToClient =? AND ID >? ORDER BY ID LIMIT ?", (client_id, after_id, limit))
         messages = cursor.fetchall()
         logging.info(f"Found {len(messages)} messages for client {client_id}.")
         return messages
 
-    def delete_messages(self, message_ids):
-        """Delete messages from the database using a list of message IDs."""
+    def get_message_content(self, message_id, offset, size):
+        """Read up to `size` bytes of a message's content, starting at `offset` (b"" if the message is gone)."""
+        cursor = self._conn.cursor()
+        cursor.execute("SELECT substr(Content, ?, ?) FROM messages WHERE ID =?", (offset + 1, size, message_id))
+        row = cursor.fetchone()
+        return bytes(row[0]) if row and row[0] else b""
+
+    def delete_messages(self, client_id, message_ids):
+        """Delete messages for a client from the database using a list of message IDs."""
         cursor = self._conn.cursor()
         # Create a placeholder string for the SQL query, e.g., (?,?,?).
         placeholders = ', '.join('?' for _ in message_ids)
-        cursor.execute(f"DELETE FROM messages WHERE ID IN ({placeholders})", message_ids)
+        cursor.execute(f"DELETE FROM messages WHERE ToClient =? AND ID IN ({placeholders})",
+                       [client_id] + list(message_ids))
         self._conn.commit()
+        if self._cache:
+            self._cache.messages_removed(client_id, cursor.rowcount)
+
+    def get_client_home(self, client_id):
+        """
+        Returns where a client is homed.
+
+        Returns:
+            tuple: (exists, node), where node is None for clients registered on this server.
+        """
+        if self._cache:
+            return (self._cache.has_client(client_id), self._cache.home_of(client_id))
+        cursor = self._conn.cursor()
+        cursor.execute("SELECT Home FROM clients WHERE ID =?", (client_id,))
+        row = cursor.fetchone()
+        return (row is not None, row['Home'] if row else None)
+
+    def get_local_clients_since(self, seq, limit):
+        """Retrieve up to `limit` clients registered on this server with a Seq above `seq`, in Seq order."""
+        cursor = self._conn.cursor()
+        cursor.execute("SELECT Seq, ID, UserName, PublicKey FROM clients WHERE Home IS NULL AND Seq > ? "
+                       "ORDER BY Seq LIMIT ?", (seq, limit))
+        return cursor.fetchall()
+
+    def get_clients_since(self, seq, limit):
+        """Retrieve up to `limit` clients, wherever they are homed, with a Seq above `seq`, in Seq order."""
+        cursor = self._conn.cursor()
+        cursor.execute("SELECT Seq, ID, UserName, PublicKey FROM clients WHERE Seq > ? ORDER BY Seq LIMIT ?",
+                       (seq, limit))
+        return cursor.fetchall()
+
+    def get_directory_seq(self):
+        """Returns the highest Seq in the directory, 0 if it is empty."""
+        cursor = self._conn.cursor()
+        cursor.execute("SELECT COALESCE(MAX(Seq), 0) FROM clients")
+        return cursor.fetchone()[0]
+
+    def add_replicated_clients(self, entries):
+        """
+        Copies directory entries from the server this replica follows, keeping that server's Seq,
+        so the highest Seq is how far the directory has been copied.
+
+        Args:
+            entries (list): (seq, client_id, username, public_key) tuples.
+        """
+        cursor = self._conn.cursor()
+        now = datetime.datetime.now()
+        cursor.executemany("INSERT OR REPLACE INTO clients (Seq, ID, UserName, PublicKey, LastSeen) VALUES (?,?,?,?,?)",
+                           [entry + (now,) for entry in entries])
+        self._conn.commit()
+        if self._cache:
+            for _, client_id, username, _ in entries:
+                self._cache.add_client(client_id, username)
+
+    def add_remote_clients(self, node, entries, last_seq):
+        """
+        Adds clients homed on another node, and records how far that node's directory has been copied.
+        A client whose name is already taken here is skipped and logged.
+
+        Args:
+            node (int): The node the clients are homed on.
+            entries (list): (client_id, username, public_key) tuples.
+            last_seq (int): The node's Seq of the last entry.
+        """
+        cursor = self._conn.cursor()
+        now = datetime.datetime.now()
+        for client_id, username, public_key in entries:
+            cursor.execute("INSERT OR IGNORE INTO clients (ID, UserName, PublicKey, LastSeen, Home, Seq) "
+                           "VALUES (?,?,?,?,?,(SELECT COALESCE(MAX(Seq), 0) + 1 FROM clients))",
+                           (client_id, username, public_key, now, node))
+            if cursor.rowcount == 0:
+                logging.warning(f"Skipped client '{username}' from node {node}: name or ID already in use.")
+            elif self._cache:
+                self._cache.add_client(client_id, username, node)
+        cursor.execute("INSERT OR REPLACE INTO peers (Node, DirectorySeq) VALUES (?,?)", (node, last_seq))
+        self._conn.commit()
+
+    def get_peer_directory_seq(self, node):
+        """Returns the Seq of the last directory entry copied from a node, 0 if none."""
+        cursor = self._conn.cursor()
+        cursor.execute("SELECT DirectorySeq FROM peers WHERE Node =?", (node,))
+        row = cursor.fetchone()
+        return row['DirectorySeq'] if row else 0
+
+    def add_outbox_message(self, node, to_client_id, from_client_id, msg_type, content):
+        """Store a message for a client homed on another node until it is forwarded."""
+        cursor = self._conn.cursor()
+        cursor.execute("INSERT INTO outbox (Node, ToClient, FromClient, Type, Content) VALUES (?,?,?,?,?)",
+                       (node, to_client_id, from_client_id, msg_type, content))
+        self._conn.commit()
+        return cursor.lastrowid
+
+    def get_outbox(self, node, limit, max_bytes):
+        """
+        Retrieve messages waiting to be forwarded to a node, oldest first: at most `limit`
+        messages, stopping before their content exceeds `max_bytes` (at least one is returned).
+        """
+        cursor = self._conn.cursor()
+        cursor.execute("SELECT ID, ToClient, FromClient, Type, Content FROM outbox WHERE Node =? ORDER BY ID LIMIT ?",
+                       (node, limit))
+        messages = []
+        total = 0
+        # Rows are fetched one at a time, so content beyond the budget is never read.
+        for row in cursor:
+            total += len(row['Content'] or b"")
+            if messages and total > max_bytes:
+                break
+            messages.append(row)
+        return messages
+
+    def delete_outbox(self, message_ids):
+        """Delete forwarded messages from the outbox."""
+        cursor = self._conn.cursor()
+        placeholders = ', '.join('?' for _ in message_ids)
+        cursor.execute(f"DELETE FROM outbox WHERE ID IN ({placeholders})", message_ids)
+        self._conn.commit()
+
+    def add_messages(self, messages):
+        """
+        Store a batch of messages in one transaction.
+
+        Args:
+            messages (list): (to_client_id, from_client_id, msg_type, content) tuples.
+        """
+        cursor = self._conn.cursor()
+        cursor.executemany("INSERT INTO messages (ToClient, FromClient, Type, Content) VALUES (?,?,?,?)", messages)
+        self._conn.commit()
+        if self._cache:
+            for to_client_id, _, _, _ in messages:
+                self._cache.messages_added(to_client_id)
+
+    def open_reader(self):
+        """Opens a read-only connection for directory lookups; in WAL mode it reads while this one writes."""
+        return SQLiteDirectoryReader(self._db_file)
+
+    def set_wal_autocheckpoint(self, pages):
+        """Sets the WAL pages after which a commit checkpoints; 0 turns automatic checkpoints off."""
+        self._conn.execute(f"PRAGMA wal_autocheckpoint = {int(pages)}")
+
+    def backup(self, path):
+        """
+        Copies the database to `path` in one step. The server uses DatabaseBackup instead, which
+        copies an SQLite database from a thread of its own while this one keeps serving.
+        """
+        target = sqlite3.connect(path)
+        try:
+            self._conn.backup(target)
+        finally:
+            target.close()
 
     def close(self):
         """Close the connection to the database."""
         logging.info("Closing database connection.")
+        if self._cache and self._snapshot_file:
+            try:
+                self._cache.save_snapshot(self._snapshot_file, self.snapshot_stamp())
+                logging.info(f"Saved the directory snapshot to {self._snapshot_file}.")
+            except OSError as e:
+                logging.error(f"Could not save the directory snapshot to {self._snapshot_file}: {e}")
+        self._conn.close()
+
+
+class SQLiteDirectoryReader:
+    """
+    A second connection to the database of an SQLiteDataManager, for directory lookups on a
+    thread of their own (see StorageEngine.open_reader). It only reads, and in WAL mode it reads
+    the last commit while the database thread writes, so looking up a public key never waits for
+    a large message to be stored or deleted. Lookups go to the database: the directory cache
+    belongs to the database thread.
+    """
+    def __init__(self, db_file):
+        self._conn = sqlite3.connect(db_file)
+        self._conn.row_factory = sqlite3.Row
+        self._conn.execute("PRAGMA query_only = ON")
+
+    def get_client_by_id(self, client_id):
+        """Fetch a single client's details by their ID."""
+        cursor = self._conn.cursor()
+        cursor.execute("SELECT * FROM clients WHERE ID =?", (client_id,))
+        return cursor.fetchone()
+
+    def get_client_by_name(self, username):
+        """Fetch a single client's details by their username."""
+        cursor = self._conn.cursor()
+        cursor.execute("SELECT * FROM clients WHERE UserName =?", (username,))
+        return cursor.fetchone()
+
+    def close(self):
+        """Close the connection to the database."""
         self._conn.close()
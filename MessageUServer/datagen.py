@@ -0,0 +1,255 @@
+# datagen.py
+# author: Ariel Cohen ID: 329599187
+
+"""
+Generates a synthetic MessageU dataset for testing the server at scale.
+
+    python datagen.py OUT_DIR [--users N] [--messages N] [--file-fraction F] [--key-fraction F]
+                              [--text-size BYTES] [--file-size KB] [--max-file-size MB]
+                              [--key-pool N] [--client-infos N] [--server HOST:PORT] [--seed N]
+
+OUT_DIR receives:
+    dpmmn15.db    A server database with the exact schema SQLiteDataManager creates, holding the
+                  users and the messages queued for them. Start the server on it with --db.
+    users.txt     One line per user: the client ID in hex and the username, for load generators.
+    clients/      A directory per user for the first --client-infos users, each holding the
+                  my.info and server.info a client needs to connect as that user.
+
+Real RSA key pairs are generated, but only --key-pool of them, which the users share in turn:
+generating a key per user would take hours for millions of users, and the server never looks
+at the keys. Every client directory holds the private key matching its user's public key.
+
+Message content is random bytes sized like the client's encrypted payloads: symmetric key
+requests are empty, symmetric keys are one RSA block, texts and files are whole AES blocks.
+Text sizes follow a log-normal distribution around --text-size, file sizes one around
+--file-size, capped at --max-file-size. Senders and recipients are picked uniformly among all
+users. The content is not encrypted with any key, so a client pulling it reports that it cannot
+decrypt it; the server handles it exactly like real messages.
+"""
+
+import argparse   # For command line options
+import base64     # For the private key in my.info
+import datetime   # For the LastSeen timestamps
+import math       # For the size distributions
+import os         # For creating the output directories
+import random     # For reproducible users, keys and messages
+import sqlite3    # For filling the database
+import time       # For reporting progress
+from data_manager import SQLiteDataManager
+from protocol_structs import *  # Import all protocol definitions
+
+RSA_BITS = 1024     # The key size the client generates.
+RSA_EXPONENT = 17   # The exponent Crypto++ generates keys with, which makes public keys PUBLIC_KEY_SIZE bytes.
+AES_BLOCK = 16      # Encrypted texts and files are whole blocks of this size.
+INSERT_BATCH = 10000  # Rows inserted per executemany call.
+CONTENT_POOL_SIZE = 64 * 1024 * 1024  # Random bytes message content is cut from.
+# ASN.1 DER encoding of the rsaEncryption algorithm identifier (OID 1.2.840.113549.1.1.1, NULL parameters).
+RSA_ALGORITHM = bytes.fromhex("300d06092a864886f70d0101010500")
+
+
+def der(tag, content):
+    """Returns one DER element with the given tag byte and content."""
+    length = len(content)
+    if length < 0x80:
+        return bytes([tag, length]) + content
+    size = length.to_bytes((length.bit_length() + 7) // 8, 'big')
+    return bytes([tag, 0x80 | len(size)]) + size + content
+
+
+def der_integer(value):
+    """Returns a non-negative integer as a DER INTEGER."""
+    return der(0x02, value.to_bytes(value.bit_length() // 8 + 1, 'big'))
+
+
+def is_probable_prime(n, rng, rounds=40):
+    """Miller-Rabin primality test."""
+    if n < 2:
+        return False
+    for p in (2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37):
+        if n % p == 0:
+            return n == p
+    d, r = n - 1, 0
+    while d % 2 == 0:
+        d, r = d // 2, r + 1
+    for _ in range(rounds):
+        x = pow(rng.randrange(2, n - 1), d, n)
+        if x in (1, n - 1):
+            continue
+        for _ in range(r - 1):
+            x = pow(x, 2, n)
+            if x == n - 1:
+                break
+        else:
+            return False
+    return True
+
+
+def random_prime(bits, rng):
+    """Returns a random prime of exactly `bits` bits whose top two bits are set, so p * q has 2 * bits bits."""
+    while True:
+        candidate = rng.getrandbits(bits) | (3 << (bits - 2)) | 1
+        if math.gcd(candidate - 1, RSA_EXPONENT) == 1 and is_probable_prime(candidate, rng):
+            return candidate
+
+
+def generate_key_pair(rng):
+    """
+    Generates an RSA key pair encoded the way the client encodes its keys with Crypto++.
+
+    Returns:
+        tuple: (public key as a DER X.509 SubjectPublicKeyInfo of PUBLIC_KEY_SIZE bytes,
+                private key as a DER PKCS#8 PrivateKeyInfo).
+    """
+    while True:
+        p, q = random_prime(RSA_BITS // 2, rng), random_prime(RSA_BITS // 2, rng)
+        if p != q:
+            break
+    n, e = p * q, RSA_EXPONENT
+    d = pow(e, -1, math.lcm(p - 1, q - 1))
+    rsa_public = der(0x30, der_integer(n) + der_integer(e))
+    public_key = der(0x30, RSA_ALGORITHM + der(0x03, b"\x00" + rsa_public))
+    rsa_private = der(0x30, b"".join(der_integer(v) for v in (0, n, e, d, p, q, d % (p - 1), d % (q - 1), pow(q, -1, p))))
+    private_key = der(0x30, der_integer(0) + RSA_ALGORITHM + der(0x04, rsa_private))
+    assert len(public_key) == PUBLIC_KEY_SIZE
+    return public_key, private_key
+
+
+def log_normal_size(rng, median, limit):
+    """Returns a size drawn from a log-normal distribution around `median`, rounded up to whole AES blocks."""
+    size = min(limit, max(1, int(rng.lognormvariate(math.log(median), 1.0))))
+    return (size + AES_BLOCK - 1) // AES_BLOCK * AES_BLOCK
+
+
+class ContentPool:
+    """Random bytes that message content is cut from, so generating content costs no more than copying it."""
+    def __init__(self, rng, size):
+        self._data = rng.randbytes(size)
+        self._rng = rng
+
+    def take(self, size):
+        """Returns `size` random bytes; content larger than the pool repeats it."""
+        if size <= len(self._data):
+            offset = self._rng.randrange(len(self._data) - size + 1)
+            return self._data[offset:offset + size]
+        return (self._data * (size // len(self._data) + 1))[:size]
+
+
+def generate_users(conn, args, rng, key_pool, users_file):
+    """
+    Inserts args.users clients and writes users.txt.
+
+    Returns:
+        list: The client IDs, in registration order.
+    """
+    ids = []
+    now = datetime.datetime.now()
+    for start in range(0, args.users, INSERT_BATCH):
+        rows = []
+        for i in range(start, min(start + INSERT_BATCH, args.users)):
+            client_id = rng.randbytes(CLIENT_ID_SIZE)
+            name = f"user{i:07d}"
+            last_seen = now - datetime.timedelta(seconds=rng.randrange(30 * 24 * 3600))
+            rows.append((client_id, name, key_pool[i % len(key_pool)][0], last_seen, i + 1))
+            ids.append(client_id)
+            users_file.write(f"{client_id.hex()} {name}\n")
+        conn.executemany("INSERT INTO clients (ID, UserName, PublicKey, LastSeen, Seq) VALUES (?,?,?,?,?)", rows)
+    return ids
+
+
+def generate_messages(conn, args, rng, ids):
+    """
+    Inserts args.messages messages between random users.
+
+    Returns:
+        dict: The number of messages and content bytes of each message type.
+    """
+    pool = ContentPool(rng, CONTENT_POOL_SIZE)
+    totals = {t: [0, 0] for t in MessageType}
+    file_limit = min(args.max_file_size * 1024 * 1024, MAX_REQUEST_PAYLOAD)
+    for start in range(0, args.messages, INSERT_BATCH):
+        rows = []
+        for _ in range(start, min(start + INSERT_BATCH, args.messages)):
+            draw = rng.random()
+            if draw < args.key_fraction / 2:
+                msg_type, size = MessageType.SYM_KEY_REQUEST, 0
+            elif draw < args.key_fraction:
+                msg_type, size = MessageType.SYM_KEY_SEND, RSA_BITS // 8
+            elif draw < args.key_fraction + args.file_fraction:
+                msg_type, size = MessageType.FILE_SEND, log_normal_size(rng, args.file_size * 1024, file_limit)
+            else:
+                msg_type, size = MessageType.TEXT_MESSAGE, log_normal_size(rng, args.text_size, MAX_REQUEST_PAYLOAD)
+            rows.append((rng.choice(ids), rng.choice(ids), int(msg_type), pool.take(size)))
+            totals[msg_type][0] += 1
+            totals[msg_type][1] += size
+        conn.executemany("INSERT INTO messages (ToClient, FromClient, Type, Content) VALUES (?,?,?,?)", rows)
+        if start and start % (INSERT_BATCH * 10) == 0:
+            print(f"  {start} messages")
+    return totals
+
+
+def write_client_infos(args, ids, key_pool):
+    """Writes my.info and server.info for the first args.client_infos users."""
+    for i in range(min(args.client_infos, len(ids))):
+        directory = os.path.join(args.out_dir, "clients", f"user{i:07d}")
+        os.makedirs(directory, exist_ok=True)
+        # my.info as FileHandler::writeMyInfo writes it: name, client ID in hex, private key in Base64.
+        with open(os.path.join(directory, "my.info"), "w") as f:
+            f.write(f"user{i:07d}\n{ids[i].hex()}\n{base64.b64encode(key_pool[i % len(key_pool)][1]).decode()}\n")
+        with open(os.path.join(directory, "server.info"), "w") as f:
+            f.write(f"{args.server}\n")
+
+
+def main():
+    """The main entry point of the dataset generator."""
+    parser = argparse.ArgumentParser(description="MessageU synthetic dataset generator")
+    parser.add_argument("out_dir", help="directory to write the dataset to")
+    parser.add_argument("--users", type=int, default=10000, help="registered users (default: %(default)s)")
+    parser.add_argument("--messages", type=int, default=100000, help="queued messages (default: %(default)s)")
+    parser.add_argument("--file-fraction", type=float, default=0.05, help="share of files among the messages (default: %(default)s)")
+    parser.add_argument("--key-fraction", type=float, default=0.1,
+                        help="share of symmetric key requests and keys among the messages (default: %(default)s)")
+    parser.add_argument("--text-size", type=int, default=256, help="median text size in bytes (default: %(default)s)")
+    parser.add_argument("--file-size", type=int, default=256, help="median file size in KB (default: %(default)s)")
+    parser.add_argument("--max-file-size", type=int, default=64, help="largest file in MB (default: %(default)s)")
+    parser.add_argument("--key-pool", type=int, default=8, help="RSA key pairs the users share (default: %(default)s)")
+    parser.add_argument("--client-infos", type=int, default=10,
+                        help="users to write client directories for (default: %(default)s)")
+    parser.add_argument("--server", default="127.0.0.1:1357", help="address written to server.info (default: %(default)s)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the generated data (default: %(default)s)")
+    args = parser.parse_args()
+    if args.users < 1 or args.key_pool < 1:
+        parser.error("--users and --key-pool must be at least 1")
+    db_file = os.path.join(args.out_dir, "dpmmn15.db")
+    if os.path.exists(db_file):
+        parser.error(f"{db_file} already exists")
+    os.makedirs(args.out_dir, exist_ok=True)
+    rng = random.Random(args.seed)
+    started = time.monotonic()
+
+    print(f"Generating {args.key_pool} RSA key pairs...")
+    key_pool = [generate_key_pair(rng) for _ in range(args.key_pool)]
+    # Let the server's own data manager create the schema, then fill it in bulk on a connection
+    # that skips the journal and fsync: a half-written dataset is simply generated again.
+    SQLiteDataManager(db_file).close()
+    conn = sqlite3.connect(db_file)
+    conn.execute("PRAGMA journal_mode = OFF")
+    conn.execute("PRAGMA synchronous = OFF")
+    print(f"Generating {args.users} users...")
+    with open(os.path.join(args.out_dir, "users.txt"), "w") as users_file:
+        ids = generate_users(conn, args, rng, key_pool, users_file)
+    print(f"Generating {args.messages} messages...")
+    totals = generate_messages(conn, args, rng, ids)
+    conn.commit()
+    conn.close()
+    write_client_infos(args, ids, key_pool)
+
+    for msg_type, (count, size) in totals.items():
+        if count:
+            print(f"  {msg_type.name:<22}{count:>10} messages{size / (1024 * 1024):>12.1f} MB")
+    print(f"Wrote {db_file} ({os.path.getsize(db_file) / (1024 * 1024):.1f} MB) "
+          f"in {time.monotonic() - started:.1f}s.")
+
+
+# This block ensures that main() is called only when the script is executed directly.
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,131 @@
+# directory_cache.py
+# author: Ariel Cohen ID: 329599187
+
+import logging  # For logging why a snapshot is not used
+import marshal  # For the snapshot file: fast, and unlike pickle it cannot run code
+import os       # For replacing the snapshot file atomically
+
+SNAPSHOT_FORMAT = 1  # Bumped when the layout of the snapshot file changes.
+
+
+class DirectoryCache:
+    """
+    The client directory and the number of messages waiting for each client, held in memory so
+    the requests made most often are answered without reading the database: whether a client or
+    username exists, where a client is homed, and whether a pull has anything to return.
+    Public keys are not held (they would triple the memory); they are read from the database.
+
+    The cache is filled once at startup, in one streaming pass over the database or from a
+    snapshot file written at the previous clean shutdown, and kept up to date by SQLiteDataManager
+    as it writes. It costs about 200 bytes per client.
+    """
+    def __init__(self):
+        self._names = {}      # Client ID to username.
+        self._ids = {}        # Username to client ID.
+        self._homes = {}      # Client ID to home node, for clients homed on another node only.
+        self._mailboxes = {}  # Client ID to the number of messages waiting, for clients with any.
+
+    def load(self, conn):
+        """Fills the cache from the database in one pass over the clients and one over the messages index."""
+        cursor = conn.cursor()
+        # Plain tuples: building a sqlite3.Row for each of a million clients doubles the time.
+        cursor.row_factory = None
+        names, ids, homes = self._names, self._ids, self._homes
+        for client_id, username, home in cursor.execute("SELECT ID, UserName, Home FROM clients"):
+            names[client_id] = username
+            ids[username] = client_id
+            if home is not None:
+                homes[client_id] = home
+        self._mailboxes.update(cursor.execute("SELECT ToClient, COUNT(*) FROM messages GROUP BY ToClient"))
+
+    def load_snapshot(self, path, stamp):
+        """
+        Fills the cache from a snapshot file, if it was written for the database as it is now.
+
+        Args:
+            path (str): The snapshot file.
+            stamp (tuple): Describes the database now; see SQLiteDataManager.snapshot_stamp.
+        Returns:
+            bool: True if the snapshot was loaded; False, leaving the cache empty, if it is missing,
+            unreadable or stale.
+        """
+        try:
+            # Read whole: marshal.load reads a file object in small pieces, four times slower.
+            with open(path, 'rb') as f:
+                data = marshal.loads(f.read())
+        except FileNotFoundError:
+            return False
+        except (OSError, EOFError, ValueError, TypeError) as e:
+            logging.warning(f"Ignoring unreadable snapshot {path}: {e}")
+            return False
+        if not isinstance(data, tuple) or len(data) != 5 or data[0] != SNAPSHOT_FORMAT:
+            logging.warning(f"Ignoring snapshot {path} of another format.")
+            return False
+        if data[1] != stamp:
+            logging.info(f"Ignoring snapshot {path}: the database changed since it was written.")
+            return False
+        _, _, self._names, self._homes, self._mailboxes = data
+        self._ids = {username: client_id for client_id, username in self._names.items()}
+        return True
+
+    def save_snapshot(self, path, stamp):
+        """Writes the cache to a snapshot file for the database described by `stamp`."""
+        partial = path + ".part"
+        with open(partial, 'wb') as f:
+            f.write(marshal.dumps((SNAPSHOT_FORMAT, stamp, self._names, self._homes, self._mailboxes)))
+        os.replace(partial, path)
+
+    @property
+    def client_count(self):
+        return len(self._names)
+
+    @property
+    def mailbox_count(self):
+        return len(self._mailboxes)
+
+    def has_client(self, client_id):
+        return client_id in self._names
+
+    def has_username(self, username):
+        return username in self._ids
+
+    def client_id_of(self, username):
+        """Returns the ID of the client with the given username, or None."""
+        return self._ids.get(username)
+
+    def home_of(self, client_id):
+        """Returns the node a client is homed on, None for clients registered on this server."""
+        return self._homes.get(client_id)
+
+    def add_client(self, client_id, username, home=None):
+        """
+        Adds a client, replacing the one with the same ID and the one with the same username,
+        as INSERT OR REPLACE does in the database.
+        """
+        previous = self._names.get(client_id)
+        if previous is not None and previous != username:
+            del self._ids[previous]
+        other = self._ids.get(username)
+        if other is not None and other != client_id:
+            del self._names[other]
+            self._homes.pop(other, None)
+        self._names[client_id] = username
+        self._ids[username] = client_id
+        if home is not None:
+            self._homes[client_id] = home
+        else:
+            self._homes.pop(client_id, None)
+
+    def waiting(self, client_id):
+        """Returns the number of messages waiting for a client."""
+        return self._mailboxes.get(client_id, 0)
+
+    def messages_added(self, client_id, count=1):
+        self._mailboxes[client_id] = self._mailboxes.get(client_id, 0) + count
+
+    def messages_removed(self, client_id, count):
+        left = self._mailboxes.get(client_id, 0) - count
+        if left > 0:
+            self._mailboxes[client_id] = left
+        else:
+            self._mailboxes.pop(client_id, None)
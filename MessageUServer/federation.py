@@ -0,0 +1,250 @@
+# federation.py
+# author: Ariel Cohen ID: 329599187
+
+import asyncio    # For waking links up when there is something to send
+import hashlib    # For the HMAC of PEER_HELLO tokens
+import hmac       # For computing and comparing PEER_HELLO tokens
+import ipaddress  # For comparing a peer's address with the addresses of its listed host
+import logging    # For logging federation activity
+from protocol_structs import *  # Import all protocol definitions
+from connection import ProtocolError
+from outbound_link import OutboundLink
+from upload_spool import UploadSpool
+
+
+def read_federation_file(filename):
+    """
+    Reads the nodes of a federation, one "<node_id> <host>:<port>" line per node.
+    Empty lines and text after '#' are ignored.
+
+    Returns:
+        dict: Node ID to (host, port); empty if the file does not exist.
+    """
+    nodes = {}
+    try:
+        with open(filename, 'r') as f:
+            for line in f:
+                line = line.split('#', 1)[0].strip()
+                if not line:
+                    continue
+                node, address = line.split()
+                host, port = address.rsplit(':', 1)
+                nodes[int(node)] = (host, int(port))
+    except FileNotFoundError:
+        pass
+    return nodes
+
+
+def read_federation_secret(filename):
+    """Reads the secret the nodes of a federation share: the file's content, without surrounding whitespace."""
+    with open(filename, 'rb') as f:
+        secret = f.read().strip()
+    if not secret:
+        raise ValueError(f"{filename} is empty.")
+    return secret
+
+
+def peer_token(secret, from_node, to_node):
+    """
+    Returns the token a node sends in PEER_HELLO: an HMAC of both node IDs under the federation's
+    secret, so it only opens a link between those two nodes. Zeros when there is no secret.
+    """
+    if secret is None:
+        return bytes(PEER_TOKEN_SIZE)
+    return hmac.new(secret, b"MessageU peer" + bytes([from_node, to_node]), hashlib.sha256).digest()
+
+
+def _normalize_address(address):
+    """Returns an IP address as a string, with IPv4-mapped IPv6 addresses turned into IPv4."""
+    ip = ipaddress.ip_address(address.split('%', 1)[0])
+    if ip.version == 6 and ip.ipv4_mapped:
+        ip = ip.ipv4_mapped
+    return str(ip)
+
+
+def pack_directory(entries):
+    """Packs directory rows (Seq, ID, UserName, PublicKey) into a series of DirectoryEntry."""
+    return b"".join(DirectoryEntry(e['Seq'], e['ID'], e['UserName'].encode('ascii'), e['PublicKey']).pack()
+                    for e in entries)
+
+
+class PeerLink(OutboundLink):
+    """
+    The outbound link from this node to one peer.
+    It pushes this node's directory changes and the outbox messages for the peer's clients,
+    one batch at a time, and forgets what the peer acknowledges. Between batches it waits
+    until it is told there is something new to send.
+    """
+    def __init__(self, federation, node_id, host, port):
+        super().__init__(f"node {node_id}", host, port, federation.server_version)
+        self.node_id = node_id
+        self._federation = federation
+        self._wakeup = asyncio.Event()   # Set when there may be something new to send.
+
+    def pump(self):
+        """Wakes the link up to send whatever is new (directory entries first, then messages)."""
+        self._wakeup.set()
+
+    async def _ack(self, code, payload):
+        """Sends a request and returns the value of the peer's PEER_ACK."""
+        response, ack = await self.request(code, payload)
+        if response != ResponseCode.PEER_ACK:
+            raise ProtocolError(f"Node {self.node_id} rejected request {code}.")
+        return PeerAckPayload.unpack(ack).value
+
+    async def _session(self):
+        # Unacknowledged batches stay in the outbox and are sent again on the next session.
+        data_manager = self._federation.data_manager
+        hello = PeerHelloPayload(self._federation.node_id,
+                                 peer_token(self._federation.secret, self._federation.node_id, self.node_id))
+        directory_seq = await self._ack(RequestCode.PEER_HELLO, hello.pack())
+        logging.info(f"Link to node {self.node_id} up; it has our directory up to {directory_seq}.")
+        while True:
+            # Cleared before looking, so anything added while a batch is in flight is picked up next.
+            self._wakeup.clear()
+            # Directory entries go first, so the peer knows the senders of the messages that follow.
+            entries = await data_manager.get_local_clients_since(directory_seq, MAX_PEER_BATCH)
+            if entries:
+                directory_seq = await self._ack(RequestCode.PEER_DIRECTORY, pack_directory(entries))
+                continue
+            messages = await data_manager.get_outbox(self.node_id, MAX_PEER_BATCH, MAX_PEER_BATCH_BYTES)
+            if messages:
+                payload = b"".join(ForwardedMessageHeader(m['ToClient'], m['FromClient'], m['Type'], len(m['Content'])).pack()
+                                   + m['Content'] for m in messages)
+                await self._ack(RequestCode.PEER_FORWARD, payload)
+                await data_manager.delete_outbox([m['ID'] for m in messages])
+                logging.info(f"Forwarded {len(messages)} messages to node {self.node_id}.")
+                continue
+            await self._wakeup.wait()
+
+
+class Federation:
+    """
+    Connects this server to the other nodes of a federation.
+    Every node owns the clients registered on it. Nodes copy each other's directory (the
+    clients table) incrementally, so CLIENTS_LIST and PUBLIC_KEY are always answered locally,
+    and messages for clients homed elsewhere wait in an outbox and are forwarded in batches.
+    Clients must connect to the node they registered on to pull their messages.
+    With no peers configured the server behaves as a standalone server.
+
+    A connection is taken for a peer's only once its PEER_HELLO names a node of the federation
+    file, comes from an address of that node's host, and, if the nodes share a secret, carries
+    that node's token; every other PEER_* request is rejected.
+    """
+    def __init__(self, data_manager, server_version, node_id=0, nodes=None, secret=None):
+        self.node_id = node_id
+        self.data_manager = data_manager
+        self.server_version = server_version
+        self.secret = secret
+        self._nodes = dict(nodes or {})
+        self._links = {node: PeerLink(self, node, host, port)
+                       for node, (host, port) in (nodes or {}).items() if node != node_id}
+
+    def start(self):
+        """Starts the links to the peers; each keeps reconnecting until stopped."""
+        if self._links:
+            logging.info(f"Node {self.node_id} federated with nodes {sorted(self._links)}.")
+        for link in self._links.values():
+            link.start()
+
+    async def stop(self):
+        """Stops the links to the peers."""
+        for link in self._links.values():
+            await link.stop()
+
+    def notify(self):
+        """Tells every link there may be something new to send (e.g. after a registration)."""
+        for link in self._links.values():
+            link.pump()
+
+    async def store_message(self, to_client_id, from_client_id, msg_type, content):
+        """
+        Stores a message locally, or in the outbox if the recipient is homed on another node.
+
+        Args:
+            content: The content: bytes, or an UploadSpool for a large upload, which is stored
+                locally in chunks and read whole for the outbox (it is forwarded whole anyway).
+        Returns:
+            int: The ID of the stored message.
+        """
+        _, home = await self.data_manager.get_client_home(to_client_id)
+        if home is None or home == self.node_id:
+            if isinstance(content, UploadSpool):
+                return await self.data_manager.add_message_file(to_client_id, from_client_id, msg_type,
+                                                                content.path, content.size)
+            return await self.data_manager.add_message(to_client_id, from_client_id, msg_type, content)
+        if isinstance(content, UploadSpool):
+            content = await asyncio.get_running_loop().run_in_executor(None, content.read)
+        message_id = await self.data_manager.add_outbox_message(home, to_client_id, from_client_id, msg_type, content)
+        link = self._links.get(home)
+        if link:
+            link.pump()
+        else:
+            logging.warning(f"Message {message_id} is for node {home}, which is not in the federation.")
+        return message_id
+
+    # --- Requests from peers ---
+
+    async def _authenticate(self, hello, connection):
+        """Returns True if a PEER_HELLO comes from the node it names; logs why not otherwise."""
+        node = self._nodes.get(hello.node_id)
+        if node is None or hello.node_id == self.node_id:
+            logging.warning(f"PEER_HELLO from {connection.addr} names node {hello.node_id}, which is not a peer.")
+            return False
+        if self.secret is not None and not hmac.compare_digest(hello.token, peer_token(self.secret, hello.node_id, self.node_id)):
+            logging.warning(f"PEER_HELLO from {connection.addr} for node {hello.node_id} has a wrong token.")
+            return False
+        try:
+            infos = await asyncio.get_running_loop().getaddrinfo(node[0], None)
+            allowed = {_normalize_address(info[4][0]) for info in infos}
+            address = _normalize_address(connection.addr[0])
+        except (OSError, ValueError, TypeError, IndexError) as e:
+            logging.warning(f"Could not check the address of PEER_HELLO from {connection.addr}: {e}")
+            return False
+        if address not in allowed:
+            logging.warning(f"PEER_HELLO for node {hello.node_id} came from {address}, not from {node[0]}.")
+            return False
+        return True
+
+    async def handle_hello(self, payload, connection):
+        """Marks a connection as coming from a peer and returns how much of its directory we have."""
+        if len(payload) != PeerHelloPayload.size:
+            return None
+        req = PeerHelloPayload.unpack(payload)
+        connection.peer_node = None
+        if not await self._authenticate(req, connection):
+            return None
+        connection.peer_node = req.node_id
+        logging.info(f"Node {req.node_id} connected from {connection.addr}.")
+        return PeerAckPayload(await self.data_manager.get_peer_directory_seq(req.node_id))
+
+    async def handle_directory(self, payload, connection):
+        """Adds a batch of the peer's clients to our directory and returns the last Seq stored."""
+        if connection.peer_node is None or len(payload) % DirectoryEntry.size:
+            return None
+        entries = [DirectoryEntry.unpack(payload[i:i + DirectoryEntry.size])
+                   for i in range(0, len(payload), DirectoryEntry.size)]
+        if not entries:
+            return PeerAckPayload(await self.data_manager.get_peer_directory_seq(connection.peer_node))
+        rows = [(e.client_id, e.name.split(b'\x00', 1)[0].decode('ascii'), e.public_key) for e in entries]
+        await self.data_manager.add_remote_clients(connection.peer_node, rows, entries[-1].seq)
+        logging.info(f"Copied {len(rows)} directory entries from node {connection.peer_node}.")
+        return PeerAckPayload(entries[-1].seq)
+
+    async def handle_forward(self, payload, connection):
+        """Stores a batch of messages forwarded by a peer and returns how many were stored."""
+        if connection.peer_node is None:
+            return None
+        messages = []
+        offset = 0
+        while offset < len(payload):
+            header = ForwardedMessageHeader.unpack(payload[offset:offset + ForwardedMessageHeader.size])
+            offset += ForwardedMessageHeader.size
+            content = payload[offset:offset + header.content_size]
+            if len(content) != header.content_size:
+                return None
+            offset += header.content_size
+            messages.append((header.to_client_id, header.from_client_id, header.message_type, content))
+        await self.data_manager.add_messages(messages)
+        logging.info(f"Stored {len(messages)} messages forwarded by node {connection.peer_node}.")
+        return PeerAckPayload(len(messages))
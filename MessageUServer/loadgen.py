@@ -0,0 +1,807 @@
+# loadgen.py
+# author: Ariel Cohen ID: 329599187
+
+"""
+Load generator for benchmarking a running MessageU server.
+
+    python loadgen.py latency [--host H] [--port P] [--small-clients N] [--bulk-clients N]
+                              [--bulk-size MB] [--bulk-messages N] [--duration S]
+    python loadgen.py connections [--workers N] [--duration S]
+    python loadgen.py concurrent [--connections N] [--step N] [--round-timeout S]
+    python loadgen.py dataset USERS_FILE [--lists N] [--lookups N] [--pulls N]
+    python loadgen.py soak [--duration S] [--interval S] [--server-pid PID] [--watch-pid PID]
+                           [--db FILE] [--temp-files GLOB] [--max-... LIMIT]
+    python loadgen.py transfer LIBRARY [--files N] [--size MB] [--budget MB] [--max-rss-growth MB]
+                               [--work-dir DIR] [--server-pid PID]
+
+The latency scenario measures small request latency twice: with the server otherwise idle,
+and while bulk clients upload and download large messages as fast as the server lets them.
+With fair scheduling the percentiles of both phases should stay close.
+
+The connections and concurrent scenarios measure the server's network core alone: their only
+request is HELLO, which involves no database. "connections" counts how many connections per
+second the server accepts, answers and closes; "concurrent" opens ever more connections that
+stay open and checks that all of them are still answered.
+
+The dataset scenario runs against a server started on a database made by datagen.py, acting as
+the users listed in its users.txt: it times CLIENTS_LIST, PUBLIC_KEY and CLIENT_LOOKUP (by name)
+lookups of random users, and pulls of random users' queued messages. Pulls delete what they deliver, so a dataset is
+used up by repeated runs; generate it again to start over.
+
+The soak scenario runs a steady mix of sends, pulls and lookups for hours, with clients
+reconnecting now and then, and samples resource use every interval: the RSS and open file
+descriptors of the server (--server-pid), of this process, and of any other process such as
+a client (--watch-pid), the size of the database, the number of files matching a glob (such as
+a client's temp files), and the request latency percentiles. It fails with exit code 1 as soon
+as a sample has drifted from the first one by more than the limits. Process sampling reads
+/proc, so it works on Linux only.
+
+The transfer scenario checks that the client library keeps to its memory budget on multi-GB
+transfers. It loads the MessageUCore library (LIBRARY, built for this platform), caps its budget
+with mu_memory_set_budget, and registers two clients in this process; one sends the other
+--files files of --size MB (about 2 GB by default; a single message is limited to the server's
+MAX_REQUEST_PAYLOAD), and the other pulls them all at once and checks that they arrived intact.
+It reports how much the peak RSS of this process (VmHWM) grew during the transfer, the peak memory
+the library charged, and the server's peak RSS if --server-pid is given, and fails with exit code 1
+if a file was damaged or the RSS grew by more than --max-rss-growth. The work directory and the
+server's storage must each have room for all the files. Like the soak scenario it reads /proc.
+"""
+
+import argparse   # For command line options
+import ctypes     # For driving the client library in the transfer scenario
+import glob       # For counting temp files during a soak test
+import hashlib    # For checking that a transferred file arrived intact
+import multiprocessing  # For bulk clients that do not compete with the measuring threads
+import os         # For random client names
+import random     # For picking the users of a dataset
+import shutil     # For removing the work directory of a transfer
+import socket     # For connections to the server
+import sys        # For the exit code of a failed soak test
+import tempfile   # For the work directory of a transfer
+import threading  # For running the clients concurrently
+import time       # For measuring latency
+from protocol_structs import *  # Import all protocol definitions
+
+CLIENT_VERSION = 2  # The protocol version the generated requests carry.
+# The response each request the load generator sends gets when it succeeds; any other is a failure.
+SUCCESS_RESPONSES = {
+    RequestCode.REGISTER: ResponseCode.REGISTRATION_SUCCESS,
+    RequestCode.CLIENTS_LIST: ResponseCode.CLIENTS_LIST,
+    RequestCode.PUBLIC_KEY: ResponseCode.PUBLIC_KEY,
+    RequestCode.SEND_MESSAGE: ResponseCode.MESSAGE_SENT,
+    RequestCode.PULL_MESSAGES: ResponseCode.PULL_MESSAGES,
+    RequestCode.HELLO: ResponseCode.HELLO,
+    RequestCode.CLIENT_LOOKUP: ResponseCode.CLIENT_INFO,
+}
+
+
+class RequestFailed(RuntimeError):
+    """The server answered a request with something other than its success response, e.g. ERROR."""
+
+
+class LoadClient:
+    """One client connection, on which requests are sent one at a time and their responses awaited."""
+    def __init__(self, host, port):
+        self._sock = socket.create_connection((host, port))
+        self._sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.client_id = bytes(CLIENT_ID_SIZE)
+
+    def close(self):
+        self._sock.close()
+
+    def request(self, code, payload=b""):
+        """
+        Sends a request and waits for its response.
+
+        Returns:
+            tuple: (response code, payload bytes).
+        Raises:
+            RequestFailed: If the response is not the request's success response (the whole
+                response is read first, so the connection can still be used).
+        """
+        self._sock.sendall(RequestHeader(self.client_id, CLIENT_VERSION, code, len(payload)).pack() + payload)
+        header = ResponseHeader.unpack(self._receive(ResponseHeader.size))
+        response = self._receive(header.payload_size)
+        expected = SUCCESS_RESPONSES.get(code)
+        if expected is not None and header.code != expected:
+            raise RequestFailed(f"Request {code} failed with response {header.code}.")
+        return header.code, response
+
+    def register(self, name):
+        """Registers a new client under `name`; its ID is used for the following requests."""
+        payload = RegistrationRequestPayload(name.encode('ascii'), bytes(PUBLIC_KEY_SIZE)).pack()
+        try:
+            _, response = self.request(RequestCode.REGISTER, payload)
+        except RequestFailed as e:
+            raise RequestFailed(f"Registration of '{name}' failed: {e}") from None
+        self.client_id = response[:CLIENT_ID_SIZE]
+
+    def _receive(self, size):
+        """Reads exactly `size` bytes into one buffer."""
+        buffer = bytearray(size)
+        view = memoryview(buffer)
+        received = 0
+        while received < size:
+            count = self._sock.recv_into(view[received:])
+            if not count:
+                raise ConnectionError("Server closed the connection.")
+            received += count
+        return buffer
+
+
+def percentile(sorted_values, fraction):
+    """Returns the value below which `fraction` of the sorted values lie (nearest rank)."""
+    if not sorted_values:
+        return 0.0
+    index = min(len(sorted_values) - 1, int(fraction * len(sorted_values)))
+    return sorted_values[index]
+
+
+def connect_clients(args, count, prefix):
+    """Connects and registers `count` clients with unique names."""
+    run = os.urandom(4).hex()
+    clients = []
+    for i in range(count):
+        client = LoadClient(args.host, args.port)
+        client.register(f"{prefix}-{run}-{i}")
+        clients.append(client)
+    return clients
+
+
+def small_client_loop(client, stop, latencies):
+    """Asks for the client's own public key until stopped, recording the latency of each request."""
+    payload = PublicKeyRequestPayload(client.client_id).pack()
+    while not stop.is_set():
+        start = time.perf_counter()
+        client.request(RequestCode.PUBLIC_KEY, payload)
+        latencies.append(time.perf_counter() - start)
+
+
+def bulk_client_process(args, index, stop, moved):
+    """
+    Runs in its own process: sends large messages to itself and pulls them back until stopped,
+    adding the bytes moved to `moved`.
+    """
+    client = connect_clients(args, 1, f"bulk{index}")[0]
+    content = os.urandom(args.bulk_size * 1024 * 1024)
+    message = SendMessageRequestPayloadHeader(client.client_id, MessageType.FILE_SEND, len(content)).pack() + content
+    while not stop.is_set():
+        for _ in range(args.bulk_messages):
+            client.request(RequestCode.SEND_MESSAGE, message)
+            with moved.get_lock():
+                moved.value += len(content)
+            if stop.is_set():
+                break
+        _, pulled = client.request(RequestCode.PULL_MESSAGES)
+        with moved.get_lock():
+            moved.value += len(pulled)
+    client.close()
+
+
+def run_phase(small_clients, bulk_count, args):
+    """
+    Runs the small clients, and `bulk_count` bulk clients, for the configured duration.
+
+    Returns:
+        tuple: (sorted small request latencies in seconds, bulk megabytes moved per second).
+    """
+    stop = threading.Event()
+    latencies = [[] for _ in small_clients]
+    bulk_stop = multiprocessing.Event()
+    moved = multiprocessing.Value('q', 0)
+    processes = [multiprocessing.Process(target=bulk_client_process, args=(args, i, bulk_stop, moved))
+                 for i in range(bulk_count)]
+    for process in processes:
+        process.start()
+    if processes:
+        time.sleep(args.warmup)  # Let the transfers get going before measuring.
+    with moved.get_lock():
+        moved.value = 0
+    start = time.monotonic()
+    threads = [threading.Thread(target=small_client_loop, args=(c, stop, l)) for c, l in zip(small_clients, latencies)]
+    for thread in threads:
+        thread.start()
+    time.sleep(args.duration)
+    stop.set()
+    elapsed = time.monotonic() - start
+    throughput = moved.value / (1024 * 1024) / elapsed
+    bulk_stop.set()
+    for thread in threads:
+        thread.join()
+    for process in processes:
+        process.join()
+    return sorted(l for client_latencies in latencies for l in client_latencies), throughput
+
+
+def latency_scenario(args):
+    """Compares small request latency on an idle server and under bulk transfer load."""
+    small_clients = connect_clients(args, args.small_clients, "small")
+    print(f"{args.small_clients} small clients, {args.bulk_clients} bulk clients moving "
+          f"{args.bulk_messages} x {args.bulk_size} MB, {args.duration:.0f}s per phase.")
+    print(f"{'phase':<8}{'requests':>10}{'p50 ms':>10}{'p90 ms':>10}{'p99 ms':>10}{'max ms':>10}{'bulk MB/s':>12}")
+    for phase, bulk_count in (("idle", 0), ("loaded", args.bulk_clients)):
+        latencies, throughput = run_phase(small_clients, bulk_count, args)
+        print(f"{phase:<8}{len(latencies):>10}" +
+              "".join(f"{percentile(latencies, f) * 1000:>10.2f}" for f in (0.5, 0.9, 0.99, 1.0)) +
+              f"{throughput:>12.1f}")
+    for client in small_clients:
+        client.close()
+
+
+def hello_request():
+    """Returns a complete HELLO request, as sent by a client that wants no optional features."""
+    payload = HelloPayload(0, MAX_REQUEST_PAYLOAD, 0).pack()
+    return RequestHeader(bytes(CLIENT_ID_SIZE), CLIENT_VERSION, RequestCode.HELLO, len(payload)).pack() + payload
+
+
+def receive_response(sock):
+    """Reads one whole response from a blocking socket and returns its code."""
+    data = b""
+    while len(data) < ResponseHeader.size:
+        chunk = sock.recv(ResponseHeader.size - len(data))
+        if not chunk:
+            raise ConnectionError("Server closed the connection.")
+        data += chunk
+    header = ResponseHeader.unpack(data)
+    remaining = header.payload_size
+    while remaining:
+        chunk = sock.recv(remaining)
+        if not chunk:
+            raise ConnectionError("Server closed the connection.")
+        remaining -= len(chunk)
+    return header.code
+
+
+def connection_worker(args, stop, results):
+    """
+    Runs in its own process: connects, sends HELLO, reads the response and closes, until stopped.
+    Puts (connections completed, failures, latencies) on `results`.
+    """
+    request = hello_request()
+    latencies = []
+    failures = 0
+    while not stop.is_set():
+        start = time.perf_counter()
+        try:
+            with socket.create_connection((args.host, args.port), timeout=10) as sock:
+                sock.sendall(request)
+                receive_response(sock)
+        except OSError:
+            failures += 1
+            continue
+        latencies.append(time.perf_counter() - start)
+    results.put((len(latencies), failures, latencies))
+
+
+def connections_scenario(args):
+    """Measures how many short connections per second the server serves."""
+    stop = multiprocessing.Event()
+    results = multiprocessing.Queue()
+    workers = [multiprocessing.Process(target=connection_worker, args=(args, stop, results))
+               for _ in range(args.workers)]
+    for worker in workers:
+        worker.start()
+    time.sleep(args.duration)
+    stop.set()
+    outcomes = [results.get() for _ in workers]
+    for worker in workers:
+        worker.join()
+    completed = sum(outcome[0] for outcome in outcomes)
+    failures = sum(outcome[1] for outcome in outcomes)
+    latencies = sorted(l for outcome in outcomes for l in outcome[2])
+    print(f"{args.workers} workers, {args.duration:.0f}s: {completed / args.duration:.0f} connections/s, "
+          f"{failures} failed; connect+HELLO+close p50 {percentile(latencies, 0.5) * 1000:.2f} ms, "
+          f"p99 {percentile(latencies, 0.99) * 1000:.2f} ms")
+
+
+def concurrent_scenario(args):
+    """
+    Opens connections in steps of args.step and keeps them open. After each step every open
+    connection sends HELLO, and the round is timed until all of them are answered. Stops at
+    args.connections, or when connecting fails or a round takes longer than args.round_timeout.
+    """
+    request = hello_request()
+    sockets = []
+    print(f"{'open':>8}{'round ms':>10}")
+    try:
+        while len(sockets) < args.connections:
+            try:
+                for _ in range(min(args.step, args.connections - len(sockets))):
+                    sock = socket.create_connection((args.host, args.port), timeout=args.round_timeout)
+                    sockets.append(sock)
+            except OSError as e:
+                print(f"Connecting failed with {len(sockets)} open: {e}")
+                break
+            start = time.perf_counter()
+            try:
+                for sock in sockets:
+                    sock.sendall(request)
+                for sock in sockets:
+                    receive_response(sock)
+            except OSError as e:
+                print(f"Round failed with {len(sockets)} open: {e}")
+                break
+            elapsed = time.perf_counter() - start
+            print(f"{len(sockets):>8}{elapsed * 1000:>10.1f}")
+            if elapsed > args.round_timeout:
+                print("Round took longer than the limit.")
+                break
+    finally:
+        for sock in sockets:
+            sock.close()
+
+
+def timed_requests(client, requests):
+    """
+    Sends (code, payload) requests one at a time.
+
+    Returns:
+        tuple: (sorted latencies in seconds, total response payload bytes).
+    """
+    latencies = []
+    received = 0
+    for code, payload in requests:
+        start = time.perf_counter()
+        _, response = client.request(code, payload)
+        latencies.append(time.perf_counter() - start)
+        received += len(response)
+    return sorted(latencies), received
+
+
+def dataset_scenario(args):
+    """Times directory requests and pulls on a server holding a dataset made by datagen.py."""
+    with open(args.users_file) as f:
+        users = [line.split() for line in f if line.strip()]
+    ids = [bytes.fromhex(user[0]) for user in users]
+    print(f"{len(ids)} users in the dataset.")
+    client = LoadClient(args.host, args.port)
+    client.client_id = ids[0]
+    print(f"{'request':<14}{'count':>8}{'p50 ms':>10}{'p99 ms':>10}{'max ms':>10}{'MB':>10}{'MB/s':>10}")
+    runs = (
+        ("CLIENTS_LIST", [(RequestCode.CLIENTS_LIST, b"")] * args.lists),
+        ("PUBLIC_KEY", [(RequestCode.PUBLIC_KEY, PublicKeyRequestPayload(random.choice(ids)).pack())
+                        for _ in range(args.lookups)]),
+        ("CLIENT_LOOKUP", [(RequestCode.CLIENT_LOOKUP,
+                            ClientLookupRequestPayload(bytes(CLIENT_ID_SIZE), random.choice(users)[1].encode('ascii')).pack())
+                           for _ in range(args.lookups)]),
+        ("PULL_MESSAGES", None),
+    )
+    for name, requests in runs:
+        if requests is None:
+            # A pull is made as the user whose messages it takes, one connection per user.
+            latencies, received = [], 0
+            for client_id in random.sample(ids, min(args.pulls, len(ids))):
+                puller = LoadClient(args.host, args.port)
+                puller.client_id = client_id
+                pulled_latencies, pulled = timed_requests(puller, [(RequestCode.PULL_MESSAGES, b"")])
+                puller.close()
+                latencies += pulled_latencies
+                received += pulled
+            latencies.sort()
+        else:
+            latencies, received = timed_requests(client, requests)
+        megabytes = received / (1024 * 1024)
+        print(f"{name:<14}{len(latencies):>8}" +
+              "".join(f"{percentile(latencies, f) * 1000:>10.2f}" for f in (0.5, 0.99, 1.0)) +
+              f"{megabytes:>10.1f}{megabytes / max(sum(latencies), 1e-9):>10.1f}")
+    client.close()
+
+
+def process_usage(pid):
+    """
+    Reads the resident memory and open file descriptors of a process from /proc.
+
+    Returns:
+        tuple: (RSS in MB, open file descriptors), or None if the process is gone.
+    """
+    try:
+        with open(f"/proc/{pid}/status") as f:
+            rss_kb = next(int(line.split()[1]) for line in f if line.startswith("VmRSS:"))
+        return rss_kb / 1024, len(os.listdir(f"/proc/{pid}/fd"))
+    except (OSError, StopIteration):
+        return None
+
+
+def soak_client_loop(args, client, peers, stop, latencies, errors):
+    """
+    Sends messages to random peers, pulling its own after every args.pull_every of them and
+    asking for a public key in between, until stopped. Reconnects after args.reconnect_every
+    requests, and right after a failed request (a connection error, or a response other than
+    the request's success response), which it counts in errors[0] and does not time.
+    """
+    content = os.urandom(args.message_size)
+    requests = 0
+    while not stop.is_set():
+        peer = random.choice(peers)
+        failed = False
+        for code, payload in ((RequestCode.SEND_MESSAGE, SendMessageRequestPayloadHeader(
+                                  peer, MessageType.TEXT_MESSAGE, len(content)).pack() + content),
+                              (RequestCode.PUBLIC_KEY, PublicKeyRequestPayload(peer).pack())):
+            start = time.perf_counter()
+            try:
+                client.request(code, payload)
+                latencies.append(time.perf_counter() - start)
+            except (OSError, RequestFailed):
+                errors[0] += 1
+                failed = True
+                break
+            requests += 1
+        if not failed and requests % args.pull_every == 0:
+            start = time.perf_counter()
+            try:
+                client.request(RequestCode.PULL_MESSAGES)
+                latencies.append(time.perf_counter() - start)
+            except (OSError, RequestFailed):
+                errors[0] += 1
+                failed = True
+        # Nothing else is sent on a connection a request failed on.
+        if failed or requests >= args.reconnect_every:
+            client_id = client.client_id
+            client.close()
+            try:
+                client = LoadClient(args.host, args.port)
+            except OSError:
+                errors[0] += 1
+                time.sleep(1)
+                continue
+            client.client_id = client_id
+            requests = 0
+    client.close()
+
+
+def soak_sample(args, latencies):
+    """Takes one sample of resource use and of the latencies recorded since the last one."""
+    sample = {"requests": len(latencies)}
+    ordered = sorted(latencies)
+    sample["p50"] = percentile(ordered, 0.5) * 1000
+    sample["p99"] = percentile(ordered, 0.99) * 1000
+    processes = [("server", args.server_pid)] if args.server_pid else []
+    processes += [("loadgen", os.getpid())] + [(f"pid{pid}", pid) for pid in args.watch_pid]
+    for name, pid in processes:
+        usage = process_usage(pid)
+        if usage is None:
+            raise RuntimeError(f"Process {pid} ({name}) is gone.")
+        sample[f"{name}_rss"], sample[f"{name}_fds"] = usage
+    if args.db:
+        # The journal or WAL file is part of what the database occupies on disk; an lsm store is a directory.
+        paths = ([os.path.join(args.db, name) for name in os.listdir(args.db)] if os.path.isdir(args.db)
+                 else [args.db, args.db + "-journal", args.db + "-wal"])
+        sample["db_mb"] = sum(os.path.getsize(path) for path in paths if os.path.exists(path)) / (1024 * 1024)
+    if args.temp_files:
+        sample["temp_files"] = len(glob.glob(args.temp_files))
+    return sample
+
+
+def soak_drift(args, baseline, sample):
+    """Returns a description of every limit the sample exceeds compared to the baseline."""
+    failures = []
+    for key, value in sample.items():
+        if key.endswith("_rss") and value - baseline[key] > args.max_rss_growth:
+            failures.append(f"{key} grew by {value - baseline[key]:.1f} MB")
+        elif key.endswith("_fds") and value - baseline[key] > args.max_fd_growth:
+            failures.append(f"{key} grew by {value - baseline[key]}")
+    if "db_mb" in sample and sample["db_mb"] - baseline["db_mb"] > args.max_db_growth:
+        failures.append(f"database grew by {sample['db_mb'] - baseline['db_mb']:.1f} MB")
+    if "temp_files" in sample and sample["temp_files"] - baseline["temp_files"] > args.max_temp_files:
+        failures.append(f"{sample['temp_files'] - baseline['temp_files']} more temp files")
+    # A p99 below a millisecond is noise; drift is measured against at least that.
+    if sample["p99"] > args.max_latency_drift * max(baseline["p99"], 1.0):
+        failures.append(f"p99 latency {sample['p99']:.1f} ms against {baseline['p99']:.1f} ms")
+    if sample["errors"] > args.max_errors:
+        failures.append(f"{sample['errors']} failed requests")
+    return failures
+
+
+def soak_scenario(args):
+    """Runs a steady workload for a long time and fails if resource use or latency drifts."""
+    clients = connect_clients(args, args.clients, "soak")
+    peers = [client.client_id for client in clients]
+    stop = threading.Event()
+    latencies = []
+    errors = [0]
+    threads = [threading.Thread(target=soak_client_loop, args=(args, c, peers, stop, latencies, errors))
+               for c in clients]
+    for thread in threads:
+        thread.start()
+    csv = open(args.csv, "w") if args.csv else None
+    baseline = None
+    failures = []
+    started = time.monotonic()
+    try:
+        time.sleep(args.warmup)
+        latencies.clear()
+        while not failures and time.monotonic() - started < args.warmup + args.duration:
+            time.sleep(args.interval)
+            window, latencies[:] = latencies[:], []
+            sample = soak_sample(args, window)
+            sample["errors"] = errors[0]
+            sample = {"elapsed": int(time.monotonic() - started), **sample}
+            if baseline is None:
+                baseline = sample
+                print("  ".join(f"{key:>12}" for key in sample))
+                if csv:
+                    csv.write(",".join(sample) + "\n")
+            else:
+                failures = soak_drift(args, baseline, sample)
+            print("  ".join(f"{value:>12.1f}" if isinstance(value, float) else f"{value:>12}"
+                            for value in sample.values()), flush=True)
+            if csv:
+                csv.write(",".join(str(value) for value in sample.values()) + "\n")
+                csv.flush()
+    except RuntimeError as e:
+        failures = [str(e)]
+    finally:
+        stop.set()
+        for thread in threads:
+            thread.join()
+        if csv:
+            csv.close()
+    if failures:
+        print("Soak test failed: " + "; ".join(failures))
+        sys.exit(1)
+    print("Soak test passed.")
+
+
+class MuMessage(ctypes.Structure):
+    """The mu_message struct of the client library's C API (MessageU.h)."""
+    _fields_ = [
+        ("struct_size", ctypes.c_size_t),
+        ("sender_id", ctypes.POINTER(ctypes.c_uint8)),
+        ("sender_name", ctypes.c_char_p),
+        ("message_id", ctypes.c_uint32),
+        ("type", ctypes.c_uint8),
+        ("status", ctypes.c_int),
+        ("content", ctypes.POINTER(ctypes.c_uint8)),
+        ("content_size", ctypes.c_size_t),
+        ("file_path", ctypes.c_char_p),
+        ("deferred", ctypes.c_int),
+        ("sequence", ctypes.c_uint64),
+        ("skipped", ctypes.c_uint64),
+    ]
+
+
+class MuMemoryUsage(ctypes.Structure):
+    """The mu_memory_usage struct of the client library's C API (MessageU.h)."""
+    _fields_ = [
+        ("struct_size", ctypes.c_size_t),
+        ("live_bytes", ctypes.c_uint64),
+        ("peak_bytes", ctypes.c_uint64),
+        ("allocations", ctypes.c_uint64),
+    ]
+
+
+MU_MESSAGE_CB = ctypes.CFUNCTYPE(None, ctypes.POINTER(MuMessage), ctypes.c_void_p)
+MU_MESSAGE_FILE = 4         # mu_message.type of a file message
+MU_MESSAGE_CHUNKED_FILE = 6  # mu_message.type of a file sent in chunks
+MU_MESSAGE_DELIVERED = 0    # mu_message.status of a processed message
+MU_MEMORY_TOTAL = 4         # mu_memory_subsystem of all subsystems together
+
+
+def peak_rss(pid="self"):
+    """Reads the peak resident memory (VmHWM) of a process from /proc, in MB, or None if it is gone."""
+    try:
+        with open(f"/proc/{pid}/status") as f:
+            return next(int(line.split()[1]) for line in f if line.startswith("VmHWM:")) / 1024
+    except (OSError, StopIteration):
+        return None
+
+
+def write_test_file(path, size, seed):
+    """
+    Writes `size` bytes of pseudo-random content in 1 MB blocks, so that neither the file nor
+    its hash is ever held whole.
+
+    Returns:
+        bytes: The SHA-256 digest of the content.
+    """
+    block = bytearray(random.Random(seed).randbytes(1024 * 1024))
+    digest = hashlib.sha256()
+    with open(path, "wb") as f:
+        for index in range((size + len(block) - 1) // len(block)):
+            block[:8] = index.to_bytes(8, "little")  # no two blocks are alike
+            chunk = memoryview(block)[:min(len(block), size - index * len(block))]
+            f.write(chunk)
+            digest.update(chunk)
+    return digest.digest()
+
+
+def file_digest(path):
+    """Returns the SHA-256 digest of a file, read in 1 MB blocks."""
+    digest = hashlib.sha256()
+    with open(path, "rb") as f:
+        while block := f.read(1024 * 1024):
+            digest.update(block)
+    return digest.digest()
+
+
+def open_library_session(library, work_dir, name, args):
+    """
+    Opens a session of the client library with its own identity and registers it as `name`.
+
+    Raises:
+        RuntimeError: If the session cannot be opened or registered.
+    """
+    directory = os.path.join(work_dir, name)
+    os.makedirs(directory)
+    server_info = os.path.join(directory, "server.info")
+    with open(server_info, "w") as f:
+        f.write(f"{args.host}:{args.port}")
+    session = ctypes.c_void_p()
+    status = library.mu_open(server_info.encode(), os.path.join(directory, "my.info").encode(),
+                             os.path.join(directory, "pending").encode(), ctypes.byref(session))
+    if status != 0:
+        raise RuntimeError(f"mu_open failed: {library.mu_status_string(status).decode()}")
+    status = library.mu_register(session, name.encode())
+    if status != 0:
+        library.mu_close(session)
+        raise RuntimeError(f"Registration of '{name}' failed: {library.mu_status_string(status).decode()}")
+    return session
+
+
+def transfer_scenario(args):
+    """Sends multi-GB of files between two sessions of the client library and checks its peak RSS."""
+    library = ctypes.CDLL(os.path.abspath(args.library))
+    library.mu_status_string.restype = ctypes.c_char_p
+    library.mu_open.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.POINTER(ctypes.c_void_p)]
+    library.mu_close.argtypes = [ctypes.c_void_p]
+    for function in (library.mu_register, library.mu_send_sym_key):
+        function.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+    library.mu_send_file.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p]
+    library.mu_pull.argtypes = [ctypes.c_void_p, MU_MESSAGE_CB, ctypes.c_void_p]
+    library.mu_memory_set_budget.argtypes = [ctypes.c_uint64]
+    library.mu_memory_stats.argtypes = [ctypes.c_int, ctypes.POINTER(MuMemoryUsage)]
+    library.mu_memory_set_budget(int(args.budget * 1024 * 1024))
+
+    work_dir = tempfile.mkdtemp(prefix="loadgen-transfer-", dir=args.work_dir)
+    sessions = []
+    expected = {}  # digest of each file sent -> its path
+    failures = []
+
+    def on_message(message, _):
+        """Checks each file as it is pulled and deletes it, so the received files never pile up."""
+        message = message.contents
+        if message.type not in (MU_MESSAGE_FILE, MU_MESSAGE_CHUNKED_FILE):
+            return
+        if message.status != MU_MESSAGE_DELIVERED or not message.file_path:
+            failures.append(f"message {message.message_id} was not delivered (status {message.status})")
+            return
+        path = message.file_path.decode()
+        if expected.pop(file_digest(path), None) is None:
+            failures.append(f"message {message.message_id} differs from every file sent")
+        os.remove(path)
+
+    callback = MU_MESSAGE_CB(on_message)
+    try:
+        size = args.size * 1024 * 1024
+        print(f"Writing {args.files} test files of {args.size} MB...", flush=True)
+        for index in range(args.files):
+            path = os.path.join(work_dir, f"source-{index}.bin")
+            expected[write_test_file(path, size, index)] = path
+
+        run = os.urandom(4).hex()
+        sender_name, receiver_name = f"transfer-{run}-a", f"transfer-{run}-b"
+        sender = open_library_session(library, work_dir, sender_name, args)
+        sessions.append(sender)
+        receiver = open_library_session(library, work_dir, receiver_name, args)
+        sessions.append(receiver)
+        status = library.mu_send_sym_key(sender, receiver_name.encode())
+        if status == 0:
+            status = library.mu_pull(receiver, callback, None)
+        if status != 0:
+            raise RuntimeError(f"Key exchange failed: {library.mu_status_string(status).decode()}")
+
+        before = peak_rss()
+        started = time.monotonic()
+        for path in expected.values():
+            status = library.mu_send_file(sender, receiver_name.encode(), path.encode())
+            if status != 0:
+                raise RuntimeError(f"Sending {path} failed: {library.mu_status_string(status).decode()}")
+        sent = time.monotonic()
+        print(f"Sent in {sent - started:.1f} s; pulling...", flush=True)
+        status = library.mu_pull(receiver, callback, None)
+        if status != 0:
+            raise RuntimeError(f"mu_pull failed: {library.mu_status_string(status).decode()}")
+        pulled = time.monotonic()
+        after = peak_rss()
+
+        usage = MuMemoryUsage(struct_size=ctypes.sizeof(MuMemoryUsage))
+        library.mu_memory_stats(MU_MEMORY_TOTAL, ctypes.byref(usage))
+        print(f"Pulled in {pulled - sent:.1f} s")
+        print(f"{'peak RSS before (MB)':>28}{before:>10.1f}")
+        print(f"{'peak RSS after (MB)':>28}{after:>10.1f}")
+        print(f"{'library peak charged (MB)':>28}{usage.peak_bytes / (1024 * 1024):>10.1f}")
+        if args.server_pid:
+            server_peak = peak_rss(args.server_pid)
+            print(f"{'server peak RSS (MB)':>28}{server_peak if server_peak is not None else float('nan'):>10.1f}")
+        if expected:
+            failures.append(f"{len(expected)} of {args.files} files were not received")
+        if after - before > args.max_rss_growth:
+            failures.append(f"peak RSS grew by {after - before:.1f} MB (limit {args.max_rss_growth} MB)")
+    except RuntimeError as e:
+        failures = [str(e)]
+    finally:
+        for session in sessions:
+            library.mu_close(session)
+        shutil.rmtree(work_dir, ignore_errors=True)
+    if failures:
+        print("Transfer test failed: " + "; ".join(failures))
+        sys.exit(1)
+    print("Transfer test passed.")
+
+
+def main():
+    """The main entry point of the load generator."""
+    parser = argparse.ArgumentParser(description="MessageU server load generator")
+    parser.add_argument("--host", default="127.0.0.1", help="server host (default: %(default)s)")
+    parser.add_argument("--port", type=int, default=1357, help="server port (default: %(default)s)")
+    scenarios = parser.add_subparsers(dest="scenario", required=True)
+    latency = scenarios.add_parser("latency", help="small request latency, idle and under bulk transfers")
+    latency.add_argument("--small-clients", type=int, default=8, help="clients sending small requests (default: %(default)s)")
+    latency.add_argument("--bulk-clients", type=int, default=4, help="clients moving large messages (default: %(default)s)")
+    latency.add_argument("--bulk-size", type=int, default=4, help="size of each large message in MB (default: %(default)s)")
+    latency.add_argument("--bulk-messages", type=int, default=32,
+                         help="large messages sent before each pull (default: %(default)s)")
+    latency.add_argument("--duration", type=float, default=10.0, help="seconds measured per phase (default: %(default)s)")
+    latency.add_argument("--warmup", type=float, default=1.0,
+                         help="seconds of bulk load before measuring (default: %(default)s)")
+    latency.set_defaults(run=latency_scenario)
+    connections = scenarios.add_parser("connections", help="short connections served per second")
+    connections.add_argument("--workers", type=int, default=4, help="processes opening connections (default: %(default)s)")
+    connections.add_argument("--duration", type=float, default=10.0, help="seconds to run (default: %(default)s)")
+    connections.set_defaults(run=connections_scenario)
+    concurrent = scenarios.add_parser("concurrent", help="open connections that are all still answered")
+    concurrent.add_argument("--connections", type=int, default=10000, help="most connections to open (default: %(default)s)")
+    concurrent.add_argument("--step", type=int, default=1000, help="connections opened per step (default: %(default)s)")
+    concurrent.add_argument("--round-timeout", type=float, default=10.0,
+                            help="seconds a round may take before stopping (default: %(default)s)")
+    concurrent.set_defaults(run=concurrent_scenario)
+    dataset = scenarios.add_parser("dataset", help="directory requests and pulls on a datagen.py dataset")
+    dataset.add_argument("users_file", help="the users.txt written by datagen.py")
+    dataset.add_argument("--lists", type=int, default=3, help="CLIENTS_LIST requests (default: %(default)s)")
+    dataset.add_argument("--lookups", type=int, default=1000, help="PUBLIC_KEY and CLIENT_LOOKUP requests each (default: %(default)s)")
+    dataset.add_argument("--pulls", type=int, default=100, help="users whose messages are pulled (default: %(default)s)")
+    dataset.set_defaults(run=dataset_scenario)
+    soak = scenarios.add_parser("soak", help="long steady load, failing on resource or latency drift")
+    soak.add_argument("--duration", type=float, default=4 * 3600, help="seconds to run after the warmup (default: %(default)s)")
+    soak.add_argument("--interval", type=float, default=60.0, help="seconds between samples (default: %(default)s)")
+    soak.add_argument("--warmup", type=float, default=60.0,
+                      help="seconds of load before the first sample, which the others are compared to (default: %(default)s)")
+    soak.add_argument("--clients", type=int, default=8, help="clients sending, pulling and looking up (default: %(default)s)")
+    soak.add_argument("--message-size", type=int, default=1024, help="bytes per message (default: %(default)s)")
+    soak.add_argument("--pull-every", type=int, default=8, help="messages sent between pulls (default: %(default)s)")
+    soak.add_argument("--reconnect-every", type=int, default=200,
+                      help="requests after which a client reconnects (default: %(default)s)")
+    soak.add_argument("--server-pid", type=int, help="process ID of the server, to sample its RSS and descriptors")
+    soak.add_argument("--watch-pid", type=int, action="append", default=[],
+                      help="another process to sample, such as a client; may be repeated")
+    soak.add_argument("--db", help="database file (or lsm directory) of the server, to sample its size")
+    soak.add_argument("--temp-files", help="glob of files to count, such as a client's temp files (/tmp/msgU_*)")
+    soak.add_argument("--csv", help="file to write every sample to")
+    soak.add_argument("--max-rss-growth", type=float, default=64.0, help="MB any process may grow by (default: %(default)s)")
+    soak.add_argument("--max-fd-growth", type=int, default=16,
+                      help="open descriptors any process may gain (default: %(default)s)")
+    soak.add_argument("--max-db-growth", type=float, default=64.0, help="MB the database may grow by (default: %(default)s)")
+    soak.add_argument("--max-temp-files", type=int, default=16,
+                      help="files matching --temp-files that may be added (default: %(default)s)")
+    soak.add_argument("--max-latency-drift", type=float, default=3.0,
+                      help="factor the p99 latency may grow by (default: %(default)s)")
+    soak.add_argument("--max-errors", type=int, default=0, help="failed requests allowed (default: %(default)s)")
+    soak.set_defaults(run=soak_scenario)
+    transfer = scenarios.add_parser("transfer", help="peak client RSS while GBs of files are sent and pulled")
+    transfer.add_argument("library", help="the MessageUCore library to load (e.g. libMessageUCore.so)")
+    transfer.add_argument("--files", type=int, default=8, help="files sent (default: %(default)s)")
+    transfer.add_argument("--size", type=int, default=250, help="size of each file in MB (default: %(default)s)")
+    transfer.add_argument("--budget", type=float, default=16.0,
+                          help="memory budget of the library in MB (default: %(default)s)")
+    transfer.add_argument("--max-rss-growth", type=float, default=32.0,
+                          help="MB the peak RSS may grow by during the transfer (default: %(default)s)")
+    transfer.add_argument("--work-dir", help="directory for the file and the identities (default: the temp directory)")
+    transfer.add_argument("--server-pid", type=int, help="process ID of the server, to report its peak RSS")
+    transfer.set_defaults(run=transfer_scenario)
+    args = parser.parse_args()
+    args.run(args)
+
+
+# This block ensures that main() is called only when the script is executed directly.
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,328 @@
+# lsm_data_manager.py
+# author: Ariel Cohen ID: 329599187
+
+import datetime   # For timestamping
+import itertools  # For taking the oldest messages of a mailbox
+import logging    # For logging events
+import marshal    # For encoding records: fast, and unlike pickle it cannot run code
+import struct     # For the integers in keys
+import time       # For timing the preload
+from directory_cache import DirectoryCache
+from lsm_store import LSMStore
+from storage_engine import CONTENT_CHUNK, StorageEngine
+
+_ID = struct.Struct('>Q')    # Message IDs and Seqs in keys, big-endian so keys sort in numeric order.
+_NODE = struct.Struct('>I')  # Node IDs in keys.
+_CHUNK = struct.Struct('>I') # Content chunk indexes in keys.
+
+# Key prefixes. A key is its prefix followed by the parts listed.
+CLIENT = b'c'       # client ID -> (UserName, PublicKey, LastSeen, Home, Seq)
+NAME = b'n'         # username -> client ID
+SEQ = b's'          # Seq -> client ID
+MAILBOX = b'q'      # recipient ID, message ID -> (FromClient, Type, Size)
+CONTENT = b'm'      # message ID, chunk index -> CONTENT_CHUNK bytes of content (less in the last chunk)
+PEER = b'p'         # node -> the directory Seq copied from it
+OUTBOX = b'o'       # node, outbox message ID -> (ToClient, FromClient, Type, Content)
+OUTBOX_NODE = b'x'  # outbox message ID -> node
+COUNTERS = b'#'     # -> (last message ID, last outbox message ID, highest Seq)
+
+
+class LSMDataManager(StorageEngine):
+    """
+    A storage engine on LSMStore, an embedded log-structured merge store: every write is one
+    appended log record instead of B-tree page updates and a commit, which suits the server's
+    write-heavy message queue.
+
+    The tables become key ranges (see the key prefixes above). A queued message is its header,
+    in the recipient's mailbox range, so a pull is a scan of one range, and its content, in
+    chunks of CONTENT_CHUNK bytes under its ID, read in slices like a BLOB. A message pulled
+    soon after it was sent is deleted before the memtable is written out, so it never reaches a
+    segment file. Each call is one atomic write; a batch call (add_messages,
+    add_replicated_clients) too, but for add_message_file, which writes a chunk at a time and the
+    header last: a crash in the middle leaves chunks no message refers to.
+    """
+    def __init__(self, directory):
+        logging.basicConfig(level=logging.INFO, format='%(asctime)s - %(levelname)s - %(message)s')
+        self._store = LSMStore(directory)
+        counters = self._store.get(COUNTERS)
+        self._last_message_id, self._last_outbox_id, self._directory_seq = \
+            marshal.loads(counters) if counters else (0, 0, 0)
+        # The client directory and mailbox counters in memory, once preloaded.
+        self._cache = None
+        logging.info(f"Opened the store in {directory}.")
+
+    def preload(self, snapshot_file=None):
+        """
+        Loads the client directory and the number of messages waiting for each client into memory,
+        in one scan of the clients and one of the mailboxes. The snapshot file is not used: the
+        scans read keys mostly, which the store holds in memory.
+        """
+        started = time.monotonic()
+        cache = DirectoryCache()
+        for key, value in self._store.scan(CLIENT):
+            username, _, _, home, _ = marshal.loads(value)
+            cache.add_client(key[1:], username, home)
+        for key, _ in self._store.scan(MAILBOX):
+            cache.messages_added(key[1:17])
+        self._cache = cache
+        return {'clients': cache.client_count, 'mailboxes': cache.mailbox_count, 'source': 'store',
+                'seconds': time.monotonic() - started}
+
+    def _get(self, key, batch):
+        """Returns a key's value as the batch of changes being built leaves it."""
+        return batch[key] if key in batch else self._store.get(key)
+
+    def _write(self, batch):
+        """Writes a batch of changes, with the counters, as one atomic write."""
+        batch[COUNTERS] = marshal.dumps((self._last_message_id, self._last_outbox_id, self._directory_seq))
+        self._store.write(list(batch.items()))
+
+    # --- Clients ---
+
+    def _client(self, client_id, batch=None):
+        value = self._get(CLIENT + client_id, batch) if batch is not None else self._store.get(CLIENT + client_id)
+        return marshal.loads(value) if value else None
+
+    def _put_client(self, batch, client_id, username, public_key, last_seen, home, seq):
+        """Adds a client to a batch, replacing the one with the same ID and the one with the same username."""
+        for other in (client_id, self._get(NAME + username.encode('utf-8'), batch)):
+            client = self._client(other, batch) if other else None
+            if client:
+                batch[NAME + client[0].encode('utf-8')] = None
+                batch[SEQ + _ID.pack(client[4])] = None
+                batch[CLIENT + other] = None
+        batch[CLIENT + client_id] = marshal.dumps((username, public_key, last_seen, home, seq))
+        batch[NAME + username.encode('utf-8')] = client_id
+        batch[SEQ + _ID.pack(seq)] = client_id
+        self._directory_seq = max(self._directory_seq, seq)
+        if self._cache:
+            self._cache.add_client(client_id, username, home)
+
+    @staticmethod
+    def _client_row(client_id, client):
+        username, public_key, last_seen, home, seq = client
+        return {'ID': client_id, 'UserName': username, 'PublicKey': public_key, 'LastSeen': last_seen,
+                'Home': home, 'Seq': seq}
+
+    def add_client(self, client_id, username, public_key):
+        logging.info(f"Adding new client: {username}")
+        batch = {}
+        self._put_client(batch, client_id, username, public_key, str(datetime.datetime.now()), None,
+                         self._directory_seq + 1)
+        self._write(batch)
+
+    def username_exists(self, username):
+        if self._cache:
+            return self._cache.has_username(username)
+        return self._store.get(NAME + username.encode('utf-8')) is not None
+
+    def client_id_exists(self, client_id):
+        if self._cache:
+            return self._cache.has_client(client_id)
+        return self._store.get(CLIENT + client_id) is not None
+
+    def get_clients(self, exclude_id):
+        return [{'ID': key[1:], 'UserName': marshal.loads(value)[0]}
+                for key, value in self._store.scan(CLIENT) if key[1:] != exclude_id]
+
+    def get_client_by_id(self, client_id):
+        if self._cache and not self._cache.has_client(client_id):
+            return None
+        client = self._client(client_id)
+        return self._client_row(client_id, client) if client else None
+
+    def get_client_by_name(self, username):
+        if self._cache:
+            client_id = self._cache.client_id_of(username)
+        else:
+            client_id = self._store.get(NAME + username.encode('utf-8'))
+        return self.get_client_by_id(client_id) if client_id is not None else None
+
+    def update_last_seen(self, client_id):
+        client = self._client(client_id)
+        if client:
+            username, public_key, _, home, seq = client
+            self._store.write([(CLIENT + client_id,
+                                marshal.dumps((username, public_key, str(datetime.datetime.now()), home, seq)))])
+
+    def get_client_home(self, client_id):
+        if self._cache:
+            return (self._cache.has_client(client_id), self._cache.home_of(client_id))
+        client = self._client(client_id)
+        return (client is not None, client[3] if client else None)
+
+    def _clients_since(self, seq, limit, local_only):
+        rows = []
+        for _, client_id in self._store.scan(SEQ, SEQ + _ID.pack(seq + 1)):
+            if len(rows) == limit:
+                break
+            username, public_key, _, home, client_seq = self._client(client_id)
+            if not local_only or home is None:
+                rows.append({'Seq': client_seq, 'ID': client_id, 'UserName': username, 'PublicKey': public_key})
+        return rows
+
+    def get_local_clients_since(self, seq, limit):
+        return self._clients_since(seq, limit, local_only=True)
+
+    def get_clients_since(self, seq, limit):
+        return self._clients_since(seq, limit, local_only=False)
+
+    def get_directory_seq(self):
+        return self._directory_seq
+
+    def add_replicated_clients(self, entries):
+        batch = {}
+        now = str(datetime.datetime.now())
+        for seq, client_id, username, public_key in entries:
+            self._put_client(batch, client_id, username, public_key, now, None, seq)
+        self._write(batch)
+
+    def add_remote_clients(self, node, entries, last_seq):
+        batch = {}
+        now = str(datetime.datetime.now())
+        for client_id, username, public_key in entries:
+            if self._get(CLIENT + client_id, batch) or self._get(NAME + username.encode('utf-8'), batch):
+                logging.warning(f"Skipped client '{username}' from node {node}: name or ID already in use.")
+                continue
+            self._put_client(batch, client_id, username, public_key, now, node, self._directory_seq + 1)
+        batch[PEER + _NODE.pack(node)] = _ID.pack(last_seq)
+        self._write(batch)
+
+    def get_peer_directory_seq(self, node):
+        value = self._store.get(PEER + _NODE.pack(node))
+        return _ID.unpack(value)[0] if value else 0
+
+    # --- Messages ---
+
+    def _queue_message(self, batch, to_client_id, from_client_id, msg_type, content):
+        self._last_message_id += 1
+        message_id = _ID.pack(self._last_message_id)
+        content = bytes(content or b"")
+        batch[MAILBOX + to_client_id + message_id] = marshal.dumps((from_client_id, msg_type, len(content)))
+        for index, offset in enumerate(range(0, len(content), CONTENT_CHUNK)):
+            batch[CONTENT + message_id + _CHUNK.pack(index)] = content[offset:offset + CONTENT_CHUNK]
+        if self._cache:
+            self._cache.messages_added(to_client_id)
+        return self._last_message_id
+
+    def add_message(self, to_client_id, from_client_id, msg_type, content):
+        batch = {}
+        message_id = self._queue_message(batch, to_client_id, from_client_id, msg_type, content)
+        self._write(batch)
+        return message_id
+
+    def add_message_file(self, to_client_id, from_client_id, msg_type, path, size):
+        self._last_message_id += 1
+        message_id = _ID.pack(self._last_message_id)
+        with open(path, 'rb') as f:
+            for index, offset in enumerate(range(0, size, CONTENT_CHUNK)):
+                # The counters go with every chunk, so a crash never hands out this ID again.
+                self._write({CONTENT + message_id + _CHUNK.pack(index): f.read(min(CONTENT_CHUNK, size - offset))})
+        self._write({MAILBOX + to_client_id + message_id: marshal.dumps((from_client_id, msg_type, size))})
+        if self._cache:
+            self._cache.messages_added(to_client_id)
+        return self._last_message_id
+
+    def add_messages(self, messages):
+        batch = {}
+        for to_client_id, from_client_id, msg_type, content in messages:
+            self._queue_message(batch, to_client_id, from_client_id, msg_type, content)
+        self._write(batch)
+
+    def get_mailbox_summary(self, client_id, limit=-1):
+        if self._cache and not self._cache.waiting(client_id):
+            return 0, 0, 0
+        count = total_size = last_id = 0
+        for key, value in itertools.islice(self._store.scan(MAILBOX + client_id), None if limit < 0 else limit):
+            count += 1
+            total_size += marshal.loads(value)[2]
+            last_id = _ID.unpack(key[17:])[0]
+        return count, total_size, last_id
+
+    def get_messages_for_client(self, client_id, limit=-1, after_id=0):
+        if self._cache and not self._cache.waiting(client_id):
+            return []
+        messages = []
+        scan = self._store.scan(MAILBOX + client_id, MAILBOX + client_id + _ID.pack(after_id + 1))
+        for key, value in itertools.islice(scan, None if limit < 0 else limit):
+            from_client_id, msg_type, size = marshal.loads(value)
+            messages.append({'ID': _ID.unpack(key[17:])[0], 'FromClient': from_client_id, 'Type': msg_type, 'Size': size})
+        return messages
+
+    def get_message_content(self, message_id, offset, size):
+        key = CONTENT + _ID.pack(message_id)
+        pieces = []
+        while size > 0:
+            index, within = divmod(offset, CONTENT_CHUNK)
+            piece = self._store.get_range(key + _CHUNK.pack(index), within, min(size, CONTENT_CHUNK - within))
+            if not piece:
+                break
+            pieces.append(piece)
+            offset += len(piece)
+            size -= len(piece)
+        return b"".join(pieces)
+
+    def delete_messages(self, client_id, message_ids):
+        changes = []
+        deleted = 0
+        for message_id in message_ids:
+            key = _ID.pack(message_id)
+            header = self._store.get(MAILBOX + client_id + key)
+            if header is not None:
+                size = marshal.loads(header)[2]
+                changes.append((MAILBOX + client_id + key, None))
+                changes += [(CONTENT + key + _CHUNK.pack(index), None) for index in range(-(-size // CONTENT_CHUNK))]
+                deleted += 1
+        if changes:
+            self._store.write(changes)
+        if self._cache:
+            self._cache.messages_removed(client_id, deleted)
+
+    # --- Outbox ---
+
+    def add_outbox_message(self, node, to_client_id, from_client_id, msg_type, content):
+        self._last_outbox_id += 1
+        message_id = _ID.pack(self._last_outbox_id)
+        self._write({OUTBOX + _NODE.pack(node) + message_id:
+                     marshal.dumps((to_client_id, from_client_id, msg_type, bytes(content or b""))),
+                     OUTBOX_NODE + message_id: _NODE.pack(node)})
+        return self._last_outbox_id
+
+    def get_outbox(self, node, limit, max_bytes):
+        messages = []
+        total = 0
+        # Scanned lazily, so content beyond the budget is never read.
+        for key, value in itertools.islice(self._store.scan(OUTBOX + _NODE.pack(node)), limit):
+            to_client_id, from_client_id, msg_type, content = marshal.loads(value)
+            total += len(content)
+            if messages and total > max_bytes:
+                break
+            messages.append({'ID': _ID.unpack(key[5:])[0], 'ToClient': to_client_id, 'FromClient': from_client_id,
+                             'Type': msg_type, 'Content': content})
+        return messages
+
+    def delete_outbox(self, message_ids):
+        changes = []
+        for message_id in message_ids:
+            key = _ID.pack(message_id)
+            node = self._store.get(OUTBOX_NODE + key)
+            if node is not None:
+                changes += [(OUTBOX + node + key, None), (OUTBOX_NODE + key, None)]
+        if changes:
+            self._store.write(changes)
+
+    # --- Persistence ---
+
+    def backup(self, path):
+        """Copies the store's segments to the directory `path`, a store a server can be started on."""
+        self._store.backup(path)
+
+    def pending_sync(self):
+        return self._store.pending_sync()
+
+    def sync(self):
+        self._store.sync()
+
+    def close(self):
+        logging.info("Closing the store.")
+        self._store.close()
@@ -0,0 +1,382 @@
+# lsm_store.py
+# author: Ariel Cohen ID: 329599187
+
+import bisect   # For the sorted keys of the memtable and the segments
+import heapq    # For merging the memtable and the segments in key order
+import logging  # For logging flushes, compactions and recovery
+import os       # For the store's files
+import re       # For recognizing segment files
+import struct   # For the file formats
+import time     # For spacing the log's fsyncs
+import zlib     # For the CRC of log records
+
+MEMTABLE_LIMIT = 8 * 1024 * 1024  # Bytes of keys and values after which the memtable is written out as a segment.
+MAX_SEGMENTS = 4                  # Segments after which they are all merged into one.
+LOG_SYNC_INTERVAL = 1.0           # Seconds after a write by which the log is synced to disk (0: every write).
+TOMBSTONE = 0xFFFFFFFF            # The value size that marks a deleted key.
+SEGMENT_MAGIC = b"MULSM001"       # Ends every segment file.
+
+_RECORD = struct.Struct('<II')        # A log record (one write): payload size, CRC32 of the payload.
+_ENTRY = struct.Struct('<HI')         # A change in a log record: key size, value size or TOMBSTONE.
+_INDEX_ENTRY = struct.Struct('<HQI')  # A key in a segment's index: key size, value offset, value size or TOMBSTONE.
+_FOOTER = struct.Struct('<QQQ8s')     # A segment's index offset, key count, the segments it replaces, magic.
+_SEGMENT_NAME = re.compile(r'^(\d{8})\.seg$')
+LOG_NAME = "log"
+_ABSENT = object()  # Marks a key the memtable does not hold.
+
+
+def _sync_directory(directory):
+    """
+    Syncs a directory's entries to disk, so that a rename into it survives a crash. Windows
+    cannot open a directory for this; NTFS journals the rename itself.
+    """
+    if os.name == "nt":
+        return
+    fd = os.open(directory, os.O_RDONLY)
+    try:
+        os.fsync(fd)
+    finally:
+        os.close(fd)
+
+
+class _Segment:
+    """
+    One immutable segment file: the values of a sorted run of keys, then an index of the keys
+    with the offset and size of their values, then a footer. The index is held in memory, so a
+    lookup costs one read of the value.
+    """
+    def __init__(self, path, number):
+        self.path = path
+        self.number = number
+        self._file = open(path, 'rb')
+        size = self._file.seek(0, os.SEEK_END)
+        self._file.seek(size - _FOOTER.size)
+        index_offset, count, self.replaces, magic = _FOOTER.unpack(self._file.read(_FOOTER.size))
+        if magic != SEGMENT_MAGIC:
+            raise ValueError(f"{path} is not a segment file.")
+        self._file.seek(index_offset)
+        index = self._file.read(size - _FOOTER.size - index_offset)
+        self.keys = []
+        self._locations = {}
+        position = 0
+        for _ in range(count):
+            key_size, offset, value_size = _INDEX_ENTRY.unpack_from(index, position)
+            position += _INDEX_ENTRY.size
+            key = index[position:position + key_size]
+            position += key_size
+            self.keys.append(key)
+            self._locations[key] = (offset, value_size)
+
+    def __contains__(self, key):
+        return key in self._locations
+
+    def location(self, key):
+        """Returns (offset, size) of a key's value, size being TOMBSTONE for a deleted key; None if absent."""
+        return self._locations.get(key)
+
+    def read(self, location, offset=0, size=None):
+        """Reads `size` bytes (all if None) of the value at `location` from `offset`."""
+        value_offset, value_size = location
+        size = value_size - offset if size is None else min(size, value_size - offset)
+        if size <= 0:
+            return b""
+        self._file.seek(value_offset + offset)
+        return self._file.read(size)
+
+    def close(self):
+        self._file.close()
+
+    @staticmethod
+    def write(path, items, replaces=0):
+        """
+        Writes a segment of (key, value) items in key order, value None for a deleted key, and
+        syncs it to disk. It is written to a temporary file and renamed, so a segment file is
+        always whole, and the rename is synced before returning: the caller may then truncate
+        the log or delete the segments it replaces without a crash losing their contents.
+        """
+        partial = path + ".part"
+        index = []
+        with open(partial, 'wb') as f:
+            offset = 0
+            for key, value in items:
+                if value is None:
+                    index.append(_INDEX_ENTRY.pack(len(key), offset, TOMBSTONE) + key)
+                    continue
+                f.write(value)
+                index.append(_INDEX_ENTRY.pack(len(key), offset, len(value)) + key)
+                offset += len(value)
+            f.write(b"".join(index))
+            f.write(_FOOTER.pack(offset, len(index), replaces, SEGMENT_MAGIC))
+            f.flush()
+            os.fsync(f.fileno())
+        os.replace(partial, path)
+        _sync_directory(os.path.dirname(path))
+
+
+class LSMStore:
+    """
+    An embedded log-structured merge key-value store with bytes keys and values, for a workload
+    of many small writes of short-lived data such as a message queue.
+
+    A write (a batch of changes) is appended to the log as one checksummed record and applied to
+    the memtable, a dict of the recent changes; nothing is rewritten in place. Once the memtable
+    holds MEMTABLE_LIMIT bytes it is written out as a sorted, immutable segment file and the log
+    starts over. A deletion of a key no segment holds just removes it from the memtable, so data
+    deleted soon after it was written, like a pulled message, never reaches a segment. Once there
+    are more than MAX_SEGMENTS segments they are merged into one, dropping overwritten values and
+    deletions; the merge runs on the caller's thread, so that write waits for it.
+
+    Reads look in the memtable, then in the segments from the newest. Every key of every segment
+    is held in memory (about 100 bytes per key), so a read from a segment is a single file read.
+
+    The log is flushed to the operating system on every write, so a crash of the server loses
+    nothing, and synced to disk LOG_SYNC_INTERVAL seconds after a write at most: by the next write
+    once that long has passed, or by the owner calling sync() when pending_sync() says it is due
+    (the server's database thread does). A crash of the machine loses up to that much. On open, the
+    log is replayed up to its first incomplete record.
+    The store is not thread-safe.
+    """
+    def __init__(self, directory, memtable_limit=MEMTABLE_LIMIT, max_segments=MAX_SEGMENTS,
+                 sync_interval=LOG_SYNC_INTERVAL):
+        self._directory = directory
+        self._memtable_limit = memtable_limit
+        self._max_segments = max_segments
+        self._sync_interval = sync_interval
+        self._memtable = {}       # Key to value, None for a deleted key.
+        self._memtable_keys = []  # The memtable's keys, sorted.
+        self._memtable_bytes = 0
+        self._segments = []       # Oldest first.
+        self._unsynced_since = None  # When the oldest write not yet synced to disk was made.
+        os.makedirs(directory, exist_ok=True)
+        self._open_segments()
+        self._replay_log()
+        self._log = open(os.path.join(directory, LOG_NAME), 'ab')
+
+    def _open_segments(self):
+        """Opens the segment files, deleting those a merge replaced and temporary files left by a crash."""
+        numbers = []
+        for name in os.listdir(self._directory):
+            match = _SEGMENT_NAME.match(name)
+            if match:
+                numbers.append(int(match.group(1)))
+            elif name.endswith(".part"):
+                os.remove(os.path.join(self._directory, name))
+        for number in sorted(numbers):
+            self._segments.append(_Segment(self._segment_path(number), number))
+        # A merge that crashed before deleting the segments it replaced leaves them behind.
+        replaced = max((segment.replaces for segment in self._segments), default=0)
+        for segment in [s for s in self._segments if s.number <= replaced]:
+            self._delete_segment(segment)
+
+    def _replay_log(self):
+        """Applies the complete records of the log to the memtable, and cuts off an incomplete last one."""
+        path = os.path.join(self._directory, LOG_NAME)
+        try:
+            with open(path, 'rb') as f:
+                data = f.read()
+        except FileNotFoundError:
+            return
+        position = records = 0
+        while position + _RECORD.size <= len(data):
+            size, crc = _RECORD.unpack_from(data, position)
+            payload = data[position + _RECORD.size:position + _RECORD.size + size]
+            if len(payload) != size or zlib.crc32(payload) != crc:
+                break
+            self._apply(self._decode(payload))
+            position += _RECORD.size + size
+            records += 1
+        if position != len(data):
+            logging.warning(f"Cut {len(data) - position} bytes of an incomplete write off the end of {path}.")
+            with open(path, 'r+b') as f:
+                f.truncate(position)
+        if records:
+            logging.info(f"Replayed {records} writes from {path}.")
+
+    @staticmethod
+    def _decode(payload):
+        """Returns the (key, value) changes of a log record's payload."""
+        changes = []
+        position = 0
+        while position < len(payload):
+            key_size, value_size = _ENTRY.unpack_from(payload, position)
+            position += _ENTRY.size
+            key = payload[position:position + key_size]
+            position += key_size
+            if value_size == TOMBSTONE:
+                changes.append((key, None))
+            else:
+                changes.append((key, payload[position:position + value_size]))
+                position += value_size
+        return changes
+
+    def _segment_path(self, number):
+        return os.path.join(self._directory, f"{number:08d}.seg")
+
+    def _delete_segment(self, segment):
+        segment.close()
+        os.remove(segment.path)
+        self._segments.remove(segment)
+
+    def _apply(self, changes):
+        """Applies changes to the memtable."""
+        for key, value in changes:
+            previous = self._memtable.get(key, _ABSENT)
+            if previous is not _ABSENT:
+                self._memtable_bytes -= len(previous or b"")
+            if value is None and not any(key in segment for segment in self._segments):
+                # Nothing older to hide: the key is simply forgotten.
+                if previous is not _ABSENT:
+                    del self._memtable[key]
+                    del self._memtable_keys[bisect.bisect_left(self._memtable_keys, key)]
+                    self._memtable_bytes -= len(key)
+                continue
+            if previous is _ABSENT:
+                bisect.insort(self._memtable_keys, key)
+                self._memtable_bytes += len(key)
+            self._memtable[key] = value
+            self._memtable_bytes += len(value or b"")
+
+    def write(self, changes):
+        """
+        Applies a batch of changes atomically: all of them survive a crash, or none.
+
+        Args:
+            changes (list): (key, value) pairs; value None deletes the key.
+        """
+        payload = b"".join(_ENTRY.pack(len(key), TOMBSTONE if value is None else len(value)) + key + (value or b"")
+                           for key, value in changes)
+        self._log.write(_RECORD.pack(len(payload), zlib.crc32(payload)) + payload)
+        self._log.flush()
+        if self._unsynced_since is None:
+            self._unsynced_since = time.monotonic()
+        if self.pending_sync() <= 0:
+            self.sync()
+        self._apply(changes)
+        if self._memtable_bytes >= self._memtable_limit:
+            self.flush()
+
+    def pending_sync(self):
+        """Returns the seconds until the log is due to be synced, or None if everything written is synced."""
+        if self._unsynced_since is None:
+            return None
+        return self._unsynced_since + self._sync_interval - time.monotonic()
+
+    def sync(self):
+        """Syncs the writes not yet synced to disk."""
+        if self._unsynced_since is not None:
+            os.fsync(self._log.fileno())
+            self._unsynced_since = None
+
+    def get(self, key):
+        """Returns a key's value, or None."""
+        if key in self._memtable:
+            return self._memtable[key]
+        for segment in reversed(self._segments):
+            location = segment.location(key)
+            if location is not None:
+                return None if location[1] == TOMBSTONE else segment.read(location)
+        return None
+
+    def get_range(self, key, offset, size):
+        """Returns up to `size` bytes of a key's value from `offset`, b"" if there is no such key."""
+        if key in self._memtable:
+            value = self._memtable[key]
+            return value[offset:offset + size] if value else b""
+        for segment in reversed(self._segments):
+            location = segment.location(key)
+            if location is not None:
+                return b"" if location[1] == TOMBSTONE else segment.read(location, offset, size)
+        return b""
+
+    def scan(self, prefix, start=None):
+        """
+        Yields the (key, value) pairs whose key starts with `prefix`, in key order, from the key
+        `start` on (from the first such key if None). Values are read as they are yielded, so a
+        scan stopped early reads nothing more. The store must not be written to during a scan.
+        """
+        start = prefix if start is None else start
+
+        def memtable_run():
+            keys = self._memtable_keys
+            for position in range(bisect.bisect_left(keys, start), len(keys)):
+                if not keys[position].startswith(prefix):
+                    return
+                yield keys[position], 0, None
+
+        def segment_run(rank, segment):
+            keys = segment.keys
+            for position in range(bisect.bisect_left(keys, start), len(keys)):
+                if not keys[position].startswith(prefix):
+                    return
+                yield keys[position], rank, segment
+
+        # The rank breaks ties between runs: the memtable first, then the newest segment.
+        runs = [memtable_run()] + [segment_run(rank, segment)
+                                   for rank, segment in enumerate(reversed(self._segments), 1)]
+        last = None
+        for key, _, segment in heapq.merge(*runs):
+            if key == last:
+                continue
+            last = key
+            if segment is None:
+                value = self._memtable[key]
+            else:
+                location = segment.location(key)
+                value = None if location[1] == TOMBSTONE else segment.read(location)
+            if value is not None:
+                yield key, value
+
+    def flush(self):
+        """Writes the memtable out as a new segment and starts a new log."""
+        if self._memtable_keys:
+            number = self._segments[-1].number + 1 if self._segments else 1
+            _Segment.write(self._segment_path(number),
+                           ((key, self._memtable[key]) for key in self._memtable_keys))
+            self._segments.append(_Segment(self._segment_path(number), number))
+            logging.info(f"Wrote {len(self._memtable_keys)} keys to segment {number} of {self._directory}.")
+            self._memtable = {}
+            self._memtable_keys = []
+            self._memtable_bytes = 0
+        # Everything in the log is in a segment now, and the segment's name is on disk.
+        self._log.truncate(0)
+        self._log.seek(0)
+        self._unsynced_since = None
+        if len(self._segments) > self._max_segments:
+            self.compact()
+
+    def compact(self):
+        """Merges all segments into one, keeping the newest value of each key and dropping deletions."""
+        if len(self._segments) < 2:
+            return
+        started = time.monotonic()
+        newest = self._segments[-1].number
+        number = newest + 1
+        # Whatever the memtable holds stays there too, so merging it in changes nothing.
+        _Segment.write(self._segment_path(number), self.scan(b""), replaces=newest)
+        for segment in list(self._segments):
+            self._delete_segment(segment)
+        self._segments.append(_Segment(self._segment_path(number), number))
+        logging.info(f"Merged the segments of {self._directory} into segment {number} "
+                     f"in {time.monotonic() - started:.2f} s.")
+
+    def backup(self, directory):
+        """Flushes the memtable and copies the segments to a new directory, a store of its own."""
+        self.flush()
+        os.makedirs(directory)
+        for segment in self._segments:
+            target = os.path.join(directory, os.path.basename(segment.path))
+            # Segments never change, so a hard link is a copy, where the file system has them.
+            try:
+                os.link(segment.path, target)
+            except OSError:
+                with open(segment.path, 'rb') as source, open(target, 'wb') as f:
+                    while chunk := source.read(1024 * 1024):
+                        f.write(chunk)
+
+    def close(self):
+        """Syncs the log and closes the files. The memtable stays in the log, to be replayed on open."""
+        self._log.flush()
+        os.fsync(self._log.fileno())
+        self._log.close()
+        for segment in self._segments:
+            segment.close()
@@ -0,0 +1,296 @@
+# memory_data_manager.py
+# author: Ariel Cohen ID: 329599187
+
+import bisect     # For the directory in Seq order
+import datetime   # For timestamping
+import itertools  # For taking the oldest messages of a mailbox
+import logging    # For logging snapshots
+import marshal    # For the snapshot file: fast, and unlike pickle it cannot run code
+import os         # For replacing the snapshot file atomically
+import time       # For timing loads and spacing snapshots
+from storage_engine import StorageEngine
+
+SNAPSHOT_FORMAT = 1     # Bumped when the layout of the snapshot file changes.
+SNAPSHOT_INTERVAL = 60  # Seconds after a change by which the store is saved to its snapshot file.
+
+
+class MemoryDataManager(StorageEngine):
+    """
+    A storage engine that holds everything in memory, message content included, in plain dicts:
+    no write touches the disk, and every lookup is a dict lookup.
+
+    The store is saved to a single snapshot file: at most SNAPSHOT_INTERVAL seconds after a
+    change (checked when the next write comes), on backup, and when the server shuts down. It is
+    read back when the engine starts. A crash therefore loses the changes of the last
+    SNAPSHOT_INTERVAL seconds at most, and the server needs memory for every queued message.
+    Saving writes the whole store, so the request that triggers it waits for the write.
+    """
+    def __init__(self, snapshot_file):
+        logging.basicConfig(level=logging.INFO, format='%(asctime)s - %(levelname)s - %(message)s')
+        self._snapshot_file = snapshot_file
+        self._clients = {}     # Client ID to [UserName, PublicKey, LastSeen, Home, Seq].
+        self._names = {}       # Username to client ID.
+        self._seqs = []        # The clients' Seq, ascending.
+        self._by_seq = {}      # Seq to client ID.
+        self._messages = {}    # Message ID to (ToClient, FromClient, Type, Content).
+        self._mailboxes = {}   # Client ID to {message ID: None}, oldest first, for clients with messages.
+        self._outbox = {}      # Outbox message ID to (Node, ToClient, FromClient, Type, Content).
+        self._outboxes = {}    # Node to {outbox message ID: None}, oldest first.
+        self._peers = {}       # Node to the directory Seq copied from it.
+        self._last_message_id = 0
+        self._last_outbox_id = 0
+        self._dirty_since = None  # When the first change not in the snapshot file was made.
+        started = time.monotonic()
+        self._loaded = self._load()
+        self._load_seconds = time.monotonic() - started
+
+    def _load(self):
+        """Reads the snapshot file, if there is one. Returns True if it was read."""
+        try:
+            with open(self._snapshot_file, 'rb') as f:
+                data = marshal.loads(f.read())
+        except FileNotFoundError:
+            logging.info(f"Starting with an empty store; it will be saved to {self._snapshot_file}.")
+            return False
+        if not isinstance(data, tuple) or len(data) != 7 or data[0] != SNAPSHOT_FORMAT:
+            raise ValueError(f"{self._snapshot_file} is not a snapshot of the in-memory store.")
+        _, clients, self._messages, self._outbox, self._peers, self._last_message_id, self._last_outbox_id = data
+        for client_id, (username, public_key, last_seen, home, seq) in clients.items():
+            self._put_client(client_id, [username, public_key, last_seen, home, seq])
+        for message_id, (to_client_id, _, _, _) in self._messages.items():
+            self._mailboxes.setdefault(to_client_id, {})[message_id] = None
+        for message_id, (node, _, _, _, _) in self._outbox.items():
+            self._outboxes.setdefault(node, {})[message_id] = None
+        logging.info(f"Loaded {len(self._clients)} clients and {len(self._messages)} messages from {self._snapshot_file}.")
+        return True
+
+    def _save(self, path):
+        """Writes the whole store to `path`, through a temporary file."""
+        clients = {client_id: tuple(client) for client_id, client in self._clients.items()}
+        partial = path + ".part"
+        with open(partial, 'wb') as f:
+            f.write(marshal.dumps((SNAPSHOT_FORMAT, clients, self._messages, self._outbox, self._peers,
+                                   self._last_message_id, self._last_outbox_id)))
+            f.flush()
+            os.fsync(f.fileno())
+        os.replace(partial, path)
+
+    def _changed(self):
+        """Called after every write: saves the snapshot once a change is SNAPSHOT_INTERVAL seconds old."""
+        now = time.monotonic()
+        if self._dirty_since is None:
+            self._dirty_since = now
+        elif now - self._dirty_since >= SNAPSHOT_INTERVAL:
+            self._save(self._snapshot_file)
+            self._dirty_since = None
+
+    def preload(self, snapshot_file=None):
+        """Everything is in memory already; reports what the snapshot file held."""
+        return {'clients': len(self._clients), 'mailboxes': len(self._mailboxes),
+                'source': 'snapshot' if self._loaded else 'empty store', 'seconds': self._load_seconds}
+
+    # --- Clients ---
+
+    def _put_client(self, client_id, client):
+        """Adds a client, replacing the one with the same ID and the one with the same username."""
+        for other in (client_id, self._names.get(client[0])):
+            if other in self._clients:
+                self._remove_client(other)
+        self._clients[client_id] = client
+        self._names[client[0]] = client_id
+        seq = client[4]
+        if not self._seqs or seq > self._seqs[-1]:
+            self._seqs.append(seq)
+        else:
+            bisect.insort(self._seqs, seq)
+        self._by_seq[seq] = client_id
+
+    def _remove_client(self, client_id):
+        username, _, _, _, seq = self._clients.pop(client_id)
+        del self._names[username]
+        del self._by_seq[seq]
+        del self._seqs[bisect.bisect_left(self._seqs, seq)]
+
+    @staticmethod
+    def _client_row(client_id, client):
+        username, public_key, last_seen, home, seq = client
+        return {'ID': client_id, 'UserName': username, 'PublicKey': public_key, 'LastSeen': last_seen,
+                'Home': home, 'Seq': seq}
+
+    def add_client(self, client_id, username, public_key):
+        logging.info(f"Adding new client: {username}")
+        self._put_client(client_id, [username, public_key, str(datetime.datetime.now()), None,
+                                     self.get_directory_seq() + 1])
+        self._changed()
+
+    def username_exists(self, username):
+        return username in self._names
+
+    def client_id_exists(self, client_id):
+        return client_id in self._clients
+
+    def get_clients(self, exclude_id):
+        return [{'ID': client_id, 'UserName': client[0]}
+                for client_id, client in self._clients.items() if client_id != exclude_id]
+
+    def get_client_by_id(self, client_id):
+        client = self._clients.get(client_id)
+        return self._client_row(client_id, client) if client else None
+
+    def get_client_by_name(self, username):
+        client_id = self._names.get(username)
+        return self.get_client_by_id(client_id) if client_id is not None else None
+
+    def update_last_seen(self, client_id):
+        client = self._clients.get(client_id)
+        if client:
+            client[2] = str(datetime.datetime.now())
+            self._changed()
+
+    def get_client_home(self, client_id):
+        client = self._clients.get(client_id)
+        return (client is not None, client[3] if client else None)
+
+    def _clients_since(self, seq, limit, local_only):
+        rows = []
+        for position in range(bisect.bisect_right(self._seqs, seq), len(self._seqs)):
+            if len(rows) == limit:
+                break
+            client_id = self._by_seq[self._seqs[position]]
+            client = self._clients[client_id]
+            if not local_only or client[3] is None:
+                rows.append({'Seq': client[4], 'ID': client_id, 'UserName': client[0], 'PublicKey': client[1]})
+        return rows
+
+    def get_local_clients_since(self, seq, limit):
+        return self._clients_since(seq, limit, local_only=True)
+
+    def get_clients_since(self, seq, limit):
+        return self._clients_since(seq, limit, local_only=False)
+
+    def get_directory_seq(self):
+        return self._seqs[-1] if self._seqs else 0
+
+    def add_replicated_clients(self, entries):
+        now = str(datetime.datetime.now())
+        for seq, client_id, username, public_key in entries:
+            self._put_client(client_id, [username, public_key, now, None, seq])
+        self._changed()
+
+    def add_remote_clients(self, node, entries, last_seq):
+        now = str(datetime.datetime.now())
+        for client_id, username, public_key in entries:
+            if client_id in self._clients or username in self._names:
+                logging.warning(f"Skipped client '{username}' from node {node}: name or ID already in use.")
+                continue
+            self._put_client(client_id, [username, public_key, now, node, self.get_directory_seq() + 1])
+        self._peers[node] = last_seq
+        self._changed()
+
+    def get_peer_directory_seq(self, node):
+        return self._peers.get(node, 0)
+
+    # --- Messages ---
+
+    def _queue_message(self, to_client_id, from_client_id, msg_type, content):
+        self._last_message_id += 1
+        message_id = self._last_message_id
+        self._messages[message_id] = (to_client_id, from_client_id, msg_type, content)
+        self._mailboxes.setdefault(to_client_id, {})[message_id] = None
+        return message_id
+
+    def add_message(self, to_client_id, from_client_id, msg_type, content):
+        message_id = self._queue_message(to_client_id, from_client_id, msg_type, bytes(content))
+        self._changed()
+        return message_id
+
+    def add_message_file(self, to_client_id, from_client_id, msg_type, path, size):
+        """Reads the content whole: this engine holds every message in memory anyway."""
+        with open(path, 'rb') as f:
+            return self.add_message(to_client_id, from_client_id, msg_type, f.read(size))
+
+    def add_messages(self, messages):
+        for to_client_id, from_client_id, msg_type, content in messages:
+            self._queue_message(to_client_id, from_client_id, msg_type, bytes(content))
+        self._changed()
+
+    def get_mailbox_summary(self, client_id, limit=-1):
+        count = total_size = last_id = 0
+        for message_id in itertools.islice(self._mailboxes.get(client_id, ()), None if limit < 0 else limit):
+            count += 1
+            total_size += len(self._messages[message_id][3] or b"")
+            last_id = message_id
+        return count, total_size, last_id
+
+    def get_messages_for_client(self, client_id, limit=-1, after_id=0):
+        mailbox = self._mailboxes.get(client_id)
+        if not mailbox:
+            return []
+        rows = []
+        # Pages are taken oldest first and deleted once sent, so few IDs are skipped here.
+        waiting = itertools.dropwhile(lambda message_id: message_id <= after_id, mailbox)
+        for message_id in itertools.islice(waiting, None if limit < 0 else limit):
+            _, from_client_id, msg_type, content = self._messages[message_id]
+            rows.append({'ID': message_id, 'FromClient': from_client_id, 'Type': msg_type, 'Size': len(content or b"")})
+        return rows
+
+    def get_message_content(self, message_id, offset, size):
+        message = self._messages.get(message_id)
+        return message[3][offset:offset + size] if message and message[3] else b""
+
+    def delete_messages(self, client_id, message_ids):
+        mailbox = self._mailboxes.get(client_id)
+        if not mailbox:
+            return
+        for message_id in message_ids:
+            if message_id in mailbox:
+                del mailbox[message_id]
+                del self._messages[message_id]
+        if not mailbox:
+            del self._mailboxes[client_id]
+        self._changed()
+
+    # --- Outbox ---
+
+    def add_outbox_message(self, node, to_client_id, from_client_id, msg_type, content):
+        self._last_outbox_id += 1
+        message_id = self._last_outbox_id
+        self._outbox[message_id] = (node, to_client_id, from_client_id, msg_type, bytes(content))
+        self._outboxes.setdefault(node, {})[message_id] = None
+        self._changed()
+        return message_id
+
+    def get_outbox(self, node, limit, max_bytes):
+        messages = []
+        total = 0
+        for message_id in itertools.islice(self._outboxes.get(node, ()), limit):
+            _, to_client_id, from_client_id, msg_type, content = self._outbox[message_id]
+            total += len(content or b"")
+            if messages and total > max_bytes:
+                break
+            messages.append({'ID': message_id, 'ToClient': to_client_id, 'FromClient': from_client_id,
+                             'Type': msg_type, 'Content': content})
+        return messages
+
+    def delete_outbox(self, message_ids):
+        for message_id in message_ids:
+            message = self._outbox.pop(message_id, None)
+            if message:
+                outbox = self._outboxes[message[0]]
+                del outbox[message_id]
+                if not outbox:
+                    del self._outboxes[message[0]]
+        self._changed()
+
+    # --- Persistence ---
+
+    def backup(self, path):
+        """Writes the store to `path` as a snapshot file; a server started with --db on it loads it."""
+        self._save(path)
+
+    def close(self):
+        """Saves the store to its snapshot file if it changed since it was last saved."""
+        if self._dirty_since is not None:
+            self._save(self._snapshot_file)
+            self._dirty_since = None
+            logging.info(f"Saved the store to {self._snapshot_file}.")
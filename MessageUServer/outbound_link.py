@@ -0,0 +1,77 @@
+# outbound_link.py
+# author: Ariel Cohen ID: 329599187
+
+import asyncio    # For the connection and its retry timer
+import logging    # For logging link failures
+from protocol_structs import *  # Import all protocol definitions
+from connection import ProtocolError
+
+LINK_RETRY_INTERVAL = 2.0  # Seconds between attempts to reach a server that is down.
+MAX_LINK_RESPONSE = 16 * 1024 * 1024  # Largest response payload accepted from another server.
+
+
+class OutboundLink:
+    """
+    A connection from this server to another server, on which this server is the client.
+    It runs as a task of its own: it connects, runs the subclass's _session until the link is
+    lost, and tries again every LINK_RETRY_INTERVAL seconds. The session sends its requests
+    with request(), one at a time, each awaiting the other server's response.
+    """
+    def __init__(self, name, host, port, server_version):
+        self.name = name                 # Describes the other server in log messages.
+        self._address = (host, port)
+        self._server_version = server_version
+        self._reader = None
+        self._writer = None              # Set while the link is up.
+        self._task = None
+
+    def start(self):
+        """Starts the task that keeps the link up."""
+        self._task = asyncio.create_task(self._run())
+
+    async def stop(self):
+        """Stops the task and drops the link."""
+        if self._task:
+            self._task.cancel()
+            try:
+                await self._task
+            except asyncio.CancelledError:
+                pass
+
+    async def request(self, code, payload):
+        """
+        Sends a request to the other server and waits for its response.
+
+        Returns:
+            tuple: (response code, payload bytes).
+        Raises:
+            ProtocolError: If the response is larger than MAX_LINK_RESPONSE.
+            OSError, asyncio.IncompleteReadError: If the link is lost.
+        """
+        header = RequestHeader(bytes(CLIENT_ID_SIZE), self._server_version, code, len(payload))
+        self._writer.write(header.pack() + payload)
+        await self._writer.drain()
+        response = ResponseHeader.unpack(await self._reader.readexactly(ResponseHeader.size))
+        if response.payload_size > MAX_LINK_RESPONSE:
+            raise ProtocolError(f"Response of {response.payload_size} bytes from {self.name}.")
+        return response.code, await self._reader.readexactly(response.payload_size)
+
+    async def _session(self):
+        """Exchanges requests with the other server while the link is up; returns or raises when done."""
+
+    async def _run(self):
+        """Connects, runs the session, and reconnects after a failure."""
+        while True:
+            try:
+                self._reader, self._writer = await asyncio.open_connection(*self._address)
+            except OSError:
+                await asyncio.sleep(LINK_RETRY_INTERVAL)
+                continue
+            try:
+                await self._session()
+            except (OSError, asyncio.IncompleteReadError, ProtocolError) as e:
+                logging.warning(f"Link to {self.name} lost: {e}")
+            finally:
+                self._writer.close()
+                self._reader = self._writer = None
+            await asyncio.sleep(LINK_RETRY_INTERVAL)
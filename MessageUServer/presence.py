@@ -0,0 +1,94 @@
+# presence.py
+# author: Ariel Cohen ID: 329599187
+
+import asyncio  # For the timer of the next push
+from protocol_structs import *  # Import all protocol definitions
+
+
+class PresenceTracker:
+    """
+    Keeps track of which clients are online and pushes changes to the connections subscribed to them.
+    A client is online while it has a persistent connection that identified itself by sending a
+    request with its client ID. Changes are not pushed one by one: they are collected for
+    PRESENCE_INTERVAL seconds, and then every subscriber gets one PRESENCE_PUSH with the net change
+    of each client it watches, so a client that drops and reconnects within the interval causes no push.
+    """
+    def __init__(self, server_version):
+        self._server_version = server_version
+        self._online = {}          # Client ID to the number of its identified connections.
+        self._identified = {}      # Connection to the client ID it counts as online.
+        self._watchers = {}        # Client ID to the connections subscribed to it.
+        self._subscriptions = {}   # Connection to {client ID: online state last reported to it}.
+        self._changed = set()      # Watched client IDs that went online or offline since the last push.
+        self._timer = None         # Handle of the next push, while there are changes.
+
+    def is_online(self, client_id):
+        """Returns True if the client has an identified connection."""
+        return client_id in self._online
+
+    def identified(self, connection):
+        """Counts the connection's client (connection.client_id) as online."""
+        previous = self._identified.get(connection)
+        if previous == connection.client_id:
+            return
+        if previous is not None:
+            self._went(previous, -1)
+        self._identified[connection] = connection.client_id
+        self._went(connection.client_id, 1)
+
+    def connection_closed(self, connection):
+        """Drops the connection's subscriptions, and its client's presence if it was the last connection."""
+        self.subscribe(connection, [])
+        client_id = self._identified.pop(connection, None)
+        if client_id is not None:
+            self._went(client_id, -1)
+
+    def subscribe(self, connection, client_ids):
+        """
+        Replaces the set of clients whose presence is pushed to the connection.
+
+        Returns:
+            list: PresenceEntry for each subscribed client, with its current presence.
+        """
+        for client_id in self._subscriptions.pop(connection, {}):
+            watchers = self._watchers[client_id]
+            watchers.discard(connection)
+            if not watchers:
+                del self._watchers[client_id]
+        if not client_ids:
+            return []
+        reported = {client_id: self.is_online(client_id) for client_id in client_ids}
+        self._subscriptions[connection] = reported
+        for client_id in reported:
+            self._watchers.setdefault(client_id, set()).add(connection)
+        return [PresenceEntry(client_id, online) for client_id, online in reported.items()]
+
+    def _push(self):
+        """Pushes the changes collected over the interval; called by the timer."""
+        pushes = {}
+        for client_id in self._changed:
+            online = self.is_online(client_id)
+            for connection in self._watchers.get(client_id, ()):
+                reported = self._subscriptions[connection]
+                # A client that went offline and back (or the reverse) since the last push is not reported.
+                if reported[client_id] != online:
+                    reported[client_id] = online
+                    pushes.setdefault(connection, []).append(PresenceEntry(client_id, online).pack())
+        self._changed.clear()
+        self._timer = None
+        for connection, entries in pushes.items():
+            payload = b"".join(entries)
+            connection.queue(ResponseHeader(self._server_version, ResponseCode.PRESENCE_PUSH, len(payload)).pack() + payload)
+
+    def _went(self, client_id, delta):
+        """Adds delta to the client's connection count, recording a change if it went online or offline."""
+        count = self._online.get(client_id, 0) + delta
+        if count > 0:
+            self._online[client_id] = count
+        else:
+            self._online.pop(client_id, None)
+        went_online_or_offline = count == 0 or (delta > 0 and count == 1)
+        if went_online_or_offline and client_id in self._watchers:
+            self._changed.add(client_id)
+            if self._timer is None:
+                self._timer = asyncio.get_running_loop().call_later(PRESENCE_INTERVAL, self._push)
@@ -2,7 +2,7 @@
 # author: Ariel Cohen ID: 329599187
 
 import struct  # Used for packing data into bytes and unpacking bytes into data
-from enum import IntEnum  # Used to create enumerations for codes and types
+from enum import IntEnum, IntFlag  # Used to create enumerations for codes, types and capability bits
 
 # --- Protocol Constants ---
 # These constants define the fixed sizes for specific data fields in the protocol.
@@ -11,6 +11,15 @@ from enum import IntEnum  # Used to create enumerations for codes and types
 CLIENT_ID_SIZE = 16       # Size of the client's unique identifier in bytes.
 USERNAME_SIZE = 255     # Maximum size of a client's username in bytes.
 PUBLIC_KEY_SIZE = 160   # Size of the client's public key in bytes.
+MAX_REQUEST_PAYLOAD = 256 * 1024 * 1024  # Largest request payload the server accepts, advertised in HELLO.
+DEFAULT_MAX_BATCH = 1000  # Largest number of messages returned in one pull response, advertised in HELLO; pulls without HELLO are not capped.
+MAX_STORED_STREAM = MAX_REQUEST_PAYLOAD  # Largest stream kept in memory for an offline recipient.
+MAX_PUSH_BACKLOG = 16 * 1024 * 1024  # Unsent push bytes after which a slow recipient gets the rest of a stream stored.
+MAX_PEER_BATCH = 500  # Largest number of directory entries or messages sent to a peer or replica at once.
+MAX_PEER_BATCH_BYTES = 4 * 1024 * 1024  # Forwarded message content per peer request, beyond the first message.
+PEER_TOKEN_SIZE = 32  # HMAC-SHA256 in PEER_HELLO proving the sender knows the federation's secret.
+MAX_PRESENCE_SUBSCRIPTIONS = 10000  # Largest number of clients one connection may watch the presence of.
+PRESENCE_INTERVAL = 1.0  # Seconds over which presence changes are collected into one push per subscriber.
 
 
 # --- Request Codes ---
@@ -22,6 +31,20 @@ class RequestCode(IntEnum):
     PUBLIC_KEY = 1102       # Request for the public key of a specific client.
     SEND_MESSAGE = 1103     # Request to send a message to another client.
     PULL_MESSAGES = 1104    # Request to pull all pending messages for the client.
+    HELLO = 1105            # Capability negotiation, sent once per connection.
+    STREAM_OPEN = 1106      # Request to open a stream to another client.
+    STREAM_DATA = 1107      # One chunk of an open stream; the server sends no response.
+    STREAM_CLOSE = 1108     # Request to close a stream.
+    PRESENCE_SUBSCRIBE = 1109  # Replaces the set of clients whose presence is pushed to this connection.
+    CLIENT_LOOKUP = 1110    # Request for one client, by ID or by name, with its public key.
+    # Server-to-server requests, sent between the nodes of a federation.
+    PEER_HELLO = 1200       # A node introduces itself and asks how much of its directory the peer has.
+    PEER_DIRECTORY = 1201   # A batch of clients registered on the sending node.
+    PEER_FORWARD = 1202     # A batch of messages for clients homed on the receiving node.
+    # Sent by a read-only replica to the server it copies the directory from.
+    REPLICA_SYNC = 1203     # Asks for the directory entries after a Seq; answered once there are any.
+    # Administration, accepted only from the server's own host.
+    ADMIN_BACKUP = 1300     # Takes an online backup of the database; answered once it is written.
 
 
 # --- Response Codes ---
@@ -33,6 +56,16 @@ class ResponseCode(IntEnum):
     PUBLIC_KEY = 2102           # Indicates that the response contains a public key.
     MESSAGE_SENT = 2103         # Confirmation that a message was successfully sent and stored.
     PULL_MESSAGES = 2104        # Indicates that the response contains pending messages.
+    HELLO = 2105                # Indicates that the response contains the negotiated capabilities.
+    STREAM_OPENED = 2106        # Indicates that a stream was opened, with its ID and delivery mode.
+    STREAM_CLOSED = 2107        # Indicates that a stream was closed, with the number of chunks received.
+    STREAM_PUSH = 2108          # Sent unsolicited to the recipient of a live stream.
+    PRESENCE = 2109             # The current presence of the clients just subscribed to.
+    PRESENCE_PUSH = 2110        # Sent unsolicited: presence changes of subscribed clients since the last push.
+    CLIENT_INFO = 2111          # Indicates that the response contains one client and its public key.
+    PEER_ACK = 2200             # Acknowledges a peer request; the meaning of the value depends on the request.
+    REPLICA_DIRECTORY = 2201    # Directory entries for a replica: a series of DirectoryEntry.
+    BACKUP_DONE = 2300          # The backup is written; the payload is its path on the server, in UTF-8.
     ERROR = 9000                # Indicates that a general error occurred while processing the request.
 
 
@@ -43,6 +76,79 @@ class MessageType(IntEnum):
     SYM_KEY_SEND = 2    # A symmetric key being sent.
     TEXT_MESSAGE = 3    # A standard text message.
     FILE_SEND = 4       # A file being sent.
+    STREAM = 5          # The chunks of a stream whose recipient was offline, stored as one message.
+    FILE_CHUNKED = 6    # A large file as a manifest of per-chunk MACs followed by separately encrypted chunks.
+    FILE_CHUNK_REQUEST = 7  # Asks the sender of a FILE_CHUNKED file to send some of its chunks again.
+    FILE_BUNDLE = 8     # A directory as an index of its files followed by their contents, encrypted as one stream.
+
+# Clients set this bit in the type of the messages they number; the server stores and forwards
+# the type byte unchanged.
+MESSAGE_SEQUENCED = 0x80
+
+
+# --- Streams ---
+# How the chunks of a stream reach the recipient.
+class StreamDelivery(IntEnum):
+    LIVE = 1    # Relayed as they arrive to the recipient's open connection.
+    STORED = 2  # Collected and stored as one STREAM message when the stream is closed.
+
+# The events pushed to the recipient of a live stream.
+class StreamEvent(IntEnum):
+    OPEN = 1    # A stream was opened.
+    DATA = 2    # A chunk; the encrypted chunk follows the push header.
+    CLOSE = 3   # The sender closed the stream.
+    ABORT = 4   # The sender disconnected without closing the stream.
+    STORED = 5  # The rest of the stream will be delivered as a STREAM message.
+
+
+# --- Capabilities ---
+# Bits exchanged in HELLO. A feature is used on a connection only if both sides set its bit.
+class Capability(IntFlag):
+    NONE = 0
+    PERSISTENT_CONNECTION = 1 << 0  # Many requests may be sent over one connection.
+    STREAMS = 1 << 1                # Streams may be opened, and live streams are pushed to this connection.
+    PRESENCE = 1 << 2               # Presence changes of subscribed clients are pushed to this connection.
+    CLIENT_LOOKUP = 1 << 3          # Single clients may be looked up by ID or name instead of listing them all.
+    COMPACT_FRAMING = 1 << 4        # Frames after the HELLO exchange have compact (v3) headers, see below.
+
+# What this server implements.
+SERVER_CAPABILITIES = (Capability.PERSISTENT_CONNECTION | Capability.STREAMS | Capability.PRESENCE
+                       | Capability.CLIENT_LOOKUP | Capability.COMPACT_FRAMING)
+
+
+# --- Compact (v3) Framing ---
+# Once COMPACT_FRAMING is negotiated, every frame after the HELLO response, in both directions,
+# starts with a compact header instead of RequestHeader / ResponseHeader. Numbers are unsigned
+# LEB128 varints (7 bits per byte, low bits first, the high bit set on all but the last byte):
+#     request:  varint(code << 1 | bind), client_id (16 bytes) if bind is 1, varint(payload_size)
+#     response: varint(code), varint(payload_size)
+# The client ID is bound to the connection: it is the one in the HELLO request's header until a
+# request with bind set replaces it, so it is only sent again when it changes (after registering).
+# The version is the one of the HELLO exchange. A small SEND_MESSAGE has a 3-byte header instead
+# of 23, and its response a 3-byte header instead of 7.
+MAX_VARINT_SIZE = 5  # Bytes of a varint holding a 32-bit value.
+
+
+def pack_varint(value):
+    """Encodes a non-negative integer below 2**32 as a LEB128 varint."""
+    data = bytearray()
+    while value >= 0x80:
+        data.append(value & 0x7F | 0x80)
+        value >>= 7
+    data.append(value)
+    return bytes(data)
+
+
+def pack_compact_request_header(code, payload_size, client_id=None):
+    """Packs a compact request header; a client_id is sent to bind it to the connection."""
+    if client_id is None:
+        return pack_varint(code << 1) + pack_varint(payload_size)
+    return pack_varint(code << 1 | 1) + client_id + pack_varint(payload_size)
+
+
+def pack_compact_response_header(code, payload_size):
+    """Packs a compact response header."""
+    return pack_varint(code) + pack_varint(payload_size)
 
 
 # --- Base Class for Structures ---
@@ -102,6 +208,18 @@ class PublicKeyRequestPayload(StructBase):
         super().__init__(client_id)
         self.client_id = client_id
 
+class ClientLookupRequestPayload(StructBase):
+    """
+    Defines the payload for a request to look up one client.
+    The client is looked up by ID, or by name if the ID is all zeros.
+    """
+    # Format: client_id (16s), name (255s)
+    _format = f"<{CLIENT_ID_SIZE}s{USERNAME_SIZE}s"
+    size = struct.calcsize(_format)
+    def __init__(self, client_id, name):
+        super().__init__(client_id, name)
+        self.client_id, self.name = client_id, name
+
 class SendMessageRequestPayloadHeader(StructBase):
     """Defines the header for a message being sent. The actual message content follows this header."""
     # Format: client_id (16s), message_type (B), content_size (I)
@@ -111,6 +229,83 @@ class SendMessageRequestPayloadHeader(StructBase):
         super().__init__(client_id, message_type, content_size)
         self.client_id, self.message_type, self.content_size = client_id, message_type, content_size
 
+class HelloPayload(StructBase):
+    """
+    Defines the payload of a HELLO request and of its response.
+    The request carries the client's capabilities and limits; the response carries the
+    negotiated capabilities (the intersection) and the limits the server enforces.
+    """
+    # Format: capabilities (I), max_frame_size (I), max_batch (H)
+    _format = "<IIH"
+    size = struct.calcsize(_format)
+    def __init__(self, capabilities, max_frame_size, max_batch):
+        super().__init__(capabilities, max_frame_size, max_batch)
+        self.capabilities, self.max_frame_size, self.max_batch = capabilities, max_frame_size, max_batch
+
+class StreamOpenRequestPayload(StructBase):
+    """Defines the payload for a request to open a stream to another client."""
+    # Format: client_id (16s)
+    _format = f"<{CLIENT_ID_SIZE}s"
+    size = struct.calcsize(_format)
+    def __init__(self, client_id):
+        super().__init__(client_id)
+        self.client_id = client_id
+
+class PeerHelloPayload(StructBase):
+    """
+    Defines the payload of a PEER_HELLO request: the ID of the node that opened the link, and
+    the token proving it knows the federation's secret (zeros when there is none).
+    """
+    # Format: node_id (B), token (32s)
+    _format = f"<B{PEER_TOKEN_SIZE}s"
+    size = struct.calcsize(_format)
+    def __init__(self, node_id, token):
+        super().__init__(node_id, token)
+        self.node_id, self.token = node_id, token
+
+class DirectoryEntry(StructBase):
+    """
+    Defines one client in a PEER_DIRECTORY request or a REPLICA_DIRECTORY response;
+    their payloads are a series of these.
+    """
+    # Format: seq (Q), client_id (16s), name (255s), public_key (160s)
+    _format = f"<Q{CLIENT_ID_SIZE}s{USERNAME_SIZE}s{PUBLIC_KEY_SIZE}s"
+    size = struct.calcsize(_format)
+    def __init__(self, seq, client_id, name, public_key):
+        super().__init__(seq, client_id, name, public_key)
+        self.seq, self.client_id, self.name, self.public_key = seq, client_id, name, public_key
+
+class ReplicaSyncPayload(StructBase):
+    """Defines the payload of a REPLICA_SYNC request: the last directory Seq the replica has."""
+    # Format: seq (Q)
+    _format = "<Q"
+    size = struct.calcsize(_format)
+    def __init__(self, seq):
+        super().__init__(seq)
+        self.seq = seq
+
+class ForwardedMessageHeader(StructBase):
+    """Precedes each message in a PEER_FORWARD request. The message content follows this header."""
+    # Format: to_client_id (16s), from_client_id (16s), message_type (B), content_size (I)
+    _format = f"<{CLIENT_ID_SIZE}s{CLIENT_ID_SIZE}sBI"
+    size = struct.calcsize(_format)
+    def __init__(self, to_client_id, from_client_id, message_type, content_size):
+        super().__init__(to_client_id, from_client_id, message_type, content_size)
+        self.to_client_id, self.from_client_id = to_client_id, from_client_id
+        self.message_type, self.content_size = message_type, content_size
+
+class StreamRequestHeader(StructBase):
+    """
+    Defines the payload of a stream close request, and the header of a stream data request.
+    For stream data, the encrypted chunk follows this header.
+    """
+    # Format: stream_id (I)
+    _format = "<I"
+    size = struct.calcsize(_format)
+    def __init__(self, stream_id):
+        super().__init__(stream_id)
+        self.stream_id = stream_id
+
 
 # --- Response Structures ---
 # These classes define the exact binary structure of responses sent by the server.
@@ -154,6 +349,15 @@ class PublicKeyResponsePayload(StructBase):
         super().__init__(client_id, public_key)
         self.client_id, self.public_key = client_id, public_key
 
+class ClientInfoResponsePayload(StructBase):
+    """Defines the payload for a client lookup response: the client's ID, name and public key."""
+    # Format: client_id (16s), name (255s), public_key (160s)
+    _format = f"<{CLIENT_ID_SIZE}s{USERNAME_SIZE}s{PUBLIC_KEY_SIZE}s"
+    size = struct.calcsize(_format)
+    def __init__(self, client_id, name, public_key):
+        super().__init__(client_id, name, public_key)
+        self.client_id, self.name, self.public_key = client_id, name, public_key
+
 class MessageSentResponsePayload(StructBase):
     """Defines the payload for confirming a message was sent, returning the recipient's ID and the new message ID."""
     # Format: client_id (16s), message_id (I)
@@ -172,6 +376,7 @@ class PulledMessage:
     # Format: from_client_id (16s), msg_id (I), msg_type (B), msg_size (I)
     _header_format = f"<{CLIENT_ID_SIZE}sIBI"
     _header_size = struct.calcsize(_header_format)
+    header_size = _header_size
 
     def __init__(self, from_client_id, msg_id, msg_type, msg_size, content):
         self.from_client_id = from_client_id
@@ -182,8 +387,11 @@ class PulledMessage:
 
     def pack(self):
         """Packs the message header and its content into a single bytes object."""
-        header = struct.pack(self._header_format, self.from_client_id, self.msg_id, self.msg_type, self.msg_size)
-        return header + self.content
+        return self.pack_header() + self.content
+
+    def pack_header(self):
+        """Packs the message header alone, for content that is sent in slices after it."""
+        return struct.pack(self._header_format, self.from_client_id, self.msg_id, self.msg_type, self.msg_size)
     
     @classmethod
     def unpack_stream(cls, buffer):
@@ -206,4 +414,68 @@ class PulledMessage:
             
             # Create and append the message object.
             messages.append(cls(from_client_id, msg_id, msg_type, msg_size, content))
-        return messages
\ No newline at end of file
+        return messages
+
+class StreamOpenedPayload(StructBase):
+    """Defines the payload for a stream opened response, with the stream's ID and delivery mode."""
+    # Format: stream_id (I), delivery (B)
+    _format = "<IB"
+    size = struct.calcsize(_format)
+    def __init__(self, stream_id, delivery):
+        super().__init__(stream_id, delivery)
+        self.stream_id, self.delivery = stream_id, delivery
+
+class StreamClosedPayload(StructBase):
+    """
+    Defines the payload for a stream closed response.
+    The message ID is that of the stored STREAM message, or 0 if every chunk was relayed live.
+    """
+    # Format: stream_id (I), chunk_count (I), message_id (I)
+    _format = "<III"
+    size = struct.calcsize(_format)
+    def __init__(self, stream_id, chunk_count, message_id):
+        super().__init__(stream_id, chunk_count, message_id)
+        self.stream_id, self.chunk_count, self.message_id = stream_id, chunk_count, message_id
+
+class StreamPushHeader(StructBase):
+    """Defines the header of a stream push. For DATA events the encrypted chunk follows this header."""
+    # Format: from_client_id (16s), stream_id (I), event (B)
+    _format = f"<{CLIENT_ID_SIZE}sIB"
+    size = struct.calcsize(_format)
+    def __init__(self, from_client_id, stream_id, event):
+        super().__init__(from_client_id, stream_id, event)
+        self.from_client_id, self.stream_id, self.event = from_client_id, stream_id, event
+
+class PresenceEntry(StructBase):
+    """
+    Defines the presence of one client; PRESENCE and PRESENCE_PUSH payloads are a series of these.
+    A PRESENCE_SUBSCRIBE payload is a series of client IDs.
+    """
+    # Format: client_id (16s), online (B)
+    _format = f"<{CLIENT_ID_SIZE}sB"
+    size = struct.calcsize(_format)
+    def __init__(self, client_id, online):
+        super().__init__(client_id, online)
+        self.client_id, self.online = client_id, online
+
+class StreamChunkHeader(StructBase):
+    """Precedes each chunk in the content of a stored STREAM message."""
+    # Format: chunk_size (I)
+    _format = "<I"
+    size = struct.calcsize(_format)
+    def __init__(self, chunk_size):
+        super().__init__(chunk_size)
+        self.chunk_size = chunk_size
+
+class PeerAckPayload(StructBase):
+    """
+    Defines the payload of a PEER_ACK response.
+    For PEER_HELLO and PEER_DIRECTORY it is the sending node's last directory Seq the receiver has;
+    for PEER_FORWARD it is the number of messages stored.
+    """
+    # Format: value (Q)
+    _format = "<Q"
+    size = struct.calcsize(_format)
+    def __init__(self, value):
+        super().__init__(value)
+        self.value = value
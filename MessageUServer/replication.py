@@ -0,0 +1,67 @@
+# replication.py
+# author: Ariel Cohen ID: 329599187
+
+import asyncio    # For holding sync requests until there are new entries
+import logging    # For logging replication activity
+from protocol_structs import *  # Import all protocol definitions
+from connection import ProtocolError
+from outbound_link import OutboundLink
+from federation import pack_directory
+
+
+class ReplicaFeed:
+    """
+    The primary's side of replication: answers REPLICA_SYNC requests from read-only replicas.
+    The directory (clients table) is a change stream ordered by Seq. A replica asks for the entries
+    after the last Seq it has; if there are none, the request is held until a client is added,
+    so replicas receive new clients as they register instead of polling.
+    """
+    def __init__(self, data_manager, server_version):
+        self._data_manager = data_manager
+        self._server_version = server_version
+        self._added = asyncio.Event()  # Replaced by a new event each time clients are added.
+
+    async def sync(self, seq):
+        """
+        Answers a REPLICA_SYNC request, waiting until there are entries after `seq`.
+
+        Returns:
+            bytes: The REPLICA_DIRECTORY response.
+        """
+        while True:
+            # Taken before looking, so clients added during the lookup end the wait.
+            added = self._added
+            entries = await self._data_manager.get_clients_since(seq, MAX_PEER_BATCH)
+            if entries:
+                payload = pack_directory(entries)
+                return ResponseHeader(self._server_version, ResponseCode.REPLICA_DIRECTORY, len(payload)).pack() + payload
+            await added.wait()
+
+    def notify(self):
+        """Wakes the held requests after clients were added to the directory."""
+        self._added.set()
+        self._added = asyncio.Event()
+
+
+class ReplicaLink(OutboundLink):
+    """
+    The replica's side of replication: the link to the primary, on which the replica always has
+    one REPLICA_SYNC in flight. Entries are stored with the primary's Seq, so after a restart the
+    replica resumes from the highest Seq in its own database.
+    """
+    def __init__(self, data_manager, server_version, host, port):
+        super().__init__(f"primary {host}:{port}", host, port, server_version)
+        self._data_manager = data_manager
+
+    async def _session(self):
+        """Asks the primary for the entries after the last one this replica has, and stores them."""
+        while True:
+            seq = await self._data_manager.get_directory_seq()
+            code, payload = await self.request(RequestCode.REPLICA_SYNC, ReplicaSyncPayload(seq).pack())
+            if code != ResponseCode.REPLICA_DIRECTORY or len(payload) % DirectoryEntry.size:
+                raise ProtocolError(f"Unexpected response {code} to REPLICA_SYNC.")
+            entries = [DirectoryEntry.unpack(payload[i:i + DirectoryEntry.size])
+                       for i in range(0, len(payload), DirectoryEntry.size)]
+            await self._data_manager.add_replicated_clients(
+                [(e.seq, e.client_id, e.name.split(b'\x00', 1)[0].decode('ascii'), e.public_key) for e in entries])
+            logging.info(f"Copied {len(entries)} directory entries from the {self.name}.")
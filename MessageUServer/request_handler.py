@@ -4,6 +4,26 @@
 import logging  # For logging server activity
 import uuid     # For generating unique client IDs
 from protocol_structs import *  # Import all protocol definitions
+from stream_relay import StreamRelay
+from replication import ReplicaFeed
+from presence import PresenceTracker
+from connection import ProtocolError
+from upload_spool import UploadSpool
+
+# Requests the server never answers, not even with an error, so the client can send them back to back.
+UNANSWERED_REQUESTS = (RequestCode.STREAM_DATA,)
+# Requests that do not update the sender's LastSeen: they come from no registered client yet (REGISTER,
+# HELLO), from another node (PEER_*), or too often for a database write each (STREAM_DATA).
+UNTRACKED_REQUESTS = (RequestCode.REGISTER, RequestCode.HELLO, RequestCode.STREAM_DATA,
+                      RequestCode.PEER_HELLO, RequestCode.PEER_DIRECTORY, RequestCode.PEER_FORWARD,
+                      RequestCode.REPLICA_SYNC, RequestCode.ADMIN_BACKUP)
+# The only requests a read-only replica serves.
+READ_ONLY_REQUESTS = (RequestCode.HELLO, RequestCode.CLIENTS_LIST, RequestCode.PUBLIC_KEY, RequestCode.CLIENT_LOOKUP,
+                      RequestCode.ADMIN_BACKUP)
+# Hosts administration requests are accepted from.
+ADMIN_HOSTS = ('127.0.0.1', '::1')
+PULL_SLICE = 1024 * 1024  # Message content read from the database per slice of a pull response.
+PULL_PAGE = 64            # Messages whose headers are read from the database at a time during a pull.
 
 class RequestHandler:
     """
@@ -12,63 +32,121 @@ class RequestHandler:
     processes the request using the data manager, and constructs a binary response
     to be sent back to the client.
     """
-    def __init__(self, data_manager, server_version):
+    def __init__(self, data_manager, server_version, federation, backup, scheduler, read_only=False, spool_dir=None):
         self._data_manager = data_manager  # An instance of SQLiteDataManager
+        self._scheduler = scheduler        # Gives each slice of a pull response its turn (see SliceScheduler).
         self._server_version = server_version
+        self._federation = federation      # Stores messages here or forwards them to the recipient's node.
+        self._read_only = read_only        # True on a replica, which serves directory reads only.
+        self._backup = backup              # Takes online backups of the database.
+        self._spool_dir = spool_dir        # Where large uploads are spooled; None for the system's temp directory.
+        self._streams = StreamRelay(federation.store_message, server_version)
+        self._replicas = ReplicaFeed(data_manager, server_version)
+        self._presence = PresenceTracker(server_version)
+        self._pulls = {}  # Client ID to the connection its pull response is being sent on.
         # A dictionary that maps request codes to their handler methods.
         # This is a clean way to manage different request types.
         self._request_handlers = {
             RequestCode.REGISTER: self._handle_registration,
             RequestCode.CLIENTS_LIST: self._handle_clients_list,
             RequestCode.PUBLIC_KEY: self._handle_public_key,
+            RequestCode.CLIENT_LOOKUP: self._handle_client_lookup,
             RequestCode.SEND_MESSAGE: self._handle_send_message,
             RequestCode.PULL_MESSAGES: self._handle_pull_messages,
+            RequestCode.HELLO: self._handle_hello,
+            RequestCode.STREAM_OPEN: self._handle_stream_open,
+            RequestCode.STREAM_DATA: self._handle_stream_data,
+            RequestCode.STREAM_CLOSE: self._handle_stream_close,
+            RequestCode.PRESENCE_SUBSCRIBE: self._handle_presence_subscribe,
+            RequestCode.PEER_HELLO: self._handle_peer_request,
+            RequestCode.PEER_DIRECTORY: self._handle_peer_request,
+            RequestCode.PEER_FORWARD: self._handle_peer_request,
+            RequestCode.REPLICA_SYNC: self._handle_replica_sync,
+            RequestCode.ADMIN_BACKUP: self._handle_admin_backup,
+        }
+        self._peer_handlers = {
+            RequestCode.PEER_HELLO: federation.handle_hello,
+            RequestCode.PEER_DIRECTORY: federation.handle_directory,
+            RequestCode.PEER_FORWARD: federation.handle_forward,
         }
 
-    def handle_request(self, sock):
+    async def handle(self, header, payload, connection):
         """
-        Reads and processes a single request from a client socket.
-        
+        Processes a single, completely received request.
+
+        Args:
+            header (RequestHeader): The parsed request header.
+            payload (bytes): The request payload.
+            connection (Connection): The connection the request arrived on.
         Returns:
-            bytes: The response to be sent back to the client.
-            None: If the client has disconnected.
+            The response to be sent back to the client: bytes (empty for UNANSWERED_REQUESTS), or an
+            async iterator of byte chunks for a response produced in slices (PULL_MESSAGES).
         """
         try:
-            # Read the fixed-size request header first.
-            header_data = sock.recv(RequestHeader.size)
-            if not header_data:
-                return None  # Client disconnected gracefully
-            
-            header = RequestHeader.unpack(header_data)
-            
-            # Read the payload, if any.
-            payload = sock.recv(header.payload_size) if header.payload_size > 0 else b''
-
-            # Update the client's 'LastSeen' timestamp for any request other than registration.
-            if header.code != RequestCode.REGISTER:
-                self._data_manager.update_last_seen(header.client_id)
+            if self._read_only and header.code not in READ_ONLY_REQUESTS:
+                logging.warning(f"Request {header.code} from {connection.addr} sent to a read-only replica.")
+                return self._create_error_response()
+
+            # Update the client's 'LastSeen' timestamp; a replica leaves that to the primary.
+            # Stream chunks are skipped: opening and closing the stream already update it, and a
+            # database write per chunk would cost more than relaying it. The request does not
+            # wait for the update; it runs on the database thread before the request's own calls.
+            if header.code not in UNTRACKED_REQUESTS and not self._read_only:
+                self._data_manager.post('update_last_seen', header.client_id)
 
             # Look up the appropriate handler for the request code.
             handler = self._request_handlers.get(header.code)
             if handler:
                 # Call the handler and return its response.
-                return handler(header, payload)
+                response = await handler(header, payload, connection)
+                if header.code != RequestCode.REGISTER and any(header.client_id):
+                    self._identify(connection, header.client_id)
+                return response
             else:
                 # If the code is unknown, log a warning and send an error.
                 logging.warning(f"Unknown request code: {header.code}")
                 return self._create_error_response()
-        except ConnectionResetError:
-            return None  # Client disconnected abruptly
+        except ProtocolError:
+            raise  # The connection is unusable, e.g. closed in the middle of an upload.
         except Exception as e:
             logging.error(f"Error processing request: {e}")
+            if header.code in UNANSWERED_REQUESTS:
+                return b""
             return self._create_error_response()
 
+    def connection_closed(self, connection):
+        """Releases the streams, presence and pull of a closed connection."""
+        self._streams.connection_closed(connection)
+        self._presence.connection_closed(connection)
+        for client_id in [c for c, pulling in self._pulls.items() if pulling is connection]:
+            del self._pulls[client_id]
+
+    def _identify(self, connection, client_id):
+        """
+        Records which client a persistent connection belongs to: the client counts as online,
+        and its live streams are pushed to this connection if it can receive them.
+        """
+        if connection.client_id == client_id or Capability.PERSISTENT_CONNECTION not in connection.capabilities:
+            return
+        connection.client_id = client_id
+        self._presence.identified(connection)
+        if Capability.STREAMS in connection.capabilities:
+            self._streams.bind(client_id, connection)
+
     def _create_error_response(self):
         """Creates a generic error response to send to the client."""
         header = ResponseHeader(self._server_version, ResponseCode.ERROR, 0)
         return header.pack()
 
-    def _handle_registration(self, header, payload):
+    async def _handle_hello(self, header, payload, connection):
+        """Handles a capability negotiation request, answering with the capabilities both sides support."""
+        req = HelloPayload.unpack(payload)
+        response_payload = connection.negotiate(req.capabilities, req.max_batch).pack()
+        logging.info(f"Negotiated capabilities {int(connection.capabilities):#x} with {connection.addr}.")
+        response_header = ResponseHeader(self._server_version, ResponseCode.HELLO, len(response_payload))
+        return response_header.pack() + response_payload
+
+    async def _handle_registration(self, header, payload, connection):
         """Handles a client registration request."""
         logging.info("Handling registration request.")
         req = RegistrationRequestPayload.unpack(payload)
@@ -76,36 +154,39 @@ class RequestHandler:
         username = req.name.split(b'\x00', 1)[0].decode('ascii')
 
         # Check if the username is already taken.
-        if self._data_manager.username_exists(username):
+        if await self._data_manager.username_exists(username):
             logging.warning(f"Registration failed: username '{username}' already exists.")
             return self._create_error_response()
 
         # Generate a new unique ID for the client.
         client_id = uuid.uuid4().bytes
-        self._data_manager.add_client(client_id, username, req.public_key)
+        await self._data_manager.add_client(client_id, username, req.public_key)
         logging.info(f"Registered new user '{username}' with ID {client_id.hex()}.")
+        # Let the other nodes of the federation and the replicas know about the new client.
+        self._federation.notify()
+        self._replicas.notify()
 
         # Create and send a success response with the new client ID.
         response_payload = RegistrationSuccessPayload(client_id).pack()
         response_header = ResponseHeader(self._server_version, ResponseCode.REGISTRATION_SUCCESS, len(response_payload))
         return response_header.pack() + response_payload
 
-    def _handle_clients_list(self, header, payload):
+    async def _handle_clients_list(self, header, payload, connection):
         """Handles a request for the list of registered clients."""
         logging.info(f"Handling clients list request from {header.client_id.hex()}.")
         # Fetch all clients except the one making the request.
-        clients = self._data_manager.get_clients(exclude_id=header.client_id)
+        clients = await self._data_manager.get_clients(exclude_id=header.client_id)
         # Pack each client's info into a single byte string.
         payload_data = b"".join([ClientInfo(c['ID'], c['UserName'].encode('ascii')).pack() for c in clients])
         
         response_header = ResponseHeader(self._server_version, ResponseCode.CLIENTS_LIST, len(payload_data))
         return response_header.pack() + payload_data
 
-    def _handle_public_key(self, header, payload):
+    async def _handle_public_key(self, header, payload, connection):
         """Handles a request for another client's public key."""
         logging.info(f"Handling public key request from {header.client_id.hex()}.")
         req = PublicKeyRequestPayload.unpack(payload)
-        client = self._data_manager.get_client_by_id(req.client_id)
+        client = await self._data_manager.get_client_by_id(req.client_id)
 
         if not client:
             logging.warning(f"Public key request for non-existent client ID {req.client_id.hex()}.")
@@ -116,8 +197,29 @@ class RequestHandler:
         response_header = ResponseHeader(self._server_version, ResponseCode.PUBLIC_KEY, len(response_payload))
         return response_header.pack() + response_payload
 
-    def _handle_send_message(self, header, payload):
-        """Handles a request to store a message for another client."""
+    async def _handle_client_lookup(self, header, payload, connection):
+        """Handles a request for one client by ID or by name, answering with its public key as well."""
+        req = ClientLookupRequestPayload.unpack(payload)
+        if any(req.client_id):
+            client = await self._data_manager.get_client_by_id(req.client_id)
+        else:
+            client = await self._data_manager.get_client_by_name(req.name.split(b'\x00', 1)[0].decode('ascii'))
+
+        if not client:
+            logging.warning(f"Lookup from {header.client_id.hex()} for a non-existent client.")
+            return self._create_error_response()
+
+        response_payload = ClientInfoResponsePayload(client['ID'], client['UserName'].encode('ascii'), client['PublicKey']).pack()
+        response_header = ResponseHeader(self._server_version, ResponseCode.CLIENT_INFO, len(response_payload))
+        return response_header.pack() + response_payload
+
+    async def _handle_send_message(self, header, payload, connection):
+        """
+        Handles a request to store a message for another client.
+        The content of a large message is still in the socket (see Connection.read_body): it is
+        only read once the recipient is known to exist, into a spool file, so the server holds
+        a bounded part of it in memory whatever its size.
+        """
         logging.info(f"Handling send message request from {header.client_id.hex()}.")
         msg_header_size = SendMessageRequestPayloadHeader.size
         if len(payload) < msg_header_size:
@@ -129,43 +231,180 @@ class RequestHandler:
         content = payload[msg_header_size:]
 
         # Ensure the recipient client exists.
-        if not self._data_manager.client_id_exists(req_header.client_id):
+        if not await self._data_manager.client_id_exists(req_header.client_id):
             logging.warning(f"Attempt to send message to non-existent client ID {req_header.client_id.hex()}.")
+            await connection.discard_body()
             return self._create_error_response()
 
-        # Add the message to the database.
-        message_id = self._data_manager.add_message(
-            to_client_id=req_header.client_id,
-            from_client_id=header.client_id,
-            msg_type=req_header.message_type,
-            content=content
-        )
-        
+        spool = None
+        try:
+            if connection.body_left:
+                spool = UploadSpool(self._spool_dir)
+                await spool.receive(connection, connection.body_left)
+                content = spool
+            # Store the message, or queue it for the recipient's node if it is homed elsewhere.
+            message_id = await self._federation.store_message(
+                to_client_id=req_header.client_id,
+                from_client_id=header.client_id,
+                msg_type=req_header.message_type,
+                content=content
+            )
+        finally:
+            if spool:
+                spool.remove()
+
         # Send a confirmation response.
         response_payload = MessageSentResponsePayload(req_header.client_id, message_id).pack()
         response_header = ResponseHeader(self._server_version, ResponseCode.MESSAGE_SENT, len(response_payload))
         return response_header.pack() + response_payload
 
-    def _handle_pull_messages(self, header, payload):
-        """Handles a client's request to pull all their pending messages."""
+    async def _handle_pull_messages(self, header, payload, connection):
+        """
+        Handles a client's request to pull its pending messages.
+        The response is produced in slices as the connection drains (see _pull_response), so
+        a download of hundreds of MB neither holds up the other connections nor sits in memory.
+        Its size is summed up in the database first, so nothing is read before the header is sent.
+        """
         logging.info(f"Handling pull messages request from {header.client_id.hex()}.")
-        messages = self._data_manager.get_messages_for_client(header.client_id)
-        
-        payload_data = b""
+        # Messages already on their way over another connection are not sent twice.
+        if header.client_id in self._pulls:
+            return ResponseHeader(self._server_version, ResponseCode.PULL_MESSAGES, 0).pack()
+        # Claimed before the lookup, so a pull arriving meanwhile on another connection sees it.
+        self._pulls[header.client_id] = connection
+        count = 0
+        try:
+            # Return at most the negotiated batch size, and the client pulls again for the rest;
+            # connections that did not negotiate get everything.
+            count, content_size, last_id = await self._data_manager.get_mailbox_summary(header.client_id,
+                                                                                      limit=connection.max_batch)
+        finally:
+            if not count:
+                self._pulls.pop(header.client_id, None)
+        if not count:
+            return ResponseHeader(self._server_version, ResponseCode.PULL_MESSAGES, 0).pack()
+        return self._pull_response(header.client_id, count, content_size, last_id)
+
+    async def _pull_response(self, client_id, count, content_size, last_id):
+        """
+        Yields a PULL_MESSAGES response for the `count` oldest messages of a client, which end
+        with message `last_id`, in slices of at most PULL_SLICE content bytes. Their headers are
+        read PULL_PAGE at a time, each page after the last ID of the one before, so memory stays
+        bounded however many messages are sent. Each PULL_SLICE content bytes, the next slice waits
+        for its turn, so small requests on other connections are answered first.
+        Messages are deleted from the database in batches, once the socket has taken a batch's
+        bytes. The protocol has no acknowledgement, so that is before the client is known to have
+        them: a connection lost at that point loses the batch, and delivery is at most once.
+        Batches not reached when a pull is cut off stay queued for the next pull.
+        """
+        total_size = count * PulledMessage.header_size + content_size
+        yield ResponseHeader(self._server_version, ResponseCode.PULL_MESSAGES, total_size).pack()
         message_ids_to_delete = []
-        # Iterate through all pending messages and pack them for sending.
-        for msg in messages:
-            payload_data += PulledMessage(
-                msg['FromClient'], msg['ID'], msg['Type'], len(msg['Content']), msg['Content']
-            ).pack()
-            message_ids_to_delete.append(msg['ID'])
-
-        response_header = ResponseHeader(self._server_version, ResponseCode.PULL_MESSAGES, len(payload_data))
-        
-        # Once the messages are packed and ready to be sent, delete them from the database.
-        # This ensures messages are delivered at least once.
-        if message_ids_to_delete:
-            self._data_manager.delete_messages(message_ids_to_delete)
-            logging.info(f"Sent and deleted {len(message_ids_to_delete)} messages for client {header.client_id.hex()}.")
+        packed_size = 0
+        sliced_size = 0  # Content bytes sent since the last turn.
+        sent = 0
+        after_id = 0
+        while sent < count:
+            page = await self._data_manager.get_messages_for_client(client_id, limit=min(PULL_PAGE, count - sent),
+                                                                    after_id=after_id)
+            # Only this pull deletes the client's messages, and newer ones come after last_id.
+            if not page or page[-1]['ID'] > last_id:
+                raise RuntimeError(f"Messages of client {client_id.hex()} changed while being sent.")
+            for msg in page:
+                yield PulledMessage(msg['FromClient'], msg['ID'], msg['Type'], msg['Size'], b"").pack_header()
+                for offset in range(0, msg['Size'], PULL_SLICE):
+                    content = await self._data_manager.get_message_content(msg['ID'], offset, PULL_SLICE)
+                    if len(content) != min(PULL_SLICE, msg['Size'] - offset):
+                        raise RuntimeError(f"Message {msg['ID']} changed while being sent.")
+                    yield content
+                    sliced_size += len(content)
+                    if sliced_size >= PULL_SLICE:
+                        await self._scheduler.turn()
+                        sliced_size = 0
+                message_ids_to_delete.append(msg['ID'])
+                packed_size += msg['Size']
+                sent += 1
+                # Deleting in batches bounds the work done at once, without a commit per small message.
+                if packed_size >= PULL_SLICE or sent == count:
+                    await self._data_manager.delete_messages(client_id, message_ids_to_delete)
+                    message_ids_to_delete = []
+                    packed_size = 0
+            after_id = page[-1]['ID']
+        logging.info(f"Sent and deleted {count} messages for client {client_id.hex()}.")
+        self._pulls.pop(client_id, None)
 
-        return response_header.pack() + payload_data
+    async def _handle_stream_open(self, header, payload, connection):
+        """Handles a request to open a stream, relayed live if the recipient is online."""
+        req = StreamOpenRequestPayload.unpack(payload)
+        # A stream lives on the connection it was opened on, so it needs the negotiated capability.
+        if Capability.STREAMS not in connection.capabilities:
+            logging.warning(f"Stream open from {connection.addr} without the negotiated capability.")
+            return self._create_error_response()
+        if not await self._data_manager.client_id_exists(req.client_id):
+            logging.warning(f"Attempt to open a stream to non-existent client ID {req.client_id.hex()}.")
+            return self._create_error_response()
+
+        stream = self._streams.open(connection, header.client_id, req.client_id)
+        delivery = StreamDelivery.LIVE if stream.listener else StreamDelivery.STORED
+        logging.info(f"Opened stream {stream.stream_id} from {header.client_id.hex()} to {req.client_id.hex()} ({delivery.name}).")
+        response_payload = StreamOpenedPayload(stream.stream_id, delivery).pack()
+        response_header = ResponseHeader(self._server_version, ResponseCode.STREAM_OPENED, len(response_payload))
+        return response_header.pack() + response_payload
+
+    async def _handle_presence_subscribe(self, header, payload, connection):
+        """Handles a request to watch the presence of a set of clients, answering with their current presence."""
+        # Changes are pushed, so the connection must stay open and be able to receive them.
+        if Capability.PRESENCE not in connection.capabilities:
+            logging.warning(f"Presence subscription from {connection.addr} without the negotiated capability.")
+            return self._create_error_response()
+        count, remainder = divmod(len(payload), CLIENT_ID_SIZE)
+        if remainder or count > MAX_PRESENCE_SUBSCRIPTIONS:
+            logging.warning(f"Invalid presence subscription of {len(payload)} bytes from {connection.addr}.")
+            return self._create_error_response()
+        client_ids = [payload[i:i + CLIENT_ID_SIZE] for i in range(0, len(payload), CLIENT_ID_SIZE)]
+        entries = self._presence.subscribe(connection, client_ids)
+        logging.info(f"Client {header.client_id.hex()} watches the presence of {len(entries)} clients.")
+        response_payload = b"".join(entry.pack() for entry in entries)
+        response_header = ResponseHeader(self._server_version, ResponseCode.PRESENCE, len(response_payload))
+        return response_header.pack() + response_payload
+
+    async def _handle_stream_data(self, header, payload, connection):
+        """Handles one chunk of a stream. No response is sent; lost chunks show in the close confirmation."""
+        req = StreamRequestHeader.unpack(payload[:StreamRequestHeader.size])
+        if not self._streams.data(connection, req.stream_id, payload[StreamRequestHeader.size:]):
+            logging.warning(f"Chunk for unknown stream {req.stream_id} from {connection.addr}.")
+        return b""
+
+    async def _handle_stream_close(self, header, payload, connection):
+        """Handles a request to close a stream, confirming how many chunks were received."""
+        req = StreamRequestHeader.unpack(payload)
+        closed = await self._streams.close(connection, req.stream_id)
+        if closed is None:
+            return self._create_error_response()
+        response_payload = closed.pack()
+        response_header = ResponseHeader(self._server_version, ResponseCode.STREAM_CLOSED, len(response_payload))
+        return response_header.pack() + response_payload
+
+    async def _handle_peer_request(self, header, payload, connection):
+        """Handles a request from another node of the federation, answering with a PEER_ACK."""
+        ack = await self._peer_handlers[header.code](payload, connection)
+        if ack is None:
+            logging.warning(f"Rejected peer request {header.code} from {connection.addr}.")
+            return self._create_error_response()
+        if header.code == RequestCode.PEER_DIRECTORY:
+            self._replicas.notify()
+        response_payload = ack.pack()
+        response_header = ResponseHeader(self._server_version, ResponseCode.PEER_ACK, len(response_payload))
+        return response_header.pack() + response_payload
+
+    async def _handle_replica_sync(self, header, payload, connection):
+        """Handles a replica asking for directory changes; held without a response until there are any."""
+        req = ReplicaSyncPayload.unpack(payload)
+        return await self._replicas.sync(req.seq)
+
+    async def _handle_admin_backup(self, header, payload, connection):
+        """Handles a request for an online backup of the database; answered once the backup is written."""
+        if not connection.addr or connection.addr[0] not in ADMIN_HOSTS:
+            logging.warning(f"Backup requested by {connection.addr}, which is not this host.")
+            return self._create_error_response()
+        path = (await self._backup.run()).encode('utf-8')
+        return ResponseHeader(self._server_version, ResponseCode.BACKUP_DONE, len(path)).pack() + path
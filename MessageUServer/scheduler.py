@@ -0,0 +1,67 @@
+# scheduler.py
+# author: Ariel Cohen ID: 329599187
+
+import asyncio  # For the futures bulk transfers wait on
+from collections import deque  # For the bulk transfers waiting for a turn, oldest first
+from contextlib import contextmanager  # For marking a request as being handled
+from protocol_structs import RequestCode
+
+SMALL_REQUEST = 64 * 1024  # A request with a payload of at most this many bytes, other than a pull, is small.
+SMALL_BURST = 16           # Most small requests finished while a bulk transfer waits for its turn.
+SMALL_WAIT = 0.05          # Most seconds a bulk transfer waits for its turn, e.g. behind a backup request.
+
+
+class SliceScheduler:
+    """
+    Shares the event loop between small requests and bulk transfers, small requests first.
+    A bulk transfer moves its bytes in slices (SPOOL_CHUNK bytes of an upload, see
+    Connection.read_body, and PULL_SLICE bytes of a pull response) and takes a turn before each
+    next slice. While no small request is being handled the turn is given at once; otherwise the
+    transfer waits until none is, until SMALL_BURST small requests have finished, or for SMALL_WAIT
+    seconds at most. A directory lookup therefore waits for at most the slices already running,
+    and large transfers still progress under a steady stream of small requests, or behind a small
+    request that takes long to handle.
+    """
+    def __init__(self):
+        self._small = 0         # Small requests being handled now.
+        self._finished = 0      # Small requests finished so far.
+        self._waiting = deque()  # (finished count that ends the wait, future) for each waiting transfer.
+
+    @contextmanager
+    def handling(self, header):
+        """Marks the request with this header as being handled, until its handler returns."""
+        small = header.payload_size <= SMALL_REQUEST and header.code != RequestCode.PULL_MESSAGES
+        if not small:
+            yield
+            return
+        self._small += 1
+        try:
+            yield
+        finally:
+            self._small -= 1
+            self._finished += 1
+            self._wake()
+
+    async def turn(self):
+        """Waits, between two slices of a bulk transfer, until the small requests being handled let it go on."""
+        if not self._small:
+            return
+        loop = asyncio.get_running_loop()
+        waiter = loop.create_future()
+        self._waiting.append((self._finished + SMALL_BURST, waiter))
+        timer = loop.call_later(SMALL_WAIT, self._release, waiter)
+        try:
+            await waiter
+        finally:
+            timer.cancel()
+
+    def _wake(self):
+        """Lets go the transfers whose wait is over: all of them once no small request is left."""
+        while self._waiting and (not self._small or self._waiting[0][0] <= self._finished):
+            self._release(self._waiting.popleft()[1])
+
+    @staticmethod
+    def _release(waiter):
+        """Lets go one waiting transfer, unless it already went on."""
+        if not waiter.done():
+            waiter.set_result(None)
@@ -1,94 +1,125 @@
 # server.py 
 # author: Ariel Cohen ID: 329599187
 
-import socket      # For network connections
-import selectors   # For managing multiple connections efficiently
+import asyncio     # For serving many connections on one thread
 import logging     # For logging server status and errors
+import argparse    # For command line options
+import signal      # For starting a backup on SIGUSR1
+import time        # For timing the startup
+try:
+    import uvloop  # Optional: a faster drop-in event loop, used when installed
+except ImportError:
+    uvloop = None
 from request_handler import RequestHandler
-from data_manager import SQLiteDataManager
+from federation import Federation, read_federation_file, read_federation_secret
+from replication import ReplicaLink
+from async_data_manager import AsyncDataManager, STORAGE_ENGINES, DEFAULT_DB_FILES
+from backup import DatabaseBackup
+from connection import Connection, ProtocolError
+from scheduler import SliceScheduler
 
 # --- Configuration ---
 # Configure logging to display timestamps, log level, and messages.
 logging.basicConfig(level=logging.INFO, format='%(asctime)s - %(levelname)s - %(message)s')
 
-SERVER_VERSION = 2  # The version of the server protocol (with DB support)
+SERVER_VERSION = 3  # The version of the server protocol (with DB support and compact framing)
 
 class Server:
     """
     The main server class for the MessageU application.
-    It handles incoming network connections, and uses a selector to manage
-    multiple clients simultaneously without blocking.
+    It serves every client connection as an asyncio coroutine, so many clients are handled
+    simultaneously on one thread. The database runs on a thread of its own (AsyncDataManager),
+    so neither slow queries nor large messages stop the other connections: while one request
+    waits for the database or for a slow socket, the others are served.
     """
-    def __init__(self, host, port):
+    def __init__(self, host, port, db_file='dpmmn15.db', node_id=0, nodes=None, primary=None, backup_dir='backups',
+                 snapshot_file=None, storage='sqlite', spool_dir=None, federation_secret=None):
+        self._started = time.monotonic()
         self._host = host
         self._port = port
-        # The selector helps manage I/O events for multiple sockets.
-        self._selector = selectors.DefaultSelector()
-        # Initialize the data manager for database persistence.
-        self._data_manager = SQLiteDataManager('dpmmn15.db') 
-        # The request handler processes all incoming requests.
-        self._request_handler = RequestHandler(self._data_manager, SERVER_VERSION)
-        self._server_socket = None
+        # The directory snapshot the preload starts from and the shutdown saves to, if any.
+        self._snapshot_file = snapshot_file
+        # Initialize the data manager for database persistence, on the chosen storage engine.
+        self._data_manager = AsyncDataManager(db_file, storage)
+        # Links to the other nodes of the federation, if any.
+        self._federation = Federation(self._data_manager, SERVER_VERSION, node_id, nodes, federation_secret)
+        # A replica copies the directory from its primary and serves directory reads only.
+        self._replica_link = ReplicaLink(self._data_manager, SERVER_VERSION, *primary) if primary else None
+        # Copies the database to backup_dir on request, while the server keeps serving.
+        self._backup = DatabaseBackup(self._data_manager, db_file, backup_dir)
+        # Serves small requests before the next slice of a large upload or pull, on every connection.
+        self._scheduler = SliceScheduler()
+        # The request handler processes all incoming requests; large uploads are spooled to spool_dir.
+        self._request_handler = RequestHandler(self._data_manager, SERVER_VERSION, self._federation, self._backup,
+                                               self._scheduler, read_only=primary is not None, spool_dir=spool_dir)
 
-    def _accept_connection(self, key, mask):
-        """Callback function for handling new connections to the server socket."""
-        sock = key.fileobj
-        conn, addr = sock.accept()
-        logging.info(f"Accepted connection from {addr}")
-        conn.setblocking(False)  # Set the new socket to non-blocking mode.
-        # Register the new client socket with the selector to monitor it for read events.
-        self._selector.register(conn, selectors.EVENT_READ, self._service_connection)
-
-    def _service_connection(self, key, mask):
-        """Callback function for handling data received from a client."""
-        sock = key.fileobj
+    async def _serve_connection(self, reader, writer):
+        """Serves one client connection: handles its requests in order and sends their responses."""
+        connection = Connection(reader, writer, self._scheduler)
+        logging.info(f"Accepted connection from {connection.addr}")
         try:
-            # Pass the socket to the request handler to process the request.
-            response = self._request_handler.handle_request(sock)
-            if response:
-                # If a response was generated, send it all back to the client.
-                sock.sendall(response)
-            else:
-                # If the handler returns None, it means the client has disconnected.
-                logging.info(f"Client {sock.getpeername()} disconnected.")
-                self._selector.unregister(sock)
-                sock.close()
+            while True:
+                request = await connection.next_request()
+                if request is None:
+                    logging.info(f"Client {connection.addr} disconnected.")
+                    break
+                header, payload = request
+                with self._scheduler.handling(header):
+                    response = await self._request_handler.handle(header, payload, connection)
+                await connection.send(response)
+        except ProtocolError as e:
+            logging.warning(f"Protocol error from {connection.addr}: {e}")
+        except OSError as e:
+            logging.info(f"Client {connection.addr} disconnected: {e}")
         except Exception as e:
             # In case of any other error, log it and close the connection.
-            logging.error(f"Error handling connection from {sock.getpeername()}: {e}")
-            self._selector.unregister(sock)
-            sock.close()
+            logging.error(f"Error handling connection from {connection.addr}: {e}")
+        finally:
+            self._request_handler.connection_closed(connection)
+            connection.close()
 
-    def start(self):
-        """Starts the server, sets up the listening socket, and enters the main event loop."""
+    async def _run(self):
+        """Preloads the directory, then listens for connections and runs the links to other servers until cancelled."""
+        # SIGTERM shuts down like Ctrl+C, so the directory snapshot is saved when a service manager stops the server.
         try:
-            self._server_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-            # Allow reusing the address to avoid "Address already in use" errors on restart.
-            self._server_socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
-            self._server_socket.bind((self._host, self._port))
-            self._server_socket.listen()
-            self._server_socket.setblocking(False)  # Set the server socket to non-blocking.
-            # Register the server socket to accept new connections.
-            self._selector.register(self._server_socket, selectors.EVENT_READ, self._accept_connection)
-            logging.info(f"Server version {SERVER_VERSION} listening on {self._host}:{self._port}")
-
-            # The main server loop.
-            while True:
-                # Wait for an event (new connection, data received, etc.).
-                events = self._selector.select(timeout=None)
-                for key, mask in events:
-                    # Get the callback associated with the event and call it.
-                    callback = key.data
-                    callback(key, mask)
+            asyncio.get_running_loop().add_signal_handler(signal.SIGTERM, asyncio.current_task().cancel)
+        except NotImplementedError:
+            pass  # Windows event loops have no signal handlers.
+        # Bound first, so a port in use fails at once, but accepting only once the directory is
+        # loaded, so the first requests are answered from memory like all the others.
+        server = await asyncio.start_server(self._serve_connection, self._host, self._port, reuse_address=True,
+                                            start_serving=False)
+        preload = await self._data_manager.preload(self._snapshot_file)
+        logging.info(f"Server version {SERVER_VERSION} listening on {self._host}:{self._port}")
+        logging.info(f"Ready in {time.monotonic() - self._started:.2f} s: preloaded {preload['clients']} clients "
+                     f"and {preload['mailboxes']} mailboxes from the {preload['source']} in {preload['seconds']:.2f} s.")
+        if hasattr(signal, 'SIGUSR1'):
+            asyncio.get_running_loop().add_signal_handler(signal.SIGUSR1, self._backup.start)
+        if self._replica_link:
+            logging.info(f"Read-only replica of {self._replica_link.name}.")
+            self._replica_link.start()
+        self._federation.start()
+        try:
+            async with server:
+                await server.serve_forever()
+        finally:
+            await self._federation.stop()
+            if self._replica_link:
+                await self._replica_link.stop()
 
-        except KeyboardInterrupt:
-            # Handle Ctrl+C to gracefully shut down the server.
+    def start(self, use_uvloop=True):
+        """Starts the server and runs the event loop (uvloop's if installed and wanted) until Ctrl+C or SIGTERM."""
+        loop = uvloop.new_event_loop() if uvloop and use_uvloop else asyncio.new_event_loop()
+        logging.info(f"Using the {type(loop).__module__.split('.')[0]} event loop.")
+        asyncio.set_event_loop(loop)
+        try:
+            loop.run_until_complete(self._run())
+        except (KeyboardInterrupt, asyncio.CancelledError):
+            # Handle Ctrl+C and SIGTERM to gracefully shut down the server.
             logging.info("Server is shutting down.")
         finally:
             # Clean up all resources.
-            if self._server_socket:
-                self._server_socket.close()
-            self._selector.close()
+            loop.close()
             self._data_manager.close()
 
 def get_port_from_file(filename="myport.info", default_port=1357):
@@ -102,10 +133,45 @@ def get_port_from_file(filename="myport.info", default_port=1357):
 
 def main():
     """The main entry point of the application."""
+    parser = argparse.ArgumentParser(description="MessageU server")
+    parser.add_argument("--port", type=int, help="port to listen on (default: read from myport.info)")
+    parser.add_argument("--storage", choices=sorted(STORAGE_ENGINES), default="sqlite",
+                        help="storage engine: SQLite tables, everything in memory with a snapshot file, "
+                             "or a log-structured merge store (default: %(default)s)")
+    parser.add_argument("--db", help="database file, or directory for lsm (default: dpmmn15.db, .mem or .lsm)")
+    parser.add_argument("--node-id", type=int, default=0,
+                        help="this server's node ID in a federation, 1-255 (default: 0, standalone)")
+    parser.add_argument("--federation", default="federation.info",
+                        help="file listing the federation's nodes (default: %(default)s)")
+    parser.add_argument("--federation-secret", metavar="FILE",
+                        help="file holding a secret shared by all nodes, which peers must prove they know")
+    parser.add_argument("--replica-of", metavar="HOST:PORT",
+                        help="run as a read-only replica of this server, serving directory requests only")
+    parser.add_argument("--backup-dir", default="backups",
+                        help="directory online backups of the database are written to (default: %(default)s)")
+    parser.add_argument("--snapshot", metavar="FILE",
+                        help="start from this directory snapshot if it is current, and save it at shutdown")
+    parser.add_argument("--spool-dir", metavar="DIR",
+                        help="directory large uploads are written to while they are received (default: the system's temporary directory)")
+    parser.add_argument("--no-uvloop", action="store_true",
+                        help="use the standard asyncio event loop even if uvloop is installed")
+    args = parser.parse_args()
+    if args.replica_of and args.node_id:
+        parser.error("a replica cannot be a federation node")
+    primary = None
+    if args.replica_of:
+        primary_host, primary_port = args.replica_of.rsplit(':', 1)
+        primary = (primary_host, int(primary_port))
+
     host = '0.0.0.0'  # Listen on all available network interfaces.
-    port = get_port_from_file()  # Get port from file or use default.
-    server = Server(host, port)  
-    server.start()
+    port = args.port or get_port_from_file()  # Get port from file or use default.
+    # A standalone server ignores the federation file.
+    nodes = read_federation_file(args.federation) if args.node_id else {}
+    federation_secret = read_federation_secret(args.federation_secret) if args.node_id and args.federation_secret else None
+    db_file = args.db or DEFAULT_DB_FILES[args.storage]
+    server = Server(host, port, db_file, args.node_id, nodes, primary, args.backup_dir, args.snapshot, args.storage,
+                    args.spool_dir, federation_secret)
+    server.start(use_uvloop=not args.no_uvloop)
 
 # This block ensures that main() is called only when the script is executed directly.
 if __name__ == "__main__":
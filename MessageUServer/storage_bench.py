@@ -0,0 +1,192 @@
+# storage_bench.py
+# author: Ariel Cohen ID: 329599187
+
+"""
+Benchmark of the server's storage engines on the same workload.
+
+    python storage_bench.py [--engines sqlite,memory,lsm] [--dir DIR] [--clients N] [--messages N]
+                            [--text-size BYTES] [--file-fraction F] [--file-size KB] [--mixed N] [--seed N]
+
+Every engine is driven directly, in this process, with the calls the request handler makes for
+each request, so the results compare the engines alone, without the network or the event loop:
+
+    register  username_exists, add_client
+    send      update_last_seen, client_id_exists, get_client_home, add_message
+    pull      update_last_seen, get_mailbox_summary, get_messages_for_client per page,
+              get_message_content per slice, delete_messages
+    lookup    update_last_seen, get_client_by_name
+
+The phases run in order: every client registers, --messages messages are sent to random
+clients, every client pulls its mailbox, then --mixed steps of the steady state follow, in
+which each step sends a message, looks up a client and pulls a random client's mailbox. Last,
+the engine is closed and opened again, and the time to open and preload it is reported. The
+same --seed gives every engine the same calls. Each phase prints the requests per second and
+the p50/p99/max latency of one request, and the bytes the engine keeps on disk after it.
+
+Engines differ in durability: SQLite syncs every commit; lsm syncs its log a second after a
+write at most (in the server its database thread syncs it when no later write does; here only
+a later write does); memory saves a snapshot on the first write a minute or more after a
+change. See their classes.
+"""
+
+import argparse   # For command line options
+import logging    # For keeping the engines' logs out of the measurements
+import math       # For the size distributions
+import os         # For the engines' files
+import random     # For the reproducible workload
+import shutil     # For removing the engines' files
+import time       # For timing the requests
+from async_data_manager import STORAGE_ENGINES, DEFAULT_DB_FILES
+from loadgen import percentile
+from request_handler import PULL_PAGE, PULL_SLICE
+
+MAX_BATCH = 64                # Messages per pull, as a client that negotiated batching asks for.
+POOL_SIZE = 4 * 1024 * 1024   # Random bytes message content is cut from.
+
+
+def disk_size(path):
+    """Returns the bytes an engine keeps on disk at `path`: a file and its journals, or a directory."""
+    if os.path.isdir(path):
+        return sum(os.path.getsize(os.path.join(path, name)) for name in os.listdir(path))
+    return sum(os.path.getsize(p) for p in (path, path + "-journal", path + "-wal") if os.path.exists(p))
+
+
+class Workload:
+    """The sequence of requests of a run, drawn from a seeded generator so every engine gets the same."""
+    def __init__(self, args):
+        self._args = args
+        self._rng = random.Random(args.seed)
+        self.clients = [(self._rng.getrandbits(128).to_bytes(16, 'big'), f"user{i}") for i in range(args.clients)]
+        # Content is cut from one pool: generating random bytes per message would dominate the run.
+        self._pool = self._rng.getrandbits(POOL_SIZE * 8).to_bytes(POOL_SIZE, 'big')
+
+    def client(self):
+        return self._rng.choice(self.clients)
+
+    def content(self):
+        """Returns the content of a message: a text, or now and then a file."""
+        if self._rng.random() < self._args.file_fraction:
+            size = int(self._rng.lognormvariate(math.log(self._args.file_size * 1024), 1.0))
+        else:
+            size = int(self._rng.lognormvariate(math.log(self._args.text_size), 0.5))
+        size = min(-(-size // 16) * 16, len(self._pool))
+        offset = self._rng.randrange(len(self._pool) - size + 1)
+        return self._pool[offset:offset + size]
+
+
+def register(engine, client_id, username):
+    if not engine.username_exists(username):
+        engine.add_client(client_id, username, bytes(160))
+
+
+def send(engine, from_id, to_id, content):
+    engine.update_last_seen(from_id)
+    if engine.client_id_exists(to_id):
+        engine.get_client_home(to_id)
+        engine.add_message(to_id, from_id, 3, content)
+
+
+def pull(engine, client_id):
+    engine.update_last_seen(client_id)
+    count, _, _ = engine.get_mailbox_summary(client_id, limit=MAX_BATCH)
+    message_ids = []
+    while len(message_ids) < count:
+        page = engine.get_messages_for_client(client_id, limit=min(PULL_PAGE, count - len(message_ids)),
+                                              after_id=message_ids[-1] if message_ids else 0)
+        if not page:
+            break
+        for msg in page:
+            for offset in range(0, msg['Size'], PULL_SLICE):
+                engine.get_message_content(msg['ID'], offset, PULL_SLICE)
+            message_ids.append(msg['ID'])
+    if message_ids:
+        engine.delete_messages(client_id, message_ids)
+
+
+def lookup(engine, client_id, username):
+    engine.update_last_seen(client_id)
+    engine.get_client_by_name(username)
+
+
+def timed(latencies, function, *args):
+    started = time.perf_counter()
+    function(*args)
+    latencies.append(time.perf_counter() - started)
+
+
+def report(engine_name, phase, latencies, seconds, path):
+    ordered = sorted(latencies)
+    print(f"{engine_name:<8}{phase:<10}{len(ordered):>9}{len(ordered) / seconds:>12.0f}"
+          f"{percentile(ordered, 0.5) * 1000:>10.3f}{percentile(ordered, 0.99) * 1000:>10.3f}"
+          f"{ordered[-1] * 1000 if ordered else 0:>10.3f}{disk_size(path) / (1024 * 1024):>10.1f}")
+
+
+def run_phase(engine_name, phase, path, steps):
+    """Runs the (function, args) steps of a phase, timing each, and prints the phase's line."""
+    latencies = []
+    started = time.perf_counter()
+    for function, args in steps:
+        timed(latencies, function, *args)
+    report(engine_name, phase, latencies, time.perf_counter() - started, path)
+
+
+def bench(engine_name, args):
+    """Runs the whole workload on one engine, in a fresh store under args.dir."""
+    path = os.path.join(args.dir, DEFAULT_DB_FILES[engine_name])
+    engine_class = STORAGE_ENGINES[engine_name]
+    engine = engine_class(path)
+    engine.preload()
+    workload = Workload(args)
+    clients = workload.clients
+
+    run_phase(engine_name, "register", path, ((register, (engine, client_id, username)) for client_id, username in clients))
+    run_phase(engine_name, "send", path, ((send, (engine, workload.client()[0], workload.client()[0], workload.content()))
+                                          for _ in range(args.messages)))
+    run_phase(engine_name, "pull", path, ((pull, (engine, client_id)) for client_id, _ in clients))
+
+    def mixed():
+        for _ in range(args.mixed):
+            yield send, (engine, workload.client()[0], workload.client()[0], workload.content())
+            yield lookup, (engine, workload.client()[0], workload.client()[1])
+            yield pull, (engine, workload.client()[0])
+    run_phase(engine_name, "mixed", path, mixed())
+
+    started = time.perf_counter()
+    engine.close()
+    engine = engine_class(path)
+    engine.preload()
+    report(engine_name, "reopen", [time.perf_counter() - started], 1.0, path)
+    engine.close()
+
+
+def main():
+    """The main entry point of the storage benchmark."""
+    parser = argparse.ArgumentParser(description="Benchmark of the MessageU server's storage engines")
+    parser.add_argument("--engines", default=",".join(STORAGE_ENGINES),
+                        help="comma-separated engines to compare (default: %(default)s)")
+    parser.add_argument("--dir", default="storage_bench", help="directory for the engines' files, emptied first (default: %(default)s)")
+    parser.add_argument("--clients", type=int, default=1000, help="registered clients (default: %(default)s)")
+    parser.add_argument("--messages", type=int, default=20000, help="messages sent in the send phase (default: %(default)s)")
+    parser.add_argument("--text-size", type=int, default=256, help="median text size in bytes (default: %(default)s)")
+    parser.add_argument("--file-fraction", type=float, default=0.01, help="share of files among the messages (default: %(default)s)")
+    parser.add_argument("--file-size", type=int, default=256, help="median file size in KB (default: %(default)s)")
+    parser.add_argument("--mixed", type=int, default=10000, help="steps of the mixed phase (default: %(default)s)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the workload (default: %(default)s)")
+    args = parser.parse_args()
+    engines = args.engines.split(",")
+    unknown = [name for name in engines if name not in STORAGE_ENGINES]
+    if unknown:
+        parser.error(f"unknown engines: {', '.join(unknown)}")
+    if args.clients < 1:
+        parser.error("--clients must be at least 1")
+    logging.basicConfig(level=logging.WARNING)
+    shutil.rmtree(args.dir, ignore_errors=True)
+    os.makedirs(args.dir)
+
+    print(f"{'engine':<8}{'phase':<10}{'requests':>9}{'per s':>12}{'p50 ms':>10}{'p99 ms':>10}{'max ms':>10}{'disk MB':>10}")
+    for name in engines:
+        bench(name, args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,191 @@
+# storage_engine.py
+# author: Ariel Cohen ID: 329599187
+
+from abc import ABC, abstractmethod  # For the interface every storage engine implements
+
+CONTENT_CHUNK = 1024 * 1024  # Bytes of message content copied from a file at a time.
+
+
+class StorageEngine(ABC):
+    """
+    The operations the server needs from its storage: the client directory, the message queue,
+    the federation's peers and outbox, backups and the startup preload. The server reaches an
+    engine only through AsyncDataManager, which runs it on the database thread, so an engine
+    never has to be thread-safe.
+
+    Rows are returned as mappings keyed by the column names of SQLiteDataManager's tables (an
+    sqlite3.Row there, a dict elsewhere), so callers read them the same way whatever the engine.
+    Message and outbox IDs are never reused, as with SQLite's AUTOINCREMENT.
+
+    Implementations:
+        SQLiteDataManager  B-tree tables in one SQLite database, a commit per write.
+        MemoryDataManager  Everything in memory, saved to a snapshot file now and then.
+        LSMDataManager     A log-structured merge store: an append-only log and sorted segments.
+    """
+
+    @abstractmethod
+    def preload(self, snapshot_file=None):
+        """
+        Prepares the engine to answer directory lookups from memory, before the server accepts
+        connections.
+
+        Args:
+            snapshot_file (str): Where the directory cache is kept between runs, if anywhere;
+            engines that keep the directory in memory anyway ignore it.
+        Returns:
+            dict: The number of clients and of mailboxes with messages, where they were loaded
+            from and the seconds it took.
+        """
+
+    @abstractmethod
+    def add_client(self, client_id, username, public_key):
+        """Adds a client registered on this server, with the next directory Seq."""
+
+    @abstractmethod
+    def username_exists(self, username):
+        """Returns True if a client has the username."""
+
+    @abstractmethod
+    def client_id_exists(self, client_id):
+        """Returns True if a client has the ID."""
+
+    @abstractmethod
+    def get_clients(self, exclude_id):
+        """Returns every client but one, as rows with ID and UserName."""
+
+    @abstractmethod
+    def get_client_by_id(self, client_id):
+        """Returns a client's row (ID, UserName, PublicKey, LastSeen, Home, Seq), or None."""
+
+    @abstractmethod
+    def get_client_by_name(self, username):
+        """Returns the row of the client with the username, or None."""
+
+    @abstractmethod
+    def update_last_seen(self, client_id):
+        """Sets a client's LastSeen to now."""
+
+    @abstractmethod
+    def add_message(self, to_client_id, from_client_id, msg_type, content):
+        """Queues a message for a client and returns its ID."""
+
+    @abstractmethod
+    def add_message_file(self, to_client_id, from_client_id, msg_type, path, size):
+        """
+        Queues a message whose content is the `size` bytes of the file at `path`, and returns its
+        ID. The content is copied CONTENT_CHUNK bytes at a time where the engine can store it in
+        pieces, so a large upload is never held in memory whole.
+        """
+
+    @abstractmethod
+    def get_mailbox_summary(self, client_id, limit=-1):
+        """
+        Sums up the oldest `limit` (-1 for all) messages waiting for a client without reading them.
+
+        Returns:
+            tuple: (count, total content size, ID of the last of them); (0, 0, 0) if none wait.
+        """
+
+    @abstractmethod
+    def get_messages_for_client(self, client_id, limit=-1, after_id=0):
+        """
+        Returns the messages waiting for a client with an ID above `after_id`, oldest first, at
+        most `limit` (-1 for all), as rows with ID, FromClient, Type and Size; the content is read
+        with get_message_content. Passing the last ID of one page as `after_id` gives the next.
+        """
+
+    @abstractmethod
+    def get_message_content(self, message_id, offset, size):
+        """Returns up to `size` bytes of a message's content from `offset` (b"" if the message is gone)."""
+
+    @abstractmethod
+    def delete_messages(self, client_id, message_ids):
+        """Deletes messages of a client; IDs of other clients' messages are ignored."""
+
+    @abstractmethod
+    def get_client_home(self, client_id):
+        """Returns (exists, node), where node is None for clients registered on this server."""
+
+    @abstractmethod
+    def get_local_clients_since(self, seq, limit):
+        """Returns up to `limit` rows (Seq, ID, UserName, PublicKey) of local clients after `seq`, in Seq order."""
+
+    @abstractmethod
+    def get_clients_since(self, seq, limit):
+        """Returns up to `limit` rows (Seq, ID, UserName, PublicKey) of all clients after `seq`, in Seq order."""
+
+    @abstractmethod
+    def get_directory_seq(self):
+        """Returns the highest Seq in the directory, 0 if it is empty."""
+
+    @abstractmethod
+    def add_replicated_clients(self, entries):
+        """
+        Copies (seq, client_id, username, public_key) entries from a primary, keeping their Seq and
+        replacing any client with the same ID or username.
+        """
+
+    @abstractmethod
+    def add_remote_clients(self, node, entries, last_seq):
+        """
+        Adds (client_id, username, public_key) entries homed on another node, skipping those whose
+        ID or username is taken, and records `last_seq` as how far that node's directory was copied.
+        """
+
+    @abstractmethod
+    def get_peer_directory_seq(self, node):
+        """Returns the Seq of the last directory entry copied from a node, 0 if none."""
+
+    @abstractmethod
+    def add_outbox_message(self, node, to_client_id, from_client_id, msg_type, content):
+        """Keeps a message for a client homed on another node until it is forwarded, and returns its ID."""
+
+    @abstractmethod
+    def get_outbox(self, node, limit, max_bytes):
+        """
+        Returns messages waiting for a node, oldest first, as rows with ID, ToClient, FromClient,
+        Type and Content: at most `limit`, stopping before their content exceeds `max_bytes`
+        (at least one is returned).
+        """
+
+    @abstractmethod
+    def delete_outbox(self, message_ids):
+        """Deletes forwarded messages from the outbox."""
+
+    @abstractmethod
+    def add_messages(self, messages):
+        """Queues a batch of (to_client_id, from_client_id, msg_type, content) messages in one write."""
+
+    @abstractmethod
+    def backup(self, path):
+        """
+        Writes a consistent copy of the store to `path`, which a server can be started on.
+        It runs on the database thread, so requests wait until it is done.
+        """
+
+    @abstractmethod
+    def close(self):
+        """Makes everything written durable and releases the store."""
+
+    def open_reader(self):
+        """
+        Opens a second, read-only view of the store for the directory lookups get_client_by_id and
+        get_client_by_name, which AsyncDataManager then runs on a thread of its own, so they never
+        wait behind a large write. Each lookup sees the last write committed.
+
+        Returns:
+            An object with those two methods and close, or None if the engine has none (the
+            default); the database thread then answers the lookups itself.
+        """
+        return None
+
+    def pending_sync(self):
+        """
+        Returns the seconds until writes the engine has not made durable yet are due to be synced
+        (0 or less: now), or None if none wait. The database thread checks it between calls and
+        while idle, and calls sync once it is due, so a last write is not left waiting for another.
+        """
+        return None
+
+    def sync(self):
+        """Makes the writes pending_sync reported durable."""
@@ -0,0 +1,133 @@
+# stream_relay.py
+# author: Ariel Cohen ID: 329599187
+
+import itertools  # For generating stream IDs
+import logging    # For logging stream activity
+from protocol_structs import *  # Import all protocol definitions
+
+
+class Stream:
+    """
+    The state of one open stream.
+    While the recipient is online its chunks are pushed to the recipient's connection as
+    they arrive and nothing is kept; otherwise they are collected in memory and stored as
+    a single STREAM message when the sender closes the stream.
+    """
+    def __init__(self, stream_id, sender, sender_id, recipient_id, listener):
+        self.stream_id = stream_id
+        self.sender = sender              # The connection the stream was opened on.
+        self.sender_id = sender_id
+        self.recipient_id = recipient_id
+        self.listener = listener          # The recipient's connection while relayed live, else None.
+        self.chunks = []                  # Packed chunks collected for a stored message.
+        self.stored_bytes = 0             # Total size of the collected chunks.
+        self.chunk_count = 0              # Chunks received from the sender.
+        self.overflow = False             # Set if the collected chunks exceeded MAX_STORED_STREAM.
+
+
+class StreamRelay:
+    """
+    Keeps track of open streams and of the connections live streams can be pushed to.
+    A connection becomes a listener for its client once it negotiated Capability.STREAMS
+    and identified itself (see RequestHandler._identify).
+    """
+    def __init__(self, store_message, server_version):
+        self._store_message = store_message  # Coroutine storing a message for an offline recipient, like Federation.store_message.
+        self._server_version = server_version
+        self._listeners = {}                # Client ID to the connection live streams are pushed to.
+        self._streams = {}                  # Stream ID to Stream.
+        self._next_id = itertools.count(1)
+
+    def bind(self, client_id, connection):
+        """Makes the connection the listener for the client; the newest connection wins."""
+        self._listeners[client_id] = connection
+
+    def connection_closed(self, connection):
+        """
+        Forgets a closed connection.
+        Streams it was receiving fall back to being stored; streams it was sending are
+        discarded, and their live recipients are told the stream was aborted.
+        """
+        if connection.client_id is not None and self._listeners.get(connection.client_id) is connection:
+            del self._listeners[connection.client_id]
+        for stream in list(self._streams.values()):
+            if stream.listener is connection:
+                stream.listener = None
+            if stream.sender is connection:
+                self._push(stream, StreamEvent.ABORT)
+                del self._streams[stream.stream_id]
+                logging.info(f"Stream {stream.stream_id} aborted after {stream.chunk_count} chunks.")
+
+    def open(self, connection, sender_id, recipient_id):
+        """
+        Opens a stream and tells a live recipient about it.
+
+        Returns:
+            Stream: The new stream.
+        """
+        stream = Stream(next(self._next_id), connection, sender_id, recipient_id, self._listeners.get(recipient_id))
+        self._streams[stream.stream_id] = stream
+        self._push(stream, StreamEvent.OPEN)
+        return stream
+
+    def data(self, connection, stream_id, chunk):
+        """
+        Relays or collects one chunk.
+
+        Returns:
+            bool: False if the stream does not exist or was not opened on this connection.
+        """
+        stream = self._streams.get(stream_id)
+        if stream is None or stream.sender is not connection:
+            return False
+        stream.chunk_count += 1
+        # A recipient that does not keep up gets the rest of the stream as a stored message,
+        # so a slow reader cannot make the server buffer without bound.
+        if stream.listener and stream.listener.pending_bytes() > MAX_PUSH_BACKLOG:
+            logging.warning(f"Recipient of stream {stream_id} is too slow; storing the rest of the stream.")
+            self._push(stream, StreamEvent.STORED)
+            stream.listener = None
+        if stream.listener:
+            self._push(stream, StreamEvent.DATA, chunk)
+        elif not stream.overflow:
+            if stream.stored_bytes + StreamChunkHeader.size + len(chunk) > MAX_STORED_STREAM:
+                stream.overflow = True
+                stream.chunks = []
+            else:
+                stream.chunks.append(StreamChunkHeader(len(chunk)).pack() + chunk)
+                stream.stored_bytes += StreamChunkHeader.size + len(chunk)
+        return True
+
+    async def close(self, connection, stream_id):
+        """
+        Closes a stream, storing the collected chunks as one STREAM message.
+
+        Returns:
+            StreamClosedPayload: The close confirmation, or None if the stream cannot be closed.
+        """
+        stream = self._streams.get(stream_id)
+        if stream is None or stream.sender is not connection:
+            return None
+        del self._streams[stream_id]
+        self._push(stream, StreamEvent.CLOSE)
+        if stream.overflow:
+            logging.warning(f"Stream {stream_id} exceeded the stored stream limit and was discarded.")
+            return None
+        message_id = 0
+        if stream.chunks:
+            message_id = await self._store_message(
+                to_client_id=stream.recipient_id,
+                from_client_id=stream.sender_id,
+                msg_type=MessageType.STREAM,
+                content=b"".join(stream.chunks)
+            )
+        logging.info(f"Stream {stream_id} closed after {stream.chunk_count} chunks.")
+        return StreamClosedPayload(stream_id, stream.chunk_count, message_id)
+
+    def _push(self, stream, event, chunk=b""):
+        """Queues a push for the stream's live recipient, if there is one."""
+        if stream.listener is None:
+            return
+        push_header = StreamPushHeader(stream.sender_id, stream.stream_id, event).pack()
+        response_header = ResponseHeader(self._server_version, ResponseCode.STREAM_PUSH, len(push_header) + len(chunk))
+        stream.listener.queue(response_header.pack() + push_header + chunk)
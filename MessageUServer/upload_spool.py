@@ -0,0 +1,61 @@
+# upload_spool.py
+# author: Ariel Cohen ID: 329599187
+
+import asyncio   # For writing to the spool file off the event loop
+import os        # For removing the spool file
+import tempfile  # For creating the spool file
+
+SPOOL_THRESHOLD = 1024 * 1024  # Message content larger than this is spooled to disk while it is received.
+SPOOL_CHUNK = 256 * 1024       # Bytes read from the socket and written to the spool file at a time.
+
+
+class UploadSpool:
+    """
+    The content of one large message, written to a temporary file while it is received, so the
+    server holds at most SPOOL_CHUNK bytes of it in memory. The storage engine copies it from
+    the file in chunks as well (see StorageEngine.add_message_file); the file is removed once
+    the message is stored.
+    """
+    def __init__(self, spool_dir=None):
+        if spool_dir:
+            os.makedirs(spool_dir, exist_ok=True)
+        fd, self.path = tempfile.mkstemp(prefix="upload-", suffix=".spool", dir=spool_dir)
+        self._file = os.fdopen(fd, 'wb')
+        self.size = 0
+
+    async def receive(self, connection, size):
+        """
+        Reads `size` bytes of the current request's payload from the connection into the file.
+
+        Raises:
+            ProtocolError: If the client closed the connection before sending them.
+            OSError: If the file cannot be written; the rest of the payload is read and dropped.
+        """
+        loop = asyncio.get_running_loop()
+        left = size
+        try:
+            while left:
+                chunk = await connection.read_body(min(SPOOL_CHUNK, left))
+                left -= len(chunk)
+                # Written on an executor thread, so a slow disk never stalls the other connections.
+                await loop.run_in_executor(None, self._file.write, chunk)
+                self.size += len(chunk)
+            await loop.run_in_executor(None, self._file.flush)
+        except OSError:
+            await connection.discard_body()
+            raise
+        finally:
+            self._file.close()
+
+    def read(self):
+        """Returns the whole content, for the few places that need it in memory (e.g. the outbox)."""
+        with open(self.path, 'rb') as f:
+            return f.read()
+
+    def remove(self):
+        """Removes the spool file."""
+        self._file.close()
+        try:
+            os.remove(self.path)
+        except FileNotFoundError:
+            pass